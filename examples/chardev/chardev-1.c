@@ -121,6 +121,15 @@ static int __init my_init(void)
         return -1;
     }
 
+    // device_open() looks up the buffer of the minor being opened
+    if(mychardev_buffers_init(num_of_dev) < 0)
+    {
+        printk("Error: Could not allocate the buffer table\n");
+        cdev_del(&mychardev);
+        unregister_chrdev_region(dev_num, num_of_dev);
+        return -ENOMEM;
+    }
+
     printk("Successfully registered device %s: Major-%u Minor-%u\n", DRIVER_NAME, MAJOR_NUM, MINOR_NUM);
     printk("\tCreated entry under: /proc/devices\n");
 
@@ -145,6 +154,8 @@ static void __exit my_exit(void)
 
     cdev_del(&mychardev);
 
+    mychardev_buffers_exit();
+
     printk("Successfully un-registered Device number %u %u\n", MAJOR_NUM, MINOR_NUM);
     printk("------------------------------------------------------\n");
 }
@@ -16,6 +16,12 @@ MODULE_DESCRIPTION("An example for registering device numbers for character devi
 // Device number assigned to this character device
 static dev_t dev_num = MKDEV(MAJOR_NUM, MINOR_NUM);
 static struct class *my_class;
+
+// Every minor is an independent device, with a buffer, lock and statistics of its own:
+// /dev/MyChar_Node0, /dev/MyChar_Node1, ...
+static unsigned int nr_minors = RESERVED_CNT;
+module_param(nr_minors, uint, 0444);
+MODULE_PARM_DESC(nr_minors, "Number of minors, each with its own buffer");
 // Character device object to register with the kernel
 static struct cdev mychardev =
 {
@@ -28,8 +34,12 @@ static struct file_operations fops = {
     .owner = THIS_MODULE,
     .open = device_open,
     .release = device_close,
-	.read = device_read,
-	.write = device_write
+	.llseek = device_llseek,
+	.read_iter = device_read_iter,
+	.write_iter = device_write_iter,
+	.splice_read = device_splice_read,
+	.splice_write = device_splice_write,
+	.unlocked_ioctl = device_ioctl
 };
 
 static char *class_permissions_cb(const struct device *dev, umode_t *mode)
@@ -47,9 +57,15 @@ static int __init my_init(void)
     printk("---------------------- Mod Init ----------------------\n");
     printk("Initializing module: %s\n", THIS_MODULE->name);
 
-    unsigned int num_of_dev = 1;
-
     // how many devices the cdev object should handle, starting from the dev_num base
+    unsigned int num_of_dev = nr_minors;
+    unsigned int i;
+
+    if(num_of_dev == 0 || num_of_dev > MINORMASK + 1 - MINOR_NUM)
+    {
+        printk("%s - Error: nr_minors must be between 1 and %u\n", DRIVER_NAME, MINORMASK + 1 - MINOR_NUM);
+        return -EINVAL;
+    }
 
     /****************************************************************************************
      * 1. Allocate/Register a range of device numbers. It does not deal with actual device
@@ -96,7 +112,7 @@ static int __init my_init(void)
 
     // Register the device. Creates new entry insidte file: /proc/devices
     // This will contain the driver name plus the Major Number
-    if(register_chrdev_region(dev_num, RESERVED_CNT, DRIVER_NAME) < 0)
+    if(register_chrdev_region(dev_num, num_of_dev, DRIVER_NAME) < 0)
     {
 		printk("%s - Error regiserting device number!\n", DRIVER_NAME);
 		return -1;
@@ -117,26 +133,29 @@ static int __init my_init(void)
     // Setup the char device we want to use
     cdev_init(&mychardev, &fops);
 
-    // num_of_dev should not exceed RESERVED_CNT
-    if(num_of_dev > RESERVED_CNT)
-    {
-        printk("%s - Error attempting to handle more devices than reserved!\n", DRIVER_NAME);
-        return -1;
-    }
-
     /*****************************************************************************
      * 2.2 Register the cdev object with the kernel, associating it with the allocated
      * device numbers
      *****************************************************************************/
 
+    // The buffers themselves are only allocated when a minor is first opened, on the NUMA node
+    // of the opener
+    if(mychardev_buffers_init(num_of_dev) < 0)
+    {
+        printk("Error: Could not allocate the buffer table\n");
+        unregister_chrdev_region(dev_num, num_of_dev);
+        return -ENOMEM;
+    }
+
     if(cdev_add(&mychardev, dev_num, num_of_dev) < 0)
     {
         printk("Error: Could not add cdev\n");
+        mychardev_buffers_exit();
         unregister_chrdev_region(dev_num, num_of_dev);
         return -1;
     }
 
-    printk("Successfully registered device %s: Major-%u Minor-%u\n", DRIVER_NAME, MAJOR_NUM, MINOR_NUM);
+    printk("Successfully registered device %s: Major-%u Minors-%u..%u\n", DRIVER_NAME, MAJOR_NUM, MINOR_NUM, MINOR_NUM + num_of_dev - 1);
     printk("\tCreated entry under: /proc/devices\n");
 
     /********************
@@ -157,6 +176,7 @@ static int __init my_init(void)
     {
         printk("Error: Could not create class\n");
         cdev_del(&mychardev);
+        mychardev_buffers_exit();
         unregister_chrdev_region(dev_num, num_of_dev);
         return -1;
     }
@@ -167,12 +187,34 @@ static int __init my_init(void)
      * 3.2 Create a node
      ********************/
 
-    // Creates entry: /sys/class/DRIVER_CLASS/DRIVER_NODE.
+    // Creates entries: /sys/class/DRIVER_CLASS/DRIVER_NODE<minor>, with the statistics of
+    // the minor in it.
     // User-space utilities like udev monitor sysfs to detect new devices and
-    // dynamically create the corresponding /dev nodes: /dev/Mychar_Node
-    device_create(my_class, NULL, dev_num, NULL, DRIVER_NODE);
-    printk("Successfully created device node\n");
-    printk("Created entry: /sys/class/%s/%s and /dev/%s\n", DRIVER_CLASS, DRIVER_NODE, DRIVER_NODE);
+    // dynamically create the corresponding /dev nodes: /dev/Mychar_Node0, ...
+    for(i = 0; i < num_of_dev; i++)
+    {
+        device_create_with_groups(my_class, NULL, dev_num + i, NULL, mychardev_buffer_groups,
+                                  DRIVER_NODE "%u", i);
+    }
+    printk("Successfully created %u device node(s)\n", num_of_dev);
+    printk("Created entries: /sys/class/%s/%s<N> and /dev/%s<N>\n", DRIVER_CLASS, DRIVER_NODE, DRIVER_NODE);
+
+    /********************
+     * 4. Hot-path tracing, disabled (a NOP) until enabled through debugfs
+     ********************/
+
+    if(mychardev_trace_init() < 0)
+    {
+        printk("Error: Could not set up tracing\n");
+        for(i = 0; i < num_of_dev; i++)
+            device_destroy(my_class, dev_num + i);
+        class_destroy(my_class);
+        cdev_del(&mychardev);
+        mychardev_buffers_exit();
+        unregister_chrdev_region(dev_num, num_of_dev);
+        return -1;
+    }
+    printk("Created entry: /sys/kernel/debug/hptrace-mychardev\n");
 
     printk("Successfully initialized module\n");
     printk("\tCreated entry under: /proc/modules\n");
@@ -186,16 +228,22 @@ static void __exit my_exit(void)
     printk("---------------------- Mod Exit ----------------------\n");
     printk("Removing module: %s\n", mychardev.owner->name);
 
-    device_destroy(my_class, dev_num);
-    class_destroy(my_class);
-
     // how many devices the cdev object should handle, starting from the dev_num base
-    unsigned int num_of_dev = 1;
+    unsigned int num_of_dev = nr_minors;
+    unsigned int i;
+
+    mychardev_trace_exit();
+
+    for(i = 0; i < num_of_dev; i++)
+        device_destroy(my_class, dev_num + i);
+    class_destroy(my_class);
 
     unregister_chrdev_region(dev_num, num_of_dev);
 
     cdev_del(&mychardev);
 
+    mychardev_buffers_exit();
+
     printk("Successfully un-registered Device number %u %u\n", MAJOR_NUM, MINOR_NUM);
     printk("------------------------------------------------------\n");
 }
@@ -14,6 +14,7 @@
 #include <linux/printk.h>
 #include <linux/types.h>
 #include <linux/uaccess.h> /* for get_user and put_user */
+#include <linux/uio.h>
 #include <linux/version.h>
 
 #include <asm/errno.h>
@@ -21,9 +22,8 @@
 /*  Prototypes - this would normally go in a .h file */
 static int device_open(struct inode *, struct file *);
 static int device_release(struct inode *, struct file *);
-static ssize_t device_read(struct file *, char __user *, size_t, loff_t *);
-static ssize_t device_write(struct file *, const char __user *, size_t,
-                            loff_t *);
+static ssize_t device_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t device_write_iter(struct kiocb *, struct iov_iter *);
 
 #define SUCCESS 0
 #define DEVICE_NAME "chardev" /* Dev name as it appears in /proc/devices   */
@@ -46,8 +46,8 @@ static char msg[BUF_LEN + 1]; /* The msg the device will give when asked */
 static struct class *cls;
 
 static struct file_operations chardev_fops = {
-    .read = device_read,
-    .write = device_write,
+    .read_iter = device_read_iter,
+    .write_iter = device_write_iter,
     .open = device_open,
     .release = device_release,
 };
@@ -114,6 +114,9 @@ static int device_open(struct inode *inode, struct file *file)
     sprintf(msg, "I already told you %d times Hello world!\n", counter++);
     try_module_get(THIS_MODULE);
 
+    /* Reads never block, so io_uring may try them inline with IOCB_NOWAIT */
+    file->f_mode |= FMODE_NOWAIT;
+
     return SUCCESS;
 }
 
@@ -132,45 +135,36 @@ static int device_release(struct inode *inode, struct file *file)
 }
 
 /* Called when a process, which already opened the dev file, attempts to
- * read from it.
+ * read from it. read(), readv(), io_uring and AIO all come through here;
+ * the iov_iter describes the user buffers, however many there are.
  */
-static ssize_t device_read(struct file *filp, /* see include/linux/fs.h   */
-                           char __user *buffer, /* buffer to fill with data */
-                           size_t length, /* length of the buffer     */
-                           loff_t *offset)
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
+    size_t len = strlen(msg);
     /* Number of bytes actually written to the buffer */
-    int bytes_read = 0;
-    const char *msg_ptr = msg;
+    size_t bytes_read;
 
-    if (!*(msg_ptr + *offset)) { /* we are at the end of message */
-        *offset = 0; /* reset the offset */
+    if (iocb->ki_pos >= len) /* we are at the end of message */
         return 0; /* signify end of file */
-    }
+    if (!iov_iter_count(to)) /* a zero-length read, nothing to copy */
+        return 0;
 
-    msg_ptr += *offset;
-
-    /* Actually put the data into the buffer */
-    while (length && *msg_ptr) {
-        /* The buffer is in the user data segment, not the kernel
-         * segment so "*" assignment won't work.  We have to use
-         * put_user which copies data from the kernel data segment to
-         * the user data segment.
-         */
-        put_user(*(msg_ptr++), buffer++);
-        length--;
-        bytes_read++;
-    }
+    /* The buffers are in the user data segment, not the kernel segment,
+     * so "*" assignment won't work. copy_to_iter() copies from the kernel
+     * data segment to each of them in turn.
+     */
+    bytes_read = copy_to_iter(msg + iocb->ki_pos, len - iocb->ki_pos, to);
+    if (!bytes_read)
+        return -EFAULT;
 
-    *offset += bytes_read;
+    iocb->ki_pos += bytes_read;
 
     /* Most read functions return the number of bytes put into the buffer. */
     return bytes_read;
 }
 
 /* Called when a process writes to dev file: echo "hi" > /dev/hello */
-static ssize_t device_write(struct file *filp, const char __user *buff,
-                            size_t len, loff_t *off)
+static ssize_t device_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
     pr_alert("Sorry, this operation is not supported.\n");
     return -EINVAL;
@@ -0,0 +1,280 @@
+/*
+ * minor_bench.c - throughput of CharDev-2 against the number of minors used
+ *
+ * Runs one writer and one reader thread per minor, on 1, 2, 4, ... up to
+ * all the minors given with -n, and reports the aggregate throughput for
+ * each count. The writer appends chunks to the buffer of its minor, the
+ * reader follows it with pread() at its own offset. When the buffer is
+ * full it is emptied by opening the minor again with O_TRUNC, and the
+ * pair starts over.
+ *
+ * Every minor has a buffer, a lock and statistics of its own, so the
+ * throughput should grow with the number of minors until the CPUs or the
+ * memory bandwidth run out. A flat curve means the minors still share
+ * something.
+ *
+ *   sudo insmod CharDev-2.ko nr_minors=16
+ *   ./minor_bench -n 16 -t 2
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEVICE "/dev/MyChar_Node"
+
+struct pair {
+    char path[64];
+    size_t chunk;
+    int fd;
+    /* Bytes written and not read yet, the reader catches up to it */
+    uint64_t written;
+    uint64_t read_off;
+    uint64_t bytes;
+    int error;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t writer, reader;
+};
+
+static volatile int stop;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* The device allows one open at a time, so writer and reader share the fd */
+static int reopen(struct pair *p)
+{
+    if (p->fd >= 0)
+        close(p->fd);
+    p->fd = open(p->path, O_RDWR | O_TRUNC);
+    if (p->fd < 0) {
+        perror(p->path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *writer(void *arg)
+{
+    struct pair *p = arg;
+    char *buf = malloc(p->chunk);
+
+    if (!buf) {
+        p->error = ENOMEM;
+        return NULL;
+    }
+    memset(buf, 'x', p->chunk);
+
+    while (!stop) {
+        ssize_t n = write(p->fd, buf, p->chunk);
+
+        if (n < 0 && errno == ENOMEM) {
+            /* Full: wait for the reader to drain it, then start over */
+            pthread_mutex_lock(&p->lock);
+            while (p->read_off < p->written && !stop)
+                pthread_cond_wait(&p->cond, &p->lock);
+            if (reopen(p))
+                p->error = errno;
+            p->written = 0;
+            p->read_off = 0;
+            pthread_cond_broadcast(&p->cond);
+            pthread_mutex_unlock(&p->lock);
+            if (p->error)
+                break;
+            continue;
+        }
+        if (n <= 0) {
+            p->error = errno;
+            break;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->written += n;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    stop = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    free(buf);
+
+    return NULL;
+}
+
+static void *reader(void *arg)
+{
+    struct pair *p = arg;
+    char *buf = malloc(p->chunk);
+
+    if (!buf) {
+        p->error = ENOMEM;
+        return NULL;
+    }
+
+    for (;;) {
+        uint64_t off;
+        size_t len;
+        ssize_t n;
+
+        pthread_mutex_lock(&p->lock);
+        while (p->read_off >= p->written && !stop)
+            pthread_cond_wait(&p->cond, &p->lock);
+        if (stop) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        off = p->read_off;
+        len = p->written - off < p->chunk ? p->written - off : p->chunk;
+        pthread_mutex_unlock(&p->lock);
+
+        /* The writer only reopens once everything was read, so the fd and
+         * offset stay valid while the lock is dropped.
+         */
+        n = pread(p->fd, buf, len, off);
+        if (n <= 0) {
+            p->error = n ? errno : EIO;
+            break;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->read_off += n;
+        p->bytes += n;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+    free(buf);
+
+    return NULL;
+}
+
+/* Runs nr pairs for seconds, returns the aggregate MiB/s read, < 0 on error */
+static double run(struct pair *pairs, unsigned int nr, size_t chunk,
+                  unsigned int seconds)
+{
+    struct timespec duration = { .tv_sec = seconds };
+    uint64_t start, bytes = 0;
+    unsigned int i;
+    int error = 0;
+
+    stop = 0;
+    for (i = 0; i < nr; i++) {
+        struct pair *p = &pairs[i];
+
+        snprintf(p->path, sizeof(p->path), DEVICE "%u", i);
+        p->chunk = chunk;
+        p->fd = -1;
+        p->written = p->read_off = p->bytes = 0;
+        p->error = 0;
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->cond, NULL);
+        if (reopen(p))
+            return -1;
+    }
+
+    start = now_ns();
+    for (i = 0; i < nr; i++) {
+        pthread_create(&pairs[i].writer, NULL, writer, &pairs[i]);
+        pthread_create(&pairs[i].reader, NULL, reader, &pairs[i]);
+    }
+
+    nanosleep(&duration, NULL);
+    for (i = 0; i < nr; i++) {
+        pthread_mutex_lock(&pairs[i].lock);
+        stop = 1;
+        pthread_cond_broadcast(&pairs[i].cond);
+        pthread_mutex_unlock(&pairs[i].lock);
+    }
+
+    for (i = 0; i < nr; i++) {
+        struct pair *p = &pairs[i];
+
+        pthread_join(p->writer, NULL);
+        pthread_join(p->reader, NULL);
+        close(p->fd);
+        bytes += p->bytes;
+        if (p->error) {
+            fprintf(stderr, "%s: %s\n", p->path, strerror(p->error));
+            error = 1;
+        }
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
+    }
+
+    return error ? -1 : bytes * 1e9 / (now_ns() - start) / (1 << 20);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n minors] [-b chunk_size] [-t seconds]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int max = 1, seconds = 2, nr;
+    size_t chunk = 4096;
+    double base = 0;
+    struct pair *pairs;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:b:t:")) != -1) {
+        switch (opt) {
+        case 'n':
+            max = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            chunk = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!max || !chunk || !seconds)
+        usage(argv[0]);
+
+    pairs = calloc(max, sizeof(*pairs));
+    if (!pairs) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    printf("%u minor(s), chunks of %zu bytes, %us per run\n", max, chunk,
+           seconds);
+    printf("%8s %10s %10s %8s\n", "minors", "MiB/s", "per_minor", "scaling");
+
+    for (nr = 1; nr <= max; nr = nr < max && nr * 2 > max ? max : nr * 2) {
+        double mibs = run(pairs, nr, chunk, seconds);
+
+        if (mibs < 0)
+            return EXIT_FAILURE;
+        if (nr == 1)
+            base = mibs;
+        printf("%8u %10.1f %10.1f %7.2fx\n", nr, mibs, mibs / nr,
+               base ? mibs / base : 0.0);
+        if (nr == max)
+            break;
+    }
+
+    free(pairs);
+
+    return 0;
+}
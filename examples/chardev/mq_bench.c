@@ -0,0 +1,229 @@
+/*
+ * mq_bench.c - write throughput of CharDev-2 against the number of writers
+ *
+ * Runs 1, 2, 4, ... up to one writer thread per online CPU, each pinned to
+ * a CPU of its own and writing fixed size chunks to the same open minor,
+ * and reports the aggregate write throughput for each count. A full buffer
+ * is emptied with MYCHARDEV_RESET and the writers go on.
+ *
+ * Load the module once without and once with multi_queue to compare the
+ * two modes. With a single buffer all writers queue up on its lock, with
+ * multi_queue every CPU appends to a queue of its own:
+ *
+ *   sudo insmod CharDev-2.ko buffer_kb=65536
+ *   ./mq_bench -t 2
+ *   sudo rmmod CharDev_2
+ *   sudo insmod CharDev-2.ko multi_queue=1 queue_kb=4096
+ *   ./mq_bench -t 2
+ *
+ * Emptying the single buffer frees its pages, which are then allocated
+ * again by the next writes. A large buffer_kb keeps that rare.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mychardev_ioctl.h"
+
+#define DEVICE "/dev/MyChar_Node0"
+
+struct writer {
+    pthread_t thread;
+    int cpu;
+    uint64_t bytes;
+    uint64_t resets;
+    int error;
+};
+
+static int dev;
+static size_t chunk = 4096;
+static volatile int stop;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *writer(void *arg)
+{
+    struct writer *w = arg;
+    cpu_set_t set;
+    char *buf = malloc(chunk);
+
+    if (!buf) {
+        w->error = ENOMEM;
+        return NULL;
+    }
+    memset(buf, 'x', chunk);
+
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    while (!stop) {
+        ssize_t n = write(dev, buf, chunk);
+
+        if (n < 0 && errno == ENOMEM) {
+            if (ioctl(dev, MYCHARDEV_RESET) < 0) {
+                w->error = errno;
+                break;
+            }
+            w->resets++;
+            continue;
+        }
+        if (n <= 0) {
+            w->error = n ? errno : EIO;
+            break;
+        }
+        w->bytes += n;
+    }
+    free(buf);
+
+    return NULL;
+}
+
+/* Runs one writer on each of the first nr CPUs, returns MiB/s, < 0 on error */
+static double run(struct writer *writers, const int *cpus, unsigned int nr,
+                  unsigned int seconds, uint64_t *resets)
+{
+    struct timespec duration = { .tv_sec = seconds };
+    uint64_t start, bytes = 0;
+    unsigned int i;
+    int error = 0;
+
+    if (ioctl(dev, MYCHARDEV_RESET) < 0) {
+        perror("MYCHARDEV_RESET");
+        return -1;
+    }
+
+    stop = 0;
+    *resets = 0;
+    start = now_ns();
+    for (i = 0; i < nr; i++) {
+        memset(&writers[i], 0, sizeof(writers[i]));
+        writers[i].cpu = cpus[i];
+        pthread_create(&writers[i].thread, NULL, writer, &writers[i]);
+    }
+
+    nanosleep(&duration, NULL);
+    stop = 1;
+
+    for (i = 0; i < nr; i++) {
+        pthread_join(writers[i].thread, NULL);
+        bytes += writers[i].bytes;
+        *resets += writers[i].resets;
+        if (writers[i].error) {
+            fprintf(stderr, "writer on cpu %d: %s\n", writers[i].cpu,
+                    strerror(writers[i].error));
+            error = 1;
+        }
+    }
+
+    return error ? -1 : bytes * 1e9 / (now_ns() - start) / (1 << 20);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-d device] [-b chunk_size] [-t seconds]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device = DEVICE;
+    unsigned int seconds = 2, nr_cpus = 0, nr;
+    struct writer *writers;
+    cpu_set_t online;
+    int queues = 0, opt, cpu, *cpus;
+    double base = 0;
+
+    while ((opt = getopt(argc, argv, "d:b:t:")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'b':
+            chunk = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!chunk || !seconds)
+        usage(argv[0]);
+
+    /* The device allows one open at a time, so all writers share the fd.
+     * O_APPEND makes them start over at 0 after a reset, not at the offset
+     * of the shared file.
+     */
+    dev = open(device, O_RDWR | O_TRUNC | O_APPEND);
+    if (dev < 0) {
+        perror(device);
+        return EXIT_FAILURE;
+    }
+    if (ioctl(dev, MYCHARDEV_GET_QUEUES, &queues) < 0) {
+        perror("MYCHARDEV_GET_QUEUES");
+        return EXIT_FAILURE;
+    }
+
+    /* The CPUs we may run on, in order */
+    if (sched_getaffinity(0, sizeof(online), &online)) {
+        perror("sched_getaffinity");
+        return EXIT_FAILURE;
+    }
+    cpus = calloc(CPU_SETSIZE, sizeof(*cpus));
+    writers = calloc(CPU_SETSIZE, sizeof(*writers));
+    if (!cpus || !writers) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &online))
+            cpus[nr_cpus++] = cpu;
+
+    if (queues)
+        printf("%s, multi-queue (%d queues)", device, queues);
+    else
+        printf("%s, single queue", device);
+    printf(", chunks of %zu bytes, %us per run\n", chunk, seconds);
+    printf("%8s %10s %12s %8s %8s\n", "writers", "MiB/s", "writes/s",
+           "scaling", "resets");
+
+    for (nr = 1;; nr = nr * 2 > nr_cpus ? nr_cpus : nr * 2) {
+        uint64_t resets;
+        double mibs = run(writers, cpus, nr, seconds, &resets);
+
+        if (mibs < 0)
+            return EXIT_FAILURE;
+        if (nr == 1)
+            base = mibs;
+        printf("%8u %10.1f %12.0f %7.2fx %8llu\n", nr, mibs,
+               mibs * (1 << 20) / chunk, base ? mibs / base : 0.0,
+               (unsigned long long)resets);
+        if (nr == nr_cpus)
+            break;
+    }
+
+    free(writers);
+    free(cpus);
+    close(dev);
+
+    return 0;
+}
@@ -1,6 +1,23 @@
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/slab.h>
+#include <linux/splice.h>
+#include <linux/topology.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/xarray.h>
 
 #include "mychardev_common.h"
+#include "mychardev_ioctl.h"
+#include "../hptrace/hptrace.h"
+#include "../pagebuf/pagebuf.h"
+#include "../statpage/statpage.h"
 
 #define SUCCESS 0
 #define FAILURE -1
@@ -8,18 +25,324 @@
 
 static char msg[BUF_LEN + 1]; /* The msg the device will give when asked */
 
-#define BUFFER_SIZE 1024
+static unsigned int buffer_kb = 1024;
+module_param(buffer_kb, uint, 0444);
+MODULE_PARM_DESC(buffer_kb, "Maximum size of the buffer of each minor in KiB");
 
-static char device_buffer[BUFFER_SIZE]; // Internal buffer for the device
-static size_t current_buffer_len = 0;   // Tracks the current size of data in the buffer
-static size_t device_buffer_idx = 0;    // The last position that was written to the buffer
+#define BUFFER_SIZE ((size_t)buffer_kb * 1024)
+
+// With many writers, the single buffer and its lock are a point every write has to go through.
+// In multi-queue mode every CPU appends to a queue of its own instead, see mychardev_ioctl.h.
+static bool multi_queue;
+module_param(multi_queue, bool, 0444);
+MODULE_PARM_DESC(multi_queue, "Give every CPU a queue of its own to append to");
+
+static unsigned int queue_kb = 256;
+module_param(queue_kb, uint, 0444);
+MODULE_PARM_DESC(queue_kb, "Size of each per-CPU queue in KiB");
+
+#define QUEUE_SIZE ((size_t)queue_kb * 1024)
+
+// By default the buffer is like a file, and what was written stays until it is truncated. In
+// stream mode readers never come back for what they read: a page read to its end may then be
+// evicted under memory pressure, and reads as zeros afterwards, see pagebuf.h.
+static bool stream;
+module_param(stream, bool, 0444);
+MODULE_PARM_DESC(stream, "Let pages that were read be evicted, for readers that never seek back");
+
+// Every write to a queue becomes a record: this header, then the bytes written. The timestamp
+// orders the records of different queues when a read merges them. Headers are unaligned, they
+// are only accessed through memcpy().
+struct mychardev_record {
+    u64 ts;
+    u32 len;
+} __packed;
+
+// The queue of one CPU. Only tasks running on that CPU append to it, so its lock and its cache
+// lines normally stay with that CPU. Readers take it too, but only for the records they consume.
+struct mychardev_queue {
+    struct mutex lock;
+    char *data;                 // QUEUE_SIZE bytes on the node of the CPU, allocated on first write
+    size_t head;                // Oldest record not read yet
+    size_t tail;                // Where the next record goes
+
+    // Statistics, under lock
+    u64 writes;
+    u64 bytes_written;
+};
 
 enum {
     CDEV_NOT_USED,
     CDEV_EXCLUSIVE_OPEN,
 };
-/* Is device open? Used to prevent multiple access to device */
-static atomic_t already_open = ATOMIC_INIT(CDEV_NOT_USED);
+
+// Everything one minor needs, so that minors used by independent pipelines share nothing. It is
+// allocated when the minor is first opened, on the NUMA node of the CPU that opened it, which is
+// most likely where its users run.
+struct mychardev_buffer {
+    // Serializes readers and writers of the buffer. One open file can still have many reads and
+    // writes in flight at once, e.g. through io_uring.
+    struct mutex lock;
+    /* Is device open? Used to prevent multiple access to device */
+    atomic_t already_open;
+    int node;                   // NUMA node of this structure and of the pages
+    size_t len;                 // Tracks the current size of data in the buffer, like i_size
+    // Internal buffer for the device. It is made of separate pages, so that splice() can hand
+    // out references to them instead of copies. The buffer is sparse: a page is only allocated
+    // when a write reaches it, a page that was never written is a hole and reads as zeros.
+    // In stream mode, pages that were read to their end may be evicted under memory pressure.
+    struct pagebuf pb;
+    // Per-CPU queues in multi-queue mode, NULL otherwise
+    struct mychardev_queue __percpu *queues;
+    int read_queue;             // MYCHARDEV_SELECT_QUEUE of the open file
+
+    // Statistics, under lock. In multi-queue mode writes are counted by the queues.
+    u64 opens;
+    u64 reads;
+    u64 writes;
+    u64 bytes_read;
+    u64 bytes_written;
+};
+
+// One slot per minor, filled on first open under buffers_lock
+static struct mychardev_buffer **buffers;
+static unsigned int nr_buffers;
+static DEFINE_MUTEX(buffers_lock);
+
+// The shrinker and LRU list shared by the buffers of all minors
+static struct pagebuf_cache mychardev_cache;
+
+// Hot-path trace sites, toggled under /sys/kernel/debug/hptrace-mychardev/
+enum {
+    MYCHARDEV_TRACE_OPEN,
+    MYCHARDEV_TRACE_READ,
+    MYCHARDEV_TRACE_WRITE,
+    MYCHARDEV_TRACE_NR,
+};
+
+static struct hptrace_site mychardev_sites[MYCHARDEV_TRACE_NR] = {
+    [MYCHARDEV_TRACE_OPEN] = HPTRACE_SITE("open"),
+    [MYCHARDEV_TRACE_READ] = HPTRACE_SITE("read"),
+    [MYCHARDEV_TRACE_WRITE] = HPTRACE_SITE("write"),
+};
+
+static struct hptrace_subsys mychardev_trace =
+    HPTRACE_SUBSYS("mychardev", mychardev_sites);
+
+int mychardev_trace_init(void)
+{
+    return hptrace_register(&mychardev_trace);
+}
+
+void mychardev_trace_exit(void)
+{
+    hptrace_unregister(&mychardev_trace);
+}
+
+// Totals of all the minors, in a page user space maps from /proc/statpage-<module>, see
+// statpage.h. Monitoring tools read them there without a system call.
+enum {
+    MYCHARDEV_STAT_OPENS,
+    MYCHARDEV_STAT_READS,
+    MYCHARDEV_STAT_WRITES,
+    MYCHARDEV_STAT_BYTES_READ,
+    MYCHARDEV_STAT_BYTES_WRITTEN,
+    MYCHARDEV_STAT_RESIDENT_PAGES,
+    MYCHARDEV_STAT_EVICTED_PAGES,
+    MYCHARDEV_STAT_REFAULTED_PAGES,
+    MYCHARDEV_STAT_NR,
+};
+
+static const char *const mychardev_stat_names[MYCHARDEV_STAT_NR] = {
+    [MYCHARDEV_STAT_OPENS] = "opens",
+    [MYCHARDEV_STAT_READS] = "reads",
+    [MYCHARDEV_STAT_WRITES] = "writes",
+    [MYCHARDEV_STAT_BYTES_READ] = "bytes_read",
+    [MYCHARDEV_STAT_BYTES_WRITTEN] = "bytes_written",
+    [MYCHARDEV_STAT_RESIDENT_PAGES] = "resident_pages",
+    [MYCHARDEV_STAT_EVICTED_PAGES] = "evicted_pages",
+    [MYCHARDEV_STAT_REFAULTED_PAGES] = "refaulted_pages",
+};
+
+// Sums the statistics of the minors the way their sysfs attributes read them, but without their
+// locks, which readers and writers of the minors would otherwise contend on for every refresh.
+// A value may miss the updates in progress, the next refresh has them.
+static void mychardev_stats_refresh(struct statpage *sp, u64 *values)
+{
+    unsigned int i;
+    int cpu;
+
+    memset(values, 0, MYCHARDEV_STAT_NR * sizeof(*values));
+    for (i = 0; i < nr_buffers; i++)
+    {
+        struct mychardev_buffer *buf = smp_load_acquire(&buffers[i]);
+
+        if (!buf)
+            continue;
+        values[MYCHARDEV_STAT_OPENS] += READ_ONCE(buf->opens);
+        values[MYCHARDEV_STAT_READS] += READ_ONCE(buf->reads);
+        values[MYCHARDEV_STAT_WRITES] += READ_ONCE(buf->writes);
+        values[MYCHARDEV_STAT_BYTES_READ] += READ_ONCE(buf->bytes_read);
+        values[MYCHARDEV_STAT_BYTES_WRITTEN] += READ_ONCE(buf->bytes_written);
+        values[MYCHARDEV_STAT_RESIDENT_PAGES] += READ_ONCE(buf->pb.resident);
+        values[MYCHARDEV_STAT_EVICTED_PAGES] += READ_ONCE(buf->pb.evicted);
+        values[MYCHARDEV_STAT_REFAULTED_PAGES] += READ_ONCE(buf->pb.refaulted);
+
+        if (!buf->queues)
+            continue;
+        for_each_possible_cpu(cpu)
+        {
+            struct mychardev_queue *q = per_cpu_ptr(buf->queues, cpu);
+
+            values[MYCHARDEV_STAT_WRITES] += READ_ONCE(q->writes);
+            values[MYCHARDEV_STAT_BYTES_WRITTEN] += READ_ONCE(q->bytes_written);
+        }
+    }
+}
+
+// This file is part of both CharDev-1 and CharDev-2, each gets a page named after itself
+static struct statpage mychardev_stats =
+    STATPAGE(THIS_MODULE->name, mychardev_stat_names, mychardev_stats_refresh);
+
+int mychardev_buffers_init(unsigned int count)
+{
+    int err;
+
+    buffers = kcalloc(count, sizeof(*buffers), GFP_KERNEL);
+    if (!buffers)
+        return -ENOMEM;
+
+    err = pagebuf_cache_register(&mychardev_cache, "mychardev");
+    if (err)
+        goto free_buffers;
+    nr_buffers = count;
+
+    err = statpage_register(&mychardev_stats);
+    if (err)
+    {
+        pagebuf_cache_unregister(&mychardev_cache);
+        nr_buffers = 0;
+        goto free_buffers;
+    }
+
+    return 0;
+
+free_buffers:
+    kfree(buffers);
+    buffers = NULL;
+    return err;
+}
+
+// Drops every page of the buffer and empties the queues. Pages still referenced by a pipe are
+// only freed once the pipe drops them.
+static void mychardev_buffer_truncate(struct mychardev_buffer *buf)
+{
+    int cpu;
+
+    pagebuf_truncate(&buf->pb);
+    buf->len = 0;
+
+    if (!buf->queues)
+        return;
+    for_each_possible_cpu(cpu)
+    {
+        struct mychardev_queue *q = per_cpu_ptr(buf->queues, cpu);
+
+        mutex_lock(&q->lock);
+        q->head = 0;
+        q->tail = 0;
+        mutex_unlock(&q->lock);
+    }
+}
+
+static int mychardev_queues_alloc(struct mychardev_buffer *buf)
+{
+    int cpu;
+
+    // Per-CPU memory already lives on the node of its CPU
+    buf->queues = alloc_percpu(struct mychardev_queue);
+    if (!buf->queues)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu)
+        mutex_init(&per_cpu_ptr(buf->queues, cpu)->lock);
+
+    return 0;
+}
+
+static void mychardev_queues_free(struct mychardev_buffer *buf)
+{
+    int cpu;
+
+    if (!buf->queues)
+        return;
+    for_each_possible_cpu(cpu)
+        kvfree(per_cpu_ptr(buf->queues, cpu)->data);
+    free_percpu(buf->queues);
+}
+
+void mychardev_buffers_exit(void)
+{
+    unsigned int i;
+
+    // Before the buffers go, the refresh of the stats page reads them
+    statpage_unregister(&mychardev_stats);
+
+    for (i = 0; i < nr_buffers; i++)
+    {
+        if (!buffers[i])
+            continue;
+        // The shrinker may still look at the pages, under the lock
+        mutex_lock(&buffers[i]->lock);
+        mychardev_buffer_truncate(buffers[i]);
+        mutex_unlock(&buffers[i]->lock);
+        mychardev_queues_free(buffers[i]);
+        kfree(buffers[i]);
+    }
+    kfree(buffers);
+    buffers = NULL;
+    nr_buffers = 0;
+
+    pagebuf_cache_unregister(&mychardev_cache);
+}
+
+// Returns the buffer of a minor, allocating it on the local NUMA node on first use
+static struct mychardev_buffer *mychardev_buffer_get(unsigned int minor)
+{
+    struct mychardev_buffer *buf;
+    int node = numa_node_id();
+
+    if (minor >= nr_buffers)
+        return ERR_PTR(-ENODEV);
+
+    mutex_lock(&buffers_lock);
+    buf = buffers[minor];
+    if (buf)
+        goto out;
+
+    buf = kzalloc_node(sizeof(*buf), GFP_KERNEL, node);
+    if (!buf)
+    {
+        buf = ERR_PTR(-ENOMEM);
+        goto out;
+    }
+    if (multi_queue && mychardev_queues_alloc(buf))
+    {
+        kfree(buf);
+        buf = ERR_PTR(-ENOMEM);
+        goto out;
+    }
+    mutex_init(&buf->lock);
+    pagebuf_init(&buf->pb, &mychardev_cache, &buf->lock, node);
+    atomic_set(&buf->already_open, CDEV_NOT_USED);
+    buf->node = node;
+    buf->read_queue = MYCHARDEV_QUEUE_MERGED;
+
+    // Pairs with the smp_load_acquire() of the sysfs attributes
+    smp_store_release(&buffers[minor], buf);
+out:
+    mutex_unlock(&buffers_lock);
+    return buf;
+}
 
 /* Called when a process tries to open the device file, like
  * "sudo cat /dev/chardev"
@@ -27,28 +350,52 @@ static atomic_t already_open = ATOMIC_INIT(CDEV_NOT_USED);
 int device_open(struct inode* inode, struct file* file)
 {
     static unsigned int counter = 0;
+    struct mychardev_buffer *buf;
+    u64 t0 = hptrace_begin(mychardev_sites, MYCHARDEV_TRACE_OPEN);
+
+    // Every minor has a buffer of its own
+    buf = mychardev_buffer_get(iminor(inode) - MINOR_NUM);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
 
     // If file is not oppened (NOT_USED), set to EXCLUSIVE_OPEN
     // if arg1 == arg2; then set arg1 to arg3 AND Return arg2 else return arg1
     // Compare and Swap, prevent concurrent access to shared resources
-    if (atomic_cmpxchg(&already_open, CDEV_NOT_USED, CDEV_EXCLUSIVE_OPEN))
+    if (atomic_cmpxchg(&buf->already_open, CDEV_NOT_USED, CDEV_EXCLUSIVE_OPEN))
         return -EBUSY;
 
     if(try_module_get(THIS_MODULE))
     {
+        file->private_data = buf;
+
+        mutex_lock(&buf->lock);
+        buf->opens++;
+        buf->read_queue = MYCHARDEV_QUEUE_MERGED;
+        // Like for regular files, opening with O_TRUNC starts over with an empty buffer
+        if (file->f_flags & O_TRUNC)
+            mychardev_buffer_truncate(buf);
+        mutex_unlock(&buf->lock);
+
+        // Reads and writes only sleep on the buffer lock, and do not with IOCB_NOWAIT.
+        // That lets io_uring complete them inline rather than in a worker thread.
+        file->f_mode |= FMODE_NOWAIT;
         // printk("Module %s: Opening file %u times\n", THIS_MODULE->name, counter++);
         // printk("\tRef count: %u\n", THIS_MODULE->refcnt.counter);
+        hptrace_end(mychardev_sites, MYCHARDEV_TRACE_OPEN, t0, 0);
         return SUCCESS;
     }
 
+    atomic_set(&buf->already_open, CDEV_NOT_USED);
     return FAILURE;
 }
 
 /* Called when a process closes the device file. */
 int device_close(struct inode* inode, struct file* file)
 {
+    struct mychardev_buffer *buf = file->private_data;
+
     /* We're now ready for our next caller */
-    atomic_set(&already_open, CDEV_NOT_USED);
+    atomic_set(&buf->already_open, CDEV_NOT_USED);
     
     /* Decrement the usage count, or else once you opened the file, you will
      * never get rid of the module.
@@ -60,89 +407,707 @@ int device_close(struct inode* inode, struct file* file)
 
     return 0;
 }
+/*
+ * IOCB_NOWAIT asks not to sleep, io_uring sets it to try a request inline first. Then only try
+ * the lock, and the -EAGAIN makes io_uring retry from a worker that may block.
+ */
+static int device_lock_iocb(struct mutex *lock, struct kiocb *iocb)
+{
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        return mutex_trylock(lock) ? 0 : -EAGAIN;
+
+    mutex_lock(lock);
+    return 0;
+}
+
+// A read got to pos. In stream mode, once a page was read to its end, or to the end of the data,
+// it may be evicted under memory pressure.
+static void device_buffer_consumed(struct mychardev_buffer *buf, loff_t pos)
+{
+    if (stream && pos && (!(pos & ~PAGE_MASK) || pos >= buf->len))
+        pagebuf_consume(&buf->pb, (pos - 1) >> PAGE_SHIFT);
+}
+
+// Holes read as zeros
+static size_t device_buffer_copy_to_iter(struct mychardev_buffer *buf, loff_t pos, size_t len,
+                                         struct iov_iter *to)
+{
+    size_t copied = 0;
+
+    while (copied < len)
+    {
+        struct page *page = pagebuf_page(&buf->pb, pos >> PAGE_SHIFT);
+        size_t offset = pos & ~PAGE_MASK;
+        size_t chunk = min(len - copied, PAGE_SIZE - offset);
+        size_t done;
+
+        if (page)
+            done = copy_page_to_iter(page, offset, chunk, to);
+        else
+            done = iov_iter_zero(chunk, to);
+
+        copied += done;
+        pos += done;
+        if (done < chunk)
+            break;
+        device_buffer_consumed(buf, pos);
+    }
+
+    return copied;
+}
+
+// Pages are allocated as the first write reaches them, and charged to the memory cgroup of the
+// writer. A page that a pipe still references is replaced by a copy, so that the pipe keeps the
+// data it was given, like it would with a page cache page that is written over. Returns -ENOMEM
+// if allocating fails before anything was copied, also when the cgroup is at its limit.
+static ssize_t device_buffer_copy_from_iter(struct mychardev_buffer *buf, size_t pos,
+                                            size_t len, struct iov_iter *from, gfp_t gfp)
+{
+    ssize_t copied = 0;
+
+    while (copied < len)
+    {
+        struct page *page = pagebuf_page_for_write(&buf->pb, pos >> PAGE_SHIFT, gfp);
+        size_t offset = pos & ~PAGE_MASK;
+        size_t chunk = min(len - copied, PAGE_SIZE - offset);
+        size_t done;
+
+        if (!page)
+            return copied ? copied : -ENOMEM;
+
+        done = copy_page_from_iter(page, offset, chunk, from);
+        copied += done;
+        pos += done;
+        if (done < chunk)
+            break;
+    }
+
+    return copied;
+}
+
+/*
+ * Appends one record to the queue of the CPU we run on. Should the task move to another CPU
+ * meanwhile, it still appends to the queue it started with: the lock keeps that correct, it is
+ * just no longer free of contention.
+ */
+static ssize_t device_queue_write(struct mychardev_buffer *buf, struct kiocb *iocb,
+                                  struct iov_iter *from)
+{
+    int cpu = raw_smp_processor_id();
+    struct mychardev_queue *q = per_cpu_ptr(buf->queues, cpu);
+    struct mychardev_record rec;
+    size_t len;
+    int err;
+
+    if (!iov_iter_count(from))
+        return 0;
+
+    err = device_lock_iocb(&q->lock, iocb);
+    if (err)
+        return err;
+
+    if (!q->data)
+    {
+        // kvmalloc() may sleep, let a worker do it
+        if (iocb->ki_flags & IOCB_NOWAIT)
+        {
+            mutex_unlock(&q->lock);
+            return -EAGAIN;
+        }
+        q->data = kvmalloc_node(QUEUE_SIZE, GFP_KERNEL_ACCOUNT, cpu_to_node(cpu));
+        if (!q->data)
+        {
+            mutex_unlock(&q->lock);
+            return -ENOMEM;
+        }
+    }
+
+    // Start over at the beginning once readers caught up
+    if (q->head == q->tail)
+    {
+        q->head = 0;
+        q->tail = 0;
+    }
+    if (q->tail + sizeof(rec) >= QUEUE_SIZE)
+    {
+        mutex_unlock(&q->lock);
+        return -ENOMEM;  // No space left in the queue
+    }
+
+    len = min(iov_iter_count(from), QUEUE_SIZE - q->tail - sizeof(rec));
+    len = copy_from_iter(q->data + q->tail + sizeof(rec), len, from);
+    if (!len)
+    {
+        mutex_unlock(&q->lock);
+        return -EFAULT;
+    }
+
+    // Stamped under the lock, so that the records of a queue are in the order of their stamps
+    rec.ts = ktime_get_ns();
+    rec.len = len;
+    memcpy(q->data + q->tail, &rec, sizeof(rec));
+    q->tail += sizeof(rec) + len;
+    q->writes++;
+    q->bytes_written += len;
+    mutex_unlock(&q->lock);
+
+    return len;
+}
+
+/*
+ * Copies records from the head of a queue, as long as they were written no later than until.
+ * A record that does not fit in to is split: its remainder stays at the head, under a header of
+ * its own.
+ */
+static ssize_t device_queue_copy_to_iter(struct mychardev_queue *q, u64 until,
+                                         struct iov_iter *to, struct kiocb *iocb)
+{
+    struct mychardev_record rec;
+    ssize_t copied = 0;
+    int err;
+
+    err = device_lock_iocb(&q->lock, iocb);
+    if (err)
+        return err;
+
+    while (q->head != q->tail && iov_iter_count(to))
+    {
+        size_t chunk, done;
+
+        memcpy(&rec, q->data + q->head, sizeof(rec));
+        if (rec.ts > until)
+            break;
+
+        chunk = min_t(size_t, rec.len, iov_iter_count(to));
+        done = copy_to_iter(q->data + q->head + sizeof(rec), chunk, to);
+        copied += done;
+        if (done < rec.len)
+        {
+            q->head += done;
+            rec.len -= done;
+            memcpy(q->data + q->head, &rec, sizeof(rec));
+            break;
+        }
+        q->head += sizeof(rec) + rec.len;
+    }
+    mutex_unlock(&q->lock);
+
+    return copied;
+}
+
+/*
+ * Finds the queue with the oldest record at its head, NULL if all are empty. *next_ts is set to
+ * the stamp of the oldest record of all the other queues: the records of the returned queue up
+ * to it can be taken in one go.
+ */
+static struct mychardev_queue *device_queue_oldest(struct mychardev_buffer *buf, u64 *next_ts,
+                                                   struct kiocb *iocb)
+{
+    struct mychardev_queue *oldest = NULL;
+    u64 oldest_ts = U64_MAX;
+    int cpu, err;
+
+    *next_ts = U64_MAX;
+    for_each_possible_cpu(cpu)
+    {
+        struct mychardev_queue *q = per_cpu_ptr(buf->queues, cpu);
+        struct mychardev_record rec = { .ts = U64_MAX };
+
+        err = device_lock_iocb(&q->lock, iocb);
+        if (err)
+            return ERR_PTR(err);
+        if (q->head != q->tail)
+            memcpy(&rec, q->data + q->head, sizeof(rec));
+        mutex_unlock(&q->lock);
+
+        if (rec.ts < oldest_ts)
+        {
+            *next_ts = oldest_ts;
+            oldest_ts = rec.ts;
+            oldest = q;
+        }
+        else if (rec.ts < *next_ts)
+        {
+            *next_ts = rec.ts;
+        }
+    }
+
+    return oldest;
+}
+
+// Consumes records from the selected queue, or from all of them, oldest first. Called with
+// buf->lock held, which serializes readers.
+static ssize_t device_queue_read(struct mychardev_buffer *buf, struct kiocb *iocb,
+                                 struct iov_iter *to)
+{
+    ssize_t copied = 0;
+
+    if (buf->read_queue != MYCHARDEV_QUEUE_MERGED)
+        return device_queue_copy_to_iter(per_cpu_ptr(buf->queues, buf->read_queue), U64_MAX,
+                                         to, iocb);
+
+    while (iov_iter_count(to))
+    {
+        struct mychardev_queue *q;
+        ssize_t done;
+        u64 next_ts;
+
+        q = device_queue_oldest(buf, &next_ts, iocb);
+        if (IS_ERR_OR_NULL(q))
+            return copied ? copied : PTR_ERR_OR_ZERO(q);
+
+        done = device_queue_copy_to_iter(q, next_ts, to, iocb);
+        if (done <= 0)
+            return copied ? copied : done;
+        copied += done;
+    }
+
+    return copied;
+}
+
 /**
  * @brief Read data out of the buffer
- * @param file Represents the open file instance on which the write operation is
- *             being performed
- * @param user_buf Pointer to the user-space buffere containing the data to be
- *                 written to the file
- * @param count Maximum number of bytes the user-space program is requesting to
- *              read from this device.
+ * @param iocb Represents the I/O on the open file instance: iocb->ki_filp is the file,
+ *             iocb->ki_pos the offset and iocb->ki_flags e.g. IOCB_NOWAIT
+ * @param to The user-space buffers to fill. A plain read() has one, readv() and io_uring
+ *           may pass many. iov_iter_count(to) is the maximum number of bytes the
+ *           user-space program is requesting to read from this device.
  *              Note: This number can be very large at the start, why? Tools like
  *              cat and the read() system call generally use a large buffer to
  *              minimize the number of system calls. This buffer size is typically
  *              4 KB (4096 bytes) on most systems.
- * @param pos Pointer to the current file offset, indicates where in the file the
- *            read operation should start. Does *pos = 0 (always) at the start?
  * @return This method should return the number of bytes read.
  *         Returning 0 signals to cat command that it has reached the end of file.
- *         When EOF is reached, cat stops calling device_read() and exits, printing
+ *         When EOF is reached, cat stops calling device_read_iter() and exits, printing
  *         the contents of the fil.
  * 
  *         In the first call, bytes_to_read will be returned. Because this is a non
- *         zero value, device_read() will be called again. In the second call, 0 will
+ *         zero value, device_read_iter() will be called again. In the second call, 0 will
  *         be returned (becuase pos was update during the first call).
+ *
+ *         In multi-queue mode a read consumes records from the queues instead and the file
+ *         offset is not used. 0 then means that the queues are empty for now.
  */
-ssize_t device_read(struct file *file, char __user *user_buf, size_t count, loff_t *pos)
+ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
+    struct mychardev_buffer *buf = iocb->ki_filp->private_data;
     size_t bytes_to_read;
+    loff_t pos = iocb->ki_pos;
+    int err;
+    u64 t0 = hptrace_begin(mychardev_sites, MYCHARDEV_TRACE_READ);
+
+    // Nothing to copy, and copy_to_iter() returning 0 must not read as a fault
+    if (!iov_iter_count(to))
+        return 0;
+
+    err = device_lock_iocb(&buf->lock, iocb);
+    if (err)
+        return err;
+
+    if (buf->queues)
+    {
+        ssize_t ret = device_queue_read(buf, iocb, to);
+
+        if (ret > 0)
+        {
+            buf->reads++;
+            buf->bytes_read += ret;
+        }
+        mutex_unlock(&buf->lock);
+
+        if (ret > 0)
+            hptrace_end(mychardev_sites, MYCHARDEV_TRACE_READ, t0, ret);
+        return ret;
+    }
 
     // Check if we've already read everything
-    if (*pos >= current_buffer_len)
-        return 0;  // cat will continue calling device_read() until it receives a 0, signaling EOF
+    if (pos >= buf->len)
+    {
+        mutex_unlock(&buf->lock);
+        return 0;  // cat will continue calling read() until it receives a 0, signaling EOF
+    }
 
     // Determine how many bytes to read
-    bytes_to_read = min(count, (current_buffer_len - *pos) );
+    bytes_to_read = min_t(size_t, iov_iter_count(to), buf->len - pos);
 
-    // Copy data from kernel space buffer (device_buffer) to user space buffer (user_buf)
-    if (copy_to_user(user_buf, &device_buffer[*pos], bytes_to_read))
+    // Copy data from kernel space buffer (buf->pages) to the user space buffers, one page at a
+    // time, zeros for holes
+    bytes_to_read = device_buffer_copy_to_iter(buf, pos, bytes_to_read, to);
+    buf->reads++;
+    buf->bytes_read += bytes_to_read;
+    mutex_unlock(&buf->lock);
+    if (!bytes_to_read)
     {
         pr_err("Failed to copy data from kernel space\n");
         return -EFAULT;
     }
 
-    pr_info("%s: Read %zu bytes from the device\n", DRIVER_NAME, bytes_to_read);
-    *pos += bytes_to_read;  // Update the file offset
+    pr_debug("%s: Read %zu bytes from the device\n", DRIVER_NAME, bytes_to_read);
+    iocb->ki_pos += bytes_to_read;  // Update the file offset
 
+    hptrace_end(mychardev_sites, MYCHARDEV_TRACE_READ, t0, bytes_to_read);
     return bytes_to_read;  // Return the number of bytes read
 }
 
 /**
  * @brief Write data to buffer
- * @param file Represents the open file instance on which the write operation is
- *             being performed
- * @param user_buf Pointer to the user-space buffere containing the data to be
- *                 written to the file
- * @param count The number of bytes to write from the user buffer to the file
- * @param pos Pointer to the current file offset, indicates where in teh file the
- *            write operation should start
+ * @param iocb Represents the I/O on the open file instance, see device_read_iter(). The
+ *             write goes to iocb->ki_pos, or to the end of the buffer with O_APPEND. Writing
+ *             past the end leaves a hole, which takes no memory. In multi-queue mode writes
+ *             append a record to the queue of the current CPU instead.
+ * @param from The user-space buffers containing the data to be written to the file.
+ *             iov_iter_count(from) is the number of bytes to write.
  * @return Returns the number of bytes written
  */
-ssize_t device_write(struct file *file, const char __user *user_buf, size_t count, loff_t *pos)
+ssize_t device_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    size_t bytes_to_write = 0;
+    struct mychardev_buffer *buf = iocb->ki_filp->private_data;
+    ssize_t bytes_to_write = 0;
+    loff_t pos;
+    int err;
+    u64 t0 = hptrace_begin(mychardev_sites, MYCHARDEV_TRACE_WRITE);
+
+    // The queues are independent of buf->lock, writers on different CPUs share nothing
+    if (buf->queues)
+    {
+        bytes_to_write = device_queue_write(buf, iocb, from);
+
+        if (bytes_to_write > 0)
+            hptrace_end(mychardev_sites, MYCHARDEV_TRACE_WRITE, t0, bytes_to_write);
+        return bytes_to_write;
+    }
+
+    err = device_lock_iocb(&buf->lock, iocb);
+    if (err)
+        return err;
+
+    if (iocb->ki_flags & IOCB_APPEND)
+        iocb->ki_pos = buf->len;
+    pos = iocb->ki_pos;
 
     // Ensure we don't exceed the buffer size
-    if (device_buffer_idx >= BUFFER_SIZE)
+    if (pos < 0 || pos >= BUFFER_SIZE)
     {
-        pr_err("Attempting to write at offset %lu, no more memory space left on buffer\n", device_buffer_idx);
+        mutex_unlock(&buf->lock);
+        pr_debug("Attempting to write at offset %lld, no more memory space left on buffer\n", pos);
         return -ENOMEM;  // No space left in the buffer
     }
 
     // Determine the number of bytes we can write.
-    // Write either the full amount (count), or up to the space left in the buffer.
-    bytes_to_write = min(count, (size_t)(BUFFER_SIZE - device_buffer_idx));
+    // Write either the full amount (count), or up to the end of the buffer.
+    bytes_to_write = min_t(size_t, iov_iter_count(from), BUFFER_SIZE - pos);
+    if (!bytes_to_write)
+    {
+        mutex_unlock(&buf->lock);
+        return 0;
+    }
 
-    // Copy data from user space buffer (user_buf) to kernel space buffer (device_buffer)
-    if (copy_from_user( &device_buffer[device_buffer_idx], user_buf, bytes_to_write) )
+    // Copy data from the user space buffers to kernel space buffer (buf->pages)
+    bytes_to_write = device_buffer_copy_from_iter(buf, pos, bytes_to_write, from,
+                                                  iocb->ki_flags & IOCB_NOWAIT ? GFP_NOWAIT : GFP_KERNEL);
+    // A GFP_NOWAIT allocation may well succeed from a worker that can wait
+    if (bytes_to_write == -ENOMEM && (iocb->ki_flags & IOCB_NOWAIT))
+        bytes_to_write = -EAGAIN;
+    if (bytes_to_write <= 0)
     {
+        mutex_unlock(&buf->lock);
         pr_err("Failed to copy data from user space\n");
-        return -EFAULT;  // Return error if copy fails
+        return bytes_to_write ? bytes_to_write : -EFAULT;  // Return error if copy fails
     }
-    pr_info("Wrote %zu bytes to device buffer at offset %lld\n", bytes_to_write, device_buffer_idx);
+    pr_debug("Wrote %zd bytes to device buffer at offset %lld\n", bytes_to_write, pos);
 
-    device_buffer_idx += bytes_to_write;  // Update the buffer offset. This is so that for consecutive writes the buffer isn't overwritten.
-    current_buffer_len += bytes_to_write;
+    iocb->ki_pos = pos + bytes_to_write;  // Update the file offset, the next write goes after this one
+    buf->len = max_t(size_t, buf->len, iocb->ki_pos);  // Writing past the end grows the buffer
+    buf->writes++;
+    buf->bytes_written += bytes_to_write;
+    mutex_unlock(&buf->lock);
 
+    hptrace_end(mychardev_sites, MYCHARDEV_TRACE_WRITE, t0, bytes_to_write);
     return bytes_to_write;  // Return the number of bytes written
 }
+
+/**
+ * @brief Move data out of the buffer into a pipe without copying it
+ * @param file The open file instance, as for reads
+ * @param ppos The offset to start at, updated like iocb->ki_pos in device_read_iter()
+ * @param pipe The pipe to fill, locked by our caller
+ * @param len Maximum number of bytes to move
+ * @param flags SPLICE_F_* flags of the splice() call
+ * @return The number of bytes moved, 0 at the end of the buffer
+ *
+ * Used by splice() from the device to a pipe, and by sendfile() from the device to a file or
+ * socket. Every pipe buffer takes a reference to one of our pages, the data is only copied once
+ * it leaves the pipe, e.g. into a socket.
+ */
+ssize_t device_splice_read(struct file *file, loff_t *ppos, struct pipe_inode_info *pipe,
+                           size_t len, unsigned int flags)
+{
+    struct mychardev_buffer *dev_buf = file->private_data;
+    ssize_t spliced = 0;
+    loff_t pos = *ppos;
+    u64 t0;
+
+    // Records in the queues are consumed by reads, there are no pages to hand out
+    if (dev_buf->queues)
+        return -EINVAL;
+
+    t0 = hptrace_begin(mychardev_sites, MYCHARDEV_TRACE_READ);
+    mutex_lock(&dev_buf->lock);
+
+    if (pos < dev_buf->len)
+        len = min_t(size_t, len, dev_buf->len - pos);
+    else
+        len = 0;
+
+    while (len)
+    {
+        struct page *page = pagebuf_page(&dev_buf->pb, pos >> PAGE_SHIFT);
+        size_t offset = pos & ~PAGE_MASK;
+        size_t chunk = min(len, PAGE_SIZE - offset);
+        // Holes go out as the shared zero page. Either page is only referenced, never stolen,
+        // and a write to a page still in a pipe goes to a copy, see pagebuf_page_for_write().
+        // The ops live in the kernel, so pipe buffers outliving the module are fine.
+        struct pipe_buffer buf = {
+            .page = page ? page : ZERO_PAGE(0),
+            .offset = offset,
+            .len = chunk,
+            .ops = &nosteal_pipe_buf_ops,
+        };
+        ssize_t ret;
+
+        get_page(buf.page);
+        // Drops our reference again if the pipe is full
+        ret = add_to_pipe(pipe, &buf);
+        if (ret < 0)
+        {
+            if (!spliced)
+                spliced = ret;
+            break;
+        }
+
+        spliced += chunk;
+        pos += chunk;
+        len -= chunk;
+        device_buffer_consumed(dev_buf, pos);
+    }
+
+    if (spliced > 0)
+    {
+        dev_buf->reads++;
+        dev_buf->bytes_read += spliced;
+    }
+    mutex_unlock(&dev_buf->lock);
+
+    if (spliced > 0)
+        *ppos = pos;
+
+    hptrace_end(mychardev_sites, MYCHARDEV_TRACE_READ, t0, spliced);
+    return spliced;
+}
+
+/**
+ * @brief Move data from a pipe into the buffer
+ *
+ * The bytes land at arbitrary, unaligned offsets of our pages, so they cannot simply be taken
+ * over from the pipe. iter_file_splice_write() instead hands the pipe pages to
+ * device_write_iter() as a bvec iov_iter: one copy, but none through user space.
+ */
+ssize_t device_splice_write(struct pipe_inode_info *pipe, struct file *file, loff_t *ppos,
+                            size_t len, unsigned int flags)
+{
+    return iter_file_splice_write(pipe, file, ppos, len, flags);
+}
+
+/**
+ * @brief Move the file offset, like lseek() on a regular file of size buf->len
+ *
+ * SEEK_DATA and SEEK_HOLE find the pages that were written and the holes between them. The end
+ * of the buffer counts as a hole, like the end of a file. In multi-queue mode reads and writes
+ * do not use the file offset, so it cannot be moved.
+ */
+loff_t device_llseek(struct file *file, loff_t offset, int whence)
+{
+    struct mychardev_buffer *buf = file->private_data;
+    unsigned long index;
+    loff_t ret;
+
+    if (buf->queues)
+        return -ESPIPE;
+
+    mutex_lock(&buf->lock);
+
+    switch (whence)
+    {
+    case SEEK_DATA:
+        // Evicted pages read as zeros, so they count as holes
+        if (offset < 0 || offset >= buf->len ||
+            (index = pagebuf_next_data(&buf->pb, offset >> PAGE_SHIFT)) == ULONG_MAX ||
+            ((loff_t)index << PAGE_SHIFT) >= buf->len)
+        {
+            ret = -ENXIO;
+            break;
+        }
+        ret = vfs_setpos(file, max_t(loff_t, offset, (loff_t)index << PAGE_SHIFT), BUFFER_SIZE);
+        break;
+
+    case SEEK_HOLE:
+        if (offset < 0 || offset >= buf->len)
+        {
+            ret = -ENXIO;
+            break;
+        }
+        for (index = offset >> PAGE_SHIFT; pagebuf_has_data(&buf->pb, index); index++)
+            ;
+        ret = vfs_setpos(file, min_t(loff_t, max_t(loff_t, offset, (loff_t)index << PAGE_SHIFT),
+                                     buf->len), BUFFER_SIZE);
+        break;
+
+    default:
+        ret = generic_file_llseek_size(file, offset, whence, BUFFER_SIZE, buf->len);
+        break;
+    }
+
+    mutex_unlock(&buf->lock);
+    return ret;
+}
+
+/**
+ * @brief The ioctls of mychardev_ioctl.h
+ */
+long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct mychardev_buffer *buf = file->private_data;
+    int __user *argp = (int __user *)arg;
+    int queue;
+
+    switch (cmd)
+    {
+    case MYCHARDEV_RESET:
+        mutex_lock(&buf->lock);
+        mychardev_buffer_truncate(buf);
+        mutex_unlock(&buf->lock);
+        return 0;
+
+    case MYCHARDEV_SELECT_QUEUE:
+        if (get_user(queue, argp))
+            return -EFAULT;
+        if (queue != MYCHARDEV_QUEUE_MERGED &&
+            (!buf->queues || queue < 0 || queue >= nr_cpu_ids || !cpu_possible(queue)))
+            return -EINVAL;
+        mutex_lock(&buf->lock);
+        buf->read_queue = queue;
+        mutex_unlock(&buf->lock);
+        return 0;
+
+    case MYCHARDEV_GET_QUEUES:
+        return put_user(buf->queues ? (int)nr_cpu_ids : 0, argp);
+    }
+
+    return -ENOTTY;
+}
+
+/*
+ * Statistics of a minor, under /sys/class/MyChar_Class/MyChar_NodeN/. All zero until the minor
+ * is first opened.
+ */
+#define MYCHARDEV_STAT_ATTR(field)                                                               \
+    static ssize_t field##_show(struct device *dev, struct device_attribute *attr, char *page) \
+    {                                                                                          \
+        struct mychardev_buffer *buf = smp_load_acquire(&buffers[MINOR(dev->devt) - MINOR_NUM]); \
+        u64 val = 0;                                                                           \
+                                                                                               \
+        if (buf)                                                                               \
+        {                                                                                      \
+            mutex_lock(&buf->lock);                                                            \
+            val = buf->field;                                                                  \
+            mutex_unlock(&buf->lock);                                                          \
+        }                                                                                      \
+        return sprintf(page, "%llu\n", val);                                                   \
+    }                                                                                          \
+    static DEVICE_ATTR_RO(field)
+
+// In multi-queue mode writes are counted by the queue they went to
+#define MYCHARDEV_WRITE_STAT_ATTR(field)                                                         \
+    static ssize_t field##_show(struct device *dev, struct device_attribute *attr, char *page) \
+    {                                                                                          \
+        struct mychardev_buffer *buf = smp_load_acquire(&buffers[MINOR(dev->devt) - MINOR_NUM]); \
+        u64 val = 0;                                                                           \
+        int cpu;                                                                               \
+                                                                                               \
+        if (!buf)                                                                              \
+            return sprintf(page, "0\n");                                                       \
+        mutex_lock(&buf->lock);                                                                \
+        val = buf->field;                                                                      \
+        mutex_unlock(&buf->lock);                                                              \
+        if (buf->queues)                                                                       \
+        {                                                                                      \
+            for_each_possible_cpu(cpu)                                                         \
+            {                                                                                  \
+                struct mychardev_queue *q = per_cpu_ptr(buf->queues, cpu);                     \
+                                                                                               \
+                mutex_lock(&q->lock);                                                          \
+                val += q->field;                                                               \
+                mutex_unlock(&q->lock);                                                        \
+            }                                                                                  \
+        }                                                                                      \
+        return sprintf(page, "%llu\n", val);                                                   \
+    }                                                                                          \
+    static DEVICE_ATTR_RO(field)
+
+MYCHARDEV_STAT_ATTR(opens);
+MYCHARDEV_STAT_ATTR(reads);
+MYCHARDEV_WRITE_STAT_ATTR(writes);
+MYCHARDEV_STAT_ATTR(bytes_read);
+MYCHARDEV_WRITE_STAT_ATTR(bytes_written);
+
+// Pages of the buffer in memory, evicted under memory pressure, and touched again after that
+#define MYCHARDEV_PAGEBUF_STAT_ATTR(field)                                                       \
+    static ssize_t field##_pages_show(struct device *dev, struct device_attribute *attr,      \
+                                      char *page)                                            \
+    {                                                                                          \
+        struct mychardev_buffer *buf = smp_load_acquire(&buffers[MINOR(dev->devt) - MINOR_NUM]); \
+        unsigned long val = 0;                                                                 \
+                                                                                               \
+        if (buf)                                                                               \
+        {                                                                                      \
+            mutex_lock(&buf->lock);                                                            \
+            val = buf->pb.field;                                                               \
+            mutex_unlock(&buf->lock);                                                          \
+        }                                                                                      \
+        return sprintf(page, "%lu\n", val);                                                    \
+    }                                                                                          \
+    static DEVICE_ATTR_RO(field##_pages)
+
+MYCHARDEV_PAGEBUF_STAT_ATTR(resident);
+MYCHARDEV_PAGEBUF_STAT_ATTR(evicted);
+MYCHARDEV_PAGEBUF_STAT_ATTR(refaulted);
+
+static ssize_t numa_node_show(struct device *dev, struct device_attribute *attr, char *page)
+{
+    struct mychardev_buffer *buf = smp_load_acquire(&buffers[MINOR(dev->devt) - MINOR_NUM]);
+
+    return sprintf(page, "%d\n", buf ? buf->node : NUMA_NO_NODE);
+}
+static DEVICE_ATTR_RO(numa_node);
+
+static struct attribute *mychardev_buffer_attrs[] = {
+    &dev_attr_opens.attr,
+    &dev_attr_reads.attr,
+    &dev_attr_writes.attr,
+    &dev_attr_bytes_read.attr,
+    &dev_attr_bytes_written.attr,
+    &dev_attr_resident_pages.attr,
+    &dev_attr_evicted_pages.attr,
+    &dev_attr_refaulted_pages.attr,
+    &dev_attr_numa_node.attr,
+    NULL,
+};
+
+static const struct attribute_group mychardev_buffer_group = {
+    .attrs = mychardev_buffer_attrs,
+};
+
+const struct attribute_group *mychardev_buffer_groups[] = {
+    &mychardev_buffer_group,
+    NULL,
+};
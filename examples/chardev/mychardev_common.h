@@ -7,5 +7,15 @@
 
 int device_open(struct inode* inode, struct file* file);
 int device_close(struct inode* inode, struct file* file);
-ssize_t device_read(struct file *file, char __user *user_buffer, size_t len, loff_t *off);
-ssize_t device_write(struct file *file, const char __user *user_buffer, size_t len, loff_t *off);
\ No newline at end of file
+ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t device_write_iter(struct kiocb *iocb, struct iov_iter *from);
+ssize_t device_splice_read(struct file *file, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags);
+ssize_t device_splice_write(struct pipe_inode_info *pipe, struct file *file, loff_t *ppos, size_t len, unsigned int flags);
+loff_t device_llseek(struct file *file, loff_t offset, int whence);
+long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg);   // See mychardev_ioctl.h
+int mychardev_buffers_init(unsigned int count);   // One buffer per minor, from MINOR_NUM on
+void mychardev_buffers_exit(void);
+extern const struct attribute_group *mychardev_buffer_groups[];   // Statistics of each minor
+
+int mychardev_trace_init(void);
+void mychardev_trace_exit(void);
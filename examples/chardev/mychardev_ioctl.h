@@ -0,0 +1,30 @@
+/*
+ * mychardev_ioctl.h - the ioctl definitions of CharDev-2
+ *
+ * Shared by mychardev_common.c and the user space tools.
+ *
+ * With the multi_queue module parameter set, every CPU appends to a queue
+ * of its own, and reads consume the queues instead of reading the buffer
+ * at the file offset. By default a read merges all queues, oldest record
+ * first by the time it was written. MYCHARDEV_SELECT_QUEUE limits the reads
+ * of the open file to the queue of one CPU instead, for consumers that do
+ * not need a global order.
+ */
+
+#ifndef MYCHARDEV_IOCTL_H
+#define MYCHARDEV_IOCTL_H
+
+#include <linux/ioctl.h>
+
+#define MYCHARDEV_IOC_MAGIC 'M'
+
+/* Empty the buffer, or all queues, like opening with O_TRUNC */
+#define MYCHARDEV_RESET _IO(MYCHARDEV_IOC_MAGIC, 0)
+/* Read only from the queue of CPU n, or MYCHARDEV_QUEUE_MERGED */
+#define MYCHARDEV_SELECT_QUEUE _IOW(MYCHARDEV_IOC_MAGIC, 1, int)
+/* The number of queues, one per possible CPU, 0 without multi_queue */
+#define MYCHARDEV_GET_QUEUES _IOR(MYCHARDEV_IOC_MAGIC, 2, int)
+
+#define MYCHARDEV_QUEUE_MERGED (-1)
+
+#endif
@@ -0,0 +1,274 @@
+/*
+ * rand_bench.c - random pread()/pwrite() IOPS on the buffer device
+ *
+ * Fills the first -s bytes of CharDev-2 and then does random, block
+ * aligned pread() and pwrite() calls of -b bytes within them, from -j
+ * threads sharing the open file, for -t seconds per mode:
+ *
+ *   randread   only pread()
+ *   randwrite  only pwrite()
+ *   randrw     70% pread(), 30% pwrite()
+ *
+ * and reports the IOPS and the average latency of each mode. With -S only
+ * the last block is written first: the random writes then land in holes of
+ * the sparse buffer, and the reads of holes return zeros without touching
+ * any page. The data segments are listed with SEEK_DATA/SEEK_HOLE at the end,
+ * to show what the writes allocated.
+ *
+ *   sudo insmod CharDev-2.ko buffer_kb=65536
+ *   ./rand_bench -s 64M -j 4 -t 2
+ *
+ * Runs against a regular file too, with -d, for comparison.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEVICE "/dev/MyChar_Node0"
+
+enum mode { MODE_READ, MODE_WRITE, MODE_RW, NR_MODES };
+
+static const char *mode_names[NR_MODES] = { "randread", "randwrite", "randrw" };
+
+struct worker {
+    pthread_t thread;
+    unsigned int seed;
+    uint64_t ops;
+    uint64_t ns;
+    int error;
+};
+
+static int dev;
+static enum mode mode;
+static size_t size = 1 << 20, block = 4096;
+static volatile int stop;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *worker(void *arg)
+{
+    struct worker *w = arg;
+    size_t blocks = size / block;
+    char *buf = malloc(block);
+
+    if (!buf) {
+        w->error = ENOMEM;
+        return NULL;
+    }
+    memset(buf, 'x', block);
+
+    while (!stop) {
+        off_t off = (off_t)(rand_r(&w->seed) % blocks) * block;
+        int write = mode == MODE_WRITE ||
+                    (mode == MODE_RW && rand_r(&w->seed) % 10 < 3);
+        uint64_t t = now_ns();
+        ssize_t n = write ? pwrite(dev, buf, block, off)
+                          : pread(dev, buf, block, off);
+
+        w->ns += now_ns() - t;
+        if (n != (ssize_t)block) {
+            w->error = n < 0 ? errno : EIO;
+            break;
+        }
+        w->ops++;
+    }
+    free(buf);
+
+    return NULL;
+}
+
+static int run(struct worker *workers, unsigned int jobs, unsigned int seconds)
+{
+    struct timespec duration = { .tv_sec = seconds };
+    uint64_t start, ops = 0, ns = 0, wall;
+    unsigned int i;
+    int error = 0;
+
+    stop = 0;
+    start = now_ns();
+    for (i = 0; i < jobs; i++) {
+        memset(&workers[i], 0, sizeof(workers[i]));
+        workers[i].seed = i + 1;
+        pthread_create(&workers[i].thread, NULL, worker, &workers[i]);
+    }
+
+    nanosleep(&duration, NULL);
+    stop = 1;
+
+    for (i = 0; i < jobs; i++) {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+        ns += workers[i].ns;
+        if (workers[i].error) {
+            fprintf(stderr, "%s: %s\n", mode_names[mode],
+                    strerror(workers[i].error));
+            error = 1;
+        }
+    }
+    wall = now_ns() - start;
+
+    if (!error)
+        printf("%10s %12.0f %10.1f %10.2f\n", mode_names[mode],
+               ops * 1e9 / wall, (double)ops * block * 1e9 / wall / (1 << 20),
+               ops ? ns / 1e3 / ops : 0.0);
+
+    return error ? -1 : 0;
+}
+
+/* Writes the whole range once, so that no block is a hole. Sparse, only the
+ * last block is written: that sets the size and leaves the rest a hole.
+ */
+static int fill(int sparse)
+{
+    char *buf = malloc(block);
+    size_t off;
+
+    if (!buf)
+        return -1;
+    memset(buf, 'x', block);
+    for (off = sparse ? size / block * block - block : 0; off + block <= size;
+         off += block) {
+        if (pwrite(dev, buf, block, off) != (ssize_t)block) {
+            perror("pwrite");
+            free(buf);
+            return -1;
+        }
+    }
+    free(buf);
+
+    return 0;
+}
+
+/* Lists the data segments, merged when they are adjacent */
+static void show_segments(void)
+{
+    off_t data = 0, hole;
+    unsigned int segments = 0;
+    uint64_t bytes = 0;
+
+    while ((data = lseek(dev, data, SEEK_DATA)) >= 0) {
+        hole = lseek(dev, data, SEEK_HOLE);
+        if (hole < 0)
+            break;
+        if (segments++ < 8)
+            printf("  data %#12llx..%#12llx\n", (unsigned long long)data,
+                   (unsigned long long)hole);
+        bytes += hole - data;
+        data = hole;
+    }
+    if (segments > 8)
+        printf("  ...\n");
+    printf("%u data segment(s), %llu KiB of %zu KiB allocated\n", segments,
+           (unsigned long long)bytes >> 10, size >> 10);
+}
+
+static size_t parse_size(const char *arg)
+{
+    char *end;
+    size_t val = strtoull(arg, &end, 0);
+
+    switch (*end) {
+    case 'G':
+    case 'g':
+        val <<= 10;
+        /* fall through */
+    case 'M':
+    case 'm':
+        val <<= 10;
+        /* fall through */
+    case 'K':
+    case 'k':
+        val <<= 10;
+    }
+
+    return val;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-d device] [-s size] [-b block_size] [-j threads] "
+            "[-t seconds] [-S]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device = DEVICE;
+    unsigned int seconds = 2, jobs = 1;
+    struct worker *workers;
+    int opt, sparse = 0;
+
+    while ((opt = getopt(argc, argv, "d:s:b:j:t:S")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 's':
+            size = parse_size(optarg);
+            break;
+        case 'b':
+            block = parse_size(optarg);
+            break;
+        case 'j':
+            jobs = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            sparse = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!block || size < block || !jobs || !seconds)
+        usage(argv[0]);
+
+    /* The device allows one open at a time, so all threads share the fd */
+    dev = open(device, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (dev < 0) {
+        perror(device);
+        return EXIT_FAILURE;
+    }
+    workers = calloc(jobs, sizeof(*workers));
+    if (!workers) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    if (fill(sparse))
+        return EXIT_FAILURE;
+
+    printf("%s, %zu KiB, blocks of %zu bytes, %u thread(s), %us per mode%s\n",
+           device, size >> 10, block, jobs, seconds, sparse ? ", sparse" : "");
+    printf("%10s %12s %10s %10s\n", "mode", "IOPS", "MiB/s", "avg_us");
+
+    for (mode = 0; mode < NR_MODES; mode++)
+        if (run(workers, jobs, seconds))
+            return EXIT_FAILURE;
+
+    if (sparse)
+        show_segments();
+
+    free(workers);
+    close(dev);
+
+    return 0;
+}
@@ -0,0 +1,283 @@
+/*
+ * splice_bench.c - read+write vs splice vs sendfile out of the buffer device
+ *
+ * Fills the buffer of CharDev-2 (/dev/MyChar_Node0) with 1 MiB and then
+ * forwards transfers of 4 KiB to 1 MiB from it to a destination, three
+ * ways:
+ *
+ *   rw        pread() into a user buffer, write() out of it: two copies
+ *   splice    splice() into a pipe and on to the destination: the pipe only
+ *             takes references to the pages of the device
+ *   sendfile  sendfile(), the same through the internal pipe of the kernel
+ *
+ * The destination is /dev/null by default, a file with -o, or a local TCP
+ * connection drained by a thread with -s. Throughput and the CPU time per
+ * GiB are reported for every size and method. -d runs against another
+ * device or file instead, for comparison.
+ *
+ *   sudo insmod CharDev-2.ko
+ *   ./splice_bench -o /tmp/out -t 2
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEVICE "/dev/MyChar_Node0"
+#define FILL_SIZE (1024 * 1024)
+
+enum method { METHOD_RW, METHOD_SPLICE, METHOD_SENDFILE, NR_METHODS };
+
+static const char *method_names[NR_METHODS] = { "rw", "splice", "sendfile" };
+
+static const size_t sizes[] = { 4096, 16384, 65536, 262144, 1048576 };
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+/* Fills the device up to FILL_SIZE, it may still be full from a previous run */
+static int fill_device(int dev)
+{
+    char buf[4096];
+    size_t done = 0;
+
+    memset(buf, 'x', sizeof(buf));
+    while (done < FILL_SIZE) {
+        ssize_t n = write(dev, buf, sizeof(buf));
+
+        if (n < 0 && errno == ENOMEM)
+            break;
+        if (n <= 0) {
+            perror("write");
+            return -1;
+        }
+        done += n;
+    }
+
+    return 0;
+}
+
+static void *drain(void *arg)
+{
+    int fd = *(int *)arg;
+    char buf[65536];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+
+    return NULL;
+}
+
+/* A TCP connection over loopback, whose far end is drained by a thread */
+static int connect_sink(void)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t len = sizeof(addr);
+    static int peer;
+    pthread_t thread;
+    int lfd, fd;
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(lfd, 1) || getsockname(lfd, (struct sockaddr *)&addr, &len)) {
+        perror("listen");
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("connect");
+        return -1;
+    }
+    peer = accept(lfd, NULL, NULL);
+    if (peer < 0 || pthread_create(&thread, NULL, drain, &peer)) {
+        perror("accept");
+        return -1;
+    }
+    close(lfd);
+
+    return fd;
+}
+
+/* Moves size bytes from offset 0 of the device to out */
+static int transfer(enum method method, int dev, int out, int pipefd[2],
+                    char *buf, size_t size)
+{
+    loff_t off = 0;
+    size_t done = 0;
+    ssize_t n, m;
+
+    while (done < size) {
+        switch (method) {
+        case METHOD_RW:
+            n = pread(dev, buf, size - done, off);
+            if (n <= 0)
+                return -1;
+            for (m = 0; m < n;) {
+                ssize_t w = write(out, buf + m, n - m);
+
+                if (w <= 0)
+                    return -1;
+                m += w;
+            }
+            off += n;
+            break;
+        case METHOD_SPLICE:
+            n = splice(dev, &off, pipefd[1], NULL, size - done, SPLICE_F_MOVE);
+            if (n <= 0)
+                return -1;
+            for (m = 0; m < n;) {
+                ssize_t w = splice(pipefd[0], NULL, out, NULL, n - m,
+                                   SPLICE_F_MOVE);
+
+                if (w <= 0)
+                    return -1;
+                m += w;
+            }
+            break;
+        case METHOD_SENDFILE:
+            n = sendfile(out, dev, &off, size - done);
+            if (n <= 0)
+                return -1;
+            break;
+        default:
+            return -1;
+        }
+        done += n;
+    }
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-d device] [-o output_file | -s] [-t seconds]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device = DEVICE, *output = "/dev/null";
+    unsigned int seconds = 2, s;
+    int dev, out, pipefd[2], opt, sock = 0, regular;
+    enum method method;
+    struct stat st;
+    char *buf;
+
+    while ((opt = getopt(argc, argv, "d:o:st:")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 's':
+            sock = 1;
+            break;
+        case 't':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!seconds)
+        usage(argv[0]);
+
+    /* The device allows one open at a time */
+    dev = open(device, O_RDWR);
+    if (dev < 0) {
+        perror(device);
+        return EXIT_FAILURE;
+    }
+    if (fill_device(dev))
+        return EXIT_FAILURE;
+
+    out = sock ? connect_sink() : open(output, O_WRONLY | O_CREAT, 0644);
+    if (out < 0) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+    regular = !fstat(out, &st) && S_ISREG(st.st_mode);
+
+    if (pipe(pipefd)) {
+        perror("pipe");
+        return EXIT_FAILURE;
+    }
+    /* Room for a whole transfer, so splice needs one round trip per MiB */
+    if (fcntl(pipefd[1], F_SETPIPE_SZ, FILL_SIZE) < 0)
+        perror("F_SETPIPE_SZ");
+
+    buf = malloc(FILL_SIZE);
+    if (!buf) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    printf("%s -> %s, %us per run\n", device, sock ? "tcp loopback" : output,
+           seconds);
+    printf("%8s %9s %10s %12s\n", "size", "method", "MiB/s", "cpu_ms/GiB");
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (method = 0; method < NR_METHODS; method++) {
+            uint64_t start = now_ns(), cpu = cpu_ns(), bytes = 0, wall;
+
+            do {
+                /* Overwrite the same range of a file instead of growing it */
+                if (regular)
+                    lseek(out, 0, SEEK_SET);
+                if (transfer(method, dev, out, pipefd, buf, sizes[s])) {
+                    fprintf(stderr, "%s of %zu bytes: %s\n",
+                            method_names[method], sizes[s], strerror(errno));
+                    return EXIT_FAILURE;
+                }
+                bytes += sizes[s];
+            } while (now_ns() - start < seconds * 1000000000ULL);
+
+            wall = now_ns() - start;
+            cpu = cpu_ns() - cpu;
+            printf("%8zu %9s %10.1f %12.1f\n", sizes[s], method_names[method],
+                   bytes * 1e9 / wall / (1 << 20),
+                   cpu / 1e6 / ((double)bytes / (1 << 30)));
+        }
+    }
+
+    free(buf);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    close(out);
+    close(dev);
+
+    return 0;
+}
@@ -1,33 +1,377 @@
 /*
  * devicemodel.c
+ *
+ * Registers a platform driver together with nr_devices platform devices for
+ * it. Each bound device gets private state and a character device,
+ * /dev/devicemodelN, that reads back its platform data. The state lives as
+ * long as the class device it embeds, so files still open after an unbind
+ * keep it around, and their reads fail with -ENODEV.
+ *
+ * The driver prefers asynchronous probing, so the probes of many devices
+ * run in parallel instead of one after the other. probe_async=0 falls back
+ * to synchronous probing, and probe_delay_us simulates the time a real
+ * device takes to initialize. The time from registering the first device
+ * until the last probe finished is exported in the class directory:
+ *
+ *   sudo insmod devicemodel.ko nr_devices=1000 probe_delay_us=1000
+ *   cat /sys/class/devicemodel/probe_ns
+ *
+ * devicemodel_bench does that for a range of device counts, in both modes.
+ *
+ * The devices use runtime PM with autosuspend: a read of /dev/devicemodelN
+ * powers its device up, and it powers down again once it has been idle for
+ * autosuspend_ms (per device in power/autosuspend_delay_ms). power_up_us
+ * and power_down_us simulate what the transitions cost. Every device
+ * exports how long reads waited for it to power up and how long it spent
+ * in each state under /sys/class/devicemodel/devicemodelN/.
+ * devicemodel_wake reads a device at a range of intervals to find the
+ * autosuspend delay that trades power for wake-up latency best.
  */
+#include <linux/atomic.h>
+#include <linux/cdev.h>
+#include <linux/delay.h>
+#include <linux/device.h>
+#include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/platform_device.h>
+#include <linux/pm_runtime.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/version.h>
+
+#define DEVICEMODEL_NAME "devicemodel"
+#define DEVICEMODEL_MAX_DEVICES 16384
+
+static unsigned int nr_devices = 1;
+module_param(nr_devices, uint, 0444);
+MODULE_PARM_DESC(nr_devices, "Platform devices to create (max 16384)");
+
+static bool probe_async = true;
+module_param(probe_async, bool, 0444);
+MODULE_PARM_DESC(probe_async, "Probe the devices asynchronously");
+
+static unsigned int probe_delay_us;
+module_param(probe_delay_us, uint, 0444);
+MODULE_PARM_DESC(probe_delay_us, "Simulated initialization time per device");
+
+static int autosuspend_ms = 100;
+module_param(autosuspend_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_ms, "Initial idle time before powering down");
+
+static unsigned int power_up_us = 500;
+module_param(power_up_us, uint, 0644);
+MODULE_PARM_DESC(power_up_us, "Simulated time to power a device up");
+
+static unsigned int power_down_us = 100;
+module_param(power_down_us, uint, 0644);
+MODULE_PARM_DESC(power_down_us, "Simulated time to power a device down");
 
 struct devicemodel_data {
     char *greeting;
     int number;
 };
 
+/* Per bound device, freed by the release of cdev_dev once the device is
+ * unbound and the last file opened on it is closed.
+ */
+struct devicemodel_priv {
+    struct devicemodel_data data;
+    struct cdev cdev;
+    struct device cdev_dev; /* /sys/class/devicemodel/devicemodelN */
+    dev_t devt;
+    struct device *dev; /* the platform device, which runtime PM acts on */
+    bool removed; /* unbound, under pm_lock */
+
+    /* Runtime PM statistics, under pm_lock */
+    spinlock_t pm_lock;
+    bool active;
+    u64 state_since_ns; /* when the current state was entered */
+    u64 active_ns; /* time spent in the states left so far */
+    u64 suspended_ns;
+    u64 resumes;
+    u64 suspends;
+    /* Reads that had to wait for a power up, and how long they waited */
+    u64 wakes;
+    u64 wake_ns;
+    u64 wake_max_ns;
+};
+
+static struct platform_device **devicemodel_devices;
+static dev_t devicemodel_devt;
+static struct class *devicemodel_class;
+
+/* Probe time accounting, see probe_ns_show() */
+static u64 devicemodel_start_ns;
+static u64 devicemodel_probe_ns;
+static atomic_t devicemodel_probed = ATOMIC_INIT(0);
+
+static int devicemodel_open(struct inode *inode, struct file *file)
+{
+    file->private_data =
+        container_of(inode->i_cdev, struct devicemodel_priv, cdev);
+
+    return 0;
+}
+
+/* Accounts the time spent in the state that is being left */
+static void devicemodel_set_state(struct devicemodel_priv *priv, bool active)
+{
+    u64 now = ktime_get_ns();
+
+    spin_lock(&priv->pm_lock);
+    if (priv->active)
+        priv->active_ns += now - priv->state_since_ns;
+    else
+        priv->suspended_ns += now - priv->state_since_ns;
+    priv->active = active;
+    priv->state_since_ns = now;
+    if (active)
+        priv->resumes++;
+    else
+        priv->suspends++;
+    spin_unlock(&priv->pm_lock);
+}
+
+static ssize_t devicemodel_read(struct file *file, char __user *buffer,
+                                size_t count, loff_t *offset)
+{
+    struct devicemodel_priv *priv = file->private_data;
+    u64 start, resumes, ns;
+    char buf[64];
+    int len, err;
+
+    spin_lock(&priv->pm_lock);
+    if (priv->removed) {
+        spin_unlock(&priv->pm_lock);
+        return -ENODEV;
+    }
+    resumes = priv->resumes;
+    spin_unlock(&priv->pm_lock);
+
+    /* Powers the device up, unless it still is */
+    start = ktime_get_ns();
+    err = pm_runtime_resume_and_get(priv->dev);
+    if (err)
+        return err;
+    ns = ktime_get_ns() - start;
+
+    spin_lock(&priv->pm_lock);
+    if (priv->resumes != resumes) {
+        priv->wakes++;
+        priv->wake_ns += ns;
+        priv->wake_max_ns = max(priv->wake_max_ns, ns);
+    }
+    spin_unlock(&priv->pm_lock);
+
+    len = snprintf(buf, sizeof(buf), "%s %d\n", priv->data.greeting,
+                   priv->data.number);
+
+    /* Idle from now on, autosuspend powers it down if it stays so */
+    pm_runtime_mark_last_busy(priv->dev);
+    pm_runtime_put_autosuspend(priv->dev);
+
+    return simple_read_from_buffer(buffer, count, offset, buf, len);
+}
+
+static const struct file_operations devicemodel_fops = {
+    .owner = THIS_MODULE,
+    .open = devicemodel_open,
+    .read = devicemodel_read,
+};
+
+static void devicemodel_priv_release(struct device *dev)
+{
+    struct devicemodel_priv *priv =
+        container_of(dev, struct devicemodel_priv, cdev_dev);
+
+    put_device(priv->dev);
+    kfree(priv);
+}
+
+/* Open files keep a reference on cdev_dev through the cdev, which keeps
+ * priv around after this until they are closed.
+ */
+static void devicemodel_cdev_device_del(void *data)
+{
+    struct devicemodel_priv *priv = data;
+
+    spin_lock(&priv->pm_lock);
+    priv->removed = true;
+    spin_unlock(&priv->pm_lock);
+
+    cdev_device_del(&priv->cdev, &priv->cdev_dev);
+    put_device(&priv->cdev_dev);
+}
+
+#define DEVICEMODEL_PM_ATTR(field)                                             \
+    static ssize_t field##_show(struct device *dev,                            \
+                                struct device_attribute *attr, char *buf)      \
+    {                                                                          \
+        struct devicemodel_priv *priv = dev_get_drvdata(dev);                  \
+        u64 val;                                                               \
+                                                                               \
+        spin_lock(&priv->pm_lock);                                             \
+        val = priv->field;                                                     \
+        spin_unlock(&priv->pm_lock);                                           \
+                                                                               \
+        return sprintf(buf, "%llu\n", val);                                    \
+    }                                                                          \
+    static DEVICE_ATTR_RO(field)
+
+DEVICEMODEL_PM_ATTR(resumes);
+DEVICEMODEL_PM_ATTR(suspends);
+DEVICEMODEL_PM_ATTR(wakes);
+DEVICEMODEL_PM_ATTR(wake_max_ns);
+
+static ssize_t wake_avg_ns_show(struct device *dev,
+                                struct device_attribute *attr, char *buf)
+{
+    struct devicemodel_priv *priv = dev_get_drvdata(dev);
+    u64 avg = 0;
+
+    spin_lock(&priv->pm_lock);
+    if (priv->wakes)
+        avg = div64_u64(priv->wake_ns, priv->wakes);
+    spin_unlock(&priv->pm_lock);
+
+    return sprintf(buf, "%llu\n", avg);
+}
+static DEVICE_ATTR_RO(wake_avg_ns);
+
+/* Time in a state, including the time in the current one so far */
+static u64 devicemodel_time_in(struct devicemodel_priv *priv, bool active)
+{
+    u64 ns;
+
+    spin_lock(&priv->pm_lock);
+    ns = active ? priv->active_ns : priv->suspended_ns;
+    if (priv->active == active)
+        ns += ktime_get_ns() - priv->state_since_ns;
+    spin_unlock(&priv->pm_lock);
+
+    return ns;
+}
+
+static ssize_t active_ns_show(struct device *dev, struct device_attribute *attr,
+                              char *buf)
+{
+    return sprintf(buf, "%llu\n",
+                   devicemodel_time_in(dev_get_drvdata(dev), true));
+}
+static DEVICE_ATTR_RO(active_ns);
+
+static ssize_t suspended_ns_show(struct device *dev,
+                                 struct device_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%llu\n",
+                   devicemodel_time_in(dev_get_drvdata(dev), false));
+}
+static DEVICE_ATTR_RO(suspended_ns);
+
+static struct attribute *devicemodel_attrs[] = {
+    &dev_attr_resumes.attr,
+    &dev_attr_suspends.attr,
+    &dev_attr_wakes.attr,
+    &dev_attr_wake_avg_ns.attr,
+    &dev_attr_wake_max_ns.attr,
+    &dev_attr_active_ns.attr,
+    &dev_attr_suspended_ns.attr,
+    NULL,
+};
+
+/* This macro generates devicemodel_groups structure */
+ATTRIBUTE_GROUPS(devicemodel);
+
 static int devicemodel_probe(struct platform_device *dev)
 {
     struct devicemodel_data *pd =
         (struct devicemodel_data *)(dev->dev.platform_data);
+    struct devicemodel_priv *priv;
+    int err;
+
+    priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+    if (!priv)
+        return -ENOMEM;
 
-    pr_info("devicemodel probe\n");
-    pr_info("devicemodel greeting: %s; %d\n", pd->greeting, pd->number);
+    priv->data = *pd;
+    priv->devt = MKDEV(MAJOR(devicemodel_devt), dev->id);
+    priv->dev = get_device(&dev->dev);
+    spin_lock_init(&priv->pm_lock);
+    priv->active = true;
+    priv->state_since_ns = ktime_get_ns();
+
+    /* From here on, put_device(&priv->cdev_dev) frees priv */
+    device_initialize(&priv->cdev_dev);
+    priv->cdev_dev.class = devicemodel_class;
+    priv->cdev_dev.parent = &dev->dev;
+    priv->cdev_dev.devt = priv->devt;
+    priv->cdev_dev.groups = devicemodel_groups;
+    priv->cdev_dev.release = devicemodel_priv_release;
+    dev_set_drvdata(&priv->cdev_dev, priv);
+    err = dev_set_name(&priv->cdev_dev, DEVICEMODEL_NAME "%d", dev->id);
+    if (err) {
+        put_device(&priv->cdev_dev);
+        return err;
+    }
+    platform_set_drvdata(dev, priv);
 
     /* Your device initialization code */
+    if (probe_delay_us)
+        usleep_range(probe_delay_us, probe_delay_us + probe_delay_us / 10);
+
+    cdev_init(&priv->cdev, &devicemodel_fops);
+    priv->cdev.owner = THIS_MODULE;
+
+    /* Powered up by probe, held up until probe is done */
+    pm_runtime_get_noresume(&dev->dev);
+    pm_runtime_set_active(&dev->dev);
+    pm_runtime_set_autosuspend_delay(&dev->dev, autosuspend_ms);
+    pm_runtime_use_autosuspend(&dev->dev);
+    err = devm_pm_runtime_enable(&dev->dev);
+    if (err) {
+        pm_runtime_put_noidle(&dev->dev);
+        put_device(&priv->cdev_dev);
+        return err;
+    }
+
+    /* Adds the cdev and the class device, the cdev holding a reference on
+     * the class device for as long as a file is open on it
+     */
+    err = cdev_device_add(&priv->cdev, &priv->cdev_dev);
+    if (err) {
+        pm_runtime_put_noidle(&dev->dev);
+        put_device(&priv->cdev_dev);
+        return err;
+    }
+    err = devm_add_action_or_reset(&dev->dev, devicemodel_cdev_device_del,
+                                   priv);
+    if (err) {
+        pm_runtime_put_noidle(&dev->dev);
+        return err;
+    }
+
+    pm_runtime_mark_last_busy(&dev->dev);
+    pm_runtime_put_autosuspend(&dev->dev);
+
+    /* The last probe to finish stops the clock */
+    if (atomic_inc_return(&devicemodel_probed) == nr_devices)
+        WRITE_ONCE(devicemodel_probe_ns,
+                   ktime_get_ns() - devicemodel_start_ns);
+
+    dev_dbg(&dev->dev, "devicemodel greeting: %s; %d\n", pd->greeting,
+            pd->number);
 
     return 0;
 }
 
 static int devicemodel_remove(struct platform_device *dev)
 {
-    pr_info("devicemodel example removed\n");
+    dev_dbg(&dev->dev, "devicemodel example removed\n");
 
-    /* Your device removal code */
+    /* Your device removal code, devm_ resources are released after this */
 
     return 0;
 }
@@ -50,6 +394,28 @@ static int devicemodel_resume(struct device *dev)
     return 0;
 }
 
+static int devicemodel_runtime_suspend(struct device *dev)
+{
+    /* Your device power down code */
+    if (power_down_us)
+        usleep_range(power_down_us, power_down_us + power_down_us / 10);
+
+    devicemodel_set_state(dev_get_drvdata(dev), false);
+
+    return 0;
+}
+
+static int devicemodel_runtime_resume(struct device *dev)
+{
+    /* Your device power up code */
+    if (power_up_us)
+        usleep_range(power_up_us, power_up_us + power_up_us / 10);
+
+    devicemodel_set_state(dev_get_drvdata(dev), true);
+
+    return 0;
+}
+
 static const struct dev_pm_ops devicemodel_pm_ops = {
     .suspend = devicemodel_suspend,
     .resume = devicemodel_resume,
@@ -57,38 +423,149 @@ static const struct dev_pm_ops devicemodel_pm_ops = {
     .freeze = devicemodel_suspend,
     .thaw = devicemodel_resume,
     .restore = devicemodel_resume,
+    .runtime_suspend = devicemodel_runtime_suspend,
+    .runtime_resume = devicemodel_runtime_resume,
 };
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+static ssize_t probed_show(const struct class *class,
+                           const struct class_attribute *attr, char *buf)
+#else
+static ssize_t probed_show(struct class *class, struct class_attribute *attr,
+                           char *buf)
+#endif
+{
+    return sprintf(buf, "%d\n", atomic_read(&devicemodel_probed));
+}
+static CLASS_ATTR_RO(probed);
+
+/* ns from registering the first device until all of them were probed, 0
+ * while probes are still outstanding
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+static ssize_t probe_ns_show(const struct class *class,
+                             const struct class_attribute *attr, char *buf)
+#else
+static ssize_t probe_ns_show(struct class *class, struct class_attribute *attr,
+                             char *buf)
+#endif
+{
+    return sprintf(buf, "%llu\n", READ_ONCE(devicemodel_probe_ns));
+}
+static CLASS_ATTR_RO(probe_ns);
+
 static struct platform_driver devicemodel_driver = {
     .driver =
         {
             .name = "devicemodel_example",
             .pm = &devicemodel_pm_ops,
+            .probe_type = PROBE_PREFER_ASYNCHRONOUS,
         },
     .probe = devicemodel_probe,
     .remove = devicemodel_remove,
 };
 
+static void devicemodel_unregister_devices(unsigned int count)
+{
+    while (count--)
+        platform_device_unregister(devicemodel_devices[count]);
+}
+
+static int devicemodel_register_devices(void)
+{
+    struct devicemodel_data pd = { .greeting = "Hello" };
+    unsigned int i;
+
+    devicemodel_start_ns = ktime_get_ns();
+
+    for (i = 0; i < nr_devices; i++) {
+        struct platform_device *pdev;
+
+        /* The platform data is copied, so it can live on the stack */
+        pd.number = i;
+        pdev = platform_device_register_data(NULL, "devicemodel_example", i,
+                                             &pd, sizeof(pd));
+        if (IS_ERR(pdev)) {
+            devicemodel_unregister_devices(i);
+            return PTR_ERR(pdev);
+        }
+        devicemodel_devices[i] = pdev;
+    }
+
+    return 0;
+}
+
 static int __init devicemodel_init(void)
 {
     int ret;
 
     pr_info("devicemodel init\n");
 
-    ret = platform_driver_register(&devicemodel_driver);
+    if (!nr_devices || nr_devices > DEVICEMODEL_MAX_DEVICES)
+        return -EINVAL;
+
+    devicemodel_devices =
+        kcalloc(nr_devices, sizeof(*devicemodel_devices), GFP_KERNEL);
+    if (!devicemodel_devices)
+        return -ENOMEM;
+
+    ret = alloc_chrdev_region(&devicemodel_devt, 0, nr_devices,
+                              DEVICEMODEL_NAME);
+    if (ret)
+        goto fail_region;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    devicemodel_class = class_create(DEVICEMODEL_NAME);
+#else
+    devicemodel_class = class_create(THIS_MODULE, DEVICEMODEL_NAME);
+#endif
+    if (IS_ERR(devicemodel_class)) {
+        ret = PTR_ERR(devicemodel_class);
+        goto fail_class;
+    }
+
+    ret = class_create_file(devicemodel_class, &class_attr_probed);
+    if (!ret)
+        ret = class_create_file(devicemodel_class, &class_attr_probe_ns);
+    if (ret)
+        goto fail_driver;
 
+    if (!probe_async)
+        devicemodel_driver.driver.probe_type = PROBE_FORCE_SYNCHRONOUS;
+
+    ret = platform_driver_register(&devicemodel_driver);
     if (ret) {
         pr_err("Unable to register driver\n");
-        return ret;
+        goto fail_driver;
+    }
+
+    ret = devicemodel_register_devices();
+    if (ret) {
+        pr_err("Unable to register devices\n");
+        goto fail_devices;
     }
 
     return 0;
+
+fail_devices:
+    platform_driver_unregister(&devicemodel_driver);
+fail_driver:
+    class_destroy(devicemodel_class);
+fail_class:
+    unregister_chrdev_region(devicemodel_devt, nr_devices);
+fail_region:
+    kfree(devicemodel_devices);
+    return ret;
 }
 
 static void __exit devicemodel_exit(void)
 {
     pr_info("devicemodel exit\n");
+    devicemodel_unregister_devices(nr_devices);
     platform_driver_unregister(&devicemodel_driver);
+    class_destroy(devicemodel_class);
+    unregister_chrdev_region(devicemodel_devt, nr_devices);
+    kfree(devicemodel_devices);
 }
 
 module_init(devicemodel_init);
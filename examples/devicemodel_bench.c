@@ -0,0 +1,169 @@
+/*
+ * devicemodel_bench.c - total probe time of devicemodel, sync vs async
+ *
+ * Loads devicemodel.ko with nr_devices set to 1, 10, 100, 1000 and 10000
+ * in turn, once with synchronous and once with asynchronous probing, and
+ * reports /sys/class/devicemodel/probe_ns for each run: the time from
+ * registering the first platform device until the last probe finished.
+ * Next to it the wall clock time of the module load is reported, which
+ * also covers the registration of the devices themselves.
+ *
+ *   sudo ./devicemodel_bench [-m path/to/devicemodel.ko] [-d probe_delay_us]
+ *                            [-r runs]
+ *
+ * With -d 0 the probes do no real work and the difference between the modes
+ * is mostly the cost of scheduling async work. A probe_delay_us of a few
+ * hundred microseconds, a typical device reset, shows what async probing is
+ * meant for.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROBE_NS_PATH "/sys/class/devicemodel/probe_ns"
+
+static const unsigned int counts[] = { 1, 10, 100, 1000, 10000 };
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t read_probe_ns(void)
+{
+    unsigned long long ns = 0;
+    FILE *f = fopen(PROBE_NS_PATH, "r");
+
+    if (!f) {
+        perror(PROBE_NS_PATH);
+        return 0;
+    }
+    if (fscanf(f, "%llu", &ns) != 1)
+        ns = 0;
+    fclose(f);
+
+    return ns;
+}
+
+/* One load and unload, returns 0 on success */
+static int run_once(int module_fd, unsigned int nr, int async,
+                    unsigned int delay_us, uint64_t *probe_ns,
+                    uint64_t *load_ns)
+{
+    char params[128];
+    uint64_t t0;
+    int tries;
+
+    snprintf(params, sizeof(params),
+             "nr_devices=%u probe_async=%d probe_delay_us=%u", nr, async,
+             delay_us);
+
+    t0 = now_ns();
+    if (syscall(SYS_finit_module, module_fd, params, 0)) {
+        perror("finit_module");
+        return -1;
+    }
+    *load_ns = now_ns() - t0;
+
+    /* The module loader waits for async probes of its own init, but do not
+     * rely on it.
+     */
+    for (tries = 0; tries < 1000 && !(*probe_ns = read_probe_ns()); tries++)
+        usleep(10000);
+
+    if (syscall(SYS_delete_module, "devicemodel", 0)) {
+        perror("delete_module");
+        return -1;
+    }
+
+    return *probe_ns ? 0 : -1;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-m module.ko] [-d probe_delay_us] [-r runs]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *module = "./devicemodel.ko";
+    unsigned int delay_us = 0, runs = 3, c, r;
+    uint64_t *probe, *load;
+    int module_fd, opt, async;
+
+    while ((opt = getopt(argc, argv, "m:d:r:")) != -1) {
+        switch (opt) {
+        case 'm':
+            module = optarg;
+            break;
+        case 'd':
+            delay_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            runs = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!runs)
+        usage(argv[0]);
+
+    module_fd = open(module, O_RDONLY | O_CLOEXEC);
+    if (module_fd < 0) {
+        perror(module);
+        return EXIT_FAILURE;
+    }
+
+    probe = calloc(runs, sizeof(*probe));
+    load = calloc(runs, sizeof(*load));
+    if (!probe || !load) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    printf("probe_delay_us=%u, median of %u runs\n", delay_us, runs);
+    printf("%8s %6s %14s %14s %12s\n", "devices", "mode", "probe_us",
+           "load_us", "us/device");
+
+    for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        for (async = 0; async <= 1; async++) {
+            for (r = 0; r < runs; r++) {
+                if (run_once(module_fd, counts[c], async, delay_us, &probe[r],
+                             &load[r]))
+                    return EXIT_FAILURE;
+            }
+            qsort(probe, runs, sizeof(*probe), cmp_u64);
+            qsort(load, runs, sizeof(*load), cmp_u64);
+
+            printf("%8u %6s %14.1f %14.1f %12.2f\n", counts[c],
+                   async ? "async" : "sync", probe[runs / 2] / 1e3,
+                   load[runs / 2] / 1e3, probe[runs / 2] / 1e3 / counts[c]);
+        }
+    }
+
+    free(load);
+    free(probe);
+    close(module_fd);
+
+    return 0;
+}
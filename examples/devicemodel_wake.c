@@ -0,0 +1,149 @@
+/*
+ * devicemodel_wake.c - wake-up latency of devicemodel against idle time
+ *
+ * Reads /dev/devicemodelN over and over, idling a fixed gap between two
+ * reads, for a range of gaps. A gap shorter than the autosuspend delay of
+ * the device keeps it powered up, a longer one lets it power down and the
+ * next read pays for powering it up again. For every gap the read latency
+ * percentiles are reported together with the share of time the device
+ * spent suspended, from the counters devicemodel exports:
+ *
+ *   sudo insmod devicemodel.ko autosuspend_ms=100 power_up_us=2000
+ *   sudo ./devicemodel_wake -d 0 -n 50 -g 10,50,90,110,200
+ *
+ * Raising power/autosuspend_delay_ms of the device moves the knee of the
+ * curve to the right: fewer slow reads, less time suspended.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* A counter of /sys/class/devicemodel/devicemodelN */
+static uint64_t read_stat(int index, const char *name)
+{
+    char path[96];
+    unsigned long long val = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/class/devicemodel/devicemodel%d/%s",
+             index, name);
+    f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if (fscanf(f, "%llu", &val) != 1)
+        val = 0;
+    fclose(f);
+
+    return val;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-d index] [-n reads] [-g gap_ms,...]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    char gaps_arg[256] = "1,10,50,100,200,500", path[32], buf[64], *gap;
+    unsigned int reads = 20, i;
+    uint64_t *lat;
+    int index = 0, fd, opt;
+
+    while ((opt = getopt(argc, argv, "d:n:g:")) != -1) {
+        switch (opt) {
+        case 'd':
+            index = atoi(optarg);
+            break;
+        case 'n':
+            reads = strtoul(optarg, NULL, 0);
+            break;
+        case 'g':
+            snprintf(gaps_arg, sizeof(gaps_arg), "%s", optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!reads)
+        usage(argv[0]);
+
+    snprintf(path, sizeof(path), "/dev/devicemodel%d", index);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    lat = calloc(reads, sizeof(*lat));
+    if (!lat) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    printf("%8s %6s %10s %10s %10s %11s\n", "gap_ms", "wakes", "p50_us",
+           "p90_us", "max_us", "suspended%");
+
+    for (gap = strtok(gaps_arg, ","); gap; gap = strtok(NULL, ",")) {
+        unsigned int gap_ms = strtoul(gap, NULL, 0);
+        struct timespec idle = {
+            .tv_sec = gap_ms / 1000,
+            .tv_nsec = (gap_ms % 1000) * 1000000L,
+        };
+        uint64_t wakes, active, suspended;
+
+        wakes = read_stat(index, "wakes");
+        active = read_stat(index, "active_ns");
+        suspended = read_stat(index, "suspended_ns");
+
+        for (i = 0; i < reads; i++) {
+            uint64_t t;
+
+            nanosleep(&idle, NULL);
+            t = now_ns();
+            if (pread(fd, buf, sizeof(buf), 0) < 0) {
+                perror("read");
+                return EXIT_FAILURE;
+            }
+            lat[i] = now_ns() - t;
+        }
+
+        wakes = read_stat(index, "wakes") - wakes;
+        active = read_stat(index, "active_ns") - active;
+        suspended = read_stat(index, "suspended_ns") - suspended;
+
+        qsort(lat, reads, sizeof(*lat), cmp_u64);
+        printf("%8u %6llu %10.1f %10.1f %10.1f %10.1f%%\n", gap_ms,
+               (unsigned long long)wakes, lat[reads / 2] / 1e3,
+               lat[reads * 90 / 100] / 1e3, lat[reads - 1] / 1e3,
+               active + suspended ? 100.0 * suspended / (active + suspended)
+                                  : 0.0);
+    }
+
+    free(lat);
+    close(fd);
+
+    return 0;
+}
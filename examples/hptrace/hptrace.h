@@ -0,0 +1,304 @@
+/*
+ * hptrace.h - hot-path tracing guarded by static keys
+ *
+ * A subsystem (usually one module) declares an array of trace sites, one for
+ * every place it wants to instrument. Each site owns a static key, so while a
+ * site is disabled the only thing left in the hot path is a NOP that the
+ * kernel patches into a jump when the site gets enabled (see static_key.c).
+ * Enabled sites count hits, accumulate the time spent between
+ * hptrace_begin() and hptrace_end(), and log every hit into a small ring
+ * buffer shared by the subsystem.
+ *
+ * Sites are toggled through debugfs:
+ *
+ *   /sys/kernel/debug/hptrace-<subsys>/enable         all sites at once
+ *   /sys/kernel/debug/hptrace-<subsys>/<site>/enable  a single site
+ *   /sys/kernel/debug/hptrace-<subsys>/stats          hits and average ns
+ *   /sys/kernel/debug/hptrace-<subsys>/log            the last ring entries
+ *
+ * Usage:
+ *
+ *   enum { MYDEV_TRACE_READ, MYDEV_TRACE_NR };
+ *
+ *   static struct hptrace_site mydev_sites[MYDEV_TRACE_NR] = {
+ *       [MYDEV_TRACE_READ] = HPTRACE_SITE("read"),
+ *   };
+ *   static struct hptrace_subsys mydev_trace =
+ *       HPTRACE_SUBSYS("mydev", mydev_sites);
+ *
+ *   u64 t0 = hptrace_begin(mydev_sites, MYDEV_TRACE_READ);
+ *   ...
+ *   hptrace_end(mydev_sites, MYDEV_TRACE_READ, t0, count);
+ *
+ * The site array must be indexed with constants, the address of the static
+ * key has to be known at link time.
+ *
+ * Everything lives in this header so that modules in any directory can use
+ * it without linking an extra object.
+ */
+
+#ifndef HPTRACE_H
+#define HPTRACE_H
+
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/jump_label.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/timekeeping.h>
+
+/* Number of records kept by every subsystem, must be a power of two */
+#define HPTRACE_RING_SIZE 1024
+
+struct hptrace_subsys;
+
+struct hptrace_stats {
+    u64 hits;
+    u64 ns;
+};
+
+struct hptrace_site {
+    struct static_key_false key;
+    const char *name;
+    struct hptrace_subsys *subsys;
+    struct hptrace_stats __percpu *stats;
+};
+
+struct hptrace_record {
+    u64 ts;
+    u64 ns;
+    u64 arg;
+    u32 site;
+    u32 cpu;
+};
+
+struct hptrace_subsys {
+    const char *name;
+    struct hptrace_site *sites;
+    unsigned int nr_sites;
+
+    struct hptrace_record *ring;
+    atomic_long_t ring_head;
+
+    struct dentry *dir;
+};
+
+#define HPTRACE_SITE(_name)                                                    \
+    {                                                                          \
+        .key = STATIC_KEY_FALSE_INIT, .name = _name,                           \
+    }
+
+#define HPTRACE_SUBSYS(_name, _sites)                                          \
+    {                                                                          \
+        .name = _name, .sites = _sites, .nr_sites = ARRAY_SIZE(_sites),        \
+    }
+
+#define hptrace_site_enabled(_sites, _idx)                                     \
+    static_branch_unlikely(&(_sites)[_idx].key)
+
+/* Returns the start timestamp, or 0 without reading the clock when the
+ * site is disabled.
+ */
+#define hptrace_begin(_sites, _idx)                                            \
+    (hptrace_site_enabled(_sites, _idx) ? ktime_get_ns() : 0)
+
+#define hptrace_end(_sites, _idx, _t0, _arg)                                   \
+    do {                                                                       \
+        if (hptrace_site_enabled(_sites, _idx))                                \
+            hptrace_record(&(_sites)[_idx], _t0, _arg);                        \
+    } while (0)
+
+/* Slow path, only reached once the site has been enabled. Kept out of line
+ * so that the instrumented function does not grow.
+ */
+static noinline __maybe_unused void
+hptrace_record(struct hptrace_site *site, u64 t0, u64 arg)
+{
+    struct hptrace_subsys *subsys = site->subsys;
+    struct hptrace_record *rec;
+    u64 now = ktime_get_ns();
+    /* t0 is 0 when the site was enabled between begin and end */
+    u64 ns = t0 ? now - t0 : 0;
+    unsigned long slot;
+
+    this_cpu_add(site->stats->hits, 1);
+    this_cpu_add(site->stats->ns, ns);
+
+    /* The ring overwrites the oldest entries. Writers racing for the same
+     * slot after a wrap may leave a mixed record, which is acceptable for
+     * a debugging aid and keeps the path lock-free.
+     */
+    slot = atomic_long_inc_return(&subsys->ring_head) - 1;
+    rec = &subsys->ring[slot & (HPTRACE_RING_SIZE - 1)];
+    rec->ts = now;
+    rec->ns = ns;
+    rec->arg = arg;
+    rec->site = site - subsys->sites;
+    rec->cpu = raw_smp_processor_id();
+}
+
+static inline void hptrace_site_set(struct hptrace_site *site, bool on)
+{
+    if (on)
+        static_branch_enable(&site->key);
+    else
+        static_branch_disable(&site->key);
+}
+
+static inline int hptrace_site_enable_get(void *data, u64 *val)
+{
+    struct hptrace_site *site = data;
+
+    *val = static_key_enabled(&site->key);
+    return 0;
+}
+
+static inline int hptrace_site_enable_set(void *data, u64 val)
+{
+    hptrace_site_set(data, val);
+    return 0;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(hptrace_site_enable_fops, hptrace_site_enable_get,
+                         hptrace_site_enable_set, "%llu\n");
+
+/* Reads back how many sites are enabled, writing toggles all of them */
+static inline int hptrace_subsys_enable_get(void *data, u64 *val)
+{
+    struct hptrace_subsys *subsys = data;
+    unsigned int i;
+
+    *val = 0;
+    for (i = 0; i < subsys->nr_sites; i++)
+        *val += static_key_enabled(&subsys->sites[i].key);
+
+    return 0;
+}
+
+static inline int hptrace_subsys_enable_set(void *data, u64 val)
+{
+    struct hptrace_subsys *subsys = data;
+    unsigned int i;
+
+    for (i = 0; i < subsys->nr_sites; i++)
+        hptrace_site_set(&subsys->sites[i], val);
+
+    return 0;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(hptrace_subsys_enable_fops, hptrace_subsys_enable_get,
+                         hptrace_subsys_enable_set, "%llu\n");
+
+static inline int hptrace_stats_show(struct seq_file *m, void *v)
+{
+    struct hptrace_subsys *subsys = m->private;
+    unsigned int i;
+    int cpu;
+
+    seq_printf(m, "%-16s %7s %12s %10s\n", "site", "enabled", "hits",
+               "avg_ns");
+
+    for (i = 0; i < subsys->nr_sites; i++) {
+        struct hptrace_site *site = &subsys->sites[i];
+        u64 hits = 0, ns = 0;
+
+        for_each_possible_cpu (cpu) {
+            hits += per_cpu_ptr(site->stats, cpu)->hits;
+            ns += per_cpu_ptr(site->stats, cpu)->ns;
+        }
+
+        seq_printf(m, "%-16s %7d %12llu %10llu\n", site->name,
+                   static_key_enabled(&site->key), hits,
+                   hits ? div64_u64(ns, hits) : 0);
+    }
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hptrace_stats);
+
+static inline int hptrace_log_show(struct seq_file *m, void *v)
+{
+    struct hptrace_subsys *subsys = m->private;
+    unsigned long head = atomic_long_read(&subsys->ring_head);
+    unsigned long i = head > HPTRACE_RING_SIZE ? head - HPTRACE_RING_SIZE : 0;
+
+    for (; i < head; i++) {
+        const struct hptrace_record *rec =
+            &subsys->ring[i & (HPTRACE_RING_SIZE - 1)];
+
+        if (rec->site >= subsys->nr_sites)
+            continue;
+
+        seq_printf(m, "%llu cpu%u %s ns=%llu arg=%llu\n", rec->ts, rec->cpu,
+                   subsys->sites[rec->site].name, rec->ns, rec->arg);
+    }
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hptrace_log);
+
+static inline void hptrace_unregister(struct hptrace_subsys *subsys)
+{
+    unsigned int i;
+
+    debugfs_remove_recursive(subsys->dir);
+    subsys->dir = NULL;
+
+    /* Patch every site back to a NOP before the memory goes away */
+    for (i = 0; i < subsys->nr_sites; i++) {
+        static_branch_disable(&subsys->sites[i].key);
+        free_percpu(subsys->sites[i].stats);
+        subsys->sites[i].stats = NULL;
+    }
+
+    kfree(subsys->ring);
+    subsys->ring = NULL;
+}
+
+static inline int hptrace_register(struct hptrace_subsys *subsys)
+{
+    char dir_name[32];
+    unsigned int i;
+
+    subsys->ring =
+        kcalloc(HPTRACE_RING_SIZE, sizeof(*subsys->ring), GFP_KERNEL);
+    if (!subsys->ring)
+        return -ENOMEM;
+    atomic_long_set(&subsys->ring_head, 0);
+
+    for (i = 0; i < subsys->nr_sites; i++) {
+        struct hptrace_site *site = &subsys->sites[i];
+
+        site->subsys = subsys;
+        site->stats = alloc_percpu(struct hptrace_stats);
+        if (!site->stats) {
+            hptrace_unregister(subsys);
+            return -ENOMEM;
+        }
+    }
+
+    snprintf(dir_name, sizeof(dir_name), "hptrace-%s", subsys->name);
+    subsys->dir = debugfs_create_dir(dir_name, NULL);
+
+    debugfs_create_file("enable", 0600, subsys->dir, subsys,
+                        &hptrace_subsys_enable_fops);
+    debugfs_create_file("stats", 0444, subsys->dir, subsys,
+                        &hptrace_stats_fops);
+    debugfs_create_file("log", 0444, subsys->dir, subsys, &hptrace_log_fops);
+
+    for (i = 0; i < subsys->nr_sites; i++) {
+        struct dentry *site_dir =
+            debugfs_create_dir(subsys->sites[i].name, subsys->dir);
+
+        debugfs_create_file("enable", 0600, site_dir, &subsys->sites[i],
+                            &hptrace_site_enable_fops);
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * hptrace_bench.c - cost of an hptrace site, disabled and enabled
+ *
+ * The same loop is timed in three flavours:
+ *
+ *   plain    - no instrumentation at all
+ *   disabled - an hptrace_begin()/hptrace_end() pair with the site disabled
+ *   enabled  - the same pair with the site enabled
+ *
+ * Every flavour is run `rounds` times, interleaved so that frequency changes
+ * hit all of them alike, and the minimum and median ns per iteration are
+ * reported. plain and disabled should be indistinguishable, since a disabled
+ * site is just a NOP in the instruction stream.
+ *
+ * Usage:
+ *   echo 1 > /sys/kernel/debug/hptrace-bench/run
+ *   cat /sys/kernel/debug/hptrace-bench/results
+ */
+#include <linux/debugfs.h>
+#include <linux/init.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/preempt.h>
+#include <linux/printk.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+
+#include "hptrace.h"
+
+#define MAX_ROUNDS 101
+
+static unsigned int iterations = 100000;
+module_param(iterations, uint, 0644);
+MODULE_PARM_DESC(iterations, "Loop iterations per round");
+
+static unsigned int rounds = 11;
+module_param(rounds, uint, 0644);
+MODULE_PARM_DESC(rounds, "Rounds per flavour (max 101)");
+
+enum {
+    BENCH_TRACE_LOOP,
+    BENCH_TRACE_NR,
+};
+
+static struct hptrace_site bench_sites[BENCH_TRACE_NR] = {
+    [BENCH_TRACE_LOOP] = HPTRACE_SITE("loop"),
+};
+
+static struct hptrace_subsys bench_trace =
+    HPTRACE_SUBSYS("bench", bench_sites);
+
+enum {
+    FLAVOUR_PLAIN,
+    FLAVOUR_DISABLED,
+    FLAVOUR_ENABLED,
+    NR_FLAVOURS,
+};
+
+static const char *const flavour_names[NR_FLAVOURS] = {
+    [FLAVOUR_PLAIN] = "plain",
+    [FLAVOUR_DISABLED] = "disabled",
+    [FLAVOUR_ENABLED] = "enabled",
+};
+
+struct flavour_result {
+    /* Hundredths of a nanosecond per iteration */
+    u64 min;
+    u64 median;
+};
+
+static DEFINE_MUTEX(bench_mutex);
+static struct flavour_result results[NR_FLAVOURS];
+static bool have_results;
+
+/* The loop body, something the compiler can not throw away */
+static u64 sink;
+
+static noinline u64 loop_plain(unsigned int n)
+{
+    u64 i, t0 = ktime_get_ns();
+
+    for (i = 0; i < n; i++)
+        WRITE_ONCE(sink, READ_ONCE(sink) + i);
+
+    return ktime_get_ns() - t0;
+}
+
+static noinline u64 loop_traced(unsigned int n)
+{
+    u64 i, t0 = ktime_get_ns();
+
+    for (i = 0; i < n; i++) {
+        u64 t = hptrace_begin(bench_sites, BENCH_TRACE_LOOP);
+
+        WRITE_ONCE(sink, READ_ONCE(sink) + i);
+        hptrace_end(bench_sites, BENCH_TRACE_LOOP, t, i);
+    }
+
+    return ktime_get_ns() - t0;
+}
+
+static u64 run_round(unsigned int flavour)
+{
+    u64 ns;
+
+    preempt_disable();
+    ns = flavour == FLAVOUR_PLAIN ? loop_plain(iterations) :
+                                    loop_traced(iterations);
+    preempt_enable();
+
+    return div64_u64(ns * 100, iterations);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int bench_run(void)
+{
+    u64 (*samples)[MAX_ROUNDS];
+    unsigned int r, f;
+
+    if (!iterations || !rounds || rounds > MAX_ROUNDS)
+        return -EINVAL;
+
+    samples = kcalloc(NR_FLAVOURS, sizeof(*samples), GFP_KERNEL);
+    if (!samples)
+        return -ENOMEM;
+
+    /* Interleave plain and disabled so both see the same machine state */
+    for (r = 0; r < rounds; r++) {
+        samples[FLAVOUR_PLAIN][r] = run_round(FLAVOUR_PLAIN);
+        samples[FLAVOUR_DISABLED][r] = run_round(FLAVOUR_DISABLED);
+        cond_resched();
+    }
+
+    hptrace_site_set(&bench_sites[BENCH_TRACE_LOOP], true);
+    for (r = 0; r < rounds; r++) {
+        samples[FLAVOUR_ENABLED][r] = run_round(FLAVOUR_ENABLED);
+        cond_resched();
+    }
+    hptrace_site_set(&bench_sites[BENCH_TRACE_LOOP], false);
+
+    for (f = 0; f < NR_FLAVOURS; f++) {
+        sort(samples[f], rounds, sizeof(u64), cmp_u64, NULL);
+        results[f].min = samples[f][0];
+        results[f].median = samples[f][rounds / 2];
+
+        pr_info("hptrace_bench: %-8s min %llu.%02llu ns/iter\n",
+                flavour_names[f], results[f].min / 100,
+                results[f].min % 100);
+    }
+    have_results = true;
+
+    kfree(samples);
+
+    return 0;
+}
+
+static int results_show(struct seq_file *m, void *v)
+{
+    unsigned int f;
+
+    mutex_lock(&bench_mutex);
+
+    if (have_results) {
+        seq_printf(m, "iterations %u rounds %u\n", iterations, rounds);
+        seq_printf(m, "%-8s %12s %12s\n", "flavour", "min_ns", "median_ns");
+
+        for (f = 0; f < NR_FLAVOURS; f++)
+            seq_printf(m, "%-8s %9llu.%02llu %9llu.%02llu\n",
+                       flavour_names[f], results[f].min / 100,
+                       results[f].min % 100, results[f].median / 100,
+                       results[f].median % 100);
+    }
+
+    mutex_unlock(&bench_mutex);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(results);
+
+static ssize_t run_write(struct file *file, const char __user *buf,
+                         size_t count, loff_t *ppos)
+{
+    int err;
+
+    mutex_lock(&bench_mutex);
+    err = bench_run();
+    mutex_unlock(&bench_mutex);
+
+    return err ? err : count;
+}
+
+static const struct file_operations run_fops = {
+    .owner = THIS_MODULE,
+    .write = run_write,
+};
+
+static int __init hptrace_bench_init(void)
+{
+    int err;
+
+    err = hptrace_register(&bench_trace);
+    if (err)
+        return err;
+
+    debugfs_create_file("run", 0200, bench_trace.dir, NULL, &run_fops);
+    debugfs_create_file("results", 0444, bench_trace.dir, NULL,
+                        &results_fops);
+
+    pr_info("hptrace_bench loaded, write to "
+            "/sys/kernel/debug/hptrace-bench/run to start\n");
+
+    return 0;
+}
+
+static void __exit hptrace_bench_exit(void)
+{
+    hptrace_unregister(&bench_trace);
+
+    pr_info("hptrace_bench exit\n");
+}
+
+module_init(hptrace_bench_init);
+module_exit(hptrace_bench_exit);
+
+MODULE_DESCRIPTION("Overhead of static key guarded tracing sites");
+MODULE_LICENSE("GPL");
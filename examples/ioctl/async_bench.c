@@ -0,0 +1,235 @@
+/*
+ * async_bench.c - throughput of chardev2 against the requests in flight
+ *
+ * Switches a file of the device to asynchronous requests and keeps 1, 2,
+ * 4, ... up to -q requests in flight on it from a single thread, for -t
+ * seconds per depth. Every completion read is replaced by a new request,
+ * written in one go with the others read at the same time. Reports the
+ * requests per second, the average time from submission to completion,
+ * and the speedup over one request in flight, which is what a synchronous
+ * ioctl() would get.
+ *
+ * By default the requests are CHARDEV_OP_NOP taking -s microseconds, like a
+ * device that takes a while to answer: more requests in flight keep more of
+ * the kernel threads of the module busy, up to nr_workers of them. With -o
+ * get they read the message instead, which shows the cost of the round
+ * trip through the threads. With -p, completions are waited for with poll()
+ * and read without blocking.
+ *
+ *   sudo insmod chardev2Mod.ko nr_workers=8
+ *   sudo ./async_bench -q 256 -s 50 -t 2
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chardev.h"
+
+static int use_poll;
+static unsigned int op = CHARDEV_OP_NOP, service_us = 50;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void prep(struct chardev_req *req, uint64_t tag)
+{
+    memset(req, 0, sizeof(*req));
+    req->tag = tag;
+    req->op = op;
+    req->arg = op == CHARDEV_OP_NOP ? service_us : 0;
+}
+
+/* Writes nr requests, which the depth always leaves room for */
+static int submit(int fd, struct chardev_req *reqs, unsigned int nr)
+{
+    ssize_t n = write(fd, reqs, nr * sizeof(*reqs));
+
+    if (n != (ssize_t)(nr * sizeof(*reqs))) {
+        fprintf(stderr, "write: %s\n", n < 0 ? strerror(errno) : "short write");
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads at least one completion, returns how many */
+static int reap(int fd, struct chardev_cqe *cqes, unsigned int nr)
+{
+    ssize_t n;
+
+    for (;;) {
+        if (use_poll) {
+            struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+            if (poll(&pfd, 1, -1) < 0) {
+                perror("poll");
+                return -1;
+            }
+        }
+        n = read(fd, cqes, nr * sizeof(*cqes));
+        if (n > 0)
+            return n / sizeof(*cqes);
+        if (n < 0 && errno == EAGAIN)
+            continue;
+        fprintf(stderr, "read: %s\n", n < 0 ? strerror(errno) : "no completion");
+        return -1;
+    }
+}
+
+/* Keeps depth requests in flight, returns requests per second, < 0 on error */
+static double run(const char *device, unsigned int depth, unsigned int seconds,
+                  double *avg_us)
+{
+    struct chardev_req *reqs = calloc(depth, sizeof(*reqs));
+    struct chardev_cqe *cqes = calloc(depth, sizeof(*cqes));
+    uint64_t *submitted = calloc(depth, sizeof(*submitted));
+    uint64_t start, end, done = 0, lat = 0;
+    double rate = -1;
+    unsigned int i;
+    int fd, n;
+
+    fd = open(device, O_RDWR | (use_poll ? O_NONBLOCK : 0));
+    if (fd < 0 || !reqs || !cqes || !submitted) {
+        perror(device);
+        goto out;
+    }
+    if (ioctl(fd, IOCTL_ASYNC_SETUP, depth) < 0) {
+        perror("IOCTL_ASYNC_SETUP");
+        goto out;
+    }
+
+    /* The tag of a request is its slot, which its replacement reuses */
+    start = now_ns();
+    end = start + seconds * 1000000000ULL;
+    for (i = 0; i < depth; i++) {
+        prep(&reqs[i], i);
+        submitted[i] = start;
+    }
+    if (submit(fd, reqs, depth))
+        goto out;
+
+    for (;;) {
+        uint64_t now;
+
+        n = reap(fd, cqes, depth);
+        if (n < 0)
+            goto out;
+        now = now_ns();
+
+        for (i = 0; i < (unsigned int)n; i++) {
+            uint64_t tag = cqes[i].tag;
+
+            if (tag >= depth || cqes[i].result < 0) {
+                fprintf(stderr, "bad completion: tag %llu, result %d\n",
+                        (unsigned long long)tag, cqes[i].result);
+                goto out;
+            }
+            lat += now - submitted[tag];
+            submitted[tag] = now;
+            prep(&reqs[i], tag);
+        }
+        done += n;
+
+        if (now >= end)
+            break;
+        if (submit(fd, reqs, n))
+            goto out;
+    }
+
+    /* Closing waits for the requests still in flight */
+    close(fd);
+    fd = -1;
+    rate = done * 1e9 / (now_ns() - start);
+    *avg_us = lat / 1e3 / done;
+
+out:
+    if (fd >= 0)
+        close(fd);
+    free(submitted);
+    free(cqes);
+    free(reqs);
+    return rate;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-d device] [-q max_depth] [-o nop|get] [-s service_us] "
+            "[-t seconds] [-p]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device = DEVICE_PATH;
+    unsigned int max_depth = 256, seconds = 2, depth;
+    double base = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:q:o:s:t:p")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'q':
+            max_depth = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            if (!strcmp(optarg, "nop"))
+                op = CHARDEV_OP_NOP;
+            else if (!strcmp(optarg, "get"))
+                op = CHARDEV_OP_GET_MSG;
+            else
+                usage(argv[0]);
+            break;
+        case 's':
+            service_us = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            use_poll = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!max_depth || !seconds || service_us > CHARDEV_NOP_MAX_US)
+        usage(argv[0]);
+
+    printf("%s, %s", device, op == CHARDEV_OP_NOP ? "nop" : "get");
+    if (op == CHARDEV_OP_NOP)
+        printf(" of %u us", service_us);
+    printf(", %s, %us per depth\n", use_poll ? "poll()" : "blocking read()",
+           seconds);
+    printf("%8s %12s %10s %8s\n", "depth", "req/s", "avg_us", "speedup");
+
+    for (depth = 1;; depth = depth * 2 > max_depth ? max_depth : depth * 2) {
+        double avg_us, rate = run(device, depth, seconds, &avg_us);
+
+        if (rate < 0)
+            return EXIT_FAILURE;
+        if (depth == 1)
+            base = rate;
+        printf("%8u %12.0f %10.1f %7.2fx\n", depth, rate, avg_us,
+               base ? rate / base : 0.0);
+        if (depth == max_depth)
+            break;
+    }
+
+    return 0;
+}
@@ -10,6 +10,7 @@
 #define CHARDEV_H
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 /* The major device number. We can not rely on dynamic registration
  * any more, because ioctls need to know it.
@@ -43,6 +44,43 @@
  * a number, n, and returns message[n].
  */
 
+/* Switch the file to asynchronous requests, with up to n of them in flight */
+#define IOCTL_ASYNC_SETUP _IOW(MAJOR_NUM, 3, int)
+/* Once set up, the file no longer reads and writes the message. Instead,
+ * every write() submits one or more struct chardev_req, which a pool of
+ * kernel threads processes in any order, and every read() returns one or
+ * more struct chardev_cqe, the completions of earlier requests, matched to
+ * them by their tag. Reads block until a completion is there, and poll()
+ * reports when one is (POLLIN) and when a request can be submitted
+ * (POLLOUT). With O_NONBLOCK, both fail with EAGAIN instead of waiting.
+ */
+
+#define CHARDEV_MSG_LEN 80
+#define CHARDEV_NOP_MAX_US 1000000
+
+enum chardev_op {
+    CHARDEV_OP_NOP, /* does nothing, for arg microseconds, EINVAL above
+                     * CHARDEV_NOP_MAX_US
+                     */
+    CHARDEV_OP_SET_MSG, /* IOCTL_SET_MSG, with msg */
+    CHARDEV_OP_GET_MSG, /* IOCTL_GET_MSG, into the msg of the completion */
+    CHARDEV_OP_GET_NTH_BYTE, /* IOCTL_GET_NTH_BYTE of arg, in result */
+};
+
+struct chardev_req {
+    __u64 tag; /* anything, handed back in the completion */
+    __u32 op;
+    __u32 arg;
+    char msg[CHARDEV_MSG_LEN];
+};
+
+struct chardev_cqe {
+    __u64 tag;
+    __s32 result; /* >= 0 on success, a negative errno otherwise */
+    __u32 len; /* of msg */
+    char msg[CHARDEV_MSG_LEN];
+};
+
 /* The name of the device file */
 #define DEVICE_FILE_NAME "char_dev"
 #define DEVICE_PATH "/dev/char_dev"
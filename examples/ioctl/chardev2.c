@@ -6,20 +6,29 @@
 #include <linux/cdev.h>
 #include <linux/delay.h>
 #include <linux/device.h>
+#include <linux/err.h> /* for IS_ERR() */
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/kthread.h>
+#include <linux/list.h>
 #include <linux/module.h> /* Specifically, a module */
+#include <linux/mutex.h>
+#include <linux/poll.h>
 #include <linux/printk.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
 #include <linux/uaccess.h> /* for get_user and put_user */
+#include <linux/uio.h>
 #include <linux/version.h>
+#include <linux/wait.h>
 
 #include <asm/errno.h>
 
 #include "chardev.h"
 #define SUCCESS 0
 #define DEVICE_NAME "char_dev"
-#define BUF_LEN 80
+#define BUF_LEN CHARDEV_MSG_LEN
 
 enum {
     CDEV_NOT_USED,
@@ -36,11 +45,59 @@ static char message[BUF_LEN + 1];
 
 static struct class *cls;
 
+/* Asynchronous requests, see IOCTL_ASYNC_SETUP in chardev.h.
+ *
+ * Submitted requests of all files go to one pending list, served by a pool
+ * of kernel threads. A thread that is done with a request turns it into a
+ * completion in place and queues it on the file it came from, whose reader
+ * then gets it. A file never has more than its depth of requests submitted
+ * and not yet read back, so that completions never pile up.
+ */
+static unsigned int nr_workers = 4;
+module_param(nr_workers, uint, 0444);
+MODULE_PARM_DESC(nr_workers, "Number of kernel threads serving asynchronous requests");
+
+#define ASYNC_MAX_DEPTH 4096
+
+struct async_ctx {
+    spinlock_t lock;
+    struct list_head done; /* completions not read yet */
+    unsigned int depth;
+    unsigned int queued; /* submitted and not read back yet */
+    unsigned int running; /* submitted and not completed yet */
+    bool closing; /* the last running request frees the context */
+    wait_queue_head_t wait; /* for readers, writers and poll() */
+};
+
+struct async_req {
+    struct list_head node;
+    struct async_ctx *ctx;
+    union {
+        struct chardev_req req;
+        struct chardev_cqe cqe;
+    };
+};
+
+static LIST_HEAD(pending);
+static DEFINE_SPINLOCK(pending_lock);
+static DECLARE_WAIT_QUEUE_HEAD(pending_wait);
+static struct task_struct **workers;
+
+/* Keeps requests on different threads from seeing half written messages */
+static DEFINE_MUTEX(message_lock);
+
+static void async_release(struct async_ctx *ctx);
+
 /* This is called whenever a process attempts to open the device file */
 static int device_open(struct inode *inode, struct file *file)
 {
     pr_info("device_open(%p)\n", file);
 
+    /* The iter methods below never sleep, so io_uring may call them with
+     * IOCB_NOWAIT and complete inline instead of punting to a worker.
+     */
+    file->f_mode |= FMODE_NOWAIT;
+
     try_module_get(THIS_MODULE);
     return SUCCESS;
 }
@@ -49,6 +106,9 @@ static int device_release(struct inode *inode, struct file *file)
 {
     pr_info("device_release(%p,%p)\n", inode, file);
 
+    if (file->private_data)
+        async_release(file->private_data);
+
     module_put(THIS_MODULE);
     return SUCCESS;
 }
@@ -112,6 +172,348 @@ static ssize_t device_write(struct file *file, const char __user *buffer,
     return i;
 }
 
+/* read(), readv() and io_uring or AIO reads of the device file end up here,
+ * with the destination described by an iov_iter instead of a single user
+ * pointer. The message is in memory, so nothing here ever waits, whether
+ * IOCB_NOWAIT is set in iocb->ki_flags or not.
+ */
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    size_t len = strnlen(message, BUF_LEN);
+    size_t copied;
+
+    if (iocb->ki_pos >= len)
+        return 0; /* signify end of file */
+
+    copied = copy_to_iter(message + iocb->ki_pos, len - iocb->ki_pos, to);
+    if (!copied)
+        return -EFAULT;
+
+    iocb->ki_pos += copied;
+
+    return copied;
+}
+
+/* The same for writes. Like device_write(), it takes the first BUF_LEN
+ * bytes as the new message and reports them as consumed.
+ */
+static ssize_t device_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    size_t len = min_t(size_t, iov_iter_count(from), BUF_LEN);
+
+    if (copy_from_iter(message, len, from) != len)
+        return -EFAULT;
+    if (len < BUF_LEN)
+        message[len] = '\0';
+
+    return len;
+}
+
+/* Does what a request asks for, in the context of a worker thread */
+static void async_process(struct async_req *ar)
+{
+    struct chardev_req req = ar->req;
+    struct chardev_cqe *cqe = &ar->cqe;
+
+    cqe->tag = req.tag;
+    cqe->result = SUCCESS;
+    cqe->len = 0;
+
+    switch (req.op) {
+    case CHARDEV_OP_NOP:
+        /* A worker is busy all along, so do not let one request hog it */
+        if (req.arg > CHARDEV_NOP_MAX_US)
+            cqe->result = -EINVAL;
+        else if (req.arg)
+            usleep_range(req.arg, req.arg + req.arg / 8 + 1);
+        break;
+
+    case CHARDEV_OP_SET_MSG: {
+        size_t len = strnlen(req.msg, BUF_LEN);
+
+        mutex_lock(&message_lock);
+        memcpy(message, req.msg, len);
+        message[len] = '\0';
+        mutex_unlock(&message_lock);
+        cqe->result = len;
+        break;
+    }
+
+    case CHARDEV_OP_GET_MSG:
+        mutex_lock(&message_lock);
+        cqe->len = strnlen(message, BUF_LEN);
+        memcpy(cqe->msg, message, cqe->len);
+        mutex_unlock(&message_lock);
+        cqe->result = cqe->len;
+        break;
+
+    case CHARDEV_OP_GET_NTH_BYTE:
+        cqe->result = req.arg < BUF_LEN ? message[req.arg] : -EINVAL;
+        break;
+
+    default:
+        cqe->result = -EINVAL;
+    }
+}
+
+/* Drops the completions nobody read, and the module reference of the
+ * context
+ */
+static void async_free(struct async_ctx *ctx)
+{
+    struct async_req *ar, *next;
+
+    list_for_each_entry_safe(ar, next, &ctx->done, node)
+        kfree(ar);
+    kfree(ctx);
+    module_put(THIS_MODULE);
+}
+
+/* Queues a processed request on its file as a completion. Once the file is
+ * closed, the last request to complete frees the context.
+ */
+static void async_complete(struct async_req *ar)
+{
+    struct async_ctx *ctx = ar->ctx;
+    bool orphan;
+
+    spin_lock(&ctx->lock);
+    list_add_tail(&ar->node, &ctx->done);
+    orphan = --ctx->running == 0 && ctx->closing;
+    wake_up(&ctx->wait);
+    spin_unlock(&ctx->lock);
+
+    if (orphan)
+        async_free(ctx);
+}
+
+static int async_worker(void *arg)
+{
+    while (!kthread_should_stop()) {
+        struct async_req *ar = NULL;
+
+        wait_event_interruptible(pending_wait, !list_empty(&pending) || kthread_should_stop());
+
+        spin_lock(&pending_lock);
+        if (!list_empty(&pending)) {
+            ar = list_first_entry(&pending, struct async_req, node);
+            list_del(&ar->node);
+        }
+        spin_unlock(&pending_lock);
+
+        if (ar) {
+            async_process(ar);
+            async_complete(ar);
+        }
+        cond_resched();
+    }
+
+    return 0;
+}
+
+/* Submits the requests written, as many as fit in the depth of the file.
+ * Waits for room for the first one only, and for none with IOCB_NOWAIT
+ * (io_uring trying to complete inline) or O_NONBLOCK.
+ */
+static ssize_t async_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct async_ctx *ctx = iocb->ki_filp->private_data;
+    bool nowait = (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+    gfp_t gfp = iocb->ki_flags & IOCB_NOWAIT ? GFP_NOWAIT : GFP_KERNEL;
+    size_t nr = iov_iter_count(from) / sizeof(struct chardev_req);
+    LIST_HEAD(batch);
+    struct async_req *ar, *next;
+    size_t room, i;
+    int ret;
+
+    if (!nr)
+        return -EINVAL;
+
+    spin_lock(&ctx->lock);
+    while (ctx->queued == ctx->depth) {
+        spin_unlock(&ctx->lock);
+        if (nowait)
+            return -EAGAIN;
+        ret = wait_event_interruptible(ctx->wait, READ_ONCE(ctx->queued) < ctx->depth);
+        if (ret)
+            return ret;
+        /* Other threads writing to the file may have taken the room */
+        spin_lock(&ctx->lock);
+    }
+    room = min_t(size_t, nr, ctx->depth - ctx->queued);
+    ctx->queued += room;
+    ctx->running += room;
+    spin_unlock(&ctx->lock);
+
+    for (i = 0; i < room; i++) {
+        ar = kmalloc(sizeof(*ar), gfp);
+        if (!ar) {
+            ret = nowait ? -EAGAIN : -ENOMEM;
+            break;
+        }
+        if (copy_from_iter(&ar->req, sizeof(ar->req), from) != sizeof(ar->req)) {
+            kfree(ar);
+            ret = -EFAULT;
+            break;
+        }
+        ar->ctx = ctx;
+        list_add_tail(&ar->node, &batch);
+    }
+
+    if (i < room) {
+        /* Give back the room of the requests that did not make it */
+        spin_lock(&ctx->lock);
+        ctx->queued -= room - i;
+        ctx->running -= room - i;
+        wake_up(&ctx->wait);
+        spin_unlock(&ctx->lock);
+        if (!i)
+            return ret;
+    }
+
+    spin_lock(&pending_lock);
+    list_for_each_entry_safe(ar, next, &batch, node)
+        list_move_tail(&ar->node, &pending);
+    spin_unlock(&pending_lock);
+    wake_up_nr(&pending_wait, i);
+
+    return i * sizeof(struct chardev_req);
+}
+
+/* Returns as many completions as there are and fit, waiting for the first
+ * one unless IOCB_NOWAIT or O_NONBLOCK are set. Returns 0 when nothing is
+ * in flight, since then no completion will ever come.
+ */
+static ssize_t async_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct async_ctx *ctx = iocb->ki_filp->private_data;
+    bool nowait = (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+    size_t nr = iov_iter_count(to) / sizeof(struct chardev_cqe);
+    LIST_HEAD(batch);
+    struct async_req *ar, *next;
+    size_t i = 0, copied = 0;
+    int ret;
+
+    if (!nr)
+        return -EINVAL;
+
+    spin_lock(&ctx->lock);
+    while (list_empty(&ctx->done)) {
+        bool idle = !ctx->queued;
+
+        spin_unlock(&ctx->lock);
+        if (idle)
+            return 0;
+        if (nowait)
+            return -EAGAIN;
+        ret = wait_event_interruptible(ctx->wait, !list_empty(&ctx->done) || !READ_ONCE(ctx->queued));
+        if (ret)
+            return ret;
+        spin_lock(&ctx->lock);
+    }
+    list_for_each_entry_safe(ar, next, &ctx->done, node) {
+        if (i++ == nr)
+            break;
+        list_move_tail(&ar->node, &batch);
+    }
+    spin_unlock(&ctx->lock);
+
+    list_for_each_entry_safe(ar, next, &batch, node) {
+        if (copy_to_iter(&ar->cqe, sizeof(ar->cqe), to) != sizeof(ar->cqe))
+            break;
+        copied++;
+        list_del(&ar->node);
+        kfree(ar);
+    }
+
+    spin_lock(&ctx->lock);
+    /* Completions that could not be copied go back, to be read again */
+    list_splice(&batch, &ctx->done);
+    ctx->queued -= copied;
+    wake_up(&ctx->wait);
+    spin_unlock(&ctx->lock);
+
+    return copied ? copied * sizeof(struct chardev_cqe) : -EFAULT;
+}
+
+static __poll_t device_poll(struct file *file, struct poll_table_struct *wait)
+{
+    struct async_ctx *ctx = file->private_data;
+    __poll_t mask = 0;
+
+    if (!ctx)
+        return DEFAULT_POLLMASK;
+
+    poll_wait(file, &ctx->wait, wait);
+
+    spin_lock(&ctx->lock);
+    if (!list_empty(&ctx->done))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (ctx->queued < ctx->depth)
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    spin_unlock(&ctx->lock);
+
+    return mask;
+}
+
+static int async_setup(struct file *file, int depth)
+{
+    struct async_ctx *ctx;
+
+    if (depth < 1 || depth > ASYNC_MAX_DEPTH)
+        return -EINVAL;
+
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    if (!ctx)
+        return -ENOMEM;
+
+    spin_lock_init(&ctx->lock);
+    INIT_LIST_HEAD(&ctx->done);
+    ctx->depth = depth;
+    init_waitqueue_head(&ctx->wait);
+
+    /* Once only, a file switched to requests stays that way */
+    if (cmpxchg(&file->private_data, NULL, ctx)) {
+        kfree(ctx);
+        return -EBUSY;
+    }
+
+    /* Keeps the workers around for requests still running after close() */
+    __module_get(THIS_MODULE);
+
+    return SUCCESS;
+}
+
+/* Called when the file is closed, which never waits for its requests: the
+ * last one to complete frees the context if some are still running.
+ */
+static void async_release(struct async_ctx *ctx)
+{
+    bool idle;
+
+    spin_lock(&ctx->lock);
+    ctx->closing = true;
+    idle = !ctx->running;
+    spin_unlock(&ctx->lock);
+
+    if (idle)
+        async_free(ctx);
+}
+
+static ssize_t device_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    if (iocb->ki_filp->private_data)
+        return async_read_iter(iocb, to);
+    return device_read_iter(iocb, to);
+}
+
+static ssize_t device_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    if (iocb->ki_filp->private_data)
+        return async_write_iter(iocb, from);
+    return device_write_iter(iocb, from);
+}
+
 /* This function is called whenever a process tries to do an ioctl on our
  * device file. We get two extra parameters (additional to the inode and file
  * structures, which all device functions get): the number of the ioctl called
@@ -170,6 +572,10 @@ device_ioctl(struct file *file, /* ditto */
          */
         ret = (long)message[ioctl_param];
         break;
+
+    case IOCTL_ASYNC_SETUP:
+        ret = async_setup(file, (int)ioctl_param);
+        break;
     }
 
     /* We're now ready for our next caller */
@@ -186,23 +592,66 @@ device_ioctl(struct file *file, /* ditto */
  * for unimplemented functions.
  */
 static struct file_operations fops = {
-    .read = device_read,
-    .write = device_write,
+    .read_iter = device_file_read_iter,
+    .write_iter = device_file_write_iter,
+    .poll = device_poll,
     .unlocked_ioctl = device_ioctl,
     .open = device_open,
     .release = device_release, /* a.k.a. close */
 };
 
+/* Stops the threads serving asynchronous requests, those that were started */
+static void async_stop_workers(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr_workers && workers[i]; i++)
+        kthread_stop(workers[i]);
+    kfree(workers);
+}
+
+static int async_start_workers(void)
+{
+    unsigned int i;
+
+    if (!nr_workers)
+        return -EINVAL;
+
+    workers = kcalloc(nr_workers, sizeof(*workers), GFP_KERNEL);
+    if (!workers)
+        return -ENOMEM;
+
+    for (i = 0; i < nr_workers; i++) {
+        struct task_struct *worker = kthread_run(async_worker, NULL, "chardev2/%u", i);
+
+        if (IS_ERR(worker)) {
+            async_stop_workers();
+            return PTR_ERR(worker);
+        }
+        workers[i] = worker;
+    }
+
+    return 0;
+}
+
 /* Initialize the module - Register the character device */
 static int __init chardev2_init(void)
 {
+    int ret_val;
+
+    /* Before the device shows up, requests may come in right away */
+    ret_val = async_start_workers();
+    if (ret_val)
+        return ret_val;
+
     /* Register the character device (at least try) */
-    int ret_val = register_chrdev(MAJOR_NUM, DEVICE_NAME, &fops);
+    ret_val = register_chrdev(MAJOR_NUM, DEVICE_NAME, &fops);
 
     /* Negative values signify an error */
     if (ret_val < 0) {
         pr_alert("%s failed with %d\n",
                  "Sorry, registering the character device ", ret_val);
+        async_stop_workers();
         return ret_val;
     }
 
@@ -226,6 +675,11 @@ static void __exit chardev2_exit(void)
 
     /* Unregister the device */
     unregister_chrdev(MAJOR_NUM, DEVICE_NAME);
+
+    /* No file is open and no request is running anymore, the contexts hold a
+     * reference to the module until their last request completed
+     */
+    async_stop_workers();
 }
 
 module_init(chardev2_init);
@@ -0,0 +1,337 @@
+/*
+ * cmd_bench.c - ioctl() vs batched ioctl() vs io_uring commands
+ *
+ * Runs the same IOCTL_VALGET (or IOCTL_VALSET) commands against ioctltest
+ * in four ways, for -t seconds each:
+ *
+ *   ioctl    one ioctl() per command
+ *   batch    IOCTL_VALBATCH, depth commands per ioctl()
+ *   uring    IORING_OP_URING_CMD, depth commands in flight, completed
+ *            when they are submitted
+ *   iopoll   the same on a ring set up with IORING_SETUP_IOPOLL, where
+ *            completions are polled for instead
+ *
+ * for depths of 1, 2, 4, ... up to -q, and reports the commands per second
+ * and the CPU time per command, taken from getrusage(). The argument of an
+ * io_uring command travels in the SQE, so it needs no copy from user space
+ * at all.
+ *
+ * io_uring is driven with raw system calls, no liburing needed:
+ *
+ *   sudo mknod /dev/ioctltest c <major> 0    (see dmesg after insmod)
+ *   sudo ./cmd_bench -q 256 -t 1
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ioctl_val.h"
+
+struct uring {
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+static unsigned int cmd = IOCTL_VALGET;
+
+static int uring_setup(struct uring *ring, unsigned int entries,
+                       unsigned int flags)
+{
+    struct io_uring_params p;
+    void *sq, *cq;
+    size_t sq_len, cq_len;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = flags;
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return -1;
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP && cq_len > sq_len)
+        sq_len = cq_len;
+
+    sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        return -1;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            return -1;
+    }
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        return -1;
+
+    ring->sq_head = (unsigned int *)((char *)sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)((char *)sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *)((char *)sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)((char *)sq + p.sq_off.array);
+    ring->cq_head = (unsigned int *)((char *)cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)((char *)cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *)((char *)cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+
+    return 0;
+}
+
+/* Queues one command, its argument in the SQE */
+static void uring_queue_cmd(struct uring *ring, int fd, unsigned int idx)
+{
+    unsigned int tail = *ring->sq_tail, slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    struct ioctl_arg arg = { .val = idx & 0xff };
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_URING_CMD;
+    sqe->fd = fd;
+    sqe->cmd_op = cmd;
+    memcpy(sqe->cmd, &arg, sizeof(arg));
+    sqe->user_data = idx;
+    ring->sq_array[slot] = slot;
+
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+struct result {
+    double ops_per_s;
+    double cpu_ns_per_op;
+};
+
+static void result(struct result *res, unsigned long ops, uint64_t start,
+                   uint64_t cpu)
+{
+    res->ops_per_s = ops * 1e9 / (now_ns() - start);
+    res->cpu_ns_per_op = (double)(cpu_ns() - cpu) / ops;
+}
+
+/* One ioctl() per command */
+static int run_ioctl(int fd, uint64_t duration_ns, struct result *res)
+{
+    uint64_t start = now_ns(), cpu = cpu_ns(), end = start + duration_ns;
+    struct ioctl_arg arg = { .val = 0 };
+    unsigned long ops = 0;
+
+    do {
+        arg.val = ops & 0xff;
+        if (ioctl(fd, cmd, &arg) < 0) {
+            perror("ioctl");
+            return -1;
+        }
+        ops++;
+    } while ((ops & 255) || now_ns() < end);
+
+    result(res, ops, start, cpu);
+    return 0;
+}
+
+/* depth commands per IOCTL_VALBATCH */
+static int run_batch(int fd, unsigned int depth, uint64_t duration_ns,
+                     struct result *res)
+{
+    struct ioctl_val_op ops[IOCTL_VALBATCH_MAX];
+    struct ioctl_val_batch batch = {
+        .ops = (uintptr_t)ops,
+        .nr = depth,
+    };
+    uint64_t start = now_ns(), cpu = cpu_ns(), end = start + duration_ns;
+    unsigned long nr = 0, calls = 0;
+    unsigned int i;
+
+    for (i = 0; i < depth; i++) {
+        ops[i].cmd = cmd;
+        ops[i].val = i & 0xff;
+    }
+
+    do {
+        if (ioctl(fd, IOCTL_VALBATCH, &batch) < 0) {
+            perror("IOCTL_VALBATCH");
+            return -1;
+        }
+        nr += depth;
+    } while ((++calls & 15) || now_ns() < end);
+
+    result(res, nr, start, cpu);
+    return 0;
+}
+
+/* io_uring with depth commands in flight at all times */
+static int run_uring(int fd, unsigned int depth, unsigned int flags,
+                     uint64_t duration_ns, struct result *res)
+{
+    struct uring ring;
+    uint64_t start, cpu, end;
+    unsigned long ops = 0;
+    unsigned int i, inflight, to_submit;
+    int done = 0;
+
+    if (uring_setup(&ring, depth, flags)) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    start = now_ns();
+    cpu = cpu_ns();
+    end = start + duration_ns;
+
+    for (i = 0; i < depth; i++)
+        uring_queue_cmd(&ring, fd, i);
+    to_submit = depth;
+    inflight = depth;
+
+    while (inflight) {
+        unsigned int head, tail;
+
+        /* With IORING_SETUP_IOPOLL, waiting for events is polling for them */
+        if (syscall(__NR_io_uring_enter, ring.fd, to_submit, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("io_uring_enter");
+            return -1;
+        }
+        to_submit = 0;
+
+        head = *ring.cq_head;
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+
+            if (cqe->res < 0) {
+                fprintf(stderr, "uring_cmd: %s\n", strerror(-cqe->res));
+                return -1;
+            }
+            ops++;
+            inflight--;
+            if (!done) {
+                uring_queue_cmd(&ring, fd, cqe->user_data);
+                to_submit++;
+                inflight++;
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        if (!done && now_ns() >= end)
+            done = 1;
+    }
+
+    result(res, ops, start, cpu);
+    close(ring.fd);
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-f device] [-o get|set] [-q max_depth] [-t seconds]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = "/dev/ioctltest";
+    unsigned int max_depth = 256, seconds = 1, depth;
+    struct result sync, batch, uring, iopoll;
+    uint64_t duration;
+    int fd, opt;
+
+    while ((opt = getopt(argc, argv, "f:o:q:t:")) != -1) {
+        switch (opt) {
+        case 'f':
+            path = optarg;
+            break;
+        case 'o':
+            if (!strcmp(optarg, "get"))
+                cmd = IOCTL_VALGET;
+            else if (!strcmp(optarg, "set"))
+                cmd = IOCTL_VALSET;
+            else
+                usage(argv[0]);
+            break;
+        case 'q':
+            max_depth = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!max_depth || max_depth > IOCTL_VALBATCH_MAX || !seconds)
+        usage(argv[0]);
+
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    duration = seconds * 1000000000ULL;
+
+    if (run_ioctl(fd, duration, &sync))
+        return EXIT_FAILURE;
+
+    printf("%s, %s, %us per run\n", path,
+           cmd == IOCTL_VALGET ? "IOCTL_VALGET" : "IOCTL_VALSET", seconds);
+    printf("ioctl: %.0f ops/s, %.0f cpu_ns/op\n", sync.ops_per_s,
+           sync.cpu_ns_per_op);
+    printf("%6s %12s %8s %12s %8s %12s %8s\n", "depth", "batch/s", "cpu_ns",
+           "uring/s", "cpu_ns", "iopoll/s", "cpu_ns");
+
+    for (depth = 1;; depth = depth * 2 > max_depth ? max_depth : depth * 2) {
+        if (run_batch(fd, depth, duration, &batch) ||
+            run_uring(fd, depth, 0, duration, &uring) ||
+            run_uring(fd, depth, IORING_SETUP_IOPOLL, duration, &iopoll))
+            return EXIT_FAILURE;
+
+        printf("%6u %12.0f %8.0f %12.0f %8.0f %12.0f %8.0f\n", depth,
+               batch.ops_per_s, batch.cpu_ns_per_op, uring.ops_per_s,
+               uring.cpu_ns_per_op, iopoll.ops_per_s, iopoll.cpu_ns_per_op);
+        if (depth == max_depth)
+            break;
+    }
+
+    close(fd);
+
+    return 0;
+}
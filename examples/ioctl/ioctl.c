@@ -5,24 +5,33 @@
 #include <linux/fs.h>
 #include <linux/init.h>
 #include <linux/ioctl.h>
+#include <linux/jhash.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/rhashtable.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/version.h>
 
-struct ioctl_arg {
-    unsigned int val;
-};
-
-/* Documentation/userspace-api/ioctl/ioctl-number.rst */
-#define IOC_MAGIC '\x66'
+/* io_uring commands with polled completion */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+#define HAVE_URING_CMD
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
+#endif
 
-#define IOCTL_VALSET _IOW(IOC_MAGIC, 0, struct ioctl_arg)
-#define IOCTL_VALGET _IOR(IOC_MAGIC, 1, struct ioctl_arg)
-#define IOCTL_VALGET_NUM _IOR(IOC_MAGIC, 2, int)
-#define IOCTL_VALSET_NUM _IOW(IOC_MAGIC, 3, int)
+#include "../hptrace/hptrace.h"
+#include "../statpage/statpage.h"
+#include "ioctl_kv.h"
+#include "ioctl_val.h"
 
-#define IOCTL_VAL_MAXNR 3
+#define IOCTL_VAL_MAXNR 10
 #define DRIVER_NAME "ioctltest"
 
 static unsigned int MAJOR_NUM = 0;
@@ -35,6 +44,471 @@ struct test_ioctl_data {
     rwlock_t lock;
 };
 
+/* Hot-path trace sites, toggled under /sys/kernel/debug/hptrace-ioctl/ */
+enum {
+    IOCTL_TRACE_OPEN,
+    IOCTL_TRACE_IOCTL,
+    IOCTL_TRACE_READ,
+    IOCTL_TRACE_WRITE,
+    IOCTL_TRACE_URING_CMD,
+    IOCTL_TRACE_NR,
+};
+
+static struct hptrace_site ioctl_sites[IOCTL_TRACE_NR] = {
+    [IOCTL_TRACE_OPEN] = HPTRACE_SITE("open"),
+    [IOCTL_TRACE_IOCTL] = HPTRACE_SITE("ioctl"),
+    [IOCTL_TRACE_READ] = HPTRACE_SITE("read"),
+    [IOCTL_TRACE_WRITE] = HPTRACE_SITE("write"),
+    [IOCTL_TRACE_URING_CMD] = HPTRACE_SITE("uring_cmd"),
+};
+
+static struct hptrace_subsys ioctl_trace = HPTRACE_SUBSYS("ioctl", ioctl_sites);
+
+/*
+ * The key/value cache, see ioctl_kv.h.
+ *
+ * Items live in an rhashtable, looked up under RCU only. A reader that finds an item takes a
+ * reference to it before copying the value out, since the copy may fault and sleep, and an item
+ * replaced or evicted meanwhile is freed once its last reader is done with it.
+ *
+ * Writers serialize on kv_lock, which also protects the LRU list. Moving an item to the head of
+ * the list on every hit would have readers take the lock after all, so a hit only marks the item
+ * referenced, and eviction gives referenced items a second chance instead (the CLOCK
+ * approximation of LRU).
+ */
+static unsigned int kv_capacity_kb = 65536;
+module_param(kv_capacity_kb, uint, 0444);
+MODULE_PARM_DESC(kv_capacity_kb, "Size of the keys and values the cache holds at most, in KiB");
+
+// Items kv_flush() unlinks per round of kv_lock
+#define KV_FLUSH_BATCH 256
+
+struct kv_key {
+    const void *data;
+    u32 len;
+};
+
+struct kv_item {
+    struct kv_key key; // First, so that an item compares as its key, see kv_cmpfn()
+    struct rhash_head node;
+    struct list_head lru; // Under kv_lock
+    struct rcu_head rcu;
+    refcount_t ref; // One for the table, one per reader copying the value
+    bool referenced; // Hit since eviction last looked at it
+    u32 val_len;
+    char data[]; // The key, then the value
+};
+
+struct kv_stats {
+    u64 hits;
+    u64 misses;
+    u64 puts;
+    u64 dels;
+    u64 evictions;
+};
+
+static DEFINE_PER_CPU(struct kv_stats, kv_stats);
+
+// Commands of any kind, through ioctl() and through io_uring
+struct ioctl_op_stats {
+    u64 ioctls;
+    u64 uring_cmds;
+};
+
+static DEFINE_PER_CPU(struct ioctl_op_stats, ioctl_op_stats);
+
+static struct rhashtable kv_table;
+static DEFINE_SPINLOCK(kv_lock);
+static LIST_HEAD(kv_lru); // Most recently written first
+static u64 kv_bytes; // Under kv_lock
+static u64 kv_items; // Under kv_lock
+
+/* Hashes a struct kv_key: the key of a lookup, or an item, which starts with its key */
+static u32 kv_hashfn(const void *data, u32 len, u32 seed)
+{
+    const struct kv_key *key = data;
+
+    return jhash(key->data, key->len, seed);
+}
+
+static int kv_cmpfn(struct rhashtable_compare_arg *arg, const void *obj)
+{
+    const struct kv_key *key = arg->key;
+    const struct kv_key *item_key = obj;
+
+    return key->len != item_key->len || memcmp(key->data, item_key->data, key->len);
+}
+
+static const struct rhashtable_params kv_params = {
+    .head_offset = offsetof(struct kv_item, node),
+    .hashfn = kv_hashfn,
+    .obj_hashfn = kv_hashfn,
+    .obj_cmpfn = kv_cmpfn,
+    .automatic_shrinking = true,
+};
+
+static size_t kv_item_size(const struct kv_item *item)
+{
+    return item->key.len + item->val_len;
+}
+
+static void kv_item_put(struct kv_item *item)
+{
+    if (refcount_dec_and_test(&item->ref))
+        kvfree_rcu(item, rcu);
+}
+
+/* Takes an item out of the table and the LRU list, with kv_lock held, keeping the reference of
+ * the table
+ */
+static void kv_unlink_keep(struct kv_item *item)
+{
+    rhashtable_remove_fast(&kv_table, &item->node, kv_params);
+    list_del(&item->lru);
+    kv_bytes -= kv_item_size(item);
+    kv_items--;
+}
+
+/* Takes an item out of the table and the LRU list, with kv_lock held */
+static void kv_unlink(struct kv_item *item)
+{
+    kv_unlink_keep(item);
+    kv_item_put(item);
+}
+
+/*
+ * Evicts until need more bytes fit in the capacity, with kv_lock held. Items hit since the last
+ * time get one more round, but only so many: readers keep marking them meanwhile.
+ */
+static void kv_evict(size_t need)
+{
+    u64 capacity = (u64)kv_capacity_kb * 1024;
+    u64 second_chances = kv_items;
+
+    while (kv_bytes + need > capacity && !list_empty(&kv_lru)) {
+        struct kv_item *item = list_last_entry(&kv_lru, struct kv_item, lru);
+
+        if (second_chances && READ_ONCE(item->referenced)) {
+            second_chances--;
+            WRITE_ONCE(item->referenced, false);
+            list_move(&item->lru, &kv_lru);
+            continue;
+        }
+
+        kv_unlink(item);
+        this_cpu_inc(kv_stats.evictions);
+    }
+}
+
+/* Looks a key up, and returns the item with a reference held, or NULL */
+static struct kv_item *kv_lookup(const struct kv_key *key)
+{
+    struct kv_item *item;
+
+    rcu_read_lock();
+    item = rhashtable_lookup(&kv_table, key, kv_params);
+    if (item && !refcount_inc_not_zero(&item->ref))
+        item = NULL;
+    rcu_read_unlock();
+
+    if (!item) {
+        this_cpu_inc(kv_stats.misses);
+        return NULL;
+    }
+
+    if (!READ_ONCE(item->referenced))
+        WRITE_ONCE(item->referenced, true);
+    this_cpu_inc(kv_stats.hits);
+    return item;
+}
+
+/* Copies the key of a request in, to a buffer of IOCTL_KV_KEY_MAX bytes */
+static int kv_copy_key(const struct ioctl_kv *kv, char *buf, struct kv_key *key)
+{
+    if (!kv->key_len || kv->key_len > IOCTL_KV_KEY_MAX)
+        return -EINVAL;
+    if (copy_from_user(buf, u64_to_user_ptr(kv->key), kv->key_len))
+        return -EFAULT;
+
+    key->data = buf;
+    key->len = kv->key_len;
+    return 0;
+}
+
+/* Serves the lookup of one request, updating its val_len */
+static int kv_get_one(struct ioctl_kv *kv)
+{
+    char buf[IOCTL_KV_KEY_MAX];
+    struct kv_key key;
+    struct kv_item *item;
+    int retval;
+
+    retval = kv_copy_key(kv, buf, &key);
+    if (retval)
+        return retval;
+
+    item = kv_lookup(&key);
+    if (!item)
+        return -ENOENT;
+
+    if (kv->val_len < item->val_len)
+        retval = -ENOSPC;
+    else if (copy_to_user(u64_to_user_ptr(kv->val), item->data + item->key.len, item->val_len))
+        retval = -EFAULT;
+    kv->val_len = item->val_len;
+
+    kv_item_put(item);
+    return retval;
+}
+
+static int kv_get(struct ioctl_kv __user *argp)
+{
+    struct ioctl_kv kv;
+    int retval;
+
+    if (copy_from_user(&kv, argp, sizeof(kv)))
+        return -EFAULT;
+
+    retval = kv_get_one(&kv);
+    if ((retval == 0 || retval == -ENOSPC) && put_user(kv.val_len, &argp->val_len))
+        return -EFAULT;
+
+    return retval;
+}
+
+/*
+ * Serves up to IOCTL_KV_MULTI_MAX lookups for the price of one system call. Every lookup gets
+ * its own result, misses do not fail the call.
+ */
+static int kv_multi_get(struct ioctl_kv_multi __user *argp)
+{
+    struct ioctl_kv_multi multi;
+    struct ioctl_kv __user *kvs;
+    struct ioctl_kv kv;
+    u32 i, found = 0;
+
+    if (copy_from_user(&multi, argp, sizeof(multi)))
+        return -EFAULT;
+    if (multi.nr > IOCTL_KV_MULTI_MAX)
+        return -EINVAL;
+    kvs = u64_to_user_ptr(multi.kvs);
+
+    for (i = 0; i < multi.nr; i++) {
+        if (copy_from_user(&kv, &kvs[i], sizeof(kv)))
+            return -EFAULT;
+
+        kv.result = kv_get_one(&kv);
+        if (kv.result == -EFAULT)
+            return -EFAULT;
+        if (kv.result == 0)
+            found++;
+
+        if (put_user(kv.val_len, &kvs[i].val_len) || put_user(kv.result, &kvs[i].result))
+            return -EFAULT;
+
+        cond_resched();
+    }
+
+    return put_user(found, &argp->found);
+}
+
+static int kv_put(struct ioctl_kv __user *argp)
+{
+    struct ioctl_kv kv;
+    struct kv_item *item, *old;
+    int retval;
+
+    if (copy_from_user(&kv, argp, sizeof(kv)))
+        return -EFAULT;
+    if (!kv.key_len || kv.key_len > IOCTL_KV_KEY_MAX || kv.val_len > IOCTL_KV_VAL_MAX)
+        return -EINVAL;
+    if (kv.key_len + kv.val_len > (u64)kv_capacity_kb * 1024)
+        return -E2BIG;
+
+    // Charged to the memory cgroup of the writer, like the pages of a tmpfs file. Values go up
+    // to a MiB, which kvmalloc() takes from vmalloc when no contiguous pages are to be had.
+    item = kvmalloc(struct_size(item, data, kv.key_len + kv.val_len), GFP_KERNEL_ACCOUNT);
+    if (!item)
+        return -ENOMEM;
+
+    if (copy_from_user(item->data, u64_to_user_ptr(kv.key), kv.key_len) ||
+        copy_from_user(item->data + kv.key_len, u64_to_user_ptr(kv.val), kv.val_len)) {
+        kvfree(item);
+        return -EFAULT;
+    }
+    item->key.data = item->data;
+    item->key.len = kv.key_len;
+    item->val_len = kv.val_len;
+    item->referenced = false;
+    refcount_set(&item->ref, 1);
+
+    spin_lock(&kv_lock);
+    old = rhashtable_lookup_fast(&kv_table, &item->key, kv_params);
+    if (old)
+        retval = rhashtable_replace_fast(&kv_table, &old->node, &item->node, kv_params);
+    else
+        retval = rhashtable_insert_fast(&kv_table, &item->node, kv_params);
+    if (retval) {
+        spin_unlock(&kv_lock);
+        kvfree(item);
+        return retval;
+    }
+
+    if (old) {
+        list_del(&old->lru);
+        kv_bytes -= kv_item_size(old);
+        kv_items--;
+        kv_item_put(old);
+    }
+    kv_evict(kv_item_size(item));
+    list_add(&item->lru, &kv_lru);
+    kv_bytes += kv_item_size(item);
+    kv_items++;
+    spin_unlock(&kv_lock);
+
+    this_cpu_inc(kv_stats.puts);
+    return 0;
+}
+
+static int kv_del(struct ioctl_kv __user *argp)
+{
+    char buf[IOCTL_KV_KEY_MAX];
+    struct ioctl_kv kv;
+    struct kv_key key;
+    struct kv_item *item;
+    int retval;
+
+    if (copy_from_user(&kv, argp, sizeof(kv)))
+        return -EFAULT;
+    retval = kv_copy_key(&kv, buf, &key);
+    if (retval)
+        return retval;
+
+    spin_lock(&kv_lock);
+    item = rhashtable_lookup_fast(&kv_table, &key, kv_params);
+    if (item)
+        kv_unlink(item);
+    spin_unlock(&kv_lock);
+
+    if (!item)
+        return -ENOENT;
+
+    this_cpu_inc(kv_stats.dels);
+    return 0;
+}
+
+/*
+ * Empties the cache a batch at a time. The items of a batch are unlinked under kv_lock and only
+ * put once it is dropped, so that writers and the other CPUs are not held up by a full cache.
+ */
+static void kv_flush(void)
+{
+    struct kv_item *item, *next;
+    LIST_HEAD(batch);
+    unsigned int n;
+    bool empty;
+
+    do {
+        spin_lock(&kv_lock);
+        for (n = 0; n < KV_FLUSH_BATCH && !list_empty(&kv_lru); n++) {
+            item = list_first_entry(&kv_lru, struct kv_item, lru);
+            kv_unlink_keep(item);
+            list_add(&item->lru, &batch);
+        }
+        empty = list_empty(&kv_lru);
+        spin_unlock(&kv_lock);
+
+        list_for_each_entry_safe(item, next, &batch, lru)
+            kv_item_put(item);
+        INIT_LIST_HEAD(&batch);
+        cond_resched();
+    } while (!empty);
+}
+
+static void kv_sum_stats(struct ioctl_kv_stats *stats)
+{
+    int cpu;
+
+    memset(stats, 0, sizeof(*stats));
+    for_each_possible_cpu(cpu) {
+        const struct kv_stats *s = per_cpu_ptr(&kv_stats, cpu);
+
+        stats->hits += READ_ONCE(s->hits);
+        stats->misses += READ_ONCE(s->misses);
+        stats->puts += READ_ONCE(s->puts);
+        stats->dels += READ_ONCE(s->dels);
+        stats->evictions += READ_ONCE(s->evictions);
+    }
+
+    spin_lock(&kv_lock);
+    stats->items = kv_items;
+    stats->bytes = kv_bytes;
+    spin_unlock(&kv_lock);
+    stats->capacity = (u64)kv_capacity_kb * 1024;
+}
+
+static int kv_get_stats(struct ioctl_kv_stats __user *argp)
+{
+    struct ioctl_kv_stats stats;
+
+    kv_sum_stats(&stats);
+
+    return copy_to_user(argp, &stats, sizeof(stats)) ? -EFAULT : 0;
+}
+
+static void test_ioctl_set_val(struct test_ioctl_data *ioctl_data, unsigned char val)
+{
+    write_lock(&ioctl_data->lock);
+    ioctl_data->val = val;
+    write_unlock(&ioctl_data->lock);
+}
+
+static unsigned char test_ioctl_get_val(struct test_ioctl_data *ioctl_data)
+{
+    unsigned char val;
+
+    read_lock(&ioctl_data->lock);
+    val = ioctl_data->val;
+    read_unlock(&ioctl_data->lock);
+
+    return val;
+}
+
+static int test_ioctl_val_batch(struct test_ioctl_data *ioctl_data, struct ioctl_val_batch __user *argp)
+{
+    struct ioctl_val_batch batch;
+    struct ioctl_val_op __user *ops;
+    struct ioctl_val_op op;
+    unsigned int i;
+
+    if (copy_from_user(&batch, argp, sizeof(batch)))
+        return -EFAULT;
+    if (batch.nr > IOCTL_VALBATCH_MAX)
+        return -EINVAL;
+    ops = u64_to_user_ptr(batch.ops);
+
+    for (i = 0; i < batch.nr; i++) {
+        if (copy_from_user(&op, &ops[i], sizeof(op)))
+            return -EFAULT;
+
+        switch (op.cmd) {
+        case IOCTL_VALSET:
+            test_ioctl_set_val(ioctl_data, op.val);
+            break;
+
+        case IOCTL_VALGET:
+            if (put_user(test_ioctl_get_val(ioctl_data), &ops[i].val))
+                return -EFAULT;
+            break;
+
+        default:
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
 /*
  * Provides custom IOCTL commands for user-space interaction.
  * 
@@ -47,8 +521,11 @@ static long test_ioctl_ioctl(struct file *filp, unsigned int cmd, unsigned long
     int retval = 0;
     unsigned char val;
     struct ioctl_arg data;
+    u64 t0 = hptrace_begin(ioctl_sites, IOCTL_TRACE_IOCTL);
     memset(&data, 0, sizeof(data));
 
+    this_cpu_inc(ioctl_op_stats.ioctls);
+
     switch (cmd) {
     case IOCTL_VALSET:
         if (copy_from_user(&data, (int __user *)arg, sizeof(data))) {
@@ -56,16 +533,13 @@ static long test_ioctl_ioctl(struct file *filp, unsigned int cmd, unsigned long
             goto done;
         }
 
-        pr_alert("IOCTL set val:%x .\n", data.val);
-        write_lock(&ioctl_data->lock);
-        ioctl_data->val = data.val;
-        write_unlock(&ioctl_data->lock);
+        // Not pr_alert(): printing would cost more than the rest of the call
+        pr_debug("IOCTL set val:%x .\n", data.val);
+        test_ioctl_set_val(ioctl_data, data.val);
         break;
 
     case IOCTL_VALGET:
-        read_lock(&ioctl_data->lock);
-        val = ioctl_data->val;
-        read_unlock(&ioctl_data->lock);
+        val = test_ioctl_get_val(ioctl_data);
         data.val = val;
 
         if (copy_to_user((int __user *)arg, &data, sizeof(data))) {
@@ -83,43 +557,179 @@ static long test_ioctl_ioctl(struct file *filp, unsigned int cmd, unsigned long
         ioctl_num = arg;
         break;
 
+    case IOCTL_VALBATCH:
+        retval = test_ioctl_val_batch(ioctl_data, (struct ioctl_val_batch __user *)arg);
+        break;
+
+    case IOCTL_KV_GET:
+        retval = kv_get((struct ioctl_kv __user *)arg);
+        break;
+
+    case IOCTL_KV_PUT:
+        retval = kv_put((struct ioctl_kv __user *)arg);
+        break;
+
+    case IOCTL_KV_DEL:
+        retval = kv_del((struct ioctl_kv __user *)arg);
+        break;
+
+    case IOCTL_KV_MULTI_GET:
+        retval = kv_multi_get((struct ioctl_kv_multi __user *)arg);
+        break;
+
+    case IOCTL_KV_STATS:
+        retval = kv_get_stats((struct ioctl_kv_stats __user *)arg);
+        break;
+
+    case IOCTL_KV_FLUSH:
+        kv_flush();
+        break;
+
     default:
         retval = -ENOTTY;
     }
 
 done:
+    hptrace_end(ioctl_sites, IOCTL_TRACE_IOCTL, t0, cmd);
     return retval;
 }
 
 /*
- * The test_ioctl_read function is called when a user-space application attempts to read data from
- * the character device associated with the driver. Specifically, it is invoked when the read()
- * system call is used on the device file (e.g., /dev/ioctltest).
+ * The test_ioctl_read_iter function is called when a user-space application attempts to read
+ * data from the character device associated with the driver: read(), readv(), and io_uring or
+ * AIO reads on the device file (e.g., /dev/ioctltest). It fills the whole request with val.
+ *
+ * Nothing in here sleeps, the lock is a spinning one and the data is always there, so reads
+ * with IOCB_NOWAIT (io_uring trying to complete inline) are served like any other.
  */
-static ssize_t test_ioctl_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+static ssize_t test_ioctl_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-    pr_alert("%s call.\n", __func__);
-    struct test_ioctl_data *ioctl_data = filp->private_data;
+    struct test_ioctl_data *ioctl_data = iocb->ki_filp->private_data;
+    size_t count = iov_iter_count(to), copied = 0;
+    unsigned char chunk[64];
     unsigned char val;
-    int retval;
-    int i = 0;
+    u64 t0 = hptrace_begin(ioctl_sites, IOCTL_TRACE_READ);
+
+    pr_debug("%s call.\n", __func__);
 
     read_lock(&ioctl_data->lock);
     val = ioctl_data->val;
     read_unlock(&ioctl_data->lock);
 
-    for (; i < count; i++) {
-        if (copy_to_user(&buf[i], &val, 1)) {
-            retval = -EFAULT;
-            goto out;
-        }
+    memset(chunk, val, sizeof(chunk));
+    while (copied < count) {
+        size_t n = min(count - copied, sizeof(chunk));
+        size_t done = copy_to_iter(chunk, n, to);
+
+        copied += done;
+        if (done < n)
+            break;
     }
 
-    retval = count;
-out:
+    hptrace_end(ioctl_sites, IOCTL_TRACE_READ, t0, copied);
+    return copied ? copied : (count ? -EFAULT : 0);
+}
+
+/*
+ * Writes set val to the last byte written, the counterpart of reads returning it. Like reads,
+ * they never sleep.
+ */
+static ssize_t test_ioctl_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct test_ioctl_data *ioctl_data = iocb->ki_filp->private_data;
+    size_t count = iov_iter_count(from);
+    unsigned char val;
+    u64 t0 = hptrace_begin(ioctl_sites, IOCTL_TRACE_WRITE);
+
+    if (!count)
+        return 0;
+
+    iov_iter_advance(from, count - 1);
+    if (copy_from_iter(&val, 1, from) != 1)
+        return -EFAULT;
+
+    write_lock(&ioctl_data->lock);
+    ioctl_data->val = val;
+    write_unlock(&ioctl_data->lock);
+
+    hptrace_end(ioctl_sites, IOCTL_TRACE_WRITE, t0, count);
+    return count;
+}
+
+#ifdef HAVE_URING_CMD
+/*
+ * IORING_OP_URING_CMD submissions land here, with the ioctl number in cmd_op. The argument is not
+ * behind a pointer but in the SQE itself, so there is nothing to copy from user space: a struct
+ * ioctl_arg at the start of the command area of the SQE for IOCTL_VALSET. IOCTL_VALGET returns
+ * val as the result of the CQE.
+ *
+ * Commands complete right away, unless the ring polls for completions (IORING_SETUP_IOPOLL): then
+ * they are queued, and completed by test_ioctl_uring_cmd_iopoll() when io_uring polls for them,
+ * like the requests of a polled NVMe queue.
+ */
+struct test_ioctl_pdu {
+    int result;
+};
+
+static const struct ioctl_arg *test_ioctl_cmd_arg(struct io_uring_cmd *ioucmd)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    return io_uring_sqe_cmd(ioucmd->sqe);
+#else
+    return ioucmd->cmd;
+#endif
+}
+
+static int test_ioctl_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    struct test_ioctl_data *ioctl_data = ioucmd->file->private_data;
+    struct test_ioctl_pdu *pdu = (struct test_ioctl_pdu *)ioucmd->pdu;
+    int retval;
+    u64 t0 = hptrace_begin(ioctl_sites, IOCTL_TRACE_URING_CMD);
+
+    BUILD_BUG_ON(sizeof(*pdu) > sizeof(ioucmd->pdu));
+
+    this_cpu_inc(ioctl_op_stats.uring_cmds);
+
+    switch (ioucmd->cmd_op) {
+    case IOCTL_VALSET:
+        // The SQE is only ours until we return, read it now
+        test_ioctl_set_val(ioctl_data, READ_ONCE(test_ioctl_cmd_arg(ioucmd)->val));
+        retval = 0;
+        break;
+
+    case IOCTL_VALGET:
+        retval = test_ioctl_get_val(ioctl_data);
+        break;
+
+    default:
+        retval = -ENOTTY;
+    }
+
+    hptrace_end(ioctl_sites, IOCTL_TRACE_URING_CMD, t0, ioucmd->cmd_op);
+
+    if (issue_flags & IO_URING_F_IOPOLL) {
+        pdu->result = retval;
+        return -EIOCBQUEUED;
+    }
     return retval;
 }
 
+/* Called by io_uring polling for a command queued above, which is always done already */
+static int test_ioctl_uring_cmd_iopoll(struct io_uring_cmd *ioucmd, struct io_comp_batch *iob,
+                                       unsigned int poll_flags)
+{
+    struct test_ioctl_pdu *pdu = (struct test_ioctl_pdu *)ioucmd->pdu;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    io_uring_cmd_done(ioucmd, pdu->result, 0, 0);
+#else
+    io_uring_cmd_done(ioucmd, pdu->result, 0);
+#endif
+    return 1;
+}
+#endif
+
 static int test_ioctl_close(struct inode *inode, struct file *filp)
 {
     pr_alert("%s call.\n", __func__);
@@ -135,6 +745,7 @@ static int test_ioctl_close(struct inode *inode, struct file *filp)
 static int test_ioctl_open(struct inode *inode, struct file *filp)
 {
     struct test_ioctl_data *ioctl_data;
+    u64 t0 = hptrace_begin(ioctl_sites, IOCTL_TRACE_OPEN);
 
     pr_alert("%s call.\n", __func__);
     ioctl_data = kmalloc(sizeof(struct test_ioctl_data), GFP_KERNEL);
@@ -145,7 +756,10 @@ static int test_ioctl_open(struct inode *inode, struct file *filp)
     rwlock_init(&ioctl_data->lock);
     ioctl_data->val = 0xFF;
     filp->private_data = ioctl_data;
+    /* Let io_uring try IOCB_NOWAIT reads and writes inline first */
+    filp->f_mode |= FMODE_NOWAIT;
 
+    hptrace_end(ioctl_sites, IOCTL_TRACE_OPEN, t0, 0);
     return 0;
 }
 
@@ -155,10 +769,67 @@ static struct file_operations fops = {
 #endif
     .open = test_ioctl_open,
     .release = test_ioctl_close,
-    .read = test_ioctl_read,
+    .read_iter = test_ioctl_read_iter,
+    .write_iter = test_ioctl_write_iter,
     .unlocked_ioctl = test_ioctl_ioctl,
+#ifdef HAVE_URING_CMD
+    .uring_cmd = test_ioctl_uring_cmd,
+    .uring_cmd_iopoll = test_ioctl_uring_cmd_iopoll,
+#endif
 };
 
+/* All the counters, in a page user space maps from /proc/statpage-ioctl, see statpage.h */
+enum {
+    IOCTL_STAT_IOCTLS,
+    IOCTL_STAT_URING_CMDS,
+    IOCTL_STAT_KV_HITS,
+    IOCTL_STAT_KV_MISSES,
+    IOCTL_STAT_KV_PUTS,
+    IOCTL_STAT_KV_DELS,
+    IOCTL_STAT_KV_EVICTIONS,
+    IOCTL_STAT_KV_ITEMS,
+    IOCTL_STAT_KV_BYTES,
+    IOCTL_STAT_NR,
+};
+
+static const char *const ioctl_stat_names[IOCTL_STAT_NR] = {
+    [IOCTL_STAT_IOCTLS] = "ioctls",
+    [IOCTL_STAT_URING_CMDS] = "uring_cmds",
+    [IOCTL_STAT_KV_HITS] = "kv_hits",
+    [IOCTL_STAT_KV_MISSES] = "kv_misses",
+    [IOCTL_STAT_KV_PUTS] = "kv_puts",
+    [IOCTL_STAT_KV_DELS] = "kv_dels",
+    [IOCTL_STAT_KV_EVICTIONS] = "kv_evictions",
+    [IOCTL_STAT_KV_ITEMS] = "kv_items",
+    [IOCTL_STAT_KV_BYTES] = "kv_bytes",
+};
+
+static void ioctl_stats_refresh(struct statpage *sp, u64 *values)
+{
+    struct ioctl_kv_stats kv;
+    int cpu;
+
+    values[IOCTL_STAT_IOCTLS] = 0;
+    values[IOCTL_STAT_URING_CMDS] = 0;
+    for_each_possible_cpu(cpu) {
+        const struct ioctl_op_stats *s = per_cpu_ptr(&ioctl_op_stats, cpu);
+
+        values[IOCTL_STAT_IOCTLS] += READ_ONCE(s->ioctls);
+        values[IOCTL_STAT_URING_CMDS] += READ_ONCE(s->uring_cmds);
+    }
+
+    kv_sum_stats(&kv);
+    values[IOCTL_STAT_KV_HITS] = kv.hits;
+    values[IOCTL_STAT_KV_MISSES] = kv.misses;
+    values[IOCTL_STAT_KV_PUTS] = kv.puts;
+    values[IOCTL_STAT_KV_DELS] = kv.dels;
+    values[IOCTL_STAT_KV_EVICTIONS] = kv.evictions;
+    values[IOCTL_STAT_KV_ITEMS] = kv.items;
+    values[IOCTL_STAT_KV_BYTES] = kv.bytes;
+}
+
+static struct statpage ioctl_stats = STATPAGE("ioctl", ioctl_stat_names, ioctl_stats_refresh);
+
 static int __init ioctl_init(void)
 {
     printk("---------------------- Mod Init ----------------------\n");
@@ -167,6 +838,9 @@ static int __init ioctl_init(void)
     dev_t dev;
     int alloc_ret = -1;
     int cdev_ret = -1;
+    int trace_ret = -1;
+    int kv_ret = -1;
+    int stat_ret = -1;
     
     /************************************
      * Allocate a range of device numbers
@@ -184,6 +858,12 @@ static int __init ioctl_init(void)
      * Initialize a cdev object, linking it to the file operations for the device
      ****************************************************************************/
 
+    // The key/value cache, it must be there before the device can be opened
+    kv_ret = rhashtable_init(&kv_table, &kv_params);
+
+    if (kv_ret)
+        goto error;
+
     // Setup the char device we want to use
     cdev_init(&test_ioctl_cdev, &fops);
 
@@ -196,8 +876,22 @@ static int __init ioctl_init(void)
     if (cdev_ret)
         goto error;
 
+    // Hot-path tracing, disabled (a NOP) until enabled through debugfs
+    trace_ret = hptrace_register(&ioctl_trace);
+
+    if (trace_ret)
+        goto error;
+
+    // Counters user space reads without a system call
+    stat_ret = statpage_register(&ioctl_stats);
+
+    if (stat_ret)
+        goto error;
+
     printk("Successfully registered device %s: Major-%u Minor-%u\n", DRIVER_NAME, MAJOR(dev), MINOR(dev));
     printk("\tCreated %s entry under: /proc/devices\n", DRIVER_NAME);
+    printk("\tCreated entry: /sys/kernel/debug/hptrace-ioctl\n");
+    printk("\tCreated entry: /proc/statpage-ioctl\n");
 
     printk("Successfully initialized module\n");
     printk("\tCreated entry under: /proc/modules\n\n");
@@ -209,8 +903,12 @@ static int __init ioctl_init(void)
     return 0;
 
 error:
+    if (trace_ret == 0)
+        hptrace_unregister(&ioctl_trace);
     if (cdev_ret == 0)
         cdev_del(&test_ioctl_cdev);
+    if (kv_ret == 0)
+        rhashtable_destroy(&kv_table);
     if (alloc_ret == 0)
         unregister_chrdev_region(dev, RESERVED_CNT);
 
@@ -222,7 +920,13 @@ static void __exit ioctl_exit(void)
 {
     dev_t dev = MKDEV(MAJOR_NUM, 0);
 
+    statpage_unregister(&ioctl_stats);
+    hptrace_unregister(&ioctl_trace);
     cdev_del(&test_ioctl_cdev);
+    kv_flush();
+    rhashtable_destroy(&kv_table);
+    // Wait for the items freed after a grace period
+    rcu_barrier();
     unregister_chrdev_region(dev, RESERVED_CNT);
     pr_alert("%s driver removed.\n", DRIVER_NAME);
 }
@@ -0,0 +1,74 @@
+/*
+ * ioctl_kv.h - the key/value cache ioctls of ioctltest
+ *
+ * Shared by ioctl.c and the user space tools.
+ *
+ * Besides the val of every open file, the device keeps one cache of keys
+ * and values for the whole module, shared by everyone who opens it. Keys
+ * and values are byte strings of any content. Lookups do not take a lock,
+ * so that many readers can hit the cache at once. When the values held go
+ * over the capacity, set with the kv_capacity_kb module parameter, the
+ * least recently used ones are evicted.
+ *
+ * Keys and values are passed by pointer. For IOCTL_KV_GET, val_len is the
+ * size of the val buffer on the way in and the length of the value on the
+ * way out. A value that does not fit fails with ENOSPC, with val_len set to
+ * the size needed.
+ */
+
+#ifndef IOCTL_KV_H
+#define IOCTL_KV_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* Documentation/userspace-api/ioctl/ioctl-number.rst */
+#ifndef IOC_MAGIC
+#define IOC_MAGIC '\x66'
+#endif
+
+#define IOCTL_KV_KEY_MAX 250
+#define IOCTL_KV_VAL_MAX (1 << 20)
+/* The most lookups in one IOCTL_KV_MULTI_GET */
+#define IOCTL_KV_MULTI_MAX 256
+
+struct ioctl_kv {
+    __u64 key; /* pointer to the key */
+    __u64 val; /* pointer to the value */
+    __u32 key_len;
+    __u32 val_len;
+    __s32 result; /* IOCTL_KV_MULTI_GET: 0 or a negative errno per lookup */
+    __u32 pad;
+};
+
+struct ioctl_kv_multi {
+    __u64 kvs; /* pointer to an array of nr struct ioctl_kv */
+    __u32 nr;
+    __u32 found; /* set to the number of lookups that hit */
+};
+
+struct ioctl_kv_stats {
+    __u64 hits;
+    __u64 misses;
+    __u64 puts;
+    __u64 dels;
+    __u64 evictions;
+    __u64 items;
+    __u64 bytes; /* of the keys and values held */
+    __u64 capacity;
+};
+
+/* Look a key up, ENOENT on a miss */
+#define IOCTL_KV_GET _IOWR(IOC_MAGIC, 4, struct ioctl_kv)
+/* Insert a key, or replace its value */
+#define IOCTL_KV_PUT _IOW(IOC_MAGIC, 5, struct ioctl_kv)
+/* Remove a key, ENOENT if it is not there */
+#define IOCTL_KV_DEL _IOW(IOC_MAGIC, 6, struct ioctl_kv)
+/* Look up to IOCTL_KV_MULTI_MAX keys in one call */
+#define IOCTL_KV_MULTI_GET _IOWR(IOC_MAGIC, 7, struct ioctl_kv_multi)
+/* The counters, summed over all CPUs */
+#define IOCTL_KV_STATS _IOR(IOC_MAGIC, 8, struct ioctl_kv_stats)
+/* Empty the cache */
+#define IOCTL_KV_FLUSH _IO(IOC_MAGIC, 9)
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * ioctl_val.h - the val ioctls of ioctltest
+ *
+ * Shared by ioctl.c and the user space tools.
+ *
+ * Every open file of the device holds one val. IOCTL_VALSET and
+ * IOCTL_VALGET write and read it, one system call each. IOCTL_VALBATCH
+ * carries up to IOCTL_VALBATCH_MAX of them in one call: the ops are run in
+ * order, and the val read by an IOCTL_VALGET op is stored back into it.
+ */
+
+#ifndef IOCTL_VAL_H
+#define IOCTL_VAL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* Documentation/userspace-api/ioctl/ioctl-number.rst */
+#ifndef IOC_MAGIC
+#define IOC_MAGIC '\x66'
+#endif
+
+/* The most ops in one IOCTL_VALBATCH */
+#define IOCTL_VALBATCH_MAX 256
+
+struct ioctl_arg {
+    __u32 val;
+};
+
+/* One IOCTL_VALSET or IOCTL_VALGET of a batch */
+struct ioctl_val_op {
+    __u32 cmd;
+    __u32 val; /* set, or filled in for IOCTL_VALGET */
+};
+
+struct ioctl_val_batch {
+    __u64 ops; /* pointer to an array of nr struct ioctl_val_op */
+    __u32 nr;
+    __u32 pad;
+};
+
+#define IOCTL_VALSET _IOW(IOC_MAGIC, 0, struct ioctl_arg)
+#define IOCTL_VALGET _IOR(IOC_MAGIC, 1, struct ioctl_arg)
+#define IOCTL_VALGET_NUM _IOR(IOC_MAGIC, 2, int)
+#define IOCTL_VALSET_NUM _IOW(IOC_MAGIC, 3, int)
+/* Several IOCTL_VALSET and IOCTL_VALGET for the price of one system call */
+#define IOCTL_VALBATCH _IOWR(IOC_MAGIC, 10, struct ioctl_val_batch)
+
+#endif
@@ -0,0 +1,445 @@
+/*
+ * kv_bench.c - YCSB like load generator for the ioctltest key/value cache
+ *
+ * Loads -n records of -v bytes into the cache, then runs one of the core
+ * YCSB workloads from -j threads, each with a file of its own, for -t
+ * seconds:
+ *
+ *   A  50% reads, 50% updates
+ *   B  95% reads, 5% updates
+ *   C  100% reads
+ *   D  95% reads of the latest records, 5% inserts
+ *
+ * Keys follow a zipfian distribution of constant -z (0.99 like YCSB), the
+ * popular ones scattered over the key space like with YCSB's scrambled
+ * zipfian. Workload D reads the records inserted last the most instead.
+ * With -m, reads are sent -m at a time with IOCTL_KV_MULTI_GET.
+ *
+ * Reports operations per second, the average and 99th percentile latency
+ * of an ioctl(), and the hit ratio and evictions, from IOCTL_KV_STATS. A
+ * capacity smaller than the records makes misses show:
+ *
+ *   sudo insmod ioctlMod.ko kv_capacity_kb=16384
+ *   sudo mknod /dev/ioctltest c <major> 0    (see dmesg after insmod)
+ *   sudo ./kv_bench -w B -n 100000 -v 1000 -j 4 -t 5
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ioctl_kv.h"
+
+#define DEVICE "/dev/ioctltest"
+#define KEY_LEN 24
+/* Latency histogram: 64 buckets per power of two of nanoseconds */
+#define HIST_SHIFT 6
+#define HIST_BUCKETS (64 << HIST_SHIFT)
+
+struct zipf {
+    uint64_t items;
+    double theta, alpha, zetan, eta, half_pow_theta;
+};
+
+struct worker {
+    pthread_t thread;
+    int fd;
+    uint64_t seed;
+    uint64_t ops, reads, updates;
+    uint64_t ns;
+    uint32_t hist[HIST_BUCKETS];
+    int error;
+};
+
+static const char *device = DEVICE;
+static char workload = 'A';
+static uint64_t records = 10000;
+static size_t value_size = 100;
+static unsigned int batch = 1;
+static double theta = 0.99;
+static struct zipf zipf;
+static uint64_t inserted; /* records in the key space, grows in workload D */
+static volatile int stop;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, one state per thread */
+static uint64_t next_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static double next_double(uint64_t *state)
+{
+    return (next_rand(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static uint64_t fnv1a(uint64_t val)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        hash ^= val & 0xff;
+        hash *= 0x100000001b3ULL;
+        val >>= 8;
+    }
+    return hash;
+}
+
+static double zeta(uint64_t n, double theta)
+{
+    double sum = 0;
+    uint64_t i;
+
+    for (i = 1; i <= n; i++)
+        sum += 1 / pow(i, theta);
+    return sum;
+}
+
+/* Gray et al., "Quickly Generating Billion-Record Synthetic Databases", as in YCSB */
+static void zipf_init(struct zipf *z, uint64_t items, double theta)
+{
+    double zeta2 = zeta(2, theta);
+
+    z->items = items;
+    z->theta = theta;
+    z->alpha = 1 / (1 - theta);
+    z->zetan = zeta(items, theta);
+    z->eta = (1 - pow(2.0 / items, 1 - theta)) / (1 - zeta2 / z->zetan);
+    z->half_pow_theta = 1 + pow(0.5, theta);
+}
+
+/* A rank, 0 being the most popular */
+static uint64_t zipf_next(const struct zipf *z, uint64_t *state)
+{
+    double u = next_double(state);
+    double uz = u * z->zetan;
+    uint64_t rank;
+
+    if (uz < 1)
+        return 0;
+    if (uz < z->half_pow_theta)
+        return 1;
+    rank = z->items * pow(z->eta * u - z->eta + 1, z->alpha);
+    return rank < z->items ? rank : z->items - 1;
+}
+
+static uint64_t next_key(uint64_t *state)
+{
+    uint64_t rank = zipf_next(&zipf, state);
+
+    if (workload == 'D') {
+        /* The latest records are the most popular */
+        uint64_t last = __atomic_load_n(&inserted, __ATOMIC_RELAXED);
+
+        return rank < last ? last - 1 - rank : 0;
+    }
+    return fnv1a(rank) % records;
+}
+
+static size_t make_key(char *key, uint64_t id)
+{
+    return snprintf(key, KEY_LEN, "user%llu", (unsigned long long)id);
+}
+
+static int put(int fd, uint64_t id, char *value)
+{
+    char key[KEY_LEN];
+    struct ioctl_kv kv = {
+        .key = (uintptr_t)key,
+        .val = (uintptr_t)value,
+        .val_len = value_size,
+    };
+
+    kv.key_len = make_key(key, id);
+    /* Values differ by record, so that a wrong one would show */
+    memcpy(value, &id, sizeof(id) < value_size ? sizeof(id) : value_size);
+
+    return ioctl(fd, IOCTL_KV_PUT, &kv);
+}
+
+/* Reads batch records, misses are fine */
+static int get(int fd, uint64_t *seed, char (*keys)[KEY_LEN], char *values,
+               struct ioctl_kv *kvs)
+{
+    struct ioctl_kv_multi multi = {
+        .kvs = (uintptr_t)kvs,
+        .nr = batch,
+    };
+    unsigned int i;
+
+    for (i = 0; i < batch; i++) {
+        kvs[i].key = (uintptr_t)keys[i];
+        kvs[i].key_len = make_key(keys[i], next_key(seed));
+        kvs[i].val = (uintptr_t)(values + i * value_size);
+        kvs[i].val_len = value_size;
+    }
+
+    if (batch == 1)
+        return ioctl(fd, IOCTL_KV_GET, kvs) && errno != ENOENT ? -1 : 0;
+    return ioctl(fd, IOCTL_KV_MULTI_GET, &multi);
+}
+
+static void record(struct worker *w, uint64_t ns)
+{
+    unsigned int bucket = 0;
+
+    if (ns) {
+        unsigned int log = 63 - __builtin_clzll(ns);
+
+        bucket = log < HIST_SHIFT
+                     ? ns
+                     : (log - HIST_SHIFT + 1) << HIST_SHIFT |
+                           (ns >> (log - HIST_SHIFT) & ((1 << HIST_SHIFT) - 1));
+    }
+    w->hist[bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1]++;
+    w->ns += ns;
+}
+
+static uint64_t bucket_ns(unsigned int bucket)
+{
+    unsigned int log = bucket >> HIST_SHIFT;
+
+    if (!log)
+        return bucket;
+    return (uint64_t)((1 << HIST_SHIFT) | (bucket & ((1 << HIST_SHIFT) - 1)))
+           << (log - 1);
+}
+
+static void *worker(void *arg)
+{
+    struct worker *w = arg;
+    int read_pct = workload == 'A' ? 50 : workload == 'C' ? 100 : 95;
+    char (*keys)[KEY_LEN] = calloc(batch, KEY_LEN);
+    char *values = calloc(batch, value_size);
+    struct ioctl_kv *kvs = calloc(batch, sizeof(*kvs));
+
+    if (!keys || !values || !kvs) {
+        w->error = ENOMEM;
+        goto out;
+    }
+
+    while (!stop) {
+        int read = next_rand(&w->seed) % 100 < (uint64_t)read_pct;
+        uint64_t t = now_ns();
+        int ret;
+
+        if (read)
+            ret = get(w->fd, &w->seed, keys, values, kvs);
+        else if (workload == 'D')
+            ret = put(w->fd, __atomic_fetch_add(&inserted, 1, __ATOMIC_RELAXED),
+                      values);
+        else
+            ret = put(w->fd, next_key(&w->seed), values);
+
+        record(w, now_ns() - t);
+        if (ret < 0) {
+            w->error = errno;
+            break;
+        }
+        if (read) {
+            w->reads += batch;
+            w->ops += batch;
+        } else {
+            w->updates++;
+            w->ops++;
+        }
+    }
+
+out:
+    free(kvs);
+    free(values);
+    free(keys);
+    return NULL;
+}
+
+static int load(int fd)
+{
+    char *value = calloc(1, value_size);
+    uint64_t id;
+
+    if (!value)
+        return -1;
+    for (id = 0; id < records; id++) {
+        if (put(fd, id, value)) {
+            perror("IOCTL_KV_PUT");
+            free(value);
+            return -1;
+        }
+    }
+    free(value);
+    inserted = records;
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-d device] [-w A|B|C|D] [-n records] [-v value_size] "
+            "[-z theta] [-m multi_get] [-j threads] [-t seconds]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int seconds = 5, jobs = 1, i, b;
+    struct ioctl_kv_stats before, after;
+    struct timespec duration;
+    struct worker *workers;
+    uint64_t start, wall, ops = 0, reads = 0, updates = 0, ns = 0, calls = 0;
+    uint64_t seen = 0, p99 = 0;
+    int fd, opt, error = 0;
+
+    while ((opt = getopt(argc, argv, "d:w:n:v:z:m:j:t:")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'w':
+            workload = optarg[0] & ~0x20;
+            break;
+        case 'n':
+            records = strtoull(optarg, NULL, 0);
+            break;
+        case 'v':
+            value_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'z':
+            theta = strtod(optarg, NULL);
+            break;
+        case 'm':
+            batch = strtoul(optarg, NULL, 0);
+            break;
+        case 'j':
+            jobs = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (workload < 'A' || workload > 'D' || records < 2 || !value_size ||
+        value_size > IOCTL_KV_VAL_MAX || theta <= 0 || theta >= 1 || !batch ||
+        batch > IOCTL_KV_MULTI_MAX || !jobs || !seconds)
+        usage(argv[0]);
+
+    fd = open(device, O_RDWR);
+    if (fd < 0) {
+        perror(device);
+        return EXIT_FAILURE;
+    }
+    workers = calloc(jobs, sizeof(*workers));
+    if (!workers) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    if (ioctl(fd, IOCTL_KV_FLUSH) || load(fd))
+        return EXIT_FAILURE;
+    zipf_init(&zipf, records, theta);
+
+    if (ioctl(fd, IOCTL_KV_STATS, &before)) {
+        perror("IOCTL_KV_STATS");
+        return EXIT_FAILURE;
+    }
+
+    stop = 0;
+    start = now_ns();
+    for (i = 0; i < jobs; i++) {
+        workers[i].fd = open(device, O_RDWR);
+        if (workers[i].fd < 0) {
+            perror(device);
+            return EXIT_FAILURE;
+        }
+        workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        pthread_create(&workers[i].thread, NULL, worker, &workers[i]);
+    }
+
+    duration.tv_sec = seconds;
+    duration.tv_nsec = 0;
+    nanosleep(&duration, NULL);
+    stop = 1;
+
+    for (i = 0; i < jobs; i++) {
+        pthread_join(workers[i].thread, NULL);
+        close(workers[i].fd);
+        ops += workers[i].ops;
+        reads += workers[i].reads;
+        updates += workers[i].updates;
+        ns += workers[i].ns;
+        if (workers[i].error) {
+            fprintf(stderr, "thread %u: %s\n", i, strerror(workers[i].error));
+            error = 1;
+        }
+    }
+    wall = now_ns() - start;
+
+    if (ioctl(fd, IOCTL_KV_STATS, &after)) {
+        perror("IOCTL_KV_STATS");
+        return EXIT_FAILURE;
+    }
+    if (error)
+        return EXIT_FAILURE;
+
+    /* The 99th percentile of all ioctl() calls, of all threads */
+    for (b = 0; b < HIST_BUCKETS; b++)
+        for (i = 0; i < jobs; i++)
+            calls += workers[i].hist[b];
+    for (b = 0; b < HIST_BUCKETS && !p99; b++) {
+        for (i = 0; i < jobs; i++)
+            seen += workers[i].hist[b];
+        if (seen * 100 >= calls * 99)
+            p99 = bucket_ns(b);
+    }
+
+    printf("%s, workload %c, %llu records of %zu bytes, zipfian %.2f, "
+           "%u thread(s), %us",
+           device, workload, (unsigned long long)records, value_size, theta,
+           jobs, seconds);
+    if (batch > 1)
+        printf(", multi-get of %u", batch);
+    printf("\n");
+    printf("%12s %10s %10s %10s %10s %10s %10s\n", "ops/s", "reads", "updates",
+           "avg_us", "p99_us", "hit_ratio", "evictions");
+    printf("%12.0f %10llu %10llu %10.2f %10.2f %9.1f%% %10llu\n",
+           ops * 1e9 / wall, (unsigned long long)reads,
+           (unsigned long long)updates, calls ? ns / 1e3 / calls : 0.0,
+           p99 / 1e3,
+           100.0 * (after.hits - before.hits) /
+               ((after.hits - before.hits) + (after.misses - before.misses) ?: 1),
+           (unsigned long long)(after.evictions - before.evictions));
+    printf("cache: %llu items, %llu of %llu KiB\n",
+           (unsigned long long)after.items, (unsigned long long)after.bytes >> 10,
+           (unsigned long long)after.capacity >> 10);
+
+    free(workers);
+    close(fd);
+
+    return 0;
+}
@@ -0,0 +1,297 @@
+/*
+ * uring_bench.c - read/write vs io_uring on a character device
+ *
+ * Runs the same reads (or writes) of a fixed size against a device file,
+ * first with plain pread()/pwrite() and then through io_uring at queue
+ * depth 1 and 32. For every run it reports operations per second, MiB/s,
+ * and the CPU time per operation, taken from getrusage() so that it also
+ * covers io_uring worker threads.
+ *
+ * A driver with .read_iter/.write_iter that sets FMODE_NOWAIT lets io_uring
+ * complete requests inline, when they are submitted. A driver with only
+ * .read/.write has every request punted to a worker thread, which shows as
+ * a much higher CPU cost per operation.
+ *
+ * io_uring is driven with raw system calls, no liburing needed:
+ *
+ *   sudo mknod /dev/ioctltest c <major> 0    (see dmesg after insmod)
+ *   sudo ./uring_bench -f /dev/ioctltest -o read -b 4096 -t 3
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+struct uring {
+    int fd;
+    unsigned int sq_entries;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+static int uring_setup(struct uring *ring, unsigned int entries)
+{
+    struct io_uring_params p;
+    void *sq, *cq;
+    size_t sq_len, cq_len;
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return -1;
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP && cq_len > sq_len)
+        sq_len = cq_len;
+
+    sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        return -1;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            return -1;
+    }
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        return -1;
+
+    ring->sq_entries = p.sq_entries;
+    ring->sq_head = (unsigned int *)((char *)sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)((char *)sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *)((char *)sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)((char *)sq + p.sq_off.array);
+    ring->cq_head = (unsigned int *)((char *)cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)((char *)cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *)((char *)cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+
+    return 0;
+}
+
+/* Queues one read or write of buf, tagged with its index */
+static void uring_queue(struct uring *ring, int fd, int write, void *buf,
+                        unsigned int len, unsigned int idx)
+{
+    unsigned int tail = *ring->sq_tail, slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->off = 0;
+    sqe->user_data = idx;
+    ring->sq_array[slot] = slot;
+
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static void report(const char *mode, unsigned long ops, unsigned int bs,
+                   uint64_t wall, uint64_t cpu)
+{
+    printf("%-10s %12.0f %10.1f %12.2f\n", mode, ops * 1e9 / wall,
+           (double)ops * bs * 1e9 / wall / (1 << 20), (double)cpu / ops / 1e3);
+}
+
+/* Plain pread()/pwrite() for duration_ns */
+static int run_sync(int fd, int write, unsigned int bs, uint64_t duration_ns)
+{
+    char *buf = malloc(bs);
+    uint64_t start = now_ns(), cpu = cpu_ns(), end = start + duration_ns;
+    unsigned long ops = 0;
+    ssize_t ret;
+
+    if (!buf)
+        return -1;
+    memset(buf, 'x', bs);
+
+    do {
+        ret = write ? pwrite(fd, buf, bs, 0) : pread(fd, buf, bs, 0);
+        if (ret < 0) {
+            perror(write ? "pwrite" : "pread");
+            free(buf);
+            return -1;
+        }
+        ops++;
+    } while ((ops & 255) || now_ns() < end);
+
+    report("sync", ops, bs, now_ns() - start, cpu_ns() - cpu);
+    free(buf);
+
+    return 0;
+}
+
+/* io_uring with qd requests in flight at all times for duration_ns */
+static int run_uring(int fd, int write, unsigned int bs, unsigned int qd,
+                     uint64_t duration_ns)
+{
+    struct uring ring;
+    char *bufs, mode[16];
+    uint64_t start, cpu, end;
+    unsigned long ops = 0;
+    unsigned int i, inflight, to_submit;
+    int done = 0;
+
+    if (uring_setup(&ring, qd)) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    bufs = malloc((size_t)bs * qd);
+    if (!bufs)
+        return -1;
+    memset(bufs, 'x', (size_t)bs * qd);
+
+    start = now_ns();
+    cpu = cpu_ns();
+    end = start + duration_ns;
+
+    for (i = 0; i < qd; i++)
+        uring_queue(&ring, fd, write, bufs + (size_t)i * bs, bs, i);
+    to_submit = qd;
+    inflight = qd;
+
+    while (inflight) {
+        unsigned int head, tail;
+
+        if (syscall(__NR_io_uring_enter, ring.fd, to_submit, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("io_uring_enter");
+            return -1;
+        }
+        to_submit = 0;
+
+        head = *ring.cq_head;
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+
+            if (cqe->res < 0) {
+                fprintf(stderr, "%s: %s\n", write ? "write" : "read",
+                        strerror(-cqe->res));
+                return -1;
+            }
+            ops++;
+            inflight--;
+            if (!done) {
+                /* Reuse the buffer of the completed request */
+                i = cqe->user_data;
+                uring_queue(&ring, fd, write, bufs + (size_t)i * bs, bs, i);
+                to_submit++;
+                inflight++;
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        if (!done && now_ns() >= end)
+            done = 1;
+    }
+
+    snprintf(mode, sizeof(mode), "uring-qd%u", qd);
+    report(mode, ops, bs, now_ns() - start, cpu_ns() - cpu);
+    free(bufs);
+    close(ring.fd);
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-f device] [-o read|write] [-b block_size] "
+            "[-t seconds]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = "/dev/ioctltest";
+    unsigned int bs = 4096, seconds = 3;
+    int write = 0, fd, opt;
+    uint64_t duration;
+
+    while ((opt = getopt(argc, argv, "f:o:b:t:")) != -1) {
+        switch (opt) {
+        case 'f':
+            path = optarg;
+            break;
+        case 'o':
+            if (!strcmp(optarg, "read"))
+                write = 0;
+            else if (!strcmp(optarg, "write"))
+                write = 1;
+            else
+                usage(argv[0]);
+            break;
+        case 'b':
+            bs = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!bs || !seconds)
+        usage(argv[0]);
+
+    fd = open(path, write ? O_WRONLY : O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    duration = seconds * 1000000000ULL;
+
+    printf("%s, %s of %u bytes, %us per mode\n", path, write ? "write" : "read",
+           bs, seconds);
+    printf("%-10s %12s %10s %12s\n", "mode", "ops/s", "MiB/s", "cpu_us/op");
+
+    if (run_sync(fd, write, bs, duration) ||
+        run_uring(fd, write, bs, 1, duration) ||
+        run_uring(fd, write, bs, 32, duration))
+        return EXIT_FAILURE;
+
+    close(fd);
+
+    return 0;
+}
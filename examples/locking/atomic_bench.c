@@ -0,0 +1,411 @@
+/*
+ * atomic_bench.c - cost of atomic operations between every pair of CPUs
+ *
+ * example_atomic.c only shows the atomic API on local variables, where every
+ * operation is cheap. What an atomic operation really costs depends on who
+ * else touches the same cache line. For every pair of online CPUs (a, b) two
+ * kthreads, one bound to each CPU, perform the selected operation
+ * `iterations` times while sharing data in one of three ways:
+ *
+ *   true  - both CPUs update the very same variable
+ *   false - each CPU updates its own variable, both sit on one cache line
+ *   none  - each CPU updates a variable on its own cache line
+ *
+ * Operations:
+ *
+ *   add, add64, cmpxchg, xchg, bitops - atomic_t/atomic64_t/bit operations
+ *   this_cpu, percpu_counter          - per-CPU counters, mode must be none
+ *   pingpong                          - the two CPUs hand a flag back and
+ *                                       forth, mode must be true. This gives
+ *                                       the one-way core-to-core latency.
+ *
+ * Entry [a][b] of the resulting matrix is the average cost of one operation
+ * in nanoseconds. The diagonal is the same operation on a single CPU with
+ * nobody else around.
+ *
+ * Usage:
+ *   echo "cmpxchg false" > /sys/kernel/debug/atomic_bench/run
+ *   cat /sys/kernel/debug/atomic_bench/matrix
+ */
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/init.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/printk.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+
+#include "lock_bench.h"
+
+#define RESCHED_EVERY 1024
+#define NAME_LEN 16
+
+static unsigned int iterations = 100000;
+module_param(iterations, uint, 0644);
+MODULE_PARM_DESC(iterations, "Operations done by each CPU of a pair");
+
+enum {
+    OP_ADD,
+    OP_ADD64,
+    OP_CMPXCHG,
+    OP_XCHG,
+    OP_BITOPS,
+    OP_THIS_CPU,
+    OP_PERCPU_COUNTER,
+    OP_PINGPONG,
+    NR_OPS,
+};
+
+static const char *const op_names[NR_OPS] = {
+    [OP_ADD] = "add",
+    [OP_ADD64] = "add64",
+    [OP_CMPXCHG] = "cmpxchg",
+    [OP_XCHG] = "xchg",
+    [OP_BITOPS] = "bitops",
+    [OP_THIS_CPU] = "this_cpu",
+    [OP_PERCPU_COUNTER] = "percpu_counter",
+    [OP_PINGPONG] = "pingpong",
+};
+
+enum {
+    SHARING_TRUE,
+    SHARING_FALSE,
+    SHARING_NONE,
+    NR_SHARING,
+};
+
+static const char *const sharing_names[NR_SHARING] = {
+    [SHARING_TRUE] = "true",
+    [SHARING_FALSE] = "false",
+    [SHARING_NONE] = "none",
+};
+
+union bench_slot {
+    atomic_t a;
+    atomic64_t a64;
+    unsigned long bits;
+};
+
+/* Two adjacent slots on one cache line give false sharing, slot 0 of two
+ * different lines gives no sharing at all.
+ */
+struct bench_line {
+    union bench_slot slot[2];
+} ____cacheline_aligned_in_smp;
+
+static struct bench_line lines[2];
+
+static DEFINE_PER_CPU(u64, this_cpu_counter);
+static struct percpu_counter bench_percpu_counter;
+
+struct bench_config {
+    unsigned int op;
+    unsigned int sharing;
+};
+
+static DEFINE_MUTEX(bench_mutex);
+/* Hundredths of a nanosecond per operation, nr_cpus x nr_cpus entries */
+static u64 *matrix;
+static unsigned int *matrix_cpus;
+static unsigned int matrix_nr_cpus;
+static unsigned int matrix_op;
+static unsigned int matrix_sharing;
+
+static struct dentry *bench_dir;
+
+#define BENCH_LOOP(n, stmt)                                                    \
+    do {                                                                       \
+        u64 __i;                                                               \
+        for (__i = 1; __i <= (n); __i++) {                                     \
+            stmt;                                                              \
+            if (!(__i % RESCHED_EVERY))                                        \
+                cond_resched();                                                \
+        }                                                                      \
+    } while (0)
+
+static union bench_slot *bench_slot(unsigned int sharing, unsigned int id)
+{
+    switch (sharing) {
+    case SHARING_TRUE:
+        return &lines[0].slot[0];
+    case SHARING_FALSE:
+        return &lines[0].slot[id];
+    default:
+        return &lines[id].slot[0];
+    }
+}
+
+static void pingpong(struct lock_bench_worker *w, union bench_slot *s)
+{
+    unsigned int me = w->id, other = !w->id;
+    u64 i;
+
+    /* Nobody to play with on the diagonal */
+    if (w->bench->nr_workers < 2)
+        return;
+
+    for (i = 0; i < iterations; i++) {
+        while (atomic_read(&s->a) != me)
+            cpu_relax();
+        atomic_set(&s->a, other);
+    }
+}
+
+static void bench_work(struct lock_bench_worker *w)
+{
+    const struct bench_config *cfg = w->bench->priv;
+    union bench_slot *s = bench_slot(cfg->sharing, w->id);
+    unsigned int bit = w->id;
+    int old;
+
+    switch (cfg->op) {
+    case OP_ADD:
+        BENCH_LOOP(iterations, atomic_add(1, &s->a));
+        break;
+    case OP_ADD64:
+        BENCH_LOOP(iterations, atomic64_add(1, &s->a64));
+        break;
+    case OP_CMPXCHG:
+        BENCH_LOOP(iterations, {
+            old = atomic_read(&s->a);
+            while (!atomic_try_cmpxchg(&s->a, &old, old + 1))
+                ;
+        });
+        break;
+    case OP_XCHG:
+        BENCH_LOOP(iterations, atomic_xchg(&s->a, bit));
+        break;
+    case OP_BITOPS:
+        BENCH_LOOP(iterations, change_bit(bit, &s->bits));
+        break;
+    case OP_THIS_CPU:
+        BENCH_LOOP(iterations, this_cpu_add(this_cpu_counter, 1));
+        break;
+    case OP_PERCPU_COUNTER:
+        BENCH_LOOP(iterations, percpu_counter_add(&bench_percpu_counter, 1));
+        break;
+    case OP_PINGPONG:
+        pingpong(w, s);
+        break;
+    }
+
+    w->ops = iterations;
+}
+
+/* Average cost of one operation on the two CPUs, in 1/100 ns */
+static int bench_pair(const struct bench_config *cfg, unsigned int a,
+                      unsigned int b, u64 *cost)
+{
+    unsigned int cpus[2] = { a, b };
+    struct lock_bench bench = {
+        .name = "atomic_bench",
+        .work = bench_work,
+        .priv = (void *)cfg,
+        .nr_workers = a == b ? 1 : 2,
+        .cpus = cpus,
+    };
+    u64 ns = 0, ops;
+    unsigned int i;
+    int err;
+
+    memset(lines, 0, sizeof(lines));
+
+    err = lock_bench_run(&bench);
+    if (err)
+        return err;
+
+    for (i = 0; i < bench.nr_workers; i++)
+        ns += bench.workers[i].ns;
+
+    /* Every pingpong round trip moves the line from one CPU to the other
+     * and back, report the one-way latency.
+     */
+    ops = lock_bench_total_ops(&bench);
+    if (cfg->op == OP_PINGPONG)
+        ops *= 2;
+
+    *cost = (cfg->op == OP_PINGPONG && a == b) ?
+                0 :
+                div64_u64(ns * 100, max_t(u64, ops, 1));
+
+    lock_bench_release(&bench);
+
+    return 0;
+}
+
+static int bench_run_matrix(unsigned int op, unsigned int sharing)
+{
+    struct bench_config cfg = {
+        .op = op,
+        .sharing = sharing,
+    };
+    unsigned int max_cpus = num_online_cpus();
+    unsigned int n = 0, a, b;
+    int cpu, err = 0;
+
+    kfree(matrix);
+    kfree(matrix_cpus);
+    matrix = NULL;
+    matrix_nr_cpus = 0;
+
+    matrix_cpus = kcalloc(max_cpus, sizeof(*matrix_cpus), GFP_KERNEL);
+    if (!matrix_cpus)
+        return -ENOMEM;
+
+    for_each_online_cpu (cpu) {
+        if (n == max_cpus)
+            break;
+        matrix_cpus[n++] = cpu;
+    }
+
+    matrix = kcalloc(n * n, sizeof(*matrix), GFP_KERNEL);
+    if (!matrix)
+        return -ENOMEM;
+
+    for (a = 0; a < n; a++) {
+        for (b = 0; b < n; b++) {
+            err = bench_pair(&cfg, matrix_cpus[a], matrix_cpus[b],
+                             &matrix[a * n + b]);
+            if (err)
+                return err;
+        }
+    }
+
+    matrix_nr_cpus = n;
+    matrix_op = op;
+    matrix_sharing = sharing;
+
+    pr_info("atomic_bench: %s/%s matrix for %u CPUs done\n", op_names[op],
+            sharing_names[sharing], n);
+
+    return 0;
+}
+
+static int matrix_show(struct seq_file *m, void *v)
+{
+    unsigned int a, b, n;
+
+    mutex_lock(&bench_mutex);
+
+    n = matrix_nr_cpus;
+    if (!n)
+        goto out;
+
+    seq_printf(m, "op %s sharing %s iterations %u (ns/op)\n",
+               op_names[matrix_op], sharing_names[matrix_sharing],
+               iterations);
+
+    seq_printf(m, "%5s", "cpu");
+    for (b = 0; b < n; b++)
+        seq_printf(m, " %8u", matrix_cpus[b]);
+    seq_putc(m, '\n');
+
+    for (a = 0; a < n; a++) {
+        seq_printf(m, "%5u", matrix_cpus[a]);
+        for (b = 0; b < n; b++) {
+            u64 cost = matrix[a * n + b];
+
+            seq_printf(m, " %5llu.%02llu", cost / 100, cost % 100);
+        }
+        seq_putc(m, '\n');
+    }
+
+out:
+    mutex_unlock(&bench_mutex);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(matrix);
+
+static int lookup_name(const char *const *names, unsigned int nr,
+                       const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr; i++)
+        if (strcmp(names[i], name) == 0)
+            return i;
+
+    return -EINVAL;
+}
+
+/* Accepts "<op> <sharing>", e.g. "xchg true" */
+static ssize_t run_write(struct file *file, const char __user *buf,
+                         size_t count, loff_t *ppos)
+{
+    char kbuf[2 * NAME_LEN + 2] = { 0 };
+    char op_name[NAME_LEN], sharing_name[NAME_LEN];
+    int op, sharing, err;
+
+    if (count >= sizeof(kbuf))
+        return -EINVAL;
+    if (copy_from_user(kbuf, buf, count))
+        return -EFAULT;
+    if (sscanf(kbuf, "%15s %15s", op_name, sharing_name) != 2)
+        return -EINVAL;
+
+    op = lookup_name(op_names, NR_OPS, op_name);
+    sharing = lookup_name(sharing_names, NR_SHARING, sharing_name);
+    if (op < 0 || sharing < 0)
+        return -EINVAL;
+
+    /* Per-CPU counters are never shared and pingpong always is */
+    if ((op == OP_THIS_CPU || op == OP_PERCPU_COUNTER) &&
+        sharing != SHARING_NONE)
+        return -EINVAL;
+    if (op == OP_PINGPONG && sharing != SHARING_TRUE)
+        return -EINVAL;
+
+    mutex_lock(&bench_mutex);
+    err = bench_run_matrix(op, sharing);
+    mutex_unlock(&bench_mutex);
+
+    return err ? err : count;
+}
+
+static const struct file_operations run_fops = {
+    .owner = THIS_MODULE,
+    .write = run_write,
+};
+
+static int __init atomic_bench_init(void)
+{
+    int err;
+
+    err = percpu_counter_init(&bench_percpu_counter, 0, GFP_KERNEL);
+    if (err)
+        return err;
+
+    bench_dir = debugfs_create_dir("atomic_bench", NULL);
+    debugfs_create_file("run", 0200, bench_dir, NULL, &run_fops);
+    debugfs_create_file("matrix", 0444, bench_dir, NULL, &matrix_fops);
+
+    pr_info("atomic_bench loaded, write \"<op> <sharing>\" to "
+            "/sys/kernel/debug/atomic_bench/run to start\n");
+
+    return 0;
+}
+
+static void __exit atomic_bench_exit(void)
+{
+    debugfs_remove_recursive(bench_dir);
+    percpu_counter_destroy(&bench_percpu_counter);
+    kfree(matrix);
+    kfree(matrix_cpus);
+
+    pr_info("atomic_bench exit\n");
+}
+
+module_init(atomic_bench_init);
+module_exit(atomic_bench_exit);
+
+MODULE_DESCRIPTION("Core-to-core cost matrix of atomic operations");
+MODULE_LICENSE("GPL");
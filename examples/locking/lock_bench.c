@@ -0,0 +1,161 @@
+/*
+ * lock_bench.c - kthread harness shared by the locking benchmark modules.
+ */
+
+#include <linux/cpumask.h>
+#include <linux/delay.h>
+#include <linux/err.h> /* for IS_ERR() */
+#include <linux/kthread.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+#include <linux/timex.h> /* for get_cycles() */
+
+#include "lock_bench.h"
+
+static int lock_bench_thread(void *arg)
+{
+    struct lock_bench_worker *w = arg;
+    struct lock_bench *bench = w->bench;
+    cycles_t c0;
+    u64 t0;
+
+    atomic_inc(&bench->ready);
+
+    /* Spin rather than sleep so that every worker starts at the same time */
+    while (!READ_ONCE(bench->go))
+        cond_resched();
+
+    if (!READ_ONCE(bench->stop)) {
+        t0 = ktime_get_ns();
+        c0 = get_cycles();
+
+        bench->work(w);
+
+        w->cycles = get_cycles() - c0;
+        w->ns = ktime_get_ns() - t0;
+    }
+
+    if (atomic_dec_and_test(&bench->running))
+        complete(&bench->done);
+
+    /* Stay around until lock_bench_run() collects us with kthread_stop() */
+    set_current_state(TASK_INTERRUPTIBLE);
+    while (!kthread_should_stop()) {
+        schedule();
+        set_current_state(TASK_INTERRUPTIBLE);
+    }
+    __set_current_state(TASK_RUNNING);
+
+    return 0;
+}
+
+static void lock_bench_stop_workers(struct lock_bench *bench, unsigned int nr)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr; i++)
+        kthread_stop(bench->workers[i].task);
+}
+
+/*
+ * Run a benchmark to completion. The caller reads the per-worker results
+ * from bench->workers and frees them with lock_bench_release().
+ */
+int lock_bench_run(struct lock_bench *bench)
+{
+    unsigned int i, cpu;
+    u64 t0;
+    int err;
+
+    if (bench->nr_workers == 0 || !bench->work)
+        return -EINVAL;
+
+    bench->workers = kcalloc(bench->nr_workers, sizeof(*bench->workers),
+                             GFP_KERNEL);
+    if (!bench->workers)
+        return -ENOMEM;
+
+    atomic_set(&bench->ready, 0);
+    atomic_set(&bench->running, bench->nr_workers);
+    WRITE_ONCE(bench->go, false);
+    WRITE_ONCE(bench->stop, false);
+    init_completion(&bench->done);
+
+    cpu = cpumask_first(cpu_online_mask);
+    for (i = 0; i < bench->nr_workers; i++) {
+        struct lock_bench_worker *w = &bench->workers[i];
+
+        w->bench = bench;
+        w->id = i;
+        w->cpu = bench->cpus ? bench->cpus[i] : cpu;
+
+        cpu = cpumask_next(cpu, cpu_online_mask);
+        if (cpu >= nr_cpu_ids)
+            cpu = cpumask_first(cpu_online_mask);
+
+        w->task = kthread_create(lock_bench_thread, w, "%s/%u", bench->name,
+                                 i);
+        if (IS_ERR(w->task)) {
+            err = PTR_ERR(w->task);
+            goto fail;
+        }
+
+        kthread_bind(w->task, w->cpu);
+        wake_up_process(w->task);
+    }
+
+    while (atomic_read(&bench->ready) < bench->nr_workers)
+        msleep(1);
+
+    t0 = ktime_get_ns();
+    WRITE_ONCE(bench->go, true);
+
+    if (bench->duration_ms) {
+        msleep(bench->duration_ms);
+        WRITE_ONCE(bench->stop, true);
+    }
+
+    wait_for_completion(&bench->done);
+    bench->elapsed_ns = ktime_get_ns() - t0;
+
+    lock_bench_stop_workers(bench, bench->nr_workers);
+
+    return 0;
+
+fail:
+    /* Release the workers we already have without running the work */
+    WRITE_ONCE(bench->stop, true);
+    WRITE_ONCE(bench->go, true);
+    lock_bench_stop_workers(bench, i);
+    lock_bench_release(bench);
+
+    return err;
+}
+
+void lock_bench_release(struct lock_bench *bench)
+{
+    kfree(bench->workers);
+    bench->workers = NULL;
+}
+
+u64 lock_bench_total_ops(const struct lock_bench *bench)
+{
+    unsigned int i;
+    u64 ops = 0;
+
+    for (i = 0; i < bench->nr_workers; i++)
+        ops += bench->workers[i].ops;
+
+    return ops;
+}
+
+u64 lock_bench_total_cycles(const struct lock_bench *bench)
+{
+    unsigned int i;
+    u64 cycles = 0;
+
+    for (i = 0; i < bench->nr_workers; i++)
+        cycles += bench->workers[i].cycles;
+
+    return cycles;
+}
@@ -0,0 +1,86 @@
+/*
+ * lock_bench.h - tiny harness shared by the locking benchmark modules.
+ *
+ * A benchmark describes a work function and how many workers should run it.
+ * lock_bench_run() spawns one kthread per worker, binds each one to a CPU,
+ * releases them all at the same moment and, when duration_ms is set, tells
+ * them to stop once the time is up. Every worker reports how many operations
+ * it completed together with the nanoseconds and cycles it spent doing so.
+ */
+
+#ifndef LOCK_BENCH_H
+#define LOCK_BENCH_H
+
+#include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/compiler.h>
+#include <linux/completion.h>
+#include <linux/kernel.h> /* for min() */
+#include <linux/sched.h>
+#include <linux/types.h>
+
+struct lock_bench;
+
+struct lock_bench_worker {
+    struct lock_bench *bench;
+    struct task_struct *task;
+    unsigned int id;
+    unsigned int cpu;
+
+    /* Filled in by the work function */
+    u64 ops;
+
+    /* Filled in by the harness */
+    u64 ns;
+    u64 cycles;
+} ____cacheline_aligned_in_smp;
+
+struct lock_bench {
+    const char *name;
+    /* Runs on every worker. Loops until lock_bench_should_stop() when
+     * duration_ms is set, or until it decides by itself that it is done.
+     */
+    void (*work)(struct lock_bench_worker *w);
+    void *priv;
+    unsigned int nr_workers;
+    /* Optional CPU for each worker. NULL spreads workers over online CPUs. */
+    const unsigned int *cpus;
+    unsigned int duration_ms;
+
+    /* Results */
+    struct lock_bench_worker *workers;
+    u64 elapsed_ns;
+
+    /* Internal state */
+    atomic_t ready;
+    atomic_t running;
+    bool go;
+    bool stop;
+    struct completion done;
+};
+
+int lock_bench_run(struct lock_bench *bench);
+void lock_bench_release(struct lock_bench *bench);
+
+u64 lock_bench_total_ops(const struct lock_bench *bench);
+u64 lock_bench_total_cycles(const struct lock_bench *bench);
+
+static inline bool lock_bench_should_stop(const struct lock_bench_worker *w)
+{
+    return READ_ONCE(w->bench->stop);
+}
+
+/* Worker counts used when scaling a benchmark: 1, 2, 4, ... and finally
+ * every online CPU. Returns 0 once the sequence is exhausted.
+ */
+static inline unsigned int lock_bench_next_nr(unsigned int nr,
+                                              unsigned int max)
+{
+    if (nr >= max)
+        return 0;
+    if (nr == 0)
+        return 1;
+    return min(nr * 2, max);
+}
+
+#endif
@@ -0,0 +1,368 @@
+/*
+ * mutex_bench.c - mutex hold-time benchmark built from example_mutex.c
+ *
+ * Contending kthreads take a lock, hold it for hold_ns nanoseconds, drop it
+ * and wait think_ns nanoseconds before trying again. Three locks are
+ * compared:
+ *
+ *   mutex     - struct mutex, which spins while the owner is running
+ *               (optimistic spinning) and only then goes to sleep
+ *   semaphore - struct semaphore, whose waiters always sleep
+ *   spinlock  - spinlock_t, whose waiters never sleep
+ *
+ * For every lock, hold time and number of threads we record throughput,
+ * fairness (most and least operations done by a single thread) and the
+ * distribution of the time spent waiting for the lock.
+ *
+ * Usage:
+ *   echo 1 > /sys/kernel/debug/mutex_bench/run
+ *   cat /sys/kernel/debug/mutex_bench/results
+ *   cat /sys/kernel/debug/mutex_bench/wait_hist
+ */
+#include <linux/debugfs.h>
+#include <linux/init.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/printk.h>
+#include <linux/semaphore.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/timekeeping.h>
+
+#include "lock_bench.h"
+
+#define RESCHED_EVERY 64
+#define MAX_HOLD_TIMES 8
+/* Bucket b counts waits in [2^b, 2^(b+1)) ns, the last one everything above */
+#define NR_WAIT_BUCKETS 32
+
+static unsigned int duration_ms = 200;
+module_param(duration_ms, uint, 0644);
+MODULE_PARM_DESC(duration_ms, "Run time of every configuration");
+
+static unsigned int think_ns = 100;
+module_param(think_ns, uint, 0644);
+MODULE_PARM_DESC(think_ns, "Time a thread spends outside the lock");
+
+static unsigned int hold_ns[MAX_HOLD_TIMES] = { 100, 1000, 10000, 100000,
+                                                1000000 };
+static int nr_hold_ns = 5;
+module_param_array(hold_ns, uint, &nr_hold_ns, 0644);
+MODULE_PARM_DESC(hold_ns, "Hold times to test in nanoseconds");
+
+enum {
+    LOCK_MUTEX,
+    LOCK_SEMAPHORE,
+    LOCK_SPINLOCK,
+    NR_LOCKS,
+};
+
+static const char *const lock_names[NR_LOCKS] = {
+    [LOCK_MUTEX] = "mutex",
+    [LOCK_SEMAPHORE] = "semaphore",
+    [LOCK_SPINLOCK] = "spinlock",
+};
+
+static DEFINE_MUTEX(contended_mutex);
+static struct semaphore contended_sem;
+static DEFINE_SPINLOCK(contended_spinlock);
+
+struct bench_config {
+    unsigned int lock;
+    unsigned int hold_ns;
+    /* One histogram per worker, so workers never share a cache line */
+    u64 (*wait_hist)[NR_WAIT_BUCKETS];
+};
+
+struct bench_result {
+    unsigned int lock;
+    unsigned int hold_ns;
+    unsigned int nr_threads;
+    u64 ops;
+    u64 elapsed_ns;
+    u64 min_thread_ops;
+    u64 max_thread_ops;
+    u64 wait_hist[NR_WAIT_BUCKETS];
+};
+
+static DEFINE_MUTEX(bench_mutex);
+static struct bench_result *results;
+static unsigned int nr_results;
+
+static struct dentry *bench_dir;
+
+/* Keep the CPU busy for ns nanoseconds, like real work would */
+static void busy_wait_ns(u64 ns)
+{
+    u64 end = ktime_get_ns() + ns;
+
+    while (ktime_get_ns() < end)
+        cpu_relax();
+}
+
+static void bench_lock(unsigned int lock)
+{
+    switch (lock) {
+    case LOCK_MUTEX:
+        mutex_lock(&contended_mutex);
+        break;
+    case LOCK_SEMAPHORE:
+        down(&contended_sem);
+        break;
+    case LOCK_SPINLOCK:
+        spin_lock(&contended_spinlock);
+        break;
+    }
+}
+
+static void bench_unlock(unsigned int lock)
+{
+    switch (lock) {
+    case LOCK_MUTEX:
+        mutex_unlock(&contended_mutex);
+        break;
+    case LOCK_SEMAPHORE:
+        up(&contended_sem);
+        break;
+    case LOCK_SPINLOCK:
+        spin_unlock(&contended_spinlock);
+        break;
+    }
+}
+
+static unsigned int wait_bucket(u64 ns)
+{
+    if (ns == 0)
+        return 0;
+
+    return min_t(unsigned int, ilog2(ns), NR_WAIT_BUCKETS - 1);
+}
+
+static void bench_work(struct lock_bench_worker *w)
+{
+    struct bench_config *cfg = w->bench->priv;
+    u64 *hist = cfg->wait_hist[w->id];
+    u64 t0, t1, ops = 0;
+
+    while (!lock_bench_should_stop(w)) {
+        t0 = ktime_get_ns();
+        bench_lock(cfg->lock);
+        t1 = ktime_get_ns();
+
+        busy_wait_ns(cfg->hold_ns);
+        bench_unlock(cfg->lock);
+
+        hist[wait_bucket(t1 - t0)]++;
+        ops++;
+
+        busy_wait_ns(think_ns);
+
+        if (!(ops % RESCHED_EVERY))
+            cond_resched();
+    }
+
+    w->ops = ops;
+}
+
+static int bench_run_one(unsigned int lock, unsigned int hold,
+                         unsigned int nr, struct bench_result *res)
+{
+    struct bench_config cfg = {
+        .lock = lock,
+        .hold_ns = hold,
+    };
+    struct lock_bench bench = {
+        .name = "mutex_bench",
+        .work = bench_work,
+        .priv = &cfg,
+        .nr_workers = nr,
+        .duration_ms = duration_ms,
+    };
+    unsigned int i, b;
+    int err;
+
+    cfg.wait_hist = kcalloc(nr, sizeof(*cfg.wait_hist), GFP_KERNEL);
+    if (!cfg.wait_hist)
+        return -ENOMEM;
+
+    err = lock_bench_run(&bench);
+    if (err)
+        goto out;
+
+    res->lock = lock;
+    res->hold_ns = hold;
+    res->nr_threads = nr;
+    res->elapsed_ns = bench.elapsed_ns;
+    res->ops = lock_bench_total_ops(&bench);
+    res->min_thread_ops = U64_MAX;
+    res->max_thread_ops = 0;
+
+    for (i = 0; i < nr; i++) {
+        u64 ops = bench.workers[i].ops;
+
+        res->min_thread_ops = min(res->min_thread_ops, ops);
+        res->max_thread_ops = max(res->max_thread_ops, ops);
+
+        for (b = 0; b < NR_WAIT_BUCKETS; b++)
+            res->wait_hist[b] += cfg.wait_hist[i][b];
+    }
+
+    lock_bench_release(&bench);
+
+out:
+    kfree(cfg.wait_hist);
+    return err;
+}
+
+static int bench_run_all(void)
+{
+    unsigned int cpus = num_online_cpus();
+    unsigned int max_results, lock, nr;
+    int hold, err;
+
+    kfree(results);
+    nr_results = 0;
+    max_results = NR_LOCKS * nr_hold_ns * (ilog2(cpus) + 2);
+    results = kcalloc(max_results, sizeof(*results), GFP_KERNEL);
+    if (!results)
+        return -ENOMEM;
+
+    for (lock = 0; lock < NR_LOCKS; lock++) {
+        for (hold = 0; hold < nr_hold_ns; hold++) {
+            for (nr = lock_bench_next_nr(0, cpus); nr;
+                 nr = lock_bench_next_nr(nr, cpus)) {
+                err = bench_run_one(lock, hold_ns[hold], nr,
+                                    &results[nr_results]);
+                if (err)
+                    return err;
+                nr_results++;
+            }
+        }
+    }
+
+    pr_info("mutex_bench: %u configurations done\n", nr_results);
+
+    return 0;
+}
+
+/* Upper bound of the bucket holding the given percentile */
+static u64 wait_percentile(const struct bench_result *res, unsigned int pct)
+{
+    u64 target = div64_u64(res->ops * pct + 99, 100);
+    u64 seen = 0;
+    unsigned int b;
+
+    for (b = 0; b < NR_WAIT_BUCKETS; b++) {
+        seen += res->wait_hist[b];
+        if (seen >= target && seen)
+            return 2ULL << b;
+    }
+
+    return 0;
+}
+
+static int results_show(struct seq_file *m, void *v)
+{
+    unsigned int i;
+
+    mutex_lock(&bench_mutex);
+
+    seq_printf(m, "think_ns %u\n", think_ns);
+    seq_printf(m, "%-9s %8s %7s %12s %10s %10s %9s %10s %10s\n", "lock",
+               "hold_ns", "threads", "ops/sec", "max_ops", "min_ops",
+               "max/min", "p50_wait", "p99_wait");
+
+    for (i = 0; i < nr_results; i++) {
+        const struct bench_result *res = &results[i];
+        /* Fixed point with two decimals, min_ops can legitimately be 0 */
+        u64 ratio = div64_u64(res->max_thread_ops * 100,
+                              max_t(u64, res->min_thread_ops, 1));
+
+        seq_printf(m,
+                   "%-9s %8u %7u %12llu %10llu %10llu %6llu.%02llu %10llu "
+                   "%10llu\n",
+                   lock_names[res->lock], res->hold_ns, res->nr_threads,
+                   div64_u64(res->ops * NSEC_PER_SEC, res->elapsed_ns),
+                   res->max_thread_ops, res->min_thread_ops, ratio / 100,
+                   ratio % 100, wait_percentile(res, 50),
+                   wait_percentile(res, 99));
+    }
+
+    mutex_unlock(&bench_mutex);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(results);
+
+static int wait_hist_show(struct seq_file *m, void *v)
+{
+    unsigned int i, b;
+
+    mutex_lock(&bench_mutex);
+
+    for (i = 0; i < nr_results; i++) {
+        const struct bench_result *res = &results[i];
+
+        seq_printf(m, "%s hold_ns=%u threads=%u\n", lock_names[res->lock],
+                   res->hold_ns, res->nr_threads);
+
+        for (b = 0; b < NR_WAIT_BUCKETS; b++)
+            if (res->wait_hist[b])
+                seq_printf(m, "  < %12llu ns: %llu\n", 2ULL << b,
+                           res->wait_hist[b]);
+    }
+
+    mutex_unlock(&bench_mutex);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wait_hist);
+
+static ssize_t run_write(struct file *file, const char __user *buf,
+                         size_t count, loff_t *ppos)
+{
+    int err;
+
+    mutex_lock(&bench_mutex);
+    err = bench_run_all();
+    mutex_unlock(&bench_mutex);
+
+    return err ? err : count;
+}
+
+static const struct file_operations run_fops = {
+    .owner = THIS_MODULE,
+    .write = run_write,
+};
+
+static int __init mutex_bench_init(void)
+{
+    sema_init(&contended_sem, 1);
+
+    bench_dir = debugfs_create_dir("mutex_bench", NULL);
+    debugfs_create_file("run", 0200, bench_dir, NULL, &run_fops);
+    debugfs_create_file("results", 0444, bench_dir, NULL, &results_fops);
+    debugfs_create_file("wait_hist", 0444, bench_dir, NULL, &wait_hist_fops);
+
+    pr_info("mutex_bench loaded, write to "
+            "/sys/kernel/debug/mutex_bench/run to start\n");
+
+    return 0;
+}
+
+static void __exit mutex_bench_exit(void)
+{
+    debugfs_remove_recursive(bench_dir);
+    kfree(results);
+
+    pr_info("mutex_bench exit\n");
+}
+
+module_init(mutex_bench_init);
+module_exit(mutex_bench_exit);
+
+MODULE_DESCRIPTION("Mutex, semaphore and spinlock hold-time benchmark");
+MODULE_LICENSE("GPL");
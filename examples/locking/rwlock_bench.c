@@ -0,0 +1,521 @@
+/*
+ * rwlock_bench.c - read-mostly benchmark built from example_rwlock.c
+ *
+ * Reader kthreads look up random keys in a hash table of table_size entries
+ * while one writer kthread updates an entry every writer_us microseconds.
+ * The same workload is run with the table protected by each of:
+ *
+ *   rwlock       - rwlock_t
+ *   rwsem        - struct rw_semaphore
+ *   seqlock      - seqlock_t, readers retry when a writer raced with them
+ *   percpu_rwsem - struct percpu_rw_semaphore
+ *   rcu          - lock-free readers, the writer publishes a new copy
+ *
+ * The number of readers goes from 1 up to all online CPUs. When every CPU
+ * runs a reader, the writer shares a CPU with the first one.
+ *
+ * Usage:
+ *   echo 1 > /sys/kernel/debug/rwlock_bench/run
+ *   cat /sys/kernel/debug/rwlock_bench/results
+ */
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/hash.h>
+#include <linux/init.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/mm.h> /* for kvcalloc() */
+#include <linux/mutex.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/printk.h>
+#include <linux/rculist.h>
+#include <linux/rwlock.h>
+#include <linux/rwsem.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/timekeeping.h>
+
+#include "lock_bench.h"
+
+#define RESCHED_EVERY 1024
+#define TABLE_SIZE_MIN 1024
+#define TABLE_SIZE_MAX (1024 * 1024)
+#define MAX_WRITER_PERIODS 8
+
+static unsigned int duration_ms = 200;
+module_param(duration_ms, uint, 0644);
+MODULE_PARM_DESC(duration_ms, "Run time of every configuration");
+
+static unsigned int table_size = 1024;
+module_param(table_size, uint, 0644);
+MODULE_PARM_DESC(table_size, "Number of entries in the table (1k-1M)");
+
+/* 0 runs the readers without any writer */
+static unsigned int writer_us[MAX_WRITER_PERIODS] = { 0, 10000, 1000, 100 };
+static int nr_writer_us = 4;
+module_param_array(writer_us, uint, &nr_writer_us, 0644);
+MODULE_PARM_DESC(writer_us, "Writer periods in microseconds, 0 for no writer");
+
+enum {
+    MECH_RWLOCK,
+    MECH_RWSEM,
+    MECH_SEQLOCK,
+    MECH_PERCPU_RWSEM,
+    MECH_RCU,
+    NR_MECHS,
+};
+
+static const char *const mech_names[NR_MECHS] = {
+    [MECH_RWLOCK] = "rwlock",
+    [MECH_RWSEM] = "rwsem",
+    [MECH_SEQLOCK] = "seqlock",
+    [MECH_PERCPU_RWSEM] = "percpu_rwsem",
+    [MECH_RCU] = "rcu",
+};
+
+struct cfg_entry {
+    u32 key;
+    u64 value;
+    struct hlist_node node;
+    struct rcu_head rcu;
+};
+
+static struct hlist_head *table;
+static unsigned int table_bits;
+static unsigned int table_entries;
+
+static DEFINE_RWLOCK(table_rwlock);
+static DECLARE_RWSEM(table_rwsem);
+static DEFINE_SEQLOCK(table_seqlock);
+static DEFINE_STATIC_PERCPU_RWSEM(table_percpu_rwsem);
+/* Serializes RCU updaters; readers never take it */
+static DEFINE_SPINLOCK(table_rcu_lock);
+
+struct bench_config {
+    unsigned int mech;
+    unsigned int writer_us;
+    unsigned int writer_id;
+
+    /* Writer results */
+    u64 updates;
+    u64 write_ns_total;
+    u64 write_ns_max;
+};
+
+struct bench_result {
+    unsigned int mech;
+    unsigned int nr_readers;
+    unsigned int writer_us;
+    u64 reads;
+    u64 elapsed_ns;
+    u64 updates;
+    u64 write_ns_total;
+    u64 write_ns_max;
+};
+
+static DEFINE_MUTEX(bench_mutex);
+static struct bench_result *results;
+static unsigned int nr_results;
+
+static struct dentry *bench_dir;
+
+/* Keeps the compiler from dropping lookups whose result is unused */
+static u64 lookup_sink;
+
+static struct cfg_entry *table_find(u32 key)
+{
+    struct cfg_entry *e;
+
+    hlist_for_each_entry (e, &table[hash_32(key, table_bits)], node)
+        if (e->key == key)
+            return e;
+
+    return NULL;
+}
+
+static struct cfg_entry *table_find_rcu(u32 key)
+{
+    struct cfg_entry *e;
+
+    hlist_for_each_entry_rcu (e, &table[hash_32(key, table_bits)], node)
+        if (e->key == key)
+            return e;
+
+    return NULL;
+}
+
+static void table_free(void)
+{
+    struct cfg_entry *e;
+    struct hlist_node *tmp;
+    unsigned int i;
+
+    if (!table)
+        return;
+
+    /* Wait for readers still walking the table. Entries already replaced
+     * need no waiting: kfree_rcu() frees them on its own, without calling
+     * back into this module.
+     */
+    synchronize_rcu();
+
+    for (i = 0; i < (1U << table_bits); i++)
+        hlist_for_each_entry_safe (e, tmp, &table[i], node)
+            kfree(e);
+
+    kvfree(table);
+    table = NULL;
+}
+
+static int table_build(unsigned int entries)
+{
+    unsigned int i;
+
+    table_bits = ilog2(roundup_pow_of_two(entries));
+    table = kvcalloc(1U << table_bits, sizeof(*table), GFP_KERNEL);
+    if (!table)
+        return -ENOMEM;
+
+    for (i = 0; i < entries; i++) {
+        struct cfg_entry *e = kmalloc(sizeof(*e), GFP_KERNEL);
+
+        if (!e) {
+            table_free();
+            return -ENOMEM;
+        }
+
+        e->key = i;
+        e->value = i;
+        hlist_add_head(&e->node, &table[hash_32(i, table_bits)]);
+
+        if (!(i % RESCHED_EVERY))
+            cond_resched();
+    }
+
+    table_entries = entries;
+
+    return 0;
+}
+
+static u64 table_lookup(unsigned int mech, u32 key)
+{
+    struct cfg_entry *e;
+    unsigned int seq;
+    u64 value = 0;
+
+    switch (mech) {
+    case MECH_RWLOCK:
+        read_lock(&table_rwlock);
+        e = table_find(key);
+        if (e)
+            value = e->value;
+        read_unlock(&table_rwlock);
+        break;
+
+    case MECH_RWSEM:
+        down_read(&table_rwsem);
+        e = table_find(key);
+        if (e)
+            value = e->value;
+        up_read(&table_rwsem);
+        break;
+
+    case MECH_SEQLOCK:
+        /* Writers only change values in place, so walking the chain while
+         * one is active is safe. The value is simply read again.
+         */
+        do {
+            seq = read_seqbegin(&table_seqlock);
+            e = table_find(key);
+            value = e ? READ_ONCE(e->value) : 0;
+        } while (read_seqretry(&table_seqlock, seq));
+        break;
+
+    case MECH_PERCPU_RWSEM:
+        percpu_down_read(&table_percpu_rwsem);
+        e = table_find(key);
+        if (e)
+            value = e->value;
+        percpu_up_read(&table_percpu_rwsem);
+        break;
+
+    case MECH_RCU:
+        rcu_read_lock();
+        e = table_find_rcu(key);
+        if (e)
+            value = READ_ONCE(e->value);
+        rcu_read_unlock();
+        break;
+    }
+
+    return value;
+}
+
+static void table_update(unsigned int mech, u32 key)
+{
+    struct cfg_entry *e, *old;
+
+    switch (mech) {
+    case MECH_RWLOCK:
+        write_lock(&table_rwlock);
+        e = table_find(key);
+        e->value++;
+        write_unlock(&table_rwlock);
+        break;
+
+    case MECH_RWSEM:
+        down_write(&table_rwsem);
+        e = table_find(key);
+        e->value++;
+        up_write(&table_rwsem);
+        break;
+
+    case MECH_SEQLOCK:
+        write_seqlock(&table_seqlock);
+        e = table_find(key);
+        WRITE_ONCE(e->value, e->value + 1);
+        write_sequnlock(&table_seqlock);
+        break;
+
+    case MECH_PERCPU_RWSEM:
+        percpu_down_write(&table_percpu_rwsem);
+        e = table_find(key);
+        e->value++;
+        percpu_up_write(&table_percpu_rwsem);
+        break;
+
+    case MECH_RCU:
+        /* Copy, update and publish. Readers still holding the old version
+         * keep using it until kfree_rcu() frees it after a grace period.
+         */
+        e = kmalloc(sizeof(*e), GFP_KERNEL);
+        if (!e)
+            return;
+
+        spin_lock(&table_rcu_lock);
+        old = table_find(key);
+        *e = *old;
+        e->value++;
+        hlist_replace_rcu(&old->node, &e->node);
+        spin_unlock(&table_rcu_lock);
+
+        kfree_rcu(old, rcu);
+        break;
+    }
+}
+
+/* xorshift32, good enough to spread keys and cheap enough not to matter */
+static inline u32 next_key(u32 *state)
+{
+    u32 x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+
+    return x;
+}
+
+static void reader_loop(struct lock_bench_worker *w,
+                        const struct bench_config *cfg)
+{
+    u32 state = w->id * 2654435761U + 1;
+    u64 ops = 0, sum = 0;
+
+    while (!lock_bench_should_stop(w)) {
+        sum += table_lookup(cfg->mech, next_key(&state) % table_entries);
+
+        if (!(++ops % RESCHED_EVERY))
+            cond_resched();
+    }
+
+    WRITE_ONCE(lookup_sink, sum);
+    w->ops = ops;
+}
+
+static void writer_loop(struct lock_bench_worker *w, struct bench_config *cfg)
+{
+    u32 state = 0x9e3779b9;
+    u64 t0, ns;
+
+    while (!lock_bench_should_stop(w)) {
+        t0 = ktime_get_ns();
+        table_update(cfg->mech, next_key(&state) % table_entries);
+        ns = ktime_get_ns() - t0;
+
+        cfg->updates++;
+        cfg->write_ns_total += ns;
+        cfg->write_ns_max = max(cfg->write_ns_max, ns);
+
+        usleep_range(cfg->writer_us, cfg->writer_us + cfg->writer_us / 4 + 1);
+    }
+}
+
+static void bench_work(struct lock_bench_worker *w)
+{
+    struct bench_config *cfg = w->bench->priv;
+
+    if (cfg->writer_us && w->id == cfg->writer_id)
+        writer_loop(w, cfg);
+    else
+        reader_loop(w, cfg);
+}
+
+static int bench_run_one(unsigned int mech, unsigned int nr_readers,
+                         unsigned int period_us, struct bench_result *res)
+{
+    struct bench_config cfg = {
+        .mech = mech,
+        .writer_us = period_us,
+        .writer_id = nr_readers,
+    };
+    struct lock_bench bench = {
+        .name = "rwlock_bench",
+        .work = bench_work,
+        .priv = &cfg,
+        .nr_workers = nr_readers + (period_us ? 1 : 0),
+        .duration_ms = duration_ms,
+    };
+    unsigned int i;
+    int err;
+
+    err = lock_bench_run(&bench);
+    if (err)
+        return err;
+
+    res->mech = mech;
+    res->nr_readers = nr_readers;
+    res->writer_us = period_us;
+    res->elapsed_ns = bench.elapsed_ns;
+    res->reads = 0;
+    for (i = 0; i < nr_readers; i++)
+        res->reads += bench.workers[i].ops;
+    res->updates = cfg.updates;
+    res->write_ns_total = cfg.write_ns_total;
+    res->write_ns_max = cfg.write_ns_max;
+
+    lock_bench_release(&bench);
+
+    return 0;
+}
+
+static int bench_run_all(void)
+{
+    unsigned int cpus = num_online_cpus();
+    unsigned int max_results;
+    unsigned int mech, nr;
+    int period, err;
+
+    if (table_size < TABLE_SIZE_MIN || table_size > TABLE_SIZE_MAX)
+        return -EINVAL;
+
+    kfree(results);
+    nr_results = 0;
+    max_results = nr_writer_us * NR_MECHS * (ilog2(cpus) + 2);
+    results = kcalloc(max_results, sizeof(*results), GFP_KERNEL);
+    if (!results)
+        return -ENOMEM;
+
+    err = table_build(table_size);
+    if (err)
+        return err;
+
+    for (period = 0; period < nr_writer_us; period++) {
+        for (mech = 0; mech < NR_MECHS; mech++) {
+            for (nr = lock_bench_next_nr(0, cpus); nr;
+                 nr = lock_bench_next_nr(nr, cpus)) {
+                err = bench_run_one(mech, nr, writer_us[period],
+                                    &results[nr_results]);
+                if (err)
+                    goto out;
+                nr_results++;
+            }
+        }
+    }
+
+    pr_info("rwlock_bench: %u configurations done, table of %u entries\n",
+            nr_results, table_size);
+
+out:
+    table_free();
+    return err;
+}
+
+static int results_show(struct seq_file *m, void *v)
+{
+    unsigned int i;
+
+    mutex_lock(&bench_mutex);
+
+    seq_printf(m, "table_size %u\n", table_entries);
+    seq_printf(m, "%-12s %7s %9s %14s %8s %9s %12s %12s\n", "mechanism",
+               "readers", "writer_us", "reads/sec", "ns/read", "updates",
+               "avg_write_ns", "max_write_ns");
+
+    for (i = 0; i < nr_results; i++) {
+        const struct bench_result *res = &results[i];
+
+        seq_printf(m, "%-12s %7u %9u %14llu %8llu %9llu %12llu %12llu\n",
+                   mech_names[res->mech], res->nr_readers, res->writer_us,
+                   div64_u64(res->reads * NSEC_PER_SEC, res->elapsed_ns),
+                   div64_u64(res->elapsed_ns * res->nr_readers,
+                             max_t(u64, res->reads, 1)),
+                   res->updates,
+                   div64_u64(res->write_ns_total,
+                             max_t(u64, res->updates, 1)),
+                   res->write_ns_max);
+    }
+
+    mutex_unlock(&bench_mutex);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(results);
+
+static ssize_t run_write(struct file *file, const char __user *buf,
+                         size_t count, loff_t *ppos)
+{
+    int err;
+
+    mutex_lock(&bench_mutex);
+    err = bench_run_all();
+    mutex_unlock(&bench_mutex);
+
+    return err ? err : count;
+}
+
+static const struct file_operations run_fops = {
+    .owner = THIS_MODULE,
+    .write = run_write,
+};
+
+static int __init rwlock_bench_init(void)
+{
+    bench_dir = debugfs_create_dir("rwlock_bench", NULL);
+    debugfs_create_file("run", 0200, bench_dir, NULL, &run_fops);
+    debugfs_create_file("results", 0444, bench_dir, NULL, &results_fops);
+
+    pr_info("rwlock_bench loaded, write to "
+            "/sys/kernel/debug/rwlock_bench/run to start\n");
+
+    return 0;
+}
+
+static void __exit rwlock_bench_exit(void)
+{
+    debugfs_remove_recursive(bench_dir);
+    kfree(results);
+
+    pr_info("rwlock_bench exit\n");
+}
+
+module_init(rwlock_bench_init);
+module_exit(rwlock_bench_exit);
+
+MODULE_DESCRIPTION("rwlock, rwsem, seqlock, percpu_rwsem and RCU benchmark");
+MODULE_LICENSE("GPL");
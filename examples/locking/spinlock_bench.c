@@ -0,0 +1,337 @@
+/*
+ * spinlock_bench.c - lock contention benchmark built from example_spinlock.c
+ *
+ * A group of kthreads, one per CPU, increments a shared counter as fast as
+ * it can using one of the following schemes:
+ *
+ *   irqsave - one global spinlock taken with spin_lock_irqsave()
+ *   plain   - the same global spinlock taken with spin_lock()
+ *   percpu  - one spinlock per CPU, the total is only summed when read
+ *   atomic  - a single atomic64_t, no lock at all
+ *
+ * Each scheme is run with 1, 2, 4, ... and finally all online CPUs.
+ *
+ * Usage:
+ *   echo 1 > /sys/kernel/debug/spinlock_bench/run
+ *   cat /sys/kernel/debug/spinlock_bench/results
+ */
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/init.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/printk.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "lock_bench.h"
+
+/* How often a worker offers the CPU back to the scheduler */
+#define RESCHED_EVERY 1024
+
+static unsigned int duration_ms = 200;
+module_param(duration_ms, uint, 0644);
+MODULE_PARM_DESC(duration_ms, "Run time of every scheme/thread-count pair");
+
+enum {
+    SCHEME_IRQSAVE,
+    SCHEME_PLAIN,
+    SCHEME_PERCPU,
+    SCHEME_ATOMIC,
+    NR_SCHEMES,
+};
+
+static const char *const scheme_names[NR_SCHEMES] = {
+    [SCHEME_IRQSAVE] = "irqsave",
+    [SCHEME_PLAIN] = "plain",
+    [SCHEME_PERCPU] = "percpu",
+    [SCHEME_ATOMIC] = "atomic",
+};
+
+/* The shared counter for the irqsave and plain schemes */
+static DEFINE_SPINLOCK(counter_lock);
+static u64 counter;
+
+/* The shared counter for the atomic scheme */
+static atomic64_t atomic_counter = ATOMIC64_INIT(0);
+
+/* Every CPU owns a shard on its own cache line for the percpu scheme */
+struct counter_shard {
+    spinlock_t lock;
+    u64 count;
+} ____cacheline_aligned_in_smp;
+
+static DEFINE_PER_CPU(struct counter_shard, counter_shards);
+
+struct bench_result {
+    unsigned int scheme;
+    unsigned int nr_threads;
+    u64 ops;
+    u64 elapsed_ns;
+    u64 cycles;
+    bool counter_ok;
+};
+
+/* Protects the results table and serializes runs */
+static DEFINE_MUTEX(bench_mutex);
+static struct bench_result *results;
+static unsigned int nr_results;
+
+static struct dentry *bench_dir;
+
+static void work_irqsave(struct lock_bench_worker *w)
+{
+    unsigned long flags;
+    u64 ops = 0;
+
+    while (!lock_bench_should_stop(w)) {
+        spin_lock_irqsave(&counter_lock, flags);
+        counter++;
+        spin_unlock_irqrestore(&counter_lock, flags);
+
+        if (!(++ops % RESCHED_EVERY))
+            cond_resched();
+    }
+
+    w->ops = ops;
+}
+
+static void work_plain(struct lock_bench_worker *w)
+{
+    u64 ops = 0;
+
+    while (!lock_bench_should_stop(w)) {
+        spin_lock(&counter_lock);
+        counter++;
+        spin_unlock(&counter_lock);
+
+        if (!(++ops % RESCHED_EVERY))
+            cond_resched();
+    }
+
+    w->ops = ops;
+}
+
+static void work_percpu(struct lock_bench_worker *w)
+{
+    /* Workers are bound to w->cpu, so the shard never changes under us.
+     * The lock is still needed because the reader sums shards at any time
+     * and because more workers than CPUs share a shard.
+     */
+    struct counter_shard *shard = per_cpu_ptr(&counter_shards, w->cpu);
+    u64 ops = 0;
+
+    while (!lock_bench_should_stop(w)) {
+        spin_lock(&shard->lock);
+        shard->count++;
+        spin_unlock(&shard->lock);
+
+        if (!(++ops % RESCHED_EVERY))
+            cond_resched();
+    }
+
+    w->ops = ops;
+}
+
+static void work_atomic(struct lock_bench_worker *w)
+{
+    u64 ops = 0;
+
+    while (!lock_bench_should_stop(w)) {
+        atomic64_inc(&atomic_counter);
+
+        if (!(++ops % RESCHED_EVERY))
+            cond_resched();
+    }
+
+    w->ops = ops;
+}
+
+static void (*const scheme_work[NR_SCHEMES])(struct lock_bench_worker *) = {
+    [SCHEME_IRQSAVE] = work_irqsave,
+    [SCHEME_PLAIN] = work_plain,
+    [SCHEME_PERCPU] = work_percpu,
+    [SCHEME_ATOMIC] = work_atomic,
+};
+
+static void counters_reset(void)
+{
+    int cpu;
+
+    counter = 0;
+    atomic64_set(&atomic_counter, 0);
+    for_each_possible_cpu (cpu)
+        per_cpu_ptr(&counter_shards, cpu)->count = 0;
+}
+
+/* Lazy aggregation: the percpu total only exists when somebody asks for it */
+static u64 counter_shards_sum(void)
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu (cpu) {
+        struct counter_shard *shard = per_cpu_ptr(&counter_shards, cpu);
+
+        spin_lock(&shard->lock);
+        sum += shard->count;
+        spin_unlock(&shard->lock);
+    }
+
+    return sum;
+}
+
+static u64 counter_read(unsigned int scheme)
+{
+    switch (scheme) {
+    case SCHEME_PERCPU:
+        return counter_shards_sum();
+    case SCHEME_ATOMIC:
+        return atomic64_read(&atomic_counter);
+    default:
+        return counter;
+    }
+}
+
+static int bench_run_one(unsigned int scheme, unsigned int nr,
+                         struct bench_result *res)
+{
+    struct lock_bench bench = {
+        .name = "spinlock_bench",
+        .work = scheme_work[scheme],
+        .nr_workers = nr,
+        .duration_ms = duration_ms,
+    };
+    int err;
+
+    counters_reset();
+
+    err = lock_bench_run(&bench);
+    if (err)
+        return err;
+
+    res->scheme = scheme;
+    res->nr_threads = nr;
+    res->ops = lock_bench_total_ops(&bench);
+    res->elapsed_ns = bench.elapsed_ns;
+    res->cycles = lock_bench_total_cycles(&bench);
+    res->counter_ok = counter_read(scheme) == res->ops;
+
+    lock_bench_release(&bench);
+
+    return 0;
+}
+
+static int bench_run_all(void)
+{
+    unsigned int cpus = num_online_cpus();
+    unsigned int max_results = NR_SCHEMES * (ilog2(cpus) + 2);
+    unsigned int scheme, nr;
+    int err = 0;
+
+    kfree(results);
+    nr_results = 0;
+    results = kcalloc(max_results, sizeof(*results), GFP_KERNEL);
+    if (!results)
+        return -ENOMEM;
+
+    for (scheme = 0; scheme < NR_SCHEMES; scheme++) {
+        for (nr = lock_bench_next_nr(0, cpus); nr;
+             nr = lock_bench_next_nr(nr, cpus)) {
+            struct bench_result *res = &results[nr_results];
+
+            err = bench_run_one(scheme, nr, res);
+            if (err)
+                return err;
+            nr_results++;
+
+            pr_info("spinlock_bench: %-8s threads %3u: %llu ops/sec\n",
+                    scheme_names[scheme], nr,
+                    div64_u64(res->ops * NSEC_PER_SEC, res->elapsed_ns));
+        }
+    }
+
+    return 0;
+}
+
+static int results_show(struct seq_file *m, void *v)
+{
+    unsigned int i;
+
+    mutex_lock(&bench_mutex);
+
+    seq_printf(m, "%-8s %7s %14s %10s %10s %s\n", "scheme", "threads",
+               "ops/sec", "cycles/op", "ns/op", "counter");
+
+    for (i = 0; i < nr_results; i++) {
+        const struct bench_result *res = &results[i];
+        u64 ops = max_t(u64, res->ops, 1);
+
+        /* ns/op is the time one thread spends per increment, which is what
+         * the critical section costs under that amount of contention.
+         */
+        seq_printf(m, "%-8s %7u %14llu %10llu %10llu %s\n",
+                   scheme_names[res->scheme], res->nr_threads,
+                   div64_u64(res->ops * NSEC_PER_SEC, res->elapsed_ns),
+                   div64_u64(res->cycles, ops),
+                   div64_u64(res->elapsed_ns * res->nr_threads, ops),
+                   res->counter_ok ? "ok" : "MISMATCH");
+    }
+
+    mutex_unlock(&bench_mutex);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(results);
+
+static ssize_t run_write(struct file *file, const char __user *buf,
+                         size_t count, loff_t *ppos)
+{
+    int err;
+
+    mutex_lock(&bench_mutex);
+    err = bench_run_all();
+    mutex_unlock(&bench_mutex);
+
+    return err ? err : count;
+}
+
+static const struct file_operations run_fops = {
+    .owner = THIS_MODULE,
+    .write = run_write,
+};
+
+static int __init spinlock_bench_init(void)
+{
+    int cpu;
+
+    for_each_possible_cpu (cpu)
+        spin_lock_init(&per_cpu_ptr(&counter_shards, cpu)->lock);
+
+    bench_dir = debugfs_create_dir("spinlock_bench", NULL);
+    debugfs_create_file("run", 0200, bench_dir, NULL, &run_fops);
+    debugfs_create_file("results", 0444, bench_dir, NULL, &results_fops);
+
+    pr_info("spinlock_bench loaded, write to "
+            "/sys/kernel/debug/spinlock_bench/run to start\n");
+
+    return 0;
+}
+
+static void __exit spinlock_bench_exit(void)
+{
+    debugfs_remove_recursive(bench_dir);
+    kfree(results);
+
+    pr_info("spinlock_bench exit\n");
+}
+
+module_init(spinlock_bench_init);
+module_exit(spinlock_bench_exit);
+
+MODULE_DESCRIPTION("Spinlock contention benchmark");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,369 @@
+/*
+ * pagebuf.h - growable page-backed buffers that give memory back under
+ * pressure
+ *
+ * A pagebuf is a sparse array of pages, allocated as writes reach them and
+ * charged to the memory cgroup of the writer. Once its owner is done with a
+ * page, because a reader went past it, the owner marks it consumed, which
+ * puts it on the LRU list of its cache. Under memory pressure the shrinker of
+ * the cache evicts consumed pages, the ones consumed first going first, from
+ * the cgroup and the node that run short.
+ *
+ * Data that was not consumed yet is never evicted. A writer that gets too far
+ * ahead of its readers sees its allocations fail instead, and the owner
+ * returns an error to it rather than waking up the OOM killer.
+ *
+ * An evicted page leaves a marker behind, so that touching it again counts as
+ * a refault: a reader that came back for consumed data after all. It then
+ * reads as zeros, so only owners whose readers never come back, like a
+ * stream, should consume pages at all. Many refaults mean that the owner
+ * marks pages consumed too early. Every buffer counts its resident pages,
+ * evictions and refaults.
+ *
+ * Usage:
+ *
+ *   static struct pagebuf_cache mydev_cache;
+ *   static DEFINE_MUTEX(mydev_lock);
+ *   static struct pagebuf mydev_buf;
+ *
+ *   pagebuf_cache_register(&mydev_cache, "mydev");
+ *   pagebuf_init(&mydev_buf, &mydev_cache, &mydev_lock, NUMA_NO_NODE);
+ *
+ *   mutex_lock(&mydev_lock);
+ *   page = pagebuf_page_for_write(&mydev_buf, index, GFP_KERNEL);
+ *   ...
+ *   page = pagebuf_page(&mydev_buf, index);    NULL for a hole
+ *   pagebuf_consume(&mydev_buf, index);
+ *   mutex_unlock(&mydev_lock);
+ *
+ *   pagebuf_truncate(&mydev_buf);
+ *   pagebuf_cache_unregister(&mydev_cache);
+ *
+ * All calls on a buffer are made with its lock held. The shrinker only tries
+ * that lock, and skips buffers that are busy: their owner may well be the one
+ * allocating memory.
+ *
+ * Everything lives in this header, like hptrace.h, so that modules in any
+ * directory can use it without linking an extra object. The shrinker needs
+ * Linux 6.8 or later, for memcg aware LRU lists keyed by object. Before that
+ * there is none, and consumed pages stay until the buffer is truncated.
+ */
+
+#ifndef PAGEBUF_H
+#define PAGEBUF_H
+
+#include <linux/gfp.h>
+#include <linux/highmem.h>
+#include <linux/list_lru.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+#include <linux/xarray.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#define HAVE_PAGEBUF_SHRINKER
+#endif
+
+/* What an evicted page leaves behind in the xarray */
+#define PAGEBUF_EVICTED xa_mk_value(0)
+
+struct pagebuf_cache {
+#ifdef HAVE_PAGEBUF_SHRINKER
+    struct list_lru lru; /* consumed pages, per node and memory cgroup */
+    struct shrinker *shrinker;
+#endif
+};
+
+struct pagebuf {
+    struct xarray pages;
+    struct pagebuf_cache *cache;
+    struct mutex *lock;
+    int node;
+
+    /* Under lock */
+    unsigned long resident;
+    unsigned long evicted;
+    unsigned long refaulted;
+};
+
+/* Bookkeeping of a page, found through page->private. It is allocated along
+ * with the page and charged to the same cgroup, which is how the LRU list
+ * knows which cgroup the page belongs to.
+ */
+struct pagebuf_ref {
+    struct list_head lru;
+    struct pagebuf *pb;
+    unsigned long index;
+};
+
+static inline struct pagebuf_ref *pagebuf_ref(struct page *page)
+{
+    return (struct pagebuf_ref *)page_private(page);
+}
+
+/* Puts a page on the LRU list of consumed pages, or takes it off */
+static inline void pagebuf_lru_add(struct pagebuf *pb, struct page *page)
+{
+#ifdef HAVE_PAGEBUF_SHRINKER
+    list_lru_add_obj(&pb->cache->lru, &pagebuf_ref(page)->lru);
+#endif
+}
+
+static inline void pagebuf_lru_del(struct pagebuf *pb, struct page *page)
+{
+#ifdef HAVE_PAGEBUF_SHRINKER
+    list_lru_del_obj(&pb->cache->lru, &pagebuf_ref(page)->lru);
+#endif
+}
+
+static inline void pagebuf_init(struct pagebuf *pb, struct pagebuf_cache *cache,
+                                struct mutex *lock, int node)
+{
+    xa_init_flags(&pb->pages, XA_FLAGS_ACCOUNT);
+    pb->cache = cache;
+    pb->lock = lock;
+    pb->node = node;
+    pb->resident = 0;
+    pb->evicted = 0;
+    pb->refaulted = 0;
+}
+
+/* A zeroed page with its bookkeeping. __GFP_NORETRY makes a charge over the
+ * limit of the cgroup fail after one round of reclaim, instead of calling the
+ * OOM killer.
+ */
+static inline struct page *pagebuf_alloc(struct pagebuf *pb, unsigned long index,
+                                         gfp_t gfp)
+{
+    struct pagebuf_ref *ref;
+    struct page *page;
+
+    gfp |= __GFP_ACCOUNT | __GFP_NORETRY | __GFP_NOWARN;
+    ref = kmalloc_node(sizeof(*ref), gfp, pb->node);
+    page = alloc_pages_node(pb->node, gfp | __GFP_ZERO, 0);
+    if (!ref || !page) {
+        kfree(ref);
+        if (page)
+            __free_page(page);
+        return NULL;
+    }
+
+    INIT_LIST_HEAD(&ref->lru);
+    ref->pb = pb;
+    ref->index = index;
+    set_page_private(page, (unsigned long)ref);
+
+    return page;
+}
+
+/* Drops our reference to a page that is no longer in the buffer. A pipe may
+ * still hold one of its own.
+ */
+static inline void pagebuf_put(struct pagebuf *pb, struct page *page)
+{
+    struct pagebuf_ref *ref = pagebuf_ref(page);
+
+    pagebuf_lru_del(pb, page);
+    set_page_private(page, 0);
+    kfree(ref);
+    put_page(page);
+}
+
+/* The page at index, NULL for a hole. An evicted page counts as a refault and
+ * becomes a hole.
+ */
+static inline struct page *pagebuf_page(struct pagebuf *pb, unsigned long index)
+{
+    struct page *page = xa_load(&pb->pages, index);
+
+    if (xa_is_value(page)) {
+        pb->refaulted++;
+        xa_erase(&pb->pages, index);
+        return NULL;
+    }
+
+    return page;
+}
+
+/* Whether the page at index holds data. Holes and evicted pages do not, and
+ * asking does not count as a refault.
+ */
+static inline bool pagebuf_has_data(struct pagebuf *pb, unsigned long index)
+{
+    void *entry = xa_load(&pb->pages, index);
+
+    return entry && !xa_is_value(entry);
+}
+
+/* The first index from index on whose page holds data, ULONG_MAX if there is
+ * none. For SEEK_DATA.
+ */
+static inline unsigned long pagebuf_next_data(struct pagebuf *pb,
+                                              unsigned long index)
+{
+    void *entry = xa_find(&pb->pages, &index, ULONG_MAX, XA_PRESENT);
+
+    while (entry && xa_is_value(entry))
+        entry = xa_find_after(&pb->pages, &index, ULONG_MAX, XA_PRESENT);
+
+    return entry ? index : ULONG_MAX;
+}
+
+/* The page at index, ready to be written to. A hole gets a new, zeroed page.
+ * A page that someone else still references, e.g. a pipe it was spliced to,
+ * is replaced by a copy, so that they keep the data they were given. Returns
+ * NULL when no memory could be had.
+ */
+static inline struct page *pagebuf_page_for_write(struct pagebuf *pb,
+                                                  unsigned long index,
+                                                  gfp_t gfp)
+{
+    struct page *page = pagebuf_page(pb, index);
+    struct page *new;
+    void *old;
+
+    if (page && page_count(page) == 1) {
+        /* Written again, so not consumed anymore */
+        pagebuf_lru_del(pb, page);
+        return page;
+    }
+
+    new = pagebuf_alloc(pb, index, gfp);
+    if (!new)
+        return NULL;
+    if (page)
+        copy_highpage(new, page);
+
+    old = xa_store(&pb->pages, index, new, gfp);
+    if (xa_is_err(old)) {
+        kfree(pagebuf_ref(new));
+        __free_page(new);
+        return NULL;
+    }
+    if (old)
+        pagebuf_put(pb, old);
+    else
+        pb->resident++;
+
+    return new;
+}
+
+/* The owner is done with the page at index, it may be evicted under memory
+ * pressure from now on.
+ */
+static inline void pagebuf_consume(struct pagebuf *pb, unsigned long index)
+{
+    struct page *page = xa_load(&pb->pages, index);
+
+    if (page && !xa_is_value(page))
+        pagebuf_lru_add(pb, page);
+}
+
+/* Empties the buffer, it can be used again afterwards */
+static inline void pagebuf_truncate(struct pagebuf *pb)
+{
+    struct page *page;
+    unsigned long index;
+
+    xa_for_each (&pb->pages, index, page) {
+        if (!xa_is_value(page))
+            pagebuf_put(pb, page);
+    }
+    xa_destroy(&pb->pages);
+    pb->resident = 0;
+}
+
+#ifdef HAVE_PAGEBUF_SHRINKER
+/* Called with the lock of the LRU list held, which keeps the buffer around:
+ * pagebuf_put() takes it to take the page off the list.
+ */
+static inline enum lru_status pagebuf_isolate(struct list_head *item,
+                                              struct list_lru_one *list,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+                                              spinlock_t *lru_lock,
+#endif
+                                              void *arg)
+{
+    struct pagebuf_ref *ref = container_of(item, struct pagebuf_ref, lru);
+    struct pagebuf *pb = ref->pb;
+    struct page *page;
+
+    if (!mutex_trylock(pb->lock))
+        return LRU_SKIP;
+
+    /* Replacing an entry needs no memory */
+    page = xa_store(&pb->pages, ref->index, PAGEBUF_EVICTED, GFP_NOWAIT);
+    list_lru_isolate(list, item);
+    pb->resident--;
+    pb->evicted++;
+    mutex_unlock(pb->lock);
+
+    set_page_private(page, 0);
+    kfree(ref);
+    put_page(page);
+
+    return LRU_REMOVED;
+}
+
+static inline unsigned long pagebuf_count_objects(struct shrinker *shrinker,
+                                                  struct shrink_control *sc)
+{
+    struct pagebuf_cache *cache = shrinker->private_data;
+
+    return list_lru_shrink_count(&cache->lru, sc);
+}
+
+static inline unsigned long pagebuf_scan_objects(struct shrinker *shrinker,
+                                                 struct shrink_control *sc)
+{
+    struct pagebuf_cache *cache = shrinker->private_data;
+
+    return list_lru_shrink_walk(&cache->lru, sc, pagebuf_isolate, NULL);
+}
+
+/* The shrinker shows up as pagebuf-<name> in /sys/kernel/debug/shrinker/ */
+static inline int pagebuf_cache_register(struct pagebuf_cache *cache,
+                                         const char *name)
+{
+    int err;
+
+    cache->shrinker = shrinker_alloc(SHRINKER_MEMCG_AWARE | SHRINKER_NUMA_AWARE,
+                                     "pagebuf-%s", name);
+    if (!cache->shrinker)
+        return -ENOMEM;
+
+    err = list_lru_init_memcg(&cache->lru, cache->shrinker);
+    if (err) {
+        shrinker_free(cache->shrinker);
+        return err;
+    }
+
+    cache->shrinker->count_objects = pagebuf_count_objects;
+    cache->shrinker->scan_objects = pagebuf_scan_objects;
+    cache->shrinker->private_data = cache;
+    shrinker_register(cache->shrinker);
+
+    return 0;
+}
+
+/* All buffers of the cache must have been truncated */
+static inline void pagebuf_cache_unregister(struct pagebuf_cache *cache)
+{
+    shrinker_free(cache->shrinker);
+    list_lru_destroy(&cache->lru);
+}
+#else
+static inline int pagebuf_cache_register(struct pagebuf_cache *cache,
+                                         const char *name)
+{
+    return 0;
+}
+
+static inline void pagebuf_cache_unregister(struct pagebuf_cache *cache)
+{
+}
+#endif
+
+#endif
@@ -0,0 +1,140 @@
+#!/usr/bin/env bash
+#
+# pagebuf_memcg.sh - run the pagebuf devices in a small memory cgroup
+#
+# Streams several times the memory limit of a cgroup through a device, and
+# then lets a writer run away with no reader behind it. The first must
+# succeed, with consumed pages evicted by the shrinker; the second must stop
+# with ENOMEM or ENOSPC. Neither may wake up the OOM killer of the cgroup.
+#
+# Needs root, cgroup v2 with the memory controller, and the modules loaded
+# in stream mode with buffers larger than the limit:
+#
+#   sudo insmod examples/chardev/CharDev-2.ko stream=1 buffer_kb=1048576
+#   sudo insmod examples/procfs/procfs3.ko stream=1 max_kb=1048576
+#   sudo examples/pagebuf/pagebuf_memcg.sh [limit_mb] [device...]
+#
+# The devices default to /dev/MyChar_Node0 and /proc/buffer2k, the ones
+# that are there.
+
+set -u
+
+LIMIT_MB=${1:-64}
+[ $# -gt 0 ] && shift
+DEVICES=("$@")
+if [ ${#DEVICES[@]} -eq 0 ]; then
+    for dev in /dev/MyChar_Node0 /proc/buffer2k; do
+        [ -e "$dev" ] && DEVICES+=("$dev")
+    done
+fi
+if [ ${#DEVICES[@]} -eq 0 ]; then
+    echo "No device, load CharDev-2.ko or procfs3.ko first" >&2
+    exit 1
+fi
+
+CGROOT=/sys/fs/cgroup
+CG=$CGROOT/pagebuf_memcg.$$
+
+if ! grep -qw memory "$CGROOT/cgroup.controllers" 2>/dev/null; then
+    echo "No cgroup v2 memory controller at $CGROOT" >&2
+    exit 1
+fi
+grep -qw memory "$CGROOT/cgroup.subtree_control" ||
+    echo +memory > "$CGROOT/cgroup.subtree_control" || exit 1
+
+mkdir "$CG" || exit 1
+trap 'rmdir "$CG"' EXIT
+echo $((LIMIT_MB << 20)) > "$CG/memory.max"
+# No swap, so that pages can only go away through the shrinker
+[ -e "$CG/memory.swap.max" ] && echo 0 > "$CG/memory.swap.max"
+
+# Runs a command inside the cgroup
+in_cgroup()
+{
+    bash -c 'echo $$ > "$1/cgroup.procs" && shift && exec "$@"' \
+        in_cgroup "$CG" "$@"
+}
+
+oom_kills()
+{
+    awk '$1 == "oom_kill" { print $2 }' "$CG/memory.events"
+}
+
+# Prints the page counters of a device, from sysfs or its stats file
+show_stats()
+{
+    local dev=$1 sys
+
+    case $dev in
+    /dev/*)
+        sys=/sys/class/MyChar_Class/$(basename "$dev")
+        printf "  resident %s evicted %s refaulted %s\n" \
+            "$(cat "$sys/resident_pages")" "$(cat "$sys/evicted_pages")" \
+            "$(cat "$sys/refaulted_pages")"
+        ;;
+    /proc/*)
+        echo "  $(tr '\n' ' ' < "${dev}_stats")"
+        ;;
+    esac
+}
+
+# Writes and reads back one MiB at a time, 4 times the limit in total. Every
+# MiB read is consumed and may be evicted to make room for the next one.
+stream()
+{
+    local dev=$1 mb
+
+    for ((mb = 0; mb < LIMIT_MB * 4; mb++)); do
+        in_cgroup dd if=/dev/zero of="$dev" bs=1M count=1 seek=$mb \
+            conv=notrunc status=none || return 1
+        in_cgroup dd if="$dev" of=/dev/null bs=1M count=1 skip=$mb \
+            status=none || return 1
+    done
+}
+
+# Writes twice the limit without reading anything: nothing may be evicted,
+# so the writes have to fail before that
+runaway()
+{
+    local dev=$1 out
+
+    out=$(in_cgroup dd if=/dev/zero of="$dev" bs=1M count=$((LIMIT_MB * 2)) \
+        2>&1)
+    if [ $? -eq 0 ]; then
+        echo "  runaway writer was not stopped"
+        return 1
+    fi
+    echo "  runaway writer stopped: $(echo "$out" | head -n 1)"
+}
+
+fail=0
+for dev in "${DEVICES[@]}"; do
+    : > "$dev"
+    before=$(oom_kills)
+
+    echo "$dev: streaming $((LIMIT_MB * 4)) MiB through a $LIMIT_MB MiB cgroup"
+    if ! stream "$dev"; then
+        echo "  stream failed"
+        fail=1
+    fi
+    show_stats "$dev"
+
+    echo "$dev: writing $((LIMIT_MB * 2)) MiB with no reader"
+    runaway "$dev" || fail=1
+    show_stats "$dev"
+    : > "$dev"
+
+    after=$(oom_kills)
+    [ -e "$CG/memory.peak" ] &&
+        echo "  memory.peak $(($(cat "$CG/memory.peak") >> 20)) MiB"
+    if [ "$after" != "$before" ]; then
+        echo "  OOM kills: $((after - before))"
+        fail=1
+    fi
+done
+
+if [ $fail -ne 0 ]; then
+    echo FAIL
+    exit 1
+fi
+echo PASS
@@ -4,8 +4,10 @@
 
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/proc_fs.h>
 #include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
@@ -16,51 +18,160 @@
 #define HAVE_PROC_OPS
 #endif
 
-#define PROCFS_MAX_SIZE 2048UL
+#include "../hptrace/hptrace.h"
+#include "../pagebuf/pagebuf.h"
+
+static unsigned int max_kb = 1024;
+module_param(max_kb, uint, 0444);
+MODULE_PARM_DESC(max_kb, "Maximum size of the buffer in KiB");
+
+/* Without it the buffer keeps what was read, like a file */
+static bool stream;
+module_param(stream, bool, 0444);
+MODULE_PARM_DESC(stream, "Let pages that were read be evicted, for readers "
+                         "that never seek back");
+
+#define PROCFS_MAX_SIZE ((loff_t)max_kb * 1024)
 #define PROCFS_ENTRY_FILENAME "buffer2k"
+#define PROCFS_STATS_FILENAME "buffer2k_stats"
 
 /* This structure hold information about the /proc file */
 static struct proc_dir_entry *our_proc_file;
 
-/* The buffer used to store character for this module */
-static char procfs_buffer[PROCFS_MAX_SIZE];
+/* The buffer used to store character for this module. Pages are allocated
+ * as writes reach them, and with stream set, once read they may be given back
+ * under memory pressure, see pagebuf.h.
+ */
+static struct pagebuf procfs_buffer;
+static struct pagebuf_cache procfs_cache;
+static DEFINE_MUTEX(procfs_lock);
 
 /* The size of the buffer */
-static unsigned long procfs_buffer_size = 0;
+static loff_t procfs_buffer_size = 0;
+
+/* Hot-path trace sites, toggled under /sys/kernel/debug/hptrace-procfs3/ */
+enum {
+    PROCFS3_TRACE_READ,
+    PROCFS3_TRACE_WRITE,
+    PROCFS3_TRACE_NR,
+};
+
+static struct hptrace_site procfs3_sites[PROCFS3_TRACE_NR] = {
+    [PROCFS3_TRACE_READ] = HPTRACE_SITE("read"),
+    [PROCFS3_TRACE_WRITE] = HPTRACE_SITE("write"),
+};
+
+static struct hptrace_subsys procfs3_trace =
+    HPTRACE_SUBSYS("procfs3", procfs3_sites);
 
 /* This function is called then the /proc file is read */
 static ssize_t procfs_read(struct file *filp, char __user *buffer,
                            size_t buffer_length, loff_t *offset)
 {
-    if (*offset || procfs_buffer_size == 0) {
+    loff_t pos = *offset;
+    size_t done = 0;
+    int err = 0;
+    u64 t0 = hptrace_begin(procfs3_sites, PROCFS3_TRACE_READ);
+
+    mutex_lock(&procfs_lock);
+    if (pos < 0 || pos >= procfs_buffer_size) {
+        mutex_unlock(&procfs_lock);
         pr_info("procfs_read: END\n");
-        *offset = 0;
         return 0;
     }
-    procfs_buffer_size = min(procfs_buffer_size, buffer_length);
-    if (copy_to_user(buffer, procfs_buffer, procfs_buffer_size))
-        return -EFAULT;
-    *offset += procfs_buffer_size;
+    buffer_length = min_t(loff_t, buffer_length, procfs_buffer_size - pos);
+
+    while (done < buffer_length) {
+        struct page *page = pagebuf_page(&procfs_buffer, pos >> PAGE_SHIFT);
+        size_t offset_in = offset_in_page(pos);
+        size_t chunk = min(buffer_length - done, PAGE_SIZE - offset_in);
+
+        /* Holes, and pages that were evicted, read as zeros */
+        if (page ? copy_to_user(buffer + done, page_address(page) + offset_in,
+                                chunk)
+                 : clear_user(buffer + done, chunk)) {
+            err = -EFAULT;
+            break;
+        }
+        done += chunk;
+        pos += chunk;
+
+        /* Read to its end, or to the end of the data: we are done with it */
+        if (stream && (!offset_in_page(pos) || pos == procfs_buffer_size))
+            pagebuf_consume(&procfs_buffer, (pos - 1) >> PAGE_SHIFT);
+    }
+    mutex_unlock(&procfs_lock);
+
+    if (!done)
+        return err;
+    *offset = pos;
 
-    pr_info("procfs_read: read %lu bytes\n", procfs_buffer_size);
-    return procfs_buffer_size;
+    pr_info("procfs_read: read %zu bytes\n", done);
+    hptrace_end(procfs3_sites, PROCFS3_TRACE_READ, t0, done);
+    return done;
 }
 static ssize_t procfs_write(struct file *file, const char __user *buffer,
                             size_t len, loff_t *off)
 {
-    procfs_buffer_size = min(PROCFS_MAX_SIZE, len);
-    if (copy_from_user(procfs_buffer, buffer, procfs_buffer_size))
-        return -EFAULT;
-    *off += procfs_buffer_size;
+    loff_t pos;
+    size_t done = 0;
+    int err = 0;
+    u64 t0 = hptrace_begin(procfs3_sites, PROCFS3_TRACE_WRITE);
+
+    mutex_lock(&procfs_lock);
+    pos = file->f_flags & O_APPEND ? procfs_buffer_size : *off;
+    if (pos < 0 || pos >= PROCFS_MAX_SIZE) {
+        mutex_unlock(&procfs_lock);
+        return -ENOSPC;
+    }
+    len = min_t(loff_t, len, PROCFS_MAX_SIZE - pos);
 
-    pr_info("procfs_write: write %lu bytes\n", procfs_buffer_size);
-    return procfs_buffer_size;
+    while (done < len) {
+        /* Fails rather than calling the OOM killer when our memory cgroup
+         * is at its limit and nothing can be evicted.
+         */
+        struct page *page = pagebuf_page_for_write(&procfs_buffer,
+                                                   pos >> PAGE_SHIFT, GFP_KERNEL);
+        size_t offset_in = offset_in_page(pos);
+        size_t chunk = min(len - done, PAGE_SIZE - offset_in);
+
+        if (!page) {
+            err = -ENOMEM;
+            break;
+        }
+        if (copy_from_user(page_address(page) + offset_in, buffer + done,
+                           chunk)) {
+            err = -EFAULT;
+            break;
+        }
+        done += chunk;
+        pos += chunk;
+    }
+    if (pos > procfs_buffer_size)
+        procfs_buffer_size = pos;
+    mutex_unlock(&procfs_lock);
+
+    if (!done)
+        return err;
+    *off = pos;
+
+    pr_info("procfs_write: write %zu bytes\n", done);
+    hptrace_end(procfs3_sites, PROCFS3_TRACE_WRITE, t0, done);
+    return done;
 }
 static int procfs_open(struct inode *inode, struct file *file)
 {
     pr_info("procfs_open\n");
 
     try_module_get(THIS_MODULE);
+
+    /* Like for regular files, "echo hi > /proc/buffer2k" starts over */
+    if ((file->f_mode & FMODE_WRITE) && (file->f_flags & O_TRUNC)) {
+        mutex_lock(&procfs_lock);
+        pagebuf_truncate(&procfs_buffer);
+        procfs_buffer_size = 0;
+        mutex_unlock(&procfs_lock);
+    }
     return 0;
 }
 static int procfs_close(struct inode *inode, struct file *file)
@@ -75,6 +186,7 @@ static int procfs_close(struct inode *inode, struct file *file)
 static struct proc_ops file_ops_4_our_proc_file = {
     .proc_read = procfs_read,
     .proc_write = procfs_write,
+    .proc_lseek = default_llseek,
     .proc_open = procfs_open,
     .proc_release = procfs_close,
 };
@@ -82,16 +194,50 @@ static struct proc_ops file_ops_4_our_proc_file = {
 static const struct file_operations file_ops_4_our_proc_file = {
     .read = procfs_read,
     .write = procfs_write,
+    .llseek = default_llseek,
     .open = procfs_open,
     .release = procfs_close,
 };
 #endif
 
+/* /proc/buffer2k_stats: pages of the buffer in memory, evicted under memory
+ * pressure, and touched again after that
+ */
+static int procfs_stats_show(struct seq_file *m, void *v)
+{
+    mutex_lock(&procfs_lock);
+    seq_printf(m, "size %lld\n", procfs_buffer_size);
+    seq_printf(m, "resident %lu\n", procfs_buffer.resident);
+    seq_printf(m, "evicted %lu\n", procfs_buffer.evicted);
+    seq_printf(m, "refaulted %lu\n", procfs_buffer.refaulted);
+    mutex_unlock(&procfs_lock);
+
+    return 0;
+}
+
 static int __init procfs3_init(void)
 {
+    int err;
+
+    /* Hot-path tracing, disabled (a NOP) until enabled through debugfs */
+    err = hptrace_register(&procfs3_trace);
+    if (err)
+        return err;
+
+    err = pagebuf_cache_register(&procfs_cache, "procfs3");
+    if (err) {
+        hptrace_unregister(&procfs3_trace);
+        return err;
+    }
+    pagebuf_init(&procfs_buffer, &procfs_cache, &procfs_lock, NUMA_NO_NODE);
+
     our_proc_file = proc_create(PROCFS_ENTRY_FILENAME, 0644, NULL, &file_ops_4_our_proc_file);
-    if (our_proc_file == NULL) {
+    if (our_proc_file == NULL ||
+        !proc_create_single(PROCFS_STATS_FILENAME, 0444, NULL, procfs_stats_show)) {
         pr_info("Error: Could not initialize /proc/%s\n", PROCFS_ENTRY_FILENAME);
+        remove_proc_entry(PROCFS_ENTRY_FILENAME, NULL);
+        pagebuf_cache_unregister(&procfs_cache);
+        hptrace_unregister(&procfs3_trace);
         return -ENOMEM;
     }
     proc_set_size(our_proc_file, 80);
@@ -103,7 +249,14 @@ static int __init procfs3_init(void)
 
 static void __exit procfs3_exit(void)
 {
+    remove_proc_entry(PROCFS_STATS_FILENAME, NULL);
     remove_proc_entry(PROCFS_ENTRY_FILENAME, NULL);
+    /* The shrinker may still look at the pages, under the lock */
+    mutex_lock(&procfs_lock);
+    pagebuf_truncate(&procfs_buffer);
+    mutex_unlock(&procfs_lock);
+    pagebuf_cache_unregister(&procfs_cache);
+    hptrace_unregister(&procfs3_trace);
     pr_info("/proc/%s removed\n", PROCFS_ENTRY_FILENAME);
 }
 
@@ -0,0 +1,253 @@
+/*
+ * statpage.h - counters of a module in a page user space maps read-only
+ *
+ * Reading a counter through sysfs or procfs costs a few system calls and a
+ * show() that formats it as text, which adds up for monitoring agents that
+ * poll thousands of times per second. A stats page instead publishes all the
+ * counters of a module in one page that readers map once, from
+ * /proc/statpage-<name>, and then read with plain loads, no system call at
+ * all (see statpage_abi.h for the layout, statpage_user.h for the reader).
+ *
+ * Like the vDSO data of the clock, the page is not written by the hot paths
+ * themselves, which keep counting the way they do, per CPU or under their own
+ * locks. While the proc file is open or mapped, every STATPAGE_INTERVAL_MS a
+ * work item asks the module for the current values, through its refresh
+ * callback, and publishes them under a sequence count. Values are that old
+ * at most, while the CPUs are busy: the work is deferrable, so that it does
+ * not wake up idle CPUs. With nobody looking the work does not run at all,
+ * and the page holds the values of the last refresh. read() of the proc file
+ * refreshes the values first, and returns the page.
+ *
+ * The refresh callback runs that often for as long as a reader keeps the page
+ * mapped, so it should read the counters without taking the locks of the hot
+ * paths.
+ *
+ * Usage:
+ *
+ *   static const char *const mydev_counters[] = { "opens", "reads" };
+ *
+ *   static void mydev_refresh(struct statpage *sp, u64 *values)
+ *   {
+ *       values[0] = ...;    may sleep, best without the hot path locks
+ *       values[1] = ...;
+ *   }
+ *
+ *   static struct statpage mydev_stats =
+ *       STATPAGE(KBUILD_MODNAME, mydev_counters, mydev_refresh);
+ *
+ *   statpage_register(&mydev_stats);
+ *   ...
+ *   statpage_unregister(&mydev_stats);
+ *
+ * Everything lives in this header, like hptrace.h, so that modules in any
+ * directory can use it without linking an extra object.
+ */
+
+#ifndef STATPAGE_H
+#define STATPAGE_H
+
+#include <linux/atomic.h>
+#include <linux/fs.h>
+#include <linux/gfp.h>
+#include <linux/jiffies.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/proc_fs.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/timekeeping.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+
+#include "statpage_abi.h"
+
+#define STATPAGE_INTERVAL_MS 10
+
+struct statpage {
+    const char *name;
+    const char *const *counters;
+    unsigned int nr;
+    /* Fills in the nr current values, in the order of counters */
+    void (*refresh)(struct statpage *sp, u64 *values);
+
+    struct mutex lock; /* one update at a time */
+    struct page *page;
+    struct statpage_layout *layout;
+    u64 *values;
+    struct proc_dir_entry *entry;
+    struct delayed_work work;
+    atomic_t users; /* open files of the proc entry, mappings hold one */
+};
+
+#define STATPAGE(_name, _counters, _refresh)                                   \
+    {                                                                          \
+        .name = _name, .counters = _counters, .nr = ARRAY_SIZE(_counters),    \
+        .refresh = _refresh,                                                   \
+    }
+
+/* Gets the current values and publishes them, the way the vDSO data is
+ * written: readers that saw an odd or a different seq retry.
+ */
+static inline void statpage_update(struct statpage *sp)
+{
+    struct statpage_layout *layout = sp->layout;
+    unsigned int i;
+
+    mutex_lock(&sp->lock);
+    sp->refresh(sp, sp->values);
+
+    WRITE_ONCE(layout->hdr.seq, layout->hdr.seq + 1);
+    smp_wmb();
+    for (i = 0; i < sp->nr; i++)
+        WRITE_ONCE(layout->counters[i].value, sp->values[i]);
+    WRITE_ONCE(layout->hdr.updated_ns, ktime_get_ns());
+    smp_wmb();
+    WRITE_ONCE(layout->hdr.seq, layout->hdr.seq + 1);
+    mutex_unlock(&sp->lock);
+}
+
+static inline void statpage_work(struct work_struct *work)
+{
+    struct statpage *sp =
+        container_of(to_delayed_work(work), struct statpage, work);
+
+    statpage_update(sp);
+    if (atomic_read(&sp->users))
+        schedule_delayed_work(&sp->work,
+                              msecs_to_jiffies(STATPAGE_INTERVAL_MS));
+}
+
+static inline struct statpage *statpage_of(struct file *file)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+    return pde_data(file_inode(file));
+#else
+    return PDE_DATA(file_inode(file));
+#endif
+}
+
+/* A mapping keeps its file open, so the refreshes go on until the last file
+ * is closed and the last mapping is gone. A work item that just saw no users
+ * is queued again by this if it is still running.
+ */
+static inline int statpage_proc_open(struct inode *inode, struct file *file)
+{
+    struct statpage *sp = statpage_of(file);
+
+    if (atomic_inc_return(&sp->users) == 1)
+        schedule_delayed_work(&sp->work,
+                              msecs_to_jiffies(STATPAGE_INTERVAL_MS));
+
+    return 0;
+}
+
+static inline int statpage_proc_release(struct inode *inode,
+                                        struct file *file)
+{
+    atomic_dec(&statpage_of(file)->users);
+
+    return 0;
+}
+
+/* Maps the page, read-only for good: mprotect() cannot make it writable */
+static inline int statpage_proc_mmap(struct file *file,
+                                     struct vm_area_struct *vma)
+{
+    struct statpage *sp = statpage_of(file);
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE)
+        return -EINVAL;
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    return vm_insert_page(vma, vma->vm_start, sp->page);
+}
+
+/* The page as it is after a refresh, for tools without mmap() */
+static inline ssize_t statpage_proc_read(struct file *file, char __user *buf,
+                                         size_t count, loff_t *ppos)
+{
+    struct statpage *sp = statpage_of(file);
+
+    if (!*ppos)
+        statpage_update(sp);
+
+    return simple_read_from_buffer(buf, count, ppos, sp->layout, STATPAGE_SIZE);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+static const struct proc_ops statpage_proc_ops = {
+    .proc_open = statpage_proc_open,
+    .proc_release = statpage_proc_release,
+    .proc_read = statpage_proc_read,
+    .proc_mmap = statpage_proc_mmap,
+    .proc_lseek = default_llseek,
+};
+#else
+static const struct file_operations statpage_proc_ops = {
+    .open = statpage_proc_open,
+    .release = statpage_proc_release,
+    .read = statpage_proc_read,
+    .mmap = statpage_proc_mmap,
+    .llseek = default_llseek,
+};
+#endif
+
+static inline int statpage_register(struct statpage *sp)
+{
+    char name[NAME_MAX];
+    unsigned int i;
+
+    if (sp->nr > STATPAGE_MAX_COUNTERS || STATPAGE_SIZE > PAGE_SIZE)
+        return -EINVAL;
+
+    sp->values = kcalloc(sp->nr, sizeof(*sp->values), GFP_KERNEL);
+    sp->page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    if (!sp->values || !sp->page)
+        goto fail;
+    sp->layout = page_address(sp->page);
+
+    sp->layout->hdr.magic = STATPAGE_MAGIC;
+    sp->layout->hdr.version = STATPAGE_VERSION;
+    sp->layout->hdr.nr = sp->nr;
+    sp->layout->hdr.interval_ns = STATPAGE_INTERVAL_MS * NSEC_PER_MSEC;
+    for (i = 0; i < sp->nr; i++)
+        strscpy(sp->layout->counters[i].name, sp->counters[i],
+                STATPAGE_NAME_LEN);
+
+    mutex_init(&sp->lock);
+    atomic_set(&sp->users, 0);
+    INIT_DEFERRABLE_WORK(&sp->work, statpage_work);
+    statpage_update(sp);
+
+    snprintf(name, sizeof(name), "statpage-%s", sp->name);
+    sp->entry = proc_create_data(name, 0444, NULL, &statpage_proc_ops, sp);
+    if (!sp->entry)
+        goto fail;
+
+    return 0;
+
+fail:
+    if (sp->page)
+        __free_page(sp->page);
+    kfree(sp->values);
+    return -ENOMEM;
+}
+
+/* Pages still mapped stay around until they are unmapped, frozen. Removing
+ * the proc entry releases the files still open, so the work stops.
+ */
+static inline void statpage_unregister(struct statpage *sp)
+{
+    proc_remove(sp->entry);
+    cancel_delayed_work_sync(&sp->work);
+    put_page(sp->page);
+    kfree(sp->values);
+}
+
+#endif
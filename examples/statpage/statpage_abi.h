@@ -0,0 +1,49 @@
+/*
+ * statpage_abi.h - layout of the stats page shared with user space
+ *
+ * A module with counters exposes them as one read-only page, mapped from
+ * /proc/statpage-<module>: a header, then up to STATPAGE_MAX_COUNTERS
+ * named 64-bit counters. Names do not change once the page is there, only
+ * values do.
+ *
+ * The kernel updates the values under a sequence count, like the vDSO data
+ * of the clock: seq is odd while an update is in progress, and changes with
+ * every update. A reader reads seq, waits for it to be even, reads the
+ * values it wants, and starts over if seq changed meanwhile. statpage_user.h
+ * does that.
+ */
+
+#ifndef STATPAGE_ABI_H
+#define STATPAGE_ABI_H
+
+#include <linux/types.h>
+
+#define STATPAGE_MAGIC 0x53545047 /* "STPG" */
+#define STATPAGE_VERSION 1
+#define STATPAGE_SIZE 4096
+#define STATPAGE_NAME_LEN 24
+
+struct statpage_counter {
+    char name[STATPAGE_NAME_LEN]; /* NUL terminated */
+    __u64 value;
+};
+
+struct statpage_header {
+    __u32 magic;
+    __u32 version;
+    __u32 seq;
+    __u32 nr; /* of counters */
+    __u64 updated_ns; /* CLOCK_MONOTONIC time of the last update */
+    __u64 interval_ns; /* between updates, values are that old at most */
+};
+
+struct statpage_layout {
+    struct statpage_header hdr;
+    struct statpage_counter counters[];
+};
+
+#define STATPAGE_MAX_COUNTERS                                                  \
+    ((STATPAGE_SIZE - sizeof(struct statpage_header)) /                        \
+     sizeof(struct statpage_counter))
+
+#endif
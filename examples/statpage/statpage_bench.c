@@ -0,0 +1,187 @@
+/*
+ * statpage_bench.c - cost of reading a counter from the stats page and sysfs
+ *
+ * Reads the same counter -n times in each of the ways a monitoring agent
+ * could, and reports the time per read:
+ *
+ *   statpage    statpage_read() from the mapped page, no system call
+ *   snapshot    statpage_snapshot() of all the counters of the page
+ *   proc read   pread() of the whole page from /proc/statpage-<module>
+ *   sysfs       pread() of the attribute, kept open, which runs show()
+ *   sysfs open  open(), read() and close() of the attribute each time
+ *
+ * The sysfs attribute is one of a single minor, while the page has the
+ * totals of the module: the values printed differ with more than one minor
+ * in use, the costs do not.
+ *
+ *   sudo insmod CharDev-2.ko
+ *   ./statpage_bench -m CharDev_2 -c reads \
+ *       -s /sys/class/MyChar_Class/MyChar_Node0/reads
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "statpage_user.h"
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char *what, uint64_t ns, unsigned long n,
+                   uint64_t value, double base)
+{
+    double per_read = (double)ns / n;
+
+    printf("%-12s %10.1f %14.0f %9.1fx %20llu\n", what, per_read,
+           1e9 / per_read, base ? per_read / base : 1.0,
+           (unsigned long long)value);
+}
+
+static uint64_t sysfs_pread(int fd)
+{
+    char buf[32];
+    ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+    return strtoull(buf, NULL, 10);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-m module] [-c counter] [-s sysfs_attribute] "
+            "[-n reads]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *module = "CharDev_2", *counter = "reads";
+    const char *sysfs = "/sys/class/MyChar_Class/MyChar_Node0/reads";
+    unsigned long n = 1000000, slow_n, i;
+    struct statpage_reader r;
+    uint64_t values[STATPAGE_MAX_COUNTERS], value = 0, start, end;
+    volatile uint64_t sink; /* keeps the loads in the loop */
+    char path[128], page[STATPAGE_SIZE];
+    struct statpage_counter copy;
+    double base;
+    int opt, idx, fd, err;
+
+    while ((opt = getopt(argc, argv, "m:c:s:n:")) != -1) {
+        switch (opt) {
+        case 'm':
+            module = optarg;
+            break;
+        case 'c':
+            counter = optarg;
+            break;
+        case 's':
+            sysfs = optarg;
+            break;
+        case 'n':
+            n = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!n)
+        usage(argv[0]);
+    /* The system calls take microseconds, fewer reads give the same picture */
+    slow_n = n / 10 ? n / 10 : 1;
+
+    err = statpage_open(&r, module);
+    if (err < 0) {
+        fprintf(stderr, "statpage %s: %s\n", module, strerror(-err));
+        return EXIT_FAILURE;
+    }
+    idx = statpage_find(&r, counter);
+    if (idx < 0) {
+        fprintf(stderr, "%s has no counter %s, it has:", module, counter);
+        for (i = 0; i < r.nr; i++)
+            fprintf(stderr, " %s", statpage_name(&r, i));
+        fprintf(stderr, "\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%s of %s, %lu reads (%lu through system calls)\n", counter, module,
+           n, slow_n);
+    printf("%-12s %10s %14s %10s %20s\n", "", "ns/read", "reads/s", "vs page",
+           "value");
+
+    start = now_ns();
+    for (i = 0; i < n; i++)
+        sink = statpage_read(&r, idx);
+    end = now_ns();
+    base = (double)(end - start) / n;
+    report("statpage", end - start, n, sink, 0);
+
+    start = now_ns();
+    for (i = 0; i < n; i++)
+        statpage_snapshot(&r, values);
+    report("snapshot", now_ns() - start, n, values[idx], base);
+
+    if (strchr(module, '/'))
+        snprintf(path, sizeof(path), "%s", module);
+    else
+        snprintf(path, sizeof(path), "/proc/statpage-%s", module);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    start = now_ns();
+    for (i = 0; i < slow_n; i++) {
+        if (pread(fd, page, sizeof(page), 0) != sizeof(page)) {
+            perror(path);
+            return EXIT_FAILURE;
+        }
+    }
+    end = now_ns();
+    memcpy(&copy, (char *)page + sizeof(struct statpage_header) +
+                      idx * sizeof(copy),
+           sizeof(copy));
+    report("proc read", end - start, slow_n, copy.value, base);
+    close(fd);
+
+    fd = open(sysfs, O_RDONLY);
+    if (fd < 0) {
+        perror(sysfs);
+        statpage_close(&r);
+        return EXIT_FAILURE;
+    }
+    start = now_ns();
+    for (i = 0; i < slow_n; i++)
+        value = sysfs_pread(fd);
+    report("sysfs", now_ns() - start, slow_n, value, base);
+    close(fd);
+
+    start = now_ns();
+    for (i = 0; i < slow_n; i++) {
+        fd = open(sysfs, O_RDONLY);
+        if (fd < 0) {
+            perror(sysfs);
+            return EXIT_FAILURE;
+        }
+        value = sysfs_pread(fd);
+        close(fd);
+    }
+    report("sysfs open", now_ns() - start, slow_n, value, base);
+
+    statpage_close(&r);
+    return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * statpage_user.h - reads the stats page of a module without system calls
+ *
+ * statpage_open() maps /proc/statpage-<module> once, read-only. After that,
+ * statpage_read() and statpage_snapshot() are plain loads from the page,
+ * retried while the kernel is updating it (see statpage_abi.h), so they cost
+ * a few nanoseconds and can be called as often as needed, from any number of
+ * threads.
+ *
+ *   struct statpage_reader r;
+ *   int idx;
+ *
+ *   if (statpage_open(&r, "CharDev_2") < 0)
+ *       ...
+ *   idx = statpage_find(&r, "reads");
+ *   printf("%llu\n", (unsigned long long)statpage_read(&r, idx));
+ *   statpage_close(&r);
+ *
+ * Values are the ones of the last update, at most hdr.interval_ns old while
+ * the module is busy; statpage_snapshot() returns when that was.
+ */
+
+#ifndef STATPAGE_USER_H
+#define STATPAGE_USER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "statpage_abi.h"
+
+struct statpage_reader {
+    const struct statpage_layout *page;
+    unsigned int nr;
+};
+
+/* Module is a module name, or the path of the page itself */
+static inline int statpage_open(struct statpage_reader *r, const char *module)
+{
+    char path[128];
+    void *page;
+    int fd;
+
+    r->page = NULL;
+    r->nr = 0;
+    if (strchr(module, '/'))
+        snprintf(path, sizeof(path), "%s", module);
+    else
+        snprintf(path, sizeof(path), "/proc/statpage-%s", module);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -errno;
+    page = mmap(NULL, STATPAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED)
+        return -errno;
+
+    r->page = page;
+    r->nr = r->page->hdr.nr;
+    if (r->page->hdr.magic != STATPAGE_MAGIC ||
+        r->page->hdr.version != STATPAGE_VERSION ||
+        r->nr > STATPAGE_MAX_COUNTERS) {
+        munmap(page, STATPAGE_SIZE);
+        return -EPROTO;
+    }
+
+    return 0;
+}
+
+static inline void statpage_close(struct statpage_reader *r)
+{
+    munmap((void *)r->page, STATPAGE_SIZE);
+    r->page = NULL;
+}
+
+/* Returns the index of the counter, -1 if the module has none by that name */
+static inline int statpage_find(const struct statpage_reader *r,
+                                const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < r->nr; i++) {
+        if (!strncmp(r->page->counters[i].name, name, STATPAGE_NAME_LEN))
+            return i;
+    }
+    return -1;
+}
+
+static inline const char *statpage_name(const struct statpage_reader *r,
+                                        unsigned int idx)
+{
+    return r->page->counters[idx].name;
+}
+
+/* Waits for an even seq, which the caller reads the values under */
+static inline uint32_t statpage_begin(const struct statpage_reader *r)
+{
+    uint32_t seq;
+
+    while ((seq = __atomic_load_n(&r->page->hdr.seq, __ATOMIC_ACQUIRE)) & 1)
+        ;
+    return seq;
+}
+
+/* Tells whether the values read since statpage_begin() must be read again */
+static inline int statpage_retry(const struct statpage_reader *r, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&r->page->hdr.seq, __ATOMIC_RELAXED) != seq;
+}
+
+static inline uint64_t statpage_read(const struct statpage_reader *r,
+                                     unsigned int idx)
+{
+    uint64_t value;
+    uint32_t seq;
+
+    do {
+        seq = statpage_begin(r);
+        value = __atomic_load_n(&r->page->counters[idx].value,
+                                __ATOMIC_RELAXED);
+    } while (statpage_retry(r, seq));
+
+    return value;
+}
+
+/* Copies all the values of one update, returns when it was made, in the
+ * CLOCK_MONOTONIC nanoseconds of updated_ns.
+ */
+static inline uint64_t statpage_snapshot(const struct statpage_reader *r,
+                                         uint64_t *values)
+{
+    uint64_t updated_ns;
+    unsigned int i;
+    uint32_t seq;
+
+    do {
+        seq = statpage_begin(r);
+        for (i = 0; i < r->nr; i++)
+            values[i] = __atomic_load_n(&r->page->counters[i].value,
+                                        __ATOMIC_RELAXED);
+        updated_ns = __atomic_load_n(&r->page->hdr.updated_ns,
+                                     __ATOMIC_RELAXED);
+    } while (statpage_retry(r, seq));
+
+    return updated_ns;
+}
+
+#endif
@@ -0,0 +1,312 @@
+/*
+ * syscall-sampler.c
+ *
+ * Counts which files are opened, without touching sys_call_table.
+ *
+ * syscall-steal.c replaces the openat entry of sys_call_table and prints
+ * every filename one character at a time. That serializes every openat()
+ * on the console. This module attaches a kprobe to the openat system call
+ * instead, copies the filename once and bumps a counter for it in a hash
+ * table owned by the current CPU. Nothing is printed from the hot path; the
+ * most opened paths are read on demand from /proc/syscall_sampler.
+ *
+ * Calls from users other than `uid` are rejected before any user memory is
+ * read. The default uid of -1 samples everybody.
+ */
+
+#include <linux/cred.h> /* For current_uid() */
+#include <linux/kernel.h>
+#include <linux/kprobes.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/ptrace.h> /* For regs_get_kernel_argument() */
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/stringhash.h>
+#include <linux/uaccess.h>
+#include <linux/uidgid.h> /* For __kuid_val() */
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+
+#include <asm/syscall.h> /* For syscall_get_arguments() */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+#define strncpy_from_user_nofault strncpy_from_unsafe_user
+#endif
+
+/* The symbol of a system call differs between architectures */
+#if defined(CONFIG_X86_64)
+#define SYSCALL_SYM_PREFIX "__x64_sys_"
+#elif defined(CONFIG_ARM64)
+#define SYSCALL_SYM_PREFIX "__arm64_sys_"
+#else
+#define SYSCALL_SYM_PREFIX "sys_"
+#endif
+
+#define PROC_NAME "syscall_sampler"
+
+#define SAMPLER_PATH_LEN 128
+/* Slots in the hash table of every CPU, must be a power of two */
+#define SAMPLER_SLOTS 512
+/* How far an insert looks for a free slot before giving up */
+#define SAMPLER_PROBE_LIMIT 8
+
+/* UID we want to sample, -1 for every user */
+static int uid = -1;
+module_param(uid, int, 0644);
+MODULE_PARM_DESC(uid, "Only count calls made by this uid, -1 for all");
+
+static unsigned int top_n = 20;
+module_param(top_n, uint, 0644);
+MODULE_PARM_DESC(top_n, "Number of paths shown in /proc/" PROC_NAME);
+
+static char *syscall_sym = SYSCALL_SYM_PREFIX "openat";
+module_param(syscall_sym, charp, 0444);
+MODULE_PARM_DESC(syscall_sym, "Symbol of the openat system call");
+
+struct path_slot {
+    u64 key; /* hash and length of the path, 0 while the slot is empty */
+    u64 count;
+    char path[SAMPLER_PATH_LEN];
+};
+
+/* Only the owning CPU writes into its table, readers merge all of them */
+struct path_table {
+    struct path_slot slots[SAMPLER_SLOTS];
+    u64 hits;
+    u64 dropped; /* no free slot was found */
+    u64 faults; /* the filename could not be read without sleeping */
+};
+
+static DEFINE_PER_CPU(struct path_table *, path_tables);
+
+/* The first user argument of the system call that hit the kprobe */
+static const char __user *syscall_filename(struct pt_regs *regs)
+{
+#ifdef CONFIG_ARCH_HAS_SYSCALL_WRAPPER
+    /* The wrapper receives the registers the user passed in */
+    struct pt_regs *user_regs =
+        (struct pt_regs *)regs_get_kernel_argument(regs, 0);
+    unsigned long args[6];
+
+    syscall_get_arguments(current, user_regs, args);
+    return (const char __user *)args[1];
+#else
+    return (const char __user *)regs_get_kernel_argument(regs, 1);
+#endif
+}
+
+static void path_table_add(struct path_table *t, const char *path, long len)
+{
+    u64 key = hashlen_string(NULL, path);
+    unsigned int i, idx = key & (SAMPLER_SLOTS - 1);
+
+    for (i = 0; i < SAMPLER_PROBE_LIMIT; i++) {
+        struct path_slot *slot = &t->slots[idx];
+        u64 slot_key = slot->key;
+
+        if (slot_key == key && strcmp(slot->path, path) == 0) {
+            WRITE_ONCE(slot->count, slot->count + 1);
+            return;
+        }
+
+        if (!slot_key) {
+            memcpy(slot->path, path, len);
+            slot->count = 1;
+            /* Publish the path before readers can find the slot */
+            smp_store_release(&slot->key, key);
+            return;
+        }
+
+        idx = (idx + 1) & (SAMPLER_SLOTS - 1);
+    }
+
+    WRITE_ONCE(t->dropped, t->dropped + 1);
+}
+
+/* kprobe handlers run with preemption disabled, so the table of this CPU
+ * is ours for the whole handler and user memory must be read without
+ * faulting pages in.
+ */
+static int openat_pre_handler(struct kprobe *p, struct pt_regs *regs)
+{
+    char path[SAMPLER_PATH_LEN];
+    struct path_table *t;
+    long len;
+
+    if (uid != -1 && __kuid_val(current_uid()) != uid)
+        return 0;
+
+    t = this_cpu_read(path_tables);
+    WRITE_ONCE(t->hits, t->hits + 1);
+
+    /* Returns the length including the trailing NUL, truncating if needed */
+    len = strncpy_from_user_nofault(path, syscall_filename(regs), sizeof(path));
+    if (len <= 1) {
+        WRITE_ONCE(t->faults, t->faults + 1);
+        return 0;
+    }
+
+    path_table_add(t, path, len);
+
+    return 0;
+}
+
+static struct kprobe openat_kprobe = {
+    .pre_handler = openat_pre_handler,
+};
+
+struct path_count {
+    u64 key;
+    u64 count;
+    const char *path;
+};
+
+static int path_count_cmp_key(const void *a, const void *b)
+{
+    const struct path_count *x = a, *y = b;
+
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+static int path_count_cmp_count(const void *a, const void *b)
+{
+    const struct path_count *x = a, *y = b;
+
+    if (x->count != y->count)
+        return x->count > y->count ? -1 : 1;
+    return 0;
+}
+
+/* Merge the tables of all CPUs and print the top_n paths */
+static int sampler_show(struct seq_file *m, void *v)
+{
+    struct path_count *counts;
+    u64 hits = 0, dropped = 0, faults = 0;
+    size_t n = 0, merged = 0, i;
+    int cpu;
+
+    counts = kvmalloc_array(num_possible_cpus() * SAMPLER_SLOTS,
+                            sizeof(*counts), GFP_KERNEL);
+    if (!counts)
+        return -ENOMEM;
+
+    for_each_possible_cpu (cpu) {
+        struct path_table *t = per_cpu(path_tables, cpu);
+
+        hits += READ_ONCE(t->hits);
+        dropped += READ_ONCE(t->dropped);
+        faults += READ_ONCE(t->faults);
+
+        for (i = 0; i < SAMPLER_SLOTS; i++) {
+            struct path_slot *slot = &t->slots[i];
+            u64 key = smp_load_acquire(&slot->key);
+
+            if (!key)
+                continue;
+
+            counts[n].key = key;
+            counts[n].count = READ_ONCE(slot->count);
+            counts[n].path = slot->path;
+            n++;
+        }
+    }
+
+    /* The same path may live in the table of every CPU */
+    sort(counts, n, sizeof(*counts), path_count_cmp_key, NULL);
+    for (i = 0; i < n; i++) {
+        if (merged && path_count_cmp_key(&counts[merged - 1], &counts[i]) == 0)
+            counts[merged - 1].count += counts[i].count;
+        else
+            counts[merged++] = counts[i];
+    }
+
+    sort(counts, merged, sizeof(*counts), path_count_cmp_count, NULL);
+
+    seq_printf(m, "hits %llu dropped %llu faults %llu paths %zu\n", hits,
+               dropped, faults, merged);
+    for (i = 0; i < merged && i < top_n; i++)
+        seq_printf(m, "%12llu %s\n", counts[i].count, counts[i].path);
+
+    kvfree(counts);
+
+    return 0;
+}
+
+static void path_tables_free(void)
+{
+    int cpu;
+
+    for_each_possible_cpu (cpu) {
+        vfree(per_cpu(path_tables, cpu));
+        per_cpu(path_tables, cpu) = NULL;
+    }
+}
+
+static int path_tables_alloc(void)
+{
+    int cpu;
+
+    for_each_possible_cpu (cpu) {
+        struct path_table *t = vzalloc_node(sizeof(*t), cpu_to_node(cpu));
+
+        if (!t) {
+            path_tables_free();
+            return -ENOMEM;
+        }
+        per_cpu(path_tables, cpu) = t;
+    }
+
+    return 0;
+}
+
+static int __init syscall_sampler_start(void)
+{
+    int err;
+
+    err = path_tables_alloc();
+    if (err)
+        return err;
+
+    if (!proc_create_single(PROC_NAME, 0444, NULL, sampler_show)) {
+        err = -ENOMEM;
+        goto fail_proc;
+    }
+
+    openat_kprobe.symbol_name = syscall_sym;
+    err = register_kprobe(&openat_kprobe);
+    if (err) {
+        pr_err("register_kprobe() on %s failed: %d\n", syscall_sym, err);
+        goto fail_kprobe;
+    }
+
+    pr_info("Sampling %s for UID:%d, see /proc/%s\n", syscall_sym, uid,
+            PROC_NAME);
+    return 0;
+
+fail_kprobe:
+    remove_proc_entry(PROC_NAME, NULL);
+fail_proc:
+    path_tables_free();
+    return err;
+}
+
+static void __exit syscall_sampler_end(void)
+{
+    /* Waits for running handlers, so the tables can go right after */
+    unregister_kprobe(&openat_kprobe);
+    remove_proc_entry(PROC_NAME, NULL);
+    path_tables_free();
+}
+
+module_init(syscall_sampler_start);
+module_exit(syscall_sampler_end);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Per-CPU aggregated openat() sampling with kprobes");
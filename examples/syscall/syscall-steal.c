@@ -5,12 +5,25 @@
  *
  * Disables page protection at a processor level by changing the 16th bit
  * in the cr0 register (could be Intel specific).
+ *
+ * openat, read, write, close and connect can each be hooked on its own.
+ * Every hook has a filter on uid, pid and cgroup. Hooks are installed and
+ * filters changed at runtime through
+ * /sys/kernel/syscall_steal/<syscall>/{enable,uid,pid,cgroup}.
+ * Calls that pass the filter are reported through the per-CPU rings of
+ * syscall_ring.ko, which has to be loaded first.
  */
 
+#include <linux/cgroup.h> /* For cgroup_id() */
+#include <linux/atomic.h>
 #include <linux/delay.h>
 #include <linux/kernel.h>
+#include <linux/kobject.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h> /* which will have params */
+#include <linux/mutex.h>
+#include <linux/sysfs.h>
+#include <linux/wait.h>
 #include <linux/unistd.h> /* The list of system calls */
 #include <linux/cred.h> /* For current_uid() */
 #include <linux/uidgid.h> /* For __kuid_val() */
@@ -22,6 +35,8 @@
 #include <linux/sched.h>
 #include <linux/uaccess.h>
 
+#include "syscall_ring.h" /* For syscall_ring_emit() */
+
 /* The way we access "sys_call_table" varies as kernel internal changes.
  * - Prior to v5.4 : manual symbol lookup
  * - v5.5 to v5.6  : use kallsyms_lookup_name()
@@ -66,7 +81,9 @@ module_param(sym, ulong, 0644);
 
 #endif /* Version < v5.7 */
 
-/* UID we want to spy on - will be filled from the command line. */
+/* UID we want to spy on - will be filled from the command line. It is
+ * also the initial uid filter of every hook, where -1 matches everybody.
+ */
 static uid_t uid = -1;
 module_param(uid, int, 0644);
 
@@ -98,26 +115,26 @@ static struct kprobe syscall_kprobe = {
 
 static unsigned long **sys_call_table_stolen;
 
-/* A pointer to the original system call. The reason we keep this, rather
- * than call the original function (sys_openat), is because somebody else
- * might have replaced the system call before us. Note that this is not
- * 100% safe, because if another module replaced sys_openat before us,
- * then when we are inserted, we will call the function in that module -
- * and it might be removed before we are.
- *
- * Another reason for this is that we can not get sys_openat.
- * It is a static variable, so it is not exported.
- */
-#ifdef CONFIG_ARCH_HAS_SYSCALL_WRAPPER
-static asmlinkage long (*original_call)(const struct pt_regs *);
-#else
-static asmlinkage long (*original_call)(int, const char __user *, int, umode_t);
-#endif
+/* The system calls we can spy on, each one can be hooked on its own */
+enum {
+    HOOK_OPENAT,
+    HOOK_READ,
+    HOOK_WRITE,
+    HOOK_CLOSE,
+    HOOK_CONNECT,
+    NR_HOOKS,
+};
 
-/* The function we will replace sys_openat (the function called when you
- * call the open system call) with. To find the exact prototype, with
- * the number and type of arguments, we find the original function first
- * (it is at fs/open.c).
+/* Bitmask of the hooks installed at load time, bit n is hook n */
+static unsigned int enable_mask = 1 << HOOK_OPENAT;
+module_param(enable_mask, uint, 0444);
+MODULE_PARM_DESC(enable_mask, "Hooks installed at load: 1 openat, 2 read, "
+                              "4 write, 8 close, 16 connect");
+
+/* To find the exact prototype of a system call, with the number and type
+ * of arguments, we find the original function first (openat is at
+ * fs/open.c). With the syscall wrapper every system call takes the saved
+ * user registers instead, and the arguments are read from there.
  *
  * In theory, this means that we are tied to the current version of the
  * kernel. In practice, the system calls almost never change (it would
@@ -125,42 +142,153 @@ static asmlinkage long (*original_call)(int, const char __user *, int, umode_t);
  * calls are the interface between the kernel and the processes).
  */
 #ifdef CONFIG_ARCH_HAS_SYSCALL_WRAPPER
-static asmlinkage long our_sys_openat(const struct pt_regs *regs)
+typedef asmlinkage long (*syscall_fn_t)(const struct pt_regs *);
+#define HOOK_PARAMS const struct pt_regs *regs
+#define HOOK_ARGS regs
+#define HOOK_ARG0 regs->di
+#define HOOK_ARG1 regs->si
 #else
-static asmlinkage long our_sys_openat(int dfd, const char __user *filename,
-                                      int flags, umode_t mode)
+/* None of the hooked calls takes more than six arguments, and handing six
+ * longs to one that takes fewer is harmless since they are all passed in
+ * registers.
+ */
+typedef asmlinkage long (*syscall_fn_t)(unsigned long, unsigned long,
+                                        unsigned long, unsigned long,
+                                        unsigned long, unsigned long);
+#define HOOK_PARAMS                                                            \
+    unsigned long a0, unsigned long a1, unsigned long a2, unsigned long a3,    \
+        unsigned long a4, unsigned long a5
+#define HOOK_ARGS a0, a1, a2, a3, a4, a5
+#define HOOK_ARG0 a0
+#define HOOK_ARG1 a1
 #endif
-{
-    int i = 0;
-    char ch;
 
-    if (__kuid_val(current_uid()) != uid)
-        goto orig_call;
+/* Evaluated on every hooked call without taking any lock, so each field
+ * is read once. -1 (or 0 for the cgroup) matches everything.
+ */
+struct syscall_filter {
+    int uid;
+    int pid; /* the thread group id, what user space calls a pid */
+    u64 cgroup; /* id of a cgroup v2 directory, i.e. its inode number */
+};
 
-    /* Report the file, if relevant */
-    pr_info("Opened file by %d: ", uid);
-    do {
-#ifdef CONFIG_ARCH_HAS_SYSCALL_WRAPPER
-        get_user(ch, (char __user *)regs->si + i);
-#else
-        get_user(ch, (char __user *)filename + i);
-#endif
-        i++;
-        pr_info("%c", ch);
-    } while (ch != 0);
-    pr_info("\n");
-
-orig_call:
-    /* Call the original sys_openat - otherwise, we lose the ability to
-     * open files.
+struct syscall_hook {
+    const char *name;
+    unsigned int nr; /* __NR_* and index into sys_call_table */
+    bool has_path; /* the second argument is a path in user memory */
+    bool enabled; /* our function is in sys_call_table */
+
+    /* A pointer to the original system call. The reason we keep this,
+     * rather than call the original function (e.g. sys_openat), is because
+     * somebody else might have replaced the system call before us. Note
+     * that this is not 100% safe, because if another module replaced
+     * sys_openat before us, then when we are inserted, we will call the
+     * function in that module - and it might be removed before we are.
+     *
+     * Another reason for this is that we can not get sys_openat.
+     * It is a static variable, so it is not exported.
      */
-#ifdef CONFIG_ARCH_HAS_SYSCALL_WRAPPER
-    return original_call(regs);
+    syscall_fn_t original;
+
+    struct syscall_filter filter;
+    struct kobject *kobj;
+};
+
+static struct syscall_hook syscall_hooks[NR_HOOKS] = {
+    [HOOK_OPENAT] = { .name = "openat", .nr = __NR_openat, .has_path = true },
+    [HOOK_READ] = { .name = "read", .nr = __NR_read },
+    [HOOK_WRITE] = { .name = "write", .nr = __NR_write },
+    [HOOK_CLOSE] = { .name = "close", .nr = __NR_close },
+    [HOOK_CONNECT] = { .name = "connect", .nr = __NR_connect },
+};
+
+/* Serializes sysfs writers patching sys_call_table */
+static DEFINE_MUTEX(hooks_mutex);
+
+/* Calls inside one of our functions. Some, like a read() of a pipe or a
+ * connect(), block in the original for as long as they like, and must be
+ * back in our function before the module can go.
+ */
+static atomic_t hooks_in_flight = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(hooks_wait);
+
+#ifdef CONFIG_CGROUPS
+static bool hook_cgroup_match(u64 want)
+{
+    u64 id;
+
+    if (!want)
+        return true;
+
+    rcu_read_lock();
+    id = cgroup_id(task_dfl_cgroup(current));
+    rcu_read_unlock();
+
+    return id == want;
+}
 #else
-    return original_call(dfd, filename, flags, mode);
+static bool hook_cgroup_match(u64 want)
+{
+    return true;
+}
 #endif
+
+static bool hook_filter_match(const struct syscall_filter *f)
+{
+    int want_uid = READ_ONCE(f->uid);
+    int want_pid = READ_ONCE(f->pid);
+
+    if (want_uid != -1 && __kuid_val(current_uid()) != want_uid)
+        return false;
+
+    if (want_pid != -1 && task_tgid_nr(current) != want_pid)
+        return false;
+
+    return hook_cgroup_match(READ_ONCE(f->cgroup));
+}
+
+/* Filtered out calls return before any user memory is touched. Calls that
+ * pass are queued on the ring of this CPU, read them with
+ * syscall_ring_consumer.
+ */
+static void hook_report(const struct syscall_hook *hook, unsigned long arg0,
+                        unsigned long arg1)
+{
+    if (!hook_filter_match(&hook->filter))
+        return;
+
+    syscall_ring_emit(hook->nr, arg0,
+                      hook->has_path ? (const char __user *)arg1 : NULL);
 }
 
+/* The functions we put into sys_call_table. Each one reports the call and
+ * then calls the original - otherwise, we lose the ability to open files.
+ */
+#define DEFINE_HOOK(_name, _idx)                                               \
+    static asmlinkage long our_sys_##_name(HOOK_PARAMS)                        \
+    {                                                                          \
+        long ret;                                                              \
+                                                                               \
+        atomic_inc(&hooks_in_flight);                                          \
+        hook_report(&syscall_hooks[_idx], HOOK_ARG0, HOOK_ARG1);               \
+        ret = syscall_hooks[_idx].original(HOOK_ARGS);                         \
+        if (atomic_dec_and_test(&hooks_in_flight))                             \
+            wake_up(&hooks_wait);                                              \
+        return ret;                                                            \
+    }
+
+DEFINE_HOOK(openat, HOOK_OPENAT)
+DEFINE_HOOK(read, HOOK_READ)
+DEFINE_HOOK(write, HOOK_WRITE)
+DEFINE_HOOK(close, HOOK_CLOSE)
+DEFINE_HOOK(connect, HOOK_CONNECT)
+
+static const syscall_fn_t hook_functions[NR_HOOKS] = {
+    [HOOK_OPENAT] = our_sys_openat, [HOOK_READ] = our_sys_read,
+    [HOOK_WRITE] = our_sys_write,   [HOOK_CLOSE] = our_sys_close,
+    [HOOK_CONNECT] = our_sys_connect,
+};
+
 static unsigned long **acquire_sys_call_table(void)
 {
 #ifdef HAVE_KSYS_CLOSE
@@ -236,6 +364,195 @@ static void disable_write_protection(void)
     clear_bit(16, &cr0);
     __write_cr0(cr0);
 }
+
+/* Installs or removes one hook, called with hooks_mutex held */
+static void hook_set(struct syscall_hook *hook, bool on)
+{
+    unsigned long *ours = (unsigned long *)hook_functions[hook - syscall_hooks];
+
+    if (hook->enabled == on)
+        return;
+
+    /* cr0 belongs to the CPU, do not move while write protection is off */
+    preempt_disable();
+    disable_write_protection();
+
+    if (on) {
+        /* keep track of the original function before ours can run */
+        hook->original = (syscall_fn_t)sys_call_table_stolen[hook->nr];
+        smp_wmb();
+        sys_call_table_stolen[hook->nr] = ours;
+    } else {
+        /* Return the system call back to normal */
+        if (sys_call_table_stolen[hook->nr] != ours)
+            pr_alert("Somebody else also played with the %s system call, "
+                     "the system may be left in an unstable state.\n",
+                     hook->name);
+        sys_call_table_stolen[hook->nr] = (unsigned long *)hook->original;
+    }
+
+    enable_write_protection();
+    preempt_enable();
+
+    hook->enabled = on;
+}
+
+/* The filter table lives in /sys/kernel/syscall_steal/<syscall>/ */
+static struct kobject *steal_kobj;
+
+static struct syscall_hook *kobj_to_hook(struct kobject *kobj)
+{
+    int i;
+
+    for (i = 0; i < NR_HOOKS; i++)
+        if (syscall_hooks[i].kobj == kobj)
+            return &syscall_hooks[i];
+
+    return NULL;
+}
+
+static ssize_t enable_show(struct kobject *kobj, struct kobj_attribute *attr,
+                           char *buf)
+{
+    return sprintf(buf, "%d\n", kobj_to_hook(kobj)->enabled);
+}
+
+static ssize_t enable_store(struct kobject *kobj, struct kobj_attribute *attr,
+                            const char *buf, size_t count)
+{
+    bool on;
+    int err;
+
+    err = kstrtobool(buf, &on);
+    if (err)
+        return err;
+
+    mutex_lock(&hooks_mutex);
+    hook_set(kobj_to_hook(kobj), on);
+    mutex_unlock(&hooks_mutex);
+
+    return count;
+}
+
+static ssize_t uid_show(struct kobject *kobj, struct kobj_attribute *attr,
+                        char *buf)
+{
+    return sprintf(buf, "%d\n", READ_ONCE(kobj_to_hook(kobj)->filter.uid));
+}
+
+static ssize_t uid_store(struct kobject *kobj, struct kobj_attribute *attr,
+                         const char *buf, size_t count)
+{
+    int val, err;
+
+    err = kstrtoint(buf, 0, &val);
+    if (err)
+        return err;
+
+    WRITE_ONCE(kobj_to_hook(kobj)->filter.uid, val);
+    return count;
+}
+
+static ssize_t pid_show(struct kobject *kobj, struct kobj_attribute *attr,
+                        char *buf)
+{
+    return sprintf(buf, "%d\n", READ_ONCE(kobj_to_hook(kobj)->filter.pid));
+}
+
+static ssize_t pid_store(struct kobject *kobj, struct kobj_attribute *attr,
+                         const char *buf, size_t count)
+{
+    int val, err;
+
+    err = kstrtoint(buf, 0, &val);
+    if (err)
+        return err;
+
+    WRITE_ONCE(kobj_to_hook(kobj)->filter.pid, val);
+    return count;
+}
+
+static ssize_t cgroup_show(struct kobject *kobj, struct kobj_attribute *attr,
+                           char *buf)
+{
+    return sprintf(buf, "%llu\n", READ_ONCE(kobj_to_hook(kobj)->filter.cgroup));
+}
+
+static ssize_t cgroup_store(struct kobject *kobj, struct kobj_attribute *attr,
+                            const char *buf, size_t count)
+{
+    u64 val;
+    int err;
+
+    err = kstrtou64(buf, 0, &val);
+    if (err)
+        return err;
+
+    WRITE_ONCE(kobj_to_hook(kobj)->filter.cgroup, val);
+    return count;
+}
+
+static struct kobj_attribute enable_attribute =
+    __ATTR(enable, 0600, enable_show, enable_store);
+static struct kobj_attribute uid_attribute =
+    __ATTR(uid, 0600, uid_show, uid_store);
+static struct kobj_attribute pid_attribute =
+    __ATTR(pid, 0600, pid_show, pid_store);
+static struct kobj_attribute cgroup_attribute =
+    __ATTR(cgroup, 0600, cgroup_show, cgroup_store);
+
+static struct attribute *hook_attrs[] = {
+    &enable_attribute.attr,
+    &uid_attribute.attr,
+    &pid_attribute.attr,
+    &cgroup_attribute.attr,
+    NULL,
+};
+
+static const struct attribute_group hook_attr_group = {
+    .attrs = hook_attrs,
+};
+
+static void hooks_sysfs_remove(void)
+{
+    int i;
+
+    for (i = 0; i < NR_HOOKS; i++) {
+        kobject_put(syscall_hooks[i].kobj);
+        syscall_hooks[i].kobj = NULL;
+    }
+    kobject_put(steal_kobj);
+    steal_kobj = NULL;
+}
+
+static int hooks_sysfs_create(void)
+{
+    int i, err;
+
+    steal_kobj = kobject_create_and_add("syscall_steal", kernel_kobj);
+    if (!steal_kobj)
+        return -ENOMEM;
+
+    for (i = 0; i < NR_HOOKS; i++) {
+        struct syscall_hook *hook = &syscall_hooks[i];
+
+        hook->kobj = kobject_create_and_add(hook->name, steal_kobj);
+        if (!hook->kobj) {
+            err = -ENOMEM;
+            goto fail;
+        }
+
+        err = sysfs_create_group(hook->kobj, &hook_attr_group);
+        if (err)
+            goto fail;
+    }
+
+    return 0;
+
+fail:
+    hooks_sysfs_remove();
+    return err;
+}
 #endif
 
 static int __init syscall_steal_start(void)
@@ -251,18 +568,26 @@ static int __init syscall_steal_start(void)
         return err;
     }
 #else
+    int i, err;
+
     if (!(sys_call_table_stolen = acquire_sys_call_table()))
         return -1;
 
-    disable_write_protection();
-
-    /* keep track of the original open function */
-    original_call = (void *)sys_call_table_stolen[__NR_openat];
+    for (i = 0; i < NR_HOOKS; i++) {
+        syscall_hooks[i].filter.uid = uid;
+        syscall_hooks[i].filter.pid = -1;
+        syscall_hooks[i].filter.cgroup = 0;
+    }
 
-    /* use our openat function instead */
-    sys_call_table_stolen[__NR_openat] = (unsigned long *)our_sys_openat;
+    err = hooks_sysfs_create();
+    if (err)
+        return err;
 
-    enable_write_protection();
+    /* use our functions instead */
+    mutex_lock(&hooks_mutex);
+    for (i = 0; i < NR_HOOKS; i++)
+        hook_set(&syscall_hooks[i], enable_mask & (1 << i));
+    mutex_unlock(&hooks_mutex);
 #endif
 
     pr_info("Spying on UID:%d\n", uid);
@@ -274,22 +599,30 @@ static void __exit syscall_steal_end(void)
 #if USE_KPROBES_PRE_HANDLER_BEFORE_SYSCALL
     unregister_kprobe(&syscall_kprobe);
 #else
+    int i;
+
     if (!sys_call_table_stolen)
         return;
 
-    /* Return the system call back to normal */
-    if (sys_call_table_stolen[__NR_openat] != (unsigned long *)our_sys_openat) {
-        pr_alert("Somebody else also played with the ");
-        pr_alert("open system call\n");
-        pr_alert("The system may be left in ");
-        pr_alert("an unstable state.\n");
-    }
+    /* No more writers once the files are gone */
+    hooks_sysfs_remove();
 
-    disable_write_protection();
-    sys_call_table_stolen[__NR_openat] = (unsigned long *)original_call;
-    enable_write_protection();
+    mutex_lock(&hooks_mutex);
+    for (i = 0; i < NR_HOOKS; i++)
+        hook_set(&syscall_hooks[i], false);
+    mutex_unlock(&hooks_mutex);
+
+    /* No new call comes in, wait for the ones blocked in the original */
+    while (!wait_event_timeout(hooks_wait, !atomic_read(&hooks_in_flight),
+                               10 * HZ))
+        pr_info("Waiting for %d hooked calls to return\n",
+                atomic_read(&hooks_in_flight));
 #endif
 
+    /* Calls that just entered one of our functions but did not count
+     * themselves yet, or just counted themselves out, are still running its
+     * first or last few instructions.
+     */
     msleep(2000);
 }
 
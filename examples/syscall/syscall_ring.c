@@ -0,0 +1,262 @@
+/*
+ * syscall_ring.c
+ *
+ * Per-CPU event rings for intercepted system calls.
+ *
+ * Printing every intercepted call with printk serializes all callers on
+ * the console lock and loses events as soon as the log buffer wraps. This
+ * module gives every possible CPU its own ring of fixed-size binary events
+ * instead. Producers (see syscall-steal.c) call syscall_ring_emit(), which
+ * copies the path from user space once and fills a slot of the ring owned
+ * by the current CPU, with preemption disabled so that the ring has a single
+ * producer at any time. A full ring drops the event and counts it; the
+ * caller never waits for the consumer.
+ *
+ * User space maps the rings from /dev/syscall_ring, drains them directly
+ * and sleeps in poll() once all of them are empty (see
+ * syscall_ring_consumer.c). The layout is described in syscall_ring.h.
+ */
+
+#include <linux/cpumask.h>
+#include <linux/cred.h> /* For current_uid() */
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/timekeeping.h>
+#include <linux/uaccess.h>
+#include <linux/uidgid.h> /* For __kuid_val() */
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+#include "syscall_ring.h"
+
+static unsigned int nr_events = 4096;
+module_param(nr_events, uint, 0444);
+MODULE_PARM_DESC(nr_events, "Events per CPU ring, rounded up to a power of "
+                            "two");
+
+struct syscall_ring {
+    struct syscall_ring_header *hdr; /* start of the mapping */
+    struct syscall_ring_event *events; /* the page after the header */
+};
+
+static DEFINE_PER_CPU(struct syscall_ring, rings);
+static size_t ring_bytes;
+
+static DECLARE_WAIT_QUEUE_HEAD(ring_wait);
+
+static int major;
+static struct class *cls;
+
+void syscall_ring_emit(unsigned int syscall, u64 arg,
+                       const char __user *path)
+{
+    char buf[SYSCALL_RING_PATH_LEN];
+    struct syscall_ring_header *hdr;
+    struct syscall_ring_event *ev;
+    struct syscall_ring *ring;
+    long len = 0;
+    u64 head, tail;
+
+    /* One copy for the whole string, before preemption gets disabled
+     * since reading user memory may fault.
+     */
+    if (path) {
+        len = strncpy_from_user(buf, path, sizeof(buf));
+        if (len < 0)
+            len = 0;
+        else if (len == sizeof(buf))
+            len--; /* truncated, no NUL was copied */
+    }
+    buf[len] = '\0';
+
+    ring = get_cpu_ptr(&rings);
+    hdr = ring->hdr;
+
+    head = hdr->head;
+    /* Pairs with the release of the consumer: the slot is only reused once
+     * the consumer is done reading it.
+     */
+    tail = smp_load_acquire(&hdr->tail);
+    if (head - tail >= nr_events) {
+        WRITE_ONCE(hdr->dropped, hdr->dropped + 1);
+        put_cpu_ptr(&rings);
+        return;
+    }
+
+    ev = &ring->events[head & (nr_events - 1)];
+    ev->ts = ktime_get_ns();
+    ev->pid = task_tgid_nr(current);
+    ev->uid = __kuid_val(current_uid());
+    ev->syscall = syscall;
+    ev->arg = arg;
+    ev->path_len = len;
+    memcpy(ev->path, buf, len + 1);
+
+    /* Publish the event before the consumer can see the new head */
+    smp_store_release(&hdr->head, head + 1);
+    put_cpu_ptr(&rings);
+
+    /* The tail read above may be stale, and the consumer may have gone to
+     * sleep since: wake it whenever it sleeps. wq_has_sleeper() has the
+     * barrier that orders the new head against its check in ring_poll().
+     */
+    if (wq_has_sleeper(&ring_wait))
+        wake_up_interruptible(&ring_wait);
+}
+EXPORT_SYMBOL(syscall_ring_emit);
+
+static __poll_t ring_poll(struct file *file, poll_table *wait)
+{
+    int cpu;
+
+    poll_wait(file, &ring_wait, wait);
+
+    for_each_possible_cpu (cpu) {
+        struct syscall_ring_header *hdr = per_cpu(rings, cpu).hdr;
+
+        if (smp_load_acquire(&hdr->head) != READ_ONCE(hdr->tail))
+            return EPOLLIN | EPOLLRDNORM;
+    }
+
+    return 0;
+}
+
+/* The ring of CPU n lives at offset n * ring_bytes */
+static int ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    unsigned long ring_pages = ring_bytes >> PAGE_SHIFT;
+    unsigned long cpu = vma->vm_pgoff / ring_pages;
+
+    if (vma->vm_pgoff % ring_pages)
+        return -EINVAL;
+    if (cpu >= nr_cpu_ids || !cpu_possible(cpu))
+        return -EINVAL;
+    if (vma->vm_end - vma->vm_start > ring_bytes)
+        return -EINVAL;
+
+    return remap_vmalloc_range(vma, per_cpu(rings, cpu).hdr, 0);
+}
+
+static long ring_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct syscall_ring_info info = {
+        .nr_rings = nr_cpu_ids,
+        .nr_events = nr_events,
+        .ring_bytes = ring_bytes,
+    };
+
+    if (cmd != SYSCALL_RING_GET_INFO)
+        return -ENOTTY;
+
+    if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static const struct file_operations ring_fops = {
+    .owner = THIS_MODULE,
+    .poll = ring_poll,
+    .mmap = ring_mmap,
+    .unlocked_ioctl = ring_ioctl,
+};
+
+static void rings_free(void)
+{
+    int cpu;
+
+    for_each_possible_cpu (cpu) {
+        vfree(per_cpu(rings, cpu).hdr);
+        per_cpu(rings, cpu).hdr = NULL;
+    }
+}
+
+static int rings_alloc(void)
+{
+    int cpu;
+
+    for_each_possible_cpu (cpu) {
+        struct syscall_ring *ring = per_cpu_ptr(&rings, cpu);
+
+        /* Zeroed and ready for remap_vmalloc_range() */
+        ring->hdr = vmalloc_user(ring_bytes);
+        if (!ring->hdr) {
+            rings_free();
+            return -ENOMEM;
+        }
+
+        ring->hdr->nr_events = nr_events;
+        ring->hdr->event_size = sizeof(struct syscall_ring_event);
+        ring->events = (void *)ring->hdr + PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+static int __init syscall_ring_init(void)
+{
+    int err;
+
+    BUILD_BUG_ON(sizeof(struct syscall_ring_header) > PAGE_SIZE);
+
+    if (!nr_events)
+        return -EINVAL;
+    nr_events = roundup_pow_of_two(nr_events);
+    ring_bytes = PAGE_SIZE +
+                 PAGE_ALIGN(nr_events * sizeof(struct syscall_ring_event));
+
+    err = rings_alloc();
+    if (err)
+        return err;
+
+    major = register_chrdev(0, SYSCALL_RING_DEVICE_NAME, &ring_fops);
+    if (major < 0) {
+        pr_alert("Registering char device failed with %d\n", major);
+        err = major;
+        goto fail_chrdev;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    cls = class_create(SYSCALL_RING_DEVICE_NAME);
+#else
+    cls = class_create(THIS_MODULE, SYSCALL_RING_DEVICE_NAME);
+#endif
+    if (IS_ERR(cls)) {
+        err = PTR_ERR(cls);
+        goto fail_class;
+    }
+    device_create(cls, NULL, MKDEV(major, 0), NULL, SYSCALL_RING_DEVICE_NAME);
+
+    pr_info("%u events of %zu bytes per CPU on %s\n", nr_events,
+            sizeof(struct syscall_ring_event), SYSCALL_RING_DEVICE_PATH);
+    return 0;
+
+fail_class:
+    unregister_chrdev(major, SYSCALL_RING_DEVICE_NAME);
+fail_chrdev:
+    rings_free();
+    return err;
+}
+
+static void __exit syscall_ring_exit(void)
+{
+    device_destroy(cls, MKDEV(major, 0));
+    class_destroy(cls);
+    unregister_chrdev(major, SYSCALL_RING_DEVICE_NAME);
+    rings_free();
+}
+
+module_init(syscall_ring_init);
+module_exit(syscall_ring_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Per-CPU mmap()able rings of intercepted system calls");
@@ -0,0 +1,64 @@
+/*
+ * syscall_ring.h - layout of the per-CPU syscall event rings
+ *
+ * Shared by the kernel module (syscall_ring.c), the modules that produce
+ * events (syscall-steal.c) and the user-space consumer
+ * (syscall_ring_consumer.c).
+ *
+ * Every possible CPU owns one ring. A ring is one header page followed by
+ * nr_events fixed-size event slots, and the ring of CPU n is mapped at
+ * offset n * ring_bytes of /dev/syscall_ring. The kernel only ever moves
+ * head, the consumer only ever moves tail. When the ring is full the event
+ * is dropped and counted, the producer never waits.
+ */
+
+#ifndef SYSCALL_RING_H
+#define SYSCALL_RING_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define SYSCALL_RING_DEVICE_NAME "syscall_ring"
+#define SYSCALL_RING_DEVICE_PATH "/dev/syscall_ring"
+
+#define SYSCALL_RING_PATH_LEN 224
+
+struct syscall_ring_event {
+    __u64 ts; /* ktime_get_ns(), i.e. CLOCK_MONOTONIC */
+    __u32 pid;
+    __u32 uid;
+    __u32 syscall; /* __NR_* of the intercepted call */
+    __u32 path_len;
+    __u64 arg; /* first argument of the call, e.g. the fd */
+    char path[SYSCALL_RING_PATH_LEN]; /* empty unless the call takes one */
+};
+
+/* head and tail sit on their own cache lines so producer and consumer do
+ * not keep stealing the line from each other.
+ */
+struct syscall_ring_header {
+    __u64 head; /* written by the kernel, next slot to fill */
+    __u64 pad0[7];
+    __u64 tail; /* written by the consumer, next slot to read */
+    __u64 pad1[7];
+    __u64 dropped; /* events lost because the ring was full */
+    __u32 nr_events; /* slots in the ring, a power of two */
+    __u32 event_size;
+};
+
+struct syscall_ring_info {
+    __u32 nr_rings; /* one per possible CPU */
+    __u32 nr_events;
+    __u64 ring_bytes; /* mmap() stride between rings */
+};
+
+#define SYSCALL_RING_IOC_MAGIC 's'
+#define SYSCALL_RING_GET_INFO                                                  \
+    _IOR(SYSCALL_RING_IOC_MAGIC, 0, struct syscall_ring_info)
+
+#ifdef __KERNEL__
+void syscall_ring_emit(unsigned int syscall, u64 arg,
+                       const char __user *path);
+#endif
+
+#endif
@@ -0,0 +1,214 @@
+/*
+ * syscall_ring_consumer.c - drain the per-CPU rings of syscall_ring.ko
+ *
+ * Maps the ring of every CPU from /dev/syscall_ring, consumes the events
+ * in place and sleeps in poll() whenever all rings are empty. Once a second
+ * it prints how many events were consumed and dropped, and how much CPU
+ * time the consumer itself used doing so:
+ *
+ *   sudo insmod syscall_ring.ko
+ *   sudo insmod syscall-steal.ko uid=$(id -u)
+ *   sudo ./syscall_ring_consumer -d 10 &
+ *   ./syscall_bench -n 10000000
+ *
+ * With -v every event is printed as well, which of course costs far more
+ * than consuming it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "syscall_ring.h"
+
+struct ring {
+    struct syscall_ring_header *hdr;
+    const struct syscall_ring_event *events;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+           (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+/* Consume everything queued on one ring, returns the number of events */
+static uint64_t ring_drain(struct ring *r, uint32_t mask, int verbose)
+{
+    uint64_t tail = r->hdr->tail;
+    uint64_t head = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+    uint64_t n = head - tail;
+
+    for (; tail != head; tail++) {
+        const struct syscall_ring_event *ev = &r->events[tail & mask];
+
+        if (verbose)
+            printf("%llu pid %u uid %u nr %u arg %lld %.*s\n",
+                   (unsigned long long)ev->ts, ev->pid, ev->uid, ev->syscall,
+                   (long long)ev->arg, (int)ev->path_len, ev->path);
+    }
+
+    /* Hands the slots back to the kernel once we are done with them */
+    __atomic_store_n(&r->hdr->tail, tail, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+static uint64_t rings_dropped(struct ring *rings, unsigned int nr_rings)
+{
+    uint64_t dropped = 0;
+    unsigned int i;
+
+    for (i = 0; i < nr_rings; i++)
+        if (rings[i].hdr)
+            dropped +=
+                __atomic_load_n(&rings[i].hdr->dropped, __ATOMIC_RELAXED);
+
+    return dropped;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-d seconds] [-v]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    struct syscall_ring_info info;
+    struct ring *rings;
+    unsigned int duration = 0, i;
+    uint64_t total = 0, interval = 0, wakeups = 0;
+    uint64_t start, last, cpu_start, cpu_last, dropped_start, dropped_last;
+    uint64_t elapsed, cpu_used;
+    int verbose = 0, fd, opt;
+
+    while ((opt = getopt(argc, argv, "d:v")) != -1) {
+        switch (opt) {
+        case 'd':
+            duration = strtoul(optarg, NULL, 0);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    fd = open(SYSCALL_RING_DEVICE_PATH, O_RDONLY);
+    if (fd < 0) {
+        perror(SYSCALL_RING_DEVICE_PATH);
+        return EXIT_FAILURE;
+    }
+
+    if (ioctl(fd, SYSCALL_RING_GET_INFO, &info) < 0) {
+        perror("SYSCALL_RING_GET_INFO");
+        return EXIT_FAILURE;
+    }
+
+    rings = calloc(info.nr_rings, sizeof(*rings));
+    if (!rings) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    /* Rings of CPUs that are not possible can not be mapped, skip them */
+    for (i = 0; i < info.nr_rings; i++) {
+        void *p = mmap(NULL, info.ring_bytes, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, (off_t)i * info.ring_bytes);
+
+        if (p == MAP_FAILED)
+            continue;
+        rings[i].hdr = p;
+        rings[i].events =
+            (const struct syscall_ring_event *)((char *)p + getpagesize());
+    }
+
+    start = last = now_ns();
+    cpu_start = cpu_last = cpu_ns();
+    dropped_start = dropped_last = rings_dropped(rings, info.nr_rings);
+
+    for (;;) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        uint64_t n = 0, now;
+
+        for (i = 0; i < info.nr_rings; i++)
+            if (rings[i].hdr)
+                n += ring_drain(&rings[i], info.nr_events - 1, verbose);
+        interval += n;
+
+        /* Only sleep once every ring came back empty */
+        if (!n) {
+            if (poll(&pfd, 1, 1000) < 0 && errno != EINTR) {
+                perror("poll");
+                break;
+            }
+            wakeups++;
+        }
+
+        now = now_ns();
+        if (now - last >= 1000000000ULL) {
+            uint64_t cpu = cpu_ns();
+            uint64_t dropped = rings_dropped(rings, info.nr_rings);
+            double secs = (now - last) / 1e9;
+
+            fprintf(stderr,
+                    "%10.0f events/s %10.0f drops/s %6.2f%% cpu %8.1f "
+                    "ns/event\n",
+                    interval / secs, (dropped - dropped_last) / secs,
+                    100.0 * (cpu - cpu_last) / (now - last),
+                    interval ? (double)(cpu - cpu_last) / interval : 0.0);
+
+            total += interval;
+            interval = 0;
+            last = now;
+            cpu_last = cpu;
+            dropped_last = dropped;
+
+            if (duration && now - start >= duration * 1000000000ULL)
+                break;
+        }
+    }
+
+    total += interval;
+    elapsed = now_ns() - start;
+    cpu_used = cpu_ns() - cpu_start;
+
+    fprintf(stderr,
+            "total %llu events %llu dropped %llu polls in %.2fs, "
+            "%.0f events/s, %.2f%% cpu, %.1f ns/event\n",
+            (unsigned long long)total,
+            (unsigned long long)(rings_dropped(rings, info.nr_rings) -
+                                 dropped_start),
+            (unsigned long long)wakeups, elapsed / 1e9, total / (elapsed / 1e9),
+            100.0 * cpu_used / elapsed,
+            total ? (double)cpu_used / total : 0.0);
+
+    for (i = 0; i < info.nr_rings; i++)
+        if (rings[i].hdr)
+            munmap(rings[i].hdr, info.ring_bytes);
+    free(rings);
+    close(fd);
+
+    return 0;
+}
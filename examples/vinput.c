@@ -3,70 +3,85 @@
  */
 
 #include <linux/cdev.h>
+#include <linux/hashtable.h>
 #include <linux/input.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/module.h>
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/stringhash.h>
+#include <linux/uaccess.h>
 #include <linux/version.h>
+#include <linux/xarray.h>
 
 #include <asm/uaccess.h>
 
 #include "vinput.h"
+#include "statpage/statpage.h"
 
 #define DRIVER_NAME "vinput"
 
 #define dev_to_vinput(dev) container_of(dev, struct vinput, dev)
 
-static DECLARE_BITMAP(vinput_ids, VINPUT_MINORS);
+/* Virtual devices by id, which is also their minor number. Lookups only
+ * take the RCU read lock. An id stays allocated until the device is
+ * released, even after the device was unpublished by storing NULL.
+ */
+static DEFINE_XARRAY_ALLOC(vinput_vdevices);
 
-static LIST_HEAD(vinput_devices);
-static LIST_HEAD(vinput_vdevices);
+/* Registered device types, hashed by name */
+static DEFINE_HASHTABLE(vinput_devices, 6);
 
 static int vinput_dev;
 static struct spinlock vinput_lock;
 static struct class vinput_class;
 
-/* Search the name of vinput device in the vinput_devices linked list,
- * which added at vinput_register().
+/* Search the name of vinput device in the vinput_devices hash table,
+ * which added at vinput_register(). A trailing newline, as written by
+ * echo, is not part of the name.
  */
 static struct vinput_device *vinput_get_device_by_type(const char *type)
 {
-    int found = 0;
-    struct vinput_device *vinput;
-    struct list_head *curr;
+    size_t len = strcspn(type, "\n");
+    u32 hash = full_name_hash(NULL, type, len);
+    struct vinput_device *vinput, *found = NULL;
 
     spin_lock(&vinput_lock);
-    list_for_each (curr, &vinput_devices) {
-        vinput = list_entry(curr, struct vinput_device, list);
-        if (vinput && strncmp(type, vinput->name, strlen(vinput->name)) == 0) {
-            found = 1;
+    hash_for_each_possible (vinput_devices, vinput, node, hash) {
+        if (strlen(vinput->name) == len &&
+            strncmp(type, vinput->name, len) == 0) {
+            found = vinput;
             break;
         }
     }
     spin_unlock(&vinput_lock);
 
     if (found)
-        return vinput;
+        return found;
     return ERR_PTR(-ENODEV);
 }
 
-/* Search the id of virtual device in the vinput_vdevices linked list,
- * which added at vinput_alloc_vdevice().
+/* Look up a virtual device by id and take a reference on it, which the
+ * caller drops with put_device().
  */
 static struct vinput *vinput_get_vdevice_by_id(long id)
 {
-    struct vinput *vinput = NULL;
-    struct list_head *curr;
+    struct vinput *vinput;
 
-    spin_lock(&vinput_lock);
-    list_for_each (curr, &vinput_vdevices) {
-        vinput = list_entry(curr, struct vinput, list);
-        if (vinput && vinput->id == id)
-            break;
-    }
-    spin_unlock(&vinput_lock);
+    if (id < 0 || id >= VINPUT_MINORS)
+        return ERR_PTR(-ENODEV);
 
-    if (vinput && vinput->id == id)
+    rcu_read_lock();
+    vinput = xa_load(&vinput_vdevices, id);
+    /* The device may be on its way out, its memory is freed after RCU */
+    if (vinput && !kobject_get_unless_zero(&vinput->dev.kobj))
+        vinput = NULL;
+    rcu_read_unlock();
+
+    if (vinput)
         return vinput;
     return ERR_PTR(-ENODEV);
 }
@@ -88,6 +103,10 @@ static int vinput_open(struct inode *inode, struct file *file)
 
 static int vinput_release(struct inode *inode, struct file *file)
 {
+    struct vinput *vinput = file->private_data;
+
+    put_device(&vinput->dev);
+
     return 0;
 }
 
@@ -98,7 +117,14 @@ static ssize_t vinput_read(struct file *file, char __user *buffer, size_t count,
     char buff[VINPUT_MAX_LEN + 1];
     struct vinput *vinput = file->private_data;
 
-    len = vinput->type->ops->read(vinput, buff, count);
+    down_read(&vinput->rwsem);
+    if (vinput->dead)
+        len = -ENODEV;
+    else
+        len = vinput->type->ops->read(vinput, buff, count);
+    up_read(&vinput->rwsem);
+    if (len < 0)
+        return len;
 
     if (*offset > len)
         count = 0;
@@ -113,11 +139,174 @@ static ssize_t vinput_read(struct file *file, char __user *buffer, size_t count,
     return count;
 }
 
-static ssize_t vinput_write(struct file *file, const char __user *buffer,
-                            size_t count, loff_t *offset)
+DEFINE_PER_CPU(struct vinput_totals, vinput_totals);
+
+static const char *const vinput_stat_names[] = {
+    "events", "syncs", "drops", "writes", "write_ns",
+};
+
+/* Devices come and go, these totals stay, so they are kept apart */
+static void vinput_stats_refresh(struct statpage *sp, u64 *values)
+{
+    int cpu;
+
+    memset(values, 0, ARRAY_SIZE(vinput_stat_names) * sizeof(*values));
+    for_each_possible_cpu (cpu) {
+        struct vinput_totals *totals = per_cpu_ptr(&vinput_totals, cpu);
+
+        values[0] += READ_ONCE(totals->events);
+        values[1] += READ_ONCE(totals->syncs);
+        values[2] += READ_ONCE(totals->drops);
+        values[3] += READ_ONCE(totals->writes);
+        values[4] += READ_ONCE(totals->write_ns);
+    }
+}
+
+static struct statpage vinput_statpage =
+    STATPAGE("vinput", vinput_stat_names, vinput_stats_refresh);
+
+static void vinput_sum_stats(struct vinput *vinput, struct vinput_stats *sum)
+{
+    int cpu, i;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu (cpu) {
+        struct vinput_stats *stats = per_cpu_ptr(vinput->stats, cpu);
+
+        sum->events += READ_ONCE(stats->events);
+        sum->syncs += READ_ONCE(stats->syncs);
+        sum->drops += READ_ONCE(stats->drops);
+
+        sum->latency.writes += READ_ONCE(stats->latency.writes);
+        sum->latency.total_ns += READ_ONCE(stats->latency.total_ns);
+        sum->latency.max_ns =
+            max(sum->latency.max_ns, READ_ONCE(stats->latency.max_ns));
+        for (i = 0; i < VINPUT_LAT_BUCKETS; i++)
+            sum->latency.hist[i] += READ_ONCE(stats->latency.hist[i]);
+    }
+}
+
+/* Accounts a write that entered vinput_write() at @start and whose frames
+ * have all been synced by now.
+ */
+static void vinput_count_write(struct vinput *vinput, u64 start)
+{
+    u64 ns = ktime_get_ns() - start;
+    unsigned int bucket = ns ? min_t(unsigned int, ilog2(ns),
+                                     VINPUT_LAT_BUCKETS - 1)
+                             : 0;
+    struct vinput_latency *lat = &get_cpu_ptr(vinput->stats)->latency;
+
+    lat->writes++;
+    lat->total_ns += ns;
+    if (ns > lat->max_ns)
+        lat->max_ns = ns;
+    lat->hist[bucket]++;
+    put_cpu_ptr(vinput->stats);
+
+    this_cpu_inc(vinput_totals.writes);
+    this_cpu_add(vinput_totals.write_ns, ns);
+}
+
+/* Ends a frame, device types with per-frame work (e.g. multitouch slot
+ * tracking) hook in here.
+ */
+static void vinput_sync(struct vinput *vinput)
+{
+    if (vinput->type->ops->sync)
+        vinput->type->ops->sync(vinput);
+    else
+        input_sync(vinput->input);
+}
+
+/* Reports a batch of binary events (see vinput_abi.h). The records are
+ * copied in chunks and handed to the input core one by one, with a single
+ * input_sync() per frame instead of one per event. If a chunk cannot be
+ * copied, the bytes of the records reported so far are returned, like any
+ * short write.
+ */
+static ssize_t vinput_write_batch(struct vinput *vinput,
+                                  const char __user *buffer, size_t count,
+                                  u64 start)
+{
+    struct vinput_event events[VINPUT_BATCH_CHUNK];
+    const struct vinput_event __user *uevents =
+        (const void __user *)(buffer + sizeof(struct vinput_batch));
+    size_t nr = (count - sizeof(struct vinput_batch)) / sizeof(*events);
+    unsigned int nr_events = 0, nr_syncs = 0, nr_drops = 0;
+    bool in_frame = false;
+    ssize_t ret = count;
+    size_t done, n, i;
+
+    if ((count - sizeof(struct vinput_batch)) % sizeof(*events))
+        return -EINVAL;
+    if (nr > VINPUT_BATCH_MAX)
+        return -EINVAL;
+
+    for (done = 0; done < nr; done += n) {
+        n = min_t(size_t, nr - done, VINPUT_BATCH_CHUNK);
+
+        if (done)
+            cond_resched();
+
+        if (copy_from_user(events, uevents + done, n * sizeof(*events))) {
+            ret = done ? sizeof(struct vinput_batch) + done * sizeof(*events) :
+                         -EFAULT;
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            unsigned int type = events[i].type;
+
+            in_frame = type != EV_SYN || events[i].code != SYN_REPORT;
+            if (!in_frame) {
+                vinput_sync(vinput);
+                nr_syncs++;
+            } else if (type > EV_MAX || !test_bit(type, vinput->input->evbit)) {
+                /* The input core would silently ignore it */
+                nr_drops++;
+            } else {
+                input_event(vinput->input, type, events[i].code,
+                            events[i].value);
+                nr_events++;
+            }
+        }
+    }
+
+    /* Never leave a frame half reported */
+    if (in_frame) {
+        vinput_sync(vinput);
+        nr_syncs++;
+    }
+
+    vinput_count(vinput, nr_events, nr_syncs, nr_drops);
+    vinput_count_write(vinput, start);
+    vinput_dbg(vinput,
+               "Batch of %u events in %u frames, %u dropped, %llu ns\n",
+               nr_events, nr_syncs, nr_drops, ktime_get_ns() - start);
+
+    return ret;
+}
+
+/* Called with vinput->rwsem held for reading, the device is not dead */
+static ssize_t vinput_write_locked(struct vinput *vinput,
+                                   const char __user *buffer, size_t count)
 {
     char buff[VINPUT_MAX_LEN + 1];
-    struct vinput *vinput = file->private_data;
+    struct vinput_batch batch;
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+
+    if (count >= sizeof(batch)) {
+        if (copy_from_user(&batch, buffer, sizeof(batch)))
+            return -EFAULT;
+
+        if (batch.magic == VINPUT_BATCH_MAGIC) {
+            if (batch.flags)
+                return -EINVAL;
+            return vinput_write_batch(vinput, buffer, count, start);
+        }
+    }
 
     memset(buff, 0, sizeof(char) * (VINPUT_MAX_LEN + 1));
 
@@ -129,7 +318,55 @@ static ssize_t vinput_write(struct file *file, const char __user *buffer,
     if (raw_copy_from_user(buff, buffer, count))
         return -EFAULT;
 
-    return vinput->type->ops->send(vinput, buff, count);
+    /* Every text write is one event and one input_sync() */
+    ret = vinput->type->ops->send(vinput, buff, count);
+    if (ret < 0) {
+        vinput_count(vinput, 0, 0, 1);
+    } else {
+        vinput_count(vinput, 1, 1, 0);
+        vinput_count_write(vinput, start);
+    }
+
+    return ret;
+}
+
+static ssize_t vinput_write(struct file *file, const char __user *buffer,
+                            size_t count, loff_t *offset)
+{
+    struct vinput *vinput = file->private_data;
+    ssize_t ret;
+
+    down_read(&vinput->rwsem);
+    if (vinput->dead)
+        ret = -ENODEV;
+    else
+        ret = vinput_write_locked(vinput, buffer, count);
+    up_read(&vinput->rwsem);
+
+    return ret;
+}
+
+static long vinput_ioctl(struct file *file, unsigned int cmd,
+                         unsigned long arg)
+{
+    struct vinput *vinput = file->private_data;
+    struct vinput_stats sum;
+
+    if (cmd != VINPUT_GET_LATENCY)
+        return -ENOTTY;
+
+    down_read(&vinput->rwsem);
+    if (vinput->dead) {
+        up_read(&vinput->rwsem);
+        return -ENODEV;
+    }
+    vinput_sum_stats(vinput, &sum);
+    up_read(&vinput->rwsem);
+
+    if (copy_to_user((void __user *)arg, &sum.latency, sizeof(sum.latency)))
+        return -EFAULT;
+
+    return 0;
 }
 
 static const struct file_operations vinput_fops = {
@@ -140,26 +377,40 @@ static const struct file_operations vinput_fops = {
     .release = vinput_release,
     .read = vinput_read,
     .write = vinput_write,
+    .unlocked_ioctl = vinput_ioctl,
 };
 
+/* The caller holds a reference. Unexport and vinput_unregister() may race
+ * for the same device, only the one that unpublishes it tears it down.
+ */
 static void vinput_unregister_vdevice(struct vinput *vinput)
 {
+    if (xa_cmpxchg(&vinput_vdevices, vinput->id, vinput, NULL, GFP_KERNEL) !=
+        vinput)
+        return;
+
+    /* Waits for the calls in progress, no new one gets past the check */
+    down_write(&vinput->rwsem);
+    vinput->dead = true;
+    up_write(&vinput->rwsem);
+
     input_unregister_device(vinput->input);
     if (vinput->type->ops->kill)
         vinput->type->ops->kill(vinput);
+    device_unregister(&vinput->dev);
 }
 
 static void vinput_destroy_vdevice(struct vinput *vinput)
 {
-    /* Remove from the list first */
-    spin_lock(&vinput_lock);
-    list_del(&vinput->list);
-    clear_bit(vinput->id, vinput_ids);
-    spin_unlock(&vinput_lock);
+    /* Give the id back, it is unpublished already */
+    xa_erase(&vinput_vdevices, vinput->id);
+
+    free_percpu(vinput->stats);
 
     module_put(THIS_MODULE);
 
-    kfree(vinput);
+    /* Lookups may still look at it under RCU */
+    kfree_rcu(vinput, rcu);
 }
 
 static void vinput_release_dev(struct device *dev)
@@ -175,6 +426,7 @@ static void vinput_release_dev(struct device *dev)
 static struct vinput *vinput_alloc_vdevice(void)
 {
     int err;
+    u32 id;
     struct vinput *vinput = kzalloc(sizeof(struct vinput), GFP_KERNEL);
 
     if (!vinput) {
@@ -182,19 +434,25 @@ static struct vinput *vinput_alloc_vdevice(void)
         return ERR_PTR(-ENOMEM);
     }
 
+    vinput->stats = alloc_percpu(struct vinput_stats);
+    if (!vinput->stats) {
+        kfree(vinput);
+        return ERR_PTR(-ENOMEM);
+    }
+
     try_module_get(THIS_MODULE);
 
     spin_lock_init(&vinput->lock);
+    init_rwsem(&vinput->rwsem);
 
-    spin_lock(&vinput_lock);
-    vinput->id = find_first_zero_bit(vinput_ids, VINPUT_MINORS);
-    if (vinput->id >= VINPUT_MINORS) {
-        err = -ENOBUFS;
+    /* Reserve an id, the device is published once it is registered */
+    err = xa_alloc(&vinput_vdevices, &id, NULL, XA_LIMIT(0, VINPUT_MINORS - 1),
+                   GFP_KERNEL);
+    if (err) {
+        err = err == -EBUSY ? -ENOBUFS : err;
         goto fail_id;
     }
-    set_bit(vinput->id, vinput_ids);
-    list_add(&vinput->list, &vinput_vdevices);
-    spin_unlock(&vinput_lock);
+    vinput->id = id;
 
     /* allocate the input device */
     vinput->input = input_allocate_device();
@@ -213,11 +471,10 @@ static struct vinput *vinput_alloc_vdevice(void)
     return vinput;
 
 fail_input_dev:
-    spin_lock(&vinput_lock);
-    list_del(&vinput->list);
+    xa_erase(&vinput_vdevices, vinput->id);
 fail_id:
-    spin_unlock(&vinput_lock);
     module_put(THIS_MODULE);
+    free_percpu(vinput->stats);
     kfree(vinput);
 
     return ERR_PTR(err);
@@ -280,6 +537,9 @@ static ssize_t export_store(struct class *class, struct class_attribute *attr,
     if (err < 0)
         goto fail_register_vinput;
 
+    /* Visible to open() and unexport from now on */
+    xa_store(&vinput_vdevices, vinput->id, vinput, GFP_KERNEL);
+
     return len;
 
 fail_register_vinput:
@@ -322,7 +582,7 @@ static ssize_t unexport_store(struct class *class, struct class_attribute *attr,
     }
 
     vinput_unregister_vdevice(vinput);
-    device_unregister(&vinput->dev);
+    put_device(&vinput->dev);
 
     return len;
 failed:
@@ -340,18 +600,91 @@ static struct attribute *vinput_class_attrs[] = {
 /* This macro generates vinput_class_groups structure */
 ATTRIBUTE_GROUPS(vinput_class);
 
+#define VINPUT_STAT_ATTR(field)                                                \
+    static ssize_t field##_show(struct device *dev,                            \
+                                struct device_attribute *attr, char *buf)      \
+    {                                                                          \
+        struct vinput_stats sum;                                               \
+                                                                               \
+        vinput_sum_stats(dev_to_vinput(dev), &sum);                            \
+        return sprintf(buf, "%llu\n", sum.field);                              \
+    }                                                                          \
+    static DEVICE_ATTR_RO(field)
+
+VINPUT_STAT_ATTR(events);
+VINPUT_STAT_ATTR(syncs);
+VINPUT_STAT_ATTR(drops);
+
+/* Average rate since the previous read of this file */
+static ssize_t events_per_sec_show(struct device *dev,
+                                   struct device_attribute *attr, char *buf)
+{
+    struct vinput *vinput = dev_to_vinput(dev);
+    struct vinput_stats sum;
+    u64 now = ktime_get_ns(), rate = 0;
+
+    vinput_sum_stats(vinput, &sum);
+
+    spin_lock(&vinput->lock);
+    if (vinput->rate_ns && now > vinput->rate_ns)
+        rate = div64_u64((sum.events - vinput->rate_events) * NSEC_PER_SEC,
+                         now - vinput->rate_ns);
+    vinput->rate_events = sum.events;
+    vinput->rate_ns = now;
+    spin_unlock(&vinput->lock);
+
+    return sprintf(buf, "%llu\n", rate);
+}
+static DEVICE_ATTR_RO(events_per_sec);
+
+static ssize_t debug_show(struct device *dev, struct device_attribute *attr,
+                          char *buf)
+{
+    return sprintf(buf, "%d\n", READ_ONCE(dev_to_vinput(dev)->debug));
+}
+
+static ssize_t debug_store(struct device *dev, struct device_attribute *attr,
+                           const char *buf, size_t len)
+{
+    bool debug;
+    int err;
+
+    err = kstrtobool(buf, &debug);
+    if (err)
+        return err;
+
+    WRITE_ONCE(dev_to_vinput(dev)->debug, debug);
+
+    return len;
+}
+static DEVICE_ATTR_RW(debug);
+
+static struct attribute *vinput_vdev_attrs[] = {
+    &dev_attr_events.attr,
+    &dev_attr_syncs.attr,
+    &dev_attr_drops.attr,
+    &dev_attr_events_per_sec.attr,
+    &dev_attr_debug.attr,
+    NULL,
+};
+
+/* This macro generates vinput_vdev_groups structure */
+ATTRIBUTE_GROUPS(vinput_vdev);
+
 static struct class vinput_class = {
     .name = "vinput",
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 4, 0)
     .owner = THIS_MODULE,
 #endif
     .class_groups = vinput_class_groups,
+    .dev_groups = vinput_vdev_groups,
 };
 
 int vinput_register(struct vinput_device *dev)
 {
     spin_lock(&vinput_lock);
-    list_add(&dev->list, &vinput_devices);
+    hash_add(vinput_devices, &dev->node,
+             full_name_hash(NULL, dev->name, strlen(dev->name)));
     spin_unlock(&vinput_lock);
 
     pr_info("vinput: registered new virtual input device '%s'\n", dev->name);
@@ -362,20 +695,23 @@ EXPORT_SYMBOL(vinput_register);
 
 void vinput_unregister(struct vinput_device *dev)
 {
-    struct list_head *curr, *next;
+    struct vinput *entry;
+    unsigned long id;
 
-    /* Remove from the list first */
+    /* Remove from the hash table first */
     spin_lock(&vinput_lock);
-    list_del(&dev->list);
+    hash_del(&dev->node);
     spin_unlock(&vinput_lock);
 
     /* unregister all devices of this type */
-    list_for_each_safe (curr, next, &vinput_vdevices) {
-        struct vinput *vinput = list_entry(curr, struct vinput, list);
-        if (vinput && vinput->type == dev) {
+    xa_for_each (&vinput_vdevices, id, entry) {
+        struct vinput *vinput = vinput_get_vdevice_by_id(id);
+
+        if (IS_ERR(vinput))
+            continue;
+        if (vinput->type == dev)
             vinput_unregister_vdevice(vinput);
-            device_unregister(&vinput->dev);
-        }
+        put_device(&vinput->dev);
     }
 
     pr_info("vinput: unregistered virtual input device '%s'\n", dev->name);
@@ -388,7 +724,9 @@ static int __init vinput_init(void)
 
     pr_info("vinput: Loading virtual input driver\n");
 
-    vinput_dev = register_chrdev(0, DRIVER_NAME, &vinput_fops);
+    /* register_chrdev() only covers 256 minors */
+    vinput_dev = __register_chrdev(0, 0, VINPUT_MINORS, DRIVER_NAME,
+                                   &vinput_fops);
     if (vinput_dev < 0) {
         pr_err("vinput: Unable to allocate char dev region\n");
         err = vinput_dev;
@@ -403,9 +741,17 @@ static int __init vinput_init(void)
         goto failed_class;
     }
 
+    err = statpage_register(&vinput_statpage);
+    if (err < 0) {
+        pr_err("vinput: Unable to create /proc/statpage-vinput\n");
+        goto failed_stats;
+    }
+
     return 0;
+failed_stats:
+    class_unregister(&vinput_class);
 failed_class:
-    unregister_chrdev(vinput_dev, DRIVER_NAME);
+    __unregister_chrdev(vinput_dev, 0, VINPUT_MINORS, DRIVER_NAME);
 failed_alloc:
     return err;
 }
@@ -414,7 +760,8 @@ static void __exit vinput_end(void)
 {
     pr_info("vinput: Unloading virtual input driver\n");
 
-    unregister_chrdev(vinput_dev, DRIVER_NAME);
+    statpage_unregister(&vinput_statpage);
+    __unregister_chrdev(vinput_dev, 0, VINPUT_MINORS, DRIVER_NAME);
     class_unregister(&vinput_class);
 }
 
@@ -5,27 +5,68 @@
 #ifndef VINPUT_H
 #define VINPUT_H
 
+#include <linux/atomic.h>
 #include <linux/input.h>
+#include <linux/percpu.h>
+#include <linux/rwsem.h>
 #include <linux/spinlock.h>
 
+#include "vinput_abi.h"
+
 #define VINPUT_MAX_LEN 128
-#define MAX_VINPUT 32
+/* Records of a binary batch copied from user space at once */
+#define VINPUT_BATCH_CHUNK 64
+/* Bounded by the minor numbers of one major */
+#define MAX_VINPUT (1 << 16)
 #define VINPUT_MINORS MAX_VINPUT
 
 #define dev_to_vinput(dev) container_of(dev, struct vinput, dev)
 
 struct vinput_device;
 
+/* Per-CPU, so that concurrent writers do not share a cache line */
+struct vinput_stats {
+    u64 events; /* events handed to the input core */
+    u64 syncs; /* frames ended with input_sync() */
+    u64 drops; /* events rejected before reaching the input core */
+    struct vinput_latency latency; /* from write() entry to the last sync */
+};
+
+/* Of all the devices, published in /proc/statpage-vinput, see statpage.h */
+struct vinput_totals {
+    u64 events;
+    u64 syncs;
+    u64 drops;
+    u64 writes;
+    u64 write_ns;
+};
+
+DECLARE_PER_CPU(struct vinput_totals, vinput_totals);
+
 struct vinput {
     long id;
     long devno;
-    long last_entry;
+    /* Held for reading by every call into the input device and the ops of
+     * the type, for writing to set dead once the device is unexported or
+     * its type unregistered. Files still open then get -ENODEV.
+     */
+    struct rw_semaphore rwsem;
+    bool dead;
+    /* Read and written without a lock by the send and read paths */
+    atomic_long_t last_entry;
     spinlock_t lock;
 
+    struct vinput_stats __percpu *stats;
+    /* Snapshot of the previous events_per_sec read, under lock */
+    u64 rate_events;
+    u64 rate_ns;
+    /* Log every event, rate limited, see vinput_dbg() */
+    bool debug;
+
     void *priv_data;
 
     struct device dev;
-    struct list_head list;
+    struct rcu_head rcu;
     struct input_dev *input;
     struct vinput_device *type;
 };
@@ -35,14 +76,40 @@ struct vinput_ops {
     int (*kill)(struct vinput *);
     int (*send)(struct vinput *, char *, int);
     int (*read)(struct vinput *, char *, int);
+    /* Optional, ends a frame of a binary batch instead of input_sync() */
+    void (*sync)(struct vinput *);
 };
 
 struct vinput_device {
     char name[16];
-    struct list_head list;
+    struct hlist_node node;
     struct vinput_ops *ops;
 };
 
+static inline void vinput_count(struct vinput *vinput, unsigned int events,
+                                unsigned int syncs, unsigned int drops)
+{
+    struct vinput_stats *stats = get_cpu_ptr(vinput->stats);
+
+    stats->events += events;
+    stats->syncs += syncs;
+    stats->drops += drops;
+    put_cpu_ptr(vinput->stats);
+
+    this_cpu_add(vinput_totals.events, events);
+    this_cpu_add(vinput_totals.syncs, syncs);
+    this_cpu_add(vinput_totals.drops, drops);
+}
+
+/* Per-event logging for debugging, off unless /sys/class/vinput/vinputX/debug
+ * is set, and rate limited even then.
+ */
+#define vinput_dbg(vinput, fmt, ...)                                           \
+    do {                                                                       \
+        if (unlikely(READ_ONCE((vinput)->debug)))                              \
+            dev_info_ratelimited(&(vinput)->dev, fmt, ##__VA_ARGS__);          \
+    } while (0)
+
 int vinput_register(struct vinput_device *dev);
 void vinput_unregister(struct vinput_device *dev);
 
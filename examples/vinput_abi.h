@@ -0,0 +1,59 @@
+/*
+ * vinput_abi.h - binary interface of /dev/vinputX
+ *
+ * Shared by vinput.c and the user space tools. Besides the text format of
+ * each device type ("+34" for vkbd), a write may carry a batch of raw
+ * events: a struct vinput_batch header followed by as many struct
+ * vinput_event records as fit in the rest of the write. The input core
+ * timestamps the events itself, so the records carry none.
+ *
+ * An EV_SYN/SYN_REPORT record ends a frame. If the last record of a batch
+ * does not end one, vinput ends the frame itself, so a batch without any
+ * EV_SYN record is delivered as a single frame.
+ *
+ * vinput timestamps every write on entry and measures how long it takes
+ * until its last frame went through input_sync(). VINPUT_GET_LATENCY
+ * returns those measurements, summed over all writes to the device since it
+ * was exported. Take one snapshot before and one after a run and subtract
+ * them to get the figures of the run alone.
+ */
+
+#ifndef VINPUT_ABI_H
+#define VINPUT_ABI_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define VINPUT_BATCH_MAGIC 0x564e4942 /* "BINV" in memory on little endian */
+
+struct vinput_event {
+    __u16 type; /* EV_KEY, EV_REL, EV_ABS, EV_SYN, ... */
+    __u16 code;
+    __s32 value;
+};
+
+struct vinput_batch {
+    __u32 magic;
+    __u32 flags; /* must be 0 */
+    struct vinput_event events[];
+};
+
+/* Records a single write may carry, larger batches fail with EINVAL */
+#define VINPUT_BATCH_MAX 4096
+
+/* hist[i] counts the writes that took [2^i, 2^(i+1)) ns, the last bucket
+ * also everything slower.
+ */
+#define VINPUT_LAT_BUCKETS 32
+
+struct vinput_latency {
+    __u64 writes;
+    __u64 total_ns;
+    __u64 max_ns; /* not meaningful as a difference of two snapshots */
+    __u64 hist[VINPUT_LAT_BUCKETS];
+};
+
+#define VINPUT_IOC_MAGIC 'v'
+#define VINPUT_GET_LATENCY _IOR(VINPUT_IOC_MAGIC, 0, struct vinput_latency)
+
+#endif
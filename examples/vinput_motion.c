@@ -0,0 +1,410 @@
+/*
+ * vinput_motion.c - synthetic motion through vinput and its latency
+ *
+ * A writer thread injects frames of synthetic motion into /dev/vinputN at a
+ * fixed rate, through the binary batch format of vinput_abi.h. The main
+ * thread reads the evdev node of the same device and matches every frame
+ * it receives to the write that produced it. For every frame two latencies
+ * are reported, both on CLOCK_MONOTONIC:
+ *
+ *   inject  - from before write() to the timestamp the input core gave the
+ *             frame
+ *   e2e     - from before write() to the moment read() returned it
+ *
+ * Alongside, vinput's own measurement of the same writes is fetched with
+ * VINPUT_GET_LATENCY:
+ *
+ *   sync    - from vinput_write() entry to the input_sync() of the last
+ *             frame of the write, percentiles rounded up to a power of two
+ *
+ * -t picks the motion and has to match the type of the device:
+ *
+ *   mouse   REL_X steps, for vmouse
+ *   touch   one finger sliding along the x axis, for vtouch
+ *   pad     the left stick sweeping along the x axis, for vpad
+ *
+ *   echo "vtouch" | sudo tee /sys/class/vinput/export
+ *   sudo ./vinput_motion -d 0 -t touch -r 1000 -n 10000
+ *
+ * Frames are matched by a sequence number folded into the position, so
+ * frames dropped by evdev (SYN_DROPPED) are counted instead of skewing the
+ * results.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <linux/input.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vinput_abi.h"
+
+enum motion { MOTION_MOUSE, MOTION_TOUCH, MOTION_PAD };
+
+/* How many sequence numbers fit in the position before it wraps */
+#define SEQ_MOD 1024
+
+struct motion_ctx {
+    int vinput_fd;
+    enum motion motion;
+    unsigned long frames;
+    unsigned int rate;
+    unsigned int per_write;
+    uint64_t *sent; /* CLOCK_MONOTONIC ns before the write of each frame */
+    int err;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void put_event(struct vinput_event *ev, int type, int code, int value)
+{
+    ev->type = type;
+    ev->code = code;
+    ev->value = value;
+}
+
+/* The events of one frame, returns how many were written */
+static int build_frame(enum motion motion, unsigned long seq,
+                       struct vinput_event *ev)
+{
+    int pos = seq % SEQ_MOD, n = 0;
+
+    switch (motion) {
+    case MOTION_MOUSE:
+        /* Relative events with value 0 are dropped, so start at 1 */
+        put_event(&ev[n++], EV_REL, REL_X, pos + 1);
+        break;
+    case MOTION_TOUCH:
+        if (seq == 0) {
+            put_event(&ev[n++], EV_ABS, ABS_MT_SLOT, 0);
+            put_event(&ev[n++], EV_ABS, ABS_MT_TRACKING_ID, 1);
+        }
+        put_event(&ev[n++], EV_ABS, ABS_MT_POSITION_X, pos);
+        put_event(&ev[n++], EV_ABS, ABS_MT_POSITION_Y, 2048);
+        break;
+    case MOTION_PAD:
+        /* Steps larger than the fuzz of the stick survive filtering */
+        put_event(&ev[n++], EV_ABS, ABS_X, pos * 32 - 16384);
+        break;
+    }
+    put_event(&ev[n++], EV_SYN, SYN_REPORT, 0);
+
+    return n;
+}
+
+/* Recovers the position folded into a received frame */
+static int frame_pos(enum motion motion, const struct input_event *ev)
+{
+    switch (motion) {
+    case MOTION_MOUSE:
+        if (ev->type == EV_REL && ev->code == REL_X)
+            return ev->value - 1;
+        break;
+    case MOTION_TOUCH:
+        if (ev->type == EV_ABS && ev->code == ABS_MT_POSITION_X)
+            return ev->value;
+        break;
+    case MOTION_PAD:
+        if (ev->type == EV_ABS && ev->code == ABS_X)
+            return (ev->value + 16384) / 32;
+        break;
+    }
+
+    return -1;
+}
+
+static void *writer(void *arg)
+{
+    struct motion_ctx *ctx = arg;
+    size_t bytes = sizeof(struct vinput_batch) +
+                   ctx->per_write * 4 * sizeof(struct vinput_event);
+    struct vinput_batch *batch = malloc(bytes);
+    uint64_t period = 1000000000ULL / ctx->rate, start = now_ns();
+    unsigned long seq = 0;
+
+    if (!batch) {
+        ctx->err = ENOMEM;
+        return NULL;
+    }
+    batch->magic = VINPUT_BATCH_MAGIC;
+    batch->flags = 0;
+
+    while (seq < ctx->frames) {
+        uint64_t due = start + seq * period;
+        struct timespec ts = {
+            .tv_sec = due / 1000000000ULL,
+            .tv_nsec = due % 1000000000ULL,
+        };
+        size_t n = 0, len;
+        unsigned long first = seq;
+        uint64_t t;
+
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+        for (; seq < ctx->frames && seq - first < ctx->per_write; seq++)
+            n += build_frame(ctx->motion, seq, &batch->events[n]);
+
+        t = now_ns();
+        for (; first < seq; first++)
+            __atomic_store_n(&ctx->sent[first], t, __ATOMIC_RELEASE);
+
+        len = sizeof(*batch) + n * sizeof(struct vinput_event);
+        if (write(ctx->vinput_fd, batch, len) != (ssize_t)len) {
+            ctx->err = errno;
+            break;
+        }
+    }
+
+    free(batch);
+    return NULL;
+}
+
+static int open_evdev(int index)
+{
+    char pattern[128];
+    glob_t g;
+    int fd, clk = CLOCK_MONOTONIC;
+
+    snprintf(pattern, sizeof(pattern),
+             "/sys/class/vinput/vinput%d/input/input*/event*", index);
+    if (glob(pattern, 0, NULL, &g) || g.gl_pathc < 1) {
+        fprintf(stderr, "no evdev node under %s\n", pattern);
+        return -1;
+    }
+    snprintf(pattern, sizeof(pattern), "/dev/input/%s",
+             strrchr(g.gl_pathv[0], '/') + 1);
+    globfree(&g);
+
+    fd = open(pattern, O_RDONLY);
+    if (fd < 0) {
+        perror(pattern);
+        return -1;
+    }
+
+    /* Event timestamps on the same clock as ours */
+    if (ioctl(fd, EVIOCSCLOCKID, &clk) < 0)
+        perror("EVIOCSCLOCKID");
+
+    return fd;
+}
+
+static void report(const char *name, uint64_t *lat, unsigned long n)
+{
+    if (!n)
+        return;
+
+    qsort(lat, n, sizeof(*lat), cmp_u64);
+    printf("%-7s p50=%lluus p90=%lluus p99=%lluus max=%lluus\n", name,
+           (unsigned long long)lat[n / 2] / 1000,
+           (unsigned long long)lat[n * 90 / 100] / 1000,
+           (unsigned long long)lat[n * 99 / 100] / 1000,
+           (unsigned long long)lat[n - 1] / 1000);
+}
+
+/* Percentiles of the writes vinput measured between two snapshots */
+static void report_sync(const struct vinput_latency *before,
+                        const struct vinput_latency *after)
+{
+    static const unsigned int pct[] = { 50, 90, 99 };
+    uint64_t writes = after->writes - before->writes, seen = 0;
+    unsigned int i, p = 0;
+
+    if (!writes)
+        return;
+
+    printf("%-7s avg=%lluus", "sync",
+           (unsigned long long)(after->total_ns - before->total_ns) / writes /
+               1000);
+    for (i = 0; i < VINPUT_LAT_BUCKETS && p < 3; i++) {
+        seen += after->hist[i] - before->hist[i];
+        for (; p < 3 && seen * 100 >= writes * pct[p]; p++)
+            printf(" p%u<%.1fus", pct[p], (2ULL << i) / 1000.0);
+    }
+    printf(" (%llu writes)\n", (unsigned long long)writes);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-d index] [-t mouse|touch|pad] [-r frames_per_sec] "
+            "[-n frames] [-b frames_per_write]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    struct motion_ctx ctx = {
+        .motion = MOTION_MOUSE,
+        .frames = 10000,
+        .rate = 1000,
+        .per_write = 1,
+    };
+    struct vinput_latency lat_before = { 0 }, lat_after = { 0 };
+    uint64_t *inject, *e2e, t0;
+    unsigned long next = 0, received = 0, dropped_syn = 0;
+    int index = 0, pos = -1, evdev_fd, opt;
+    char path[32];
+    pthread_t thread;
+
+    while ((opt = getopt(argc, argv, "d:t:r:n:b:")) != -1) {
+        switch (opt) {
+        case 'd':
+            index = atoi(optarg);
+            break;
+        case 't':
+            if (!strcmp(optarg, "mouse"))
+                ctx.motion = MOTION_MOUSE;
+            else if (!strcmp(optarg, "touch"))
+                ctx.motion = MOTION_TOUCH;
+            else if (!strcmp(optarg, "pad"))
+                ctx.motion = MOTION_PAD;
+            else
+                usage(argv[0]);
+            break;
+        case 'r':
+            ctx.rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            ctx.frames = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            ctx.per_write = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    /* At most 4 records per frame */
+    if (!ctx.rate || !ctx.frames || !ctx.per_write ||
+        ctx.per_write > VINPUT_BATCH_MAX / 4)
+        usage(argv[0]);
+
+    ctx.sent = calloc(ctx.frames, sizeof(*ctx.sent));
+    inject = calloc(ctx.frames, sizeof(*inject));
+    e2e = calloc(ctx.frames, sizeof(*e2e));
+    if (!ctx.sent || !inject || !e2e) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    evdev_fd = open_evdev(index);
+    if (evdev_fd < 0)
+        return EXIT_FAILURE;
+
+    snprintf(path, sizeof(path), "/dev/vinput%d", index);
+    ctx.vinput_fd = open(path, O_WRONLY);
+    if (ctx.vinput_fd < 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    if (ioctl(ctx.vinput_fd, VINPUT_GET_LATENCY, &lat_before) < 0)
+        perror("VINPUT_GET_LATENCY");
+
+    t0 = now_ns();
+    if (pthread_create(&thread, NULL, writer, &ctx)) {
+        perror("pthread_create");
+        return EXIT_FAILURE;
+    }
+
+    while (next < ctx.frames) {
+        struct pollfd pfd = { .fd = evdev_fd, .events = POLLIN };
+        struct input_event evs[64];
+        ssize_t len;
+        int i;
+
+        /* Give up once nothing arrived for a second */
+        if (poll(&pfd, 1, 1000) <= 0)
+            break;
+
+        len = read(evdev_fd, evs, sizeof(evs));
+        if (len < 0) {
+            perror("read");
+            break;
+        }
+
+        for (i = 0; i < len / (ssize_t)sizeof(evs[0]); i++) {
+            struct input_event *ev = &evs[i];
+            uint64_t recv, ts, sent;
+            unsigned long seq;
+
+            if (ev->type == EV_SYN && ev->code == SYN_DROPPED) {
+                dropped_syn++;
+                pos = -1;
+                continue;
+            }
+
+            if (ev->type != EV_SYN || ev->code != SYN_REPORT) {
+                if (frame_pos(ctx.motion, ev) >= 0)
+                    pos = frame_pos(ctx.motion, ev);
+                continue;
+            }
+
+            if (pos < 0)
+                continue;
+
+            /* Frames may be lost but never reordered: the first sequence
+             * number from `next` on that folds to the position we saw.
+             */
+            seq = next + ((unsigned long)pos + SEQ_MOD - next % SEQ_MOD) %
+                             SEQ_MOD;
+            pos = -1;
+            if (seq >= ctx.frames)
+                continue;
+
+            recv = now_ns();
+            ts = (uint64_t)ev->input_event_sec * 1000000000ULL +
+                 (uint64_t)ev->input_event_usec * 1000ULL;
+            sent = __atomic_load_n(&ctx.sent[seq], __ATOMIC_ACQUIRE);
+
+            inject[received] = ts > sent ? ts - sent : 0;
+            e2e[received] = recv - sent;
+            received++;
+            next = seq + 1;
+        }
+    }
+
+    pthread_join(thread, NULL);
+    if (ctx.err)
+        fprintf(stderr, "write: %s\n", strerror(ctx.err));
+    if (ioctl(ctx.vinput_fd, VINPUT_GET_LATENCY, &lat_after) < 0)
+        lat_after = lat_before;
+
+    printf("frames sent %lu received %lu syn_dropped %lu in %.2fs "
+           "(%u frames/s requested)\n",
+           ctx.frames, received, dropped_syn, (now_ns() - t0) / 1e9, ctx.rate);
+    report("inject", inject, received);
+    report("e2e", e2e, received);
+    report_sync(&lat_before, &lat_after);
+
+    close(ctx.vinput_fd);
+    close(evdev_fd);
+    free(e2e);
+    free(inject);
+    free(ctx.sent);
+
+    return 0;
+}
@@ -0,0 +1,246 @@
+/*
+ * vinput_replay.c - inject events through /dev/vinputX as fast as possible
+ *
+ * By default synthetic key frames are generated: every frame presses (or
+ * releases, on odd frames) `-e` keys starting at `-k`, followed by an
+ * EV_SYN/SYN_REPORT. `-b` frames are packed into one binary batch write
+ * (see vinput_abi.h). With -t the same events go through the text format of
+ * vkbd instead, one write per event, which is what the batch ABI replaces.
+ *
+ * With -f a recording of a real device is replayed instead, e.g. one taken
+ * with "cat /dev/input/event3 > rec" while typing. The recording is played
+ * back in a loop, without its original pacing, until -n events were sent.
+ *
+ *   echo "vkbd" | sudo tee /sys/class/vinput/export
+ *   sudo ./vinput_replay -d /dev/vinput0 -t
+ *   sudo ./vinput_replay -d /dev/vinput0 -b 1
+ *   sudo ./vinput_replay -d /dev/vinput0 -b 256
+ *
+ * The default key, KEY_UNKNOWN, is ignored by consoles and desktops alike,
+ * so running the benchmark does not type into the focused window.
+ */
+
+#include <fcntl.h>
+#include <linux/input.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vinput_abi.h"
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-d device] [-n events] [-e events_per_frame] "
+            "[-b frames_per_write] [-k first_key] [-f recording] [-t]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+/* Loads a recording of struct input_event, returns the number of records */
+static size_t load_recording(const char *path, struct vinput_event **out)
+{
+    struct vinput_event *events = NULL;
+    struct input_event ie;
+    size_t n = 0, cap = 0;
+    FILE *f = fopen(path, "rb");
+
+    if (!f) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    while (fread(&ie, sizeof(ie), 1, f) == 1) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            events = realloc(events, cap * sizeof(*events));
+            if (!events) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        events[n].type = ie.type;
+        events[n].code = ie.code;
+        events[n].value = ie.value;
+        n++;
+    }
+    fclose(f);
+
+    /* Looping a recording that stops mid-frame glues two frames together */
+    if (n && (events[n - 1].type != EV_SYN || events[n - 1].code != SYN_REPORT))
+        fprintf(stderr, "%s: recording does not end with SYN_REPORT\n", path);
+
+    *out = events;
+    return n;
+}
+
+static int run_text(int fd, unsigned long nr_events, int key, int per_frame,
+                    unsigned long *writes)
+{
+    char buf[16];
+    unsigned long i;
+
+    for (i = 0; i < nr_events; i++) {
+        unsigned long frame = i / per_frame;
+        int code = key + i % per_frame;
+        int len = snprintf(buf, sizeof(buf), "%c%d", frame & 1 ? '-' : '+',
+                           code);
+
+        if (write(fd, buf, len) != len) {
+            perror("write");
+            return -1;
+        }
+    }
+    *writes = nr_events;
+
+    return 0;
+}
+
+static int run_batch(int fd, unsigned long nr_events, int key, int per_frame,
+                     int frames_per_write, const struct vinput_event *rec,
+                     size_t rec_len, unsigned long *writes)
+{
+    size_t max_records = (size_t)frames_per_write * (per_frame + 1);
+    size_t bytes = sizeof(struct vinput_batch) +
+                   max_records * sizeof(struct vinput_event);
+    struct vinput_batch *batch = malloc(bytes);
+    unsigned long sent = 0, frame = 0;
+    size_t pos = 0;
+
+    if (!batch) {
+        perror("malloc");
+        return -1;
+    }
+    batch->magic = VINPUT_BATCH_MAGIC;
+    batch->flags = 0;
+
+    while (sent < nr_events) {
+        size_t n = 0;
+        ssize_t len;
+        int f, e;
+
+        if (rec) {
+            /* As many records of the recording as fit in one write */
+            while (n < max_records && sent < nr_events) {
+                batch->events[n++] = rec[pos];
+                if (rec[pos].type != EV_SYN)
+                    sent++;
+                pos = (pos + 1) % rec_len;
+            }
+        } else {
+            for (f = 0; f < frames_per_write && sent < nr_events;
+                 f++, frame++) {
+                for (e = 0; e < per_frame && sent < nr_events; e++, sent++) {
+                    batch->events[n].type = EV_KEY;
+                    batch->events[n].code = key + e;
+                    batch->events[n].value = !(frame & 1);
+                    n++;
+                }
+                batch->events[n].type = EV_SYN;
+                batch->events[n].code = SYN_REPORT;
+                batch->events[n].value = 0;
+                n++;
+            }
+        }
+
+        len = sizeof(*batch) + n * sizeof(struct vinput_event);
+        if (write(fd, batch, len) != len) {
+            perror("write");
+            free(batch);
+            return -1;
+        }
+        (*writes)++;
+    }
+
+    free(batch);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device = "/dev/vinput0", *recording = NULL;
+    unsigned long nr_events = 1000000, writes = 0;
+    int per_frame = 1, frames_per_write = 64, key = KEY_UNKNOWN;
+    struct vinput_event *rec = NULL;
+    size_t rec_len = 0;
+    int text = 0, opt, fd, err;
+    uint64_t t0, elapsed;
+
+    while ((opt = getopt(argc, argv, "d:n:e:b:k:f:t")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'n':
+            nr_events = strtoul(optarg, NULL, 0);
+            break;
+        case 'e':
+            per_frame = atoi(optarg);
+            break;
+        case 'b':
+            frames_per_write = atoi(optarg);
+            break;
+        case 'k':
+            key = atoi(optarg);
+            break;
+        case 'f':
+            recording = optarg;
+            break;
+        case 't':
+            text = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (!nr_events || per_frame < 1 || frames_per_write < 1 ||
+        (long)frames_per_write * (per_frame + 1) > VINPUT_BATCH_MAX)
+        usage(argv[0]);
+
+    if (recording) {
+        rec_len = load_recording(recording, &rec);
+        if (!rec_len) {
+            fprintf(stderr, "%s: no events\n", recording);
+            return EXIT_FAILURE;
+        }
+    }
+
+    fd = open(device, O_WRONLY);
+    if (fd < 0) {
+        perror(device);
+        return EXIT_FAILURE;
+    }
+
+    t0 = now_ns();
+    if (text)
+        err = run_text(fd, nr_events, key, per_frame, &writes);
+    else
+        err = run_batch(fd, nr_events, key, per_frame, frames_per_write, rec,
+                        rec_len, &writes);
+    elapsed = now_ns() - t0;
+
+    close(fd);
+    free(rec);
+
+    if (err)
+        return EXIT_FAILURE;
+
+    printf("%s: %lu events in %lu writes, %.3fs, %.0f events/s, "
+           "%.0f ns/event\n",
+           text ? "text" : "batch", nr_events, writes, elapsed / 1e9,
+           nr_events / (elapsed / 1e9), (double)elapsed / nr_events);
+
+    return 0;
+}
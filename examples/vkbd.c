@@ -5,7 +5,6 @@
 #include <linux/init.h>
 #include <linux/input.h>
 #include <linux/module.h>
-#include <linux/spinlock.h>
 
 #include "vinput.h"
 
@@ -36,11 +35,8 @@ static int vinput_vkbd_init(struct vinput *vinput)
 
 static int vinput_vkbd_read(struct vinput *vinput, char *buff, int len)
 {
-    spin_lock(&vinput->lock);
-    len = snprintf(buff, len, "%+ld\n", vinput->last_entry);
-    spin_unlock(&vinput->lock);
-
-    return len;
+    return snprintf(buff, len, "%+ld\n",
+                    atomic_long_read(&vinput->last_entry));
 }
 
 static int vinput_vkbd_send(struct vinput *vinput, char *buff, int len)
@@ -56,19 +52,20 @@ static int vinput_vkbd_send(struct vinput *vinput, char *buff, int len)
         ret = kstrtol(buff + 1, 10, &key);
     else
         ret = kstrtol(buff, 10, &key);
-    if (ret)
-        dev_err(&vinput->dev, "error during kstrtol: -%d\n", ret);
-    spin_lock(&vinput->lock);
-    vinput->last_entry = key;
-    spin_unlock(&vinput->lock);
+    if (ret) {
+        dev_err_ratelimited(&vinput->dev, "error during kstrtol: -%d\n", ret);
+        return ret;
+    }
+    atomic_long_set(&vinput->last_entry, key);
 
     if (key < 0) {
         type = VINPUT_RELEASE;
         key = -key;
     }
 
-    dev_info(&vinput->dev, "Event %s code %ld\n",
-             (type == VINPUT_RELEASE) ? "VINPUT_RELEASE" : "VINPUT_PRESS", key);
+    vinput_dbg(vinput, "Event %s code %ld\n",
+               (type == VINPUT_RELEASE) ? "VINPUT_RELEASE" : "VINPUT_PRESS",
+               key);
 
     /* Report the state received to input subsystem. */
     input_report_key(vinput->input, key, type);
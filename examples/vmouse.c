@@ -0,0 +1,127 @@
+/*
+ * vmouse.c
+ *
+ * Relative pointer on top of vinput. Text writes are "dx dy [buttons]",
+ * where bit 0, 1 and 2 of buttons are the left, right and middle button:
+ *
+ *   echo "vmouse" | sudo tee /sys/class/vinput/export
+ *   echo "10 -5 1" | sudo tee /dev/vinput0
+ *
+ * Reading /dev/vinputX returns the position accumulated from text writes.
+ * Binary batches (see vinput_abi.h) carry EV_REL and EV_KEY records.
+ */
+
+#include <linux/init.h>
+#include <linux/input.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "vinput.h"
+
+#define VINPUT_MOUSE "vmouse"
+
+struct vmouse_state {
+    long x;
+    long y;
+    int buttons;
+};
+
+static const unsigned int vmouse_buttons[] = { BTN_LEFT, BTN_RIGHT,
+                                               BTN_MIDDLE };
+
+static int vinput_vmouse_init(struct vinput *vinput)
+{
+    int i, err;
+
+    vinput->priv_data = kzalloc(sizeof(struct vmouse_state), GFP_KERNEL);
+    if (!vinput->priv_data)
+        return -ENOMEM;
+
+    input_set_capability(vinput->input, EV_REL, REL_X);
+    input_set_capability(vinput->input, EV_REL, REL_Y);
+    input_set_capability(vinput->input, EV_REL, REL_WHEEL);
+    for (i = 0; i < ARRAY_SIZE(vmouse_buttons); i++)
+        input_set_capability(vinput->input, EV_KEY, vmouse_buttons[i]);
+
+    err = input_register_device(vinput->input);
+    if (err) {
+        kfree(vinput->priv_data);
+        vinput->priv_data = NULL;
+    }
+
+    return err;
+}
+
+static int vinput_vmouse_kill(struct vinput *vinput)
+{
+    kfree(vinput->priv_data);
+    vinput->priv_data = NULL;
+
+    return 0;
+}
+
+static int vinput_vmouse_read(struct vinput *vinput, char *buff, int len)
+{
+    struct vmouse_state *state = vinput->priv_data;
+
+    spin_lock(&vinput->lock);
+    len = snprintf(buff, len, "%ld %ld %d\n", state->x, state->y,
+                   state->buttons);
+    spin_unlock(&vinput->lock);
+
+    return len;
+}
+
+static int vinput_vmouse_send(struct vinput *vinput, char *buff, int len)
+{
+    struct vmouse_state *state = vinput->priv_data;
+    int dx, dy, buttons = 0, i;
+
+    if (sscanf(buff, "%d %d %d", &dx, &dy, &buttons) < 2) {
+        dev_err(&vinput->dev, "expected \"dx dy [buttons]\"\n");
+        return -EINVAL;
+    }
+
+    spin_lock(&vinput->lock);
+    state->x += dx;
+    state->y += dy;
+    state->buttons = buttons;
+    spin_unlock(&vinput->lock);
+
+    input_report_rel(vinput->input, REL_X, dx);
+    input_report_rel(vinput->input, REL_Y, dy);
+    for (i = 0; i < ARRAY_SIZE(vmouse_buttons); i++)
+        input_report_key(vinput->input, vmouse_buttons[i], buttons & BIT(i));
+    input_sync(vinput->input);
+
+    return len;
+}
+
+static struct vinput_ops vmouse_ops = {
+    .init = vinput_vmouse_init,
+    .kill = vinput_vmouse_kill,
+    .send = vinput_vmouse_send,
+    .read = vinput_vmouse_read,
+};
+
+static struct vinput_device vmouse_dev = {
+    .name = VINPUT_MOUSE,
+    .ops = &vmouse_ops,
+};
+
+static int __init vmouse_init(void)
+{
+    return vinput_register(&vmouse_dev);
+}
+
+static void __exit vmouse_end(void)
+{
+    vinput_unregister(&vmouse_dev);
+}
+
+module_init(vmouse_init);
+module_exit(vmouse_end);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Emulate a relative pointer through /dev/vinput");
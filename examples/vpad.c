@@ -0,0 +1,108 @@
+/*
+ * vpad.c
+ *
+ * Gamepad on top of vinput: the usual face, shoulder and menu buttons, two
+ * sticks, two analog triggers and a d-pad. Text writes are "b code value"
+ * for a button and "a code value" for an axis, with the codes of
+ * linux/input-event-codes.h:
+ *
+ *   echo "vpad" | sudo tee /sys/class/vinput/export
+ *   echo "b 304 1" | sudo tee /dev/vinput0      (BTN_SOUTH pressed)
+ *   echo "a 0 -20000" | sudo tee /dev/vinput0   (left stick to the left)
+ *
+ * Binary batches (see vinput_abi.h) carry EV_KEY and EV_ABS records.
+ * Reading /dev/vinputX returns the last button, negative once released.
+ */
+
+#include <linux/init.h>
+#include <linux/input.h>
+#include <linux/module.h>
+
+#include "vinput.h"
+
+#define VINPUT_PAD "vpad"
+
+static const unsigned int vpad_buttons[] = {
+    BTN_SOUTH, BTN_EAST,   BTN_NORTH, BTN_WEST,  BTN_TL,
+    BTN_TR,    BTN_TL2,    BTN_TR2,   BTN_SELECT, BTN_START,
+    BTN_MODE,  BTN_THUMBL, BTN_THUMBR,
+};
+
+static int vinput_vpad_init(struct vinput *vinput)
+{
+    struct input_dev *input = vinput->input;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(vpad_buttons); i++)
+        input_set_capability(input, EV_KEY, vpad_buttons[i]);
+
+    /* Sticks */
+    input_set_abs_params(input, ABS_X, -32768, 32767, 16, 128);
+    input_set_abs_params(input, ABS_Y, -32768, 32767, 16, 128);
+    input_set_abs_params(input, ABS_RX, -32768, 32767, 16, 128);
+    input_set_abs_params(input, ABS_RY, -32768, 32767, 16, 128);
+    /* Analog triggers */
+    input_set_abs_params(input, ABS_Z, 0, 255, 0, 0);
+    input_set_abs_params(input, ABS_RZ, 0, 255, 0, 0);
+    /* D-pad */
+    input_set_abs_params(input, ABS_HAT0X, -1, 1, 0, 0);
+    input_set_abs_params(input, ABS_HAT0Y, -1, 1, 0, 0);
+
+    return input_register_device(input);
+}
+
+static int vinput_vpad_read(struct vinput *vinput, char *buff, int len)
+{
+    return snprintf(buff, len, "%+ld\n",
+                    atomic_long_read(&vinput->last_entry));
+}
+
+static int vinput_vpad_send(struct vinput *vinput, char *buff, int len)
+{
+    unsigned int code;
+    int value;
+    char kind;
+
+    if (sscanf(buff, "%c %u %d", &kind, &code, &value) != 3 ||
+        (kind != 'a' && kind != 'b')) {
+        dev_err(&vinput->dev, "expected \"b code value\" or "
+                              "\"a code value\"\n");
+        return -EINVAL;
+    }
+
+    if (kind == 'b')
+        atomic_long_set(&vinput->last_entry, value ? code : -(long)code);
+
+    /* Codes the pad does not have are dropped by the input core */
+    input_event(vinput->input, kind == 'b' ? EV_KEY : EV_ABS, code, value);
+    input_sync(vinput->input);
+
+    return len;
+}
+
+static struct vinput_ops vpad_ops = {
+    .init = vinput_vpad_init,
+    .send = vinput_vpad_send,
+    .read = vinput_vpad_read,
+};
+
+static struct vinput_device vpad_dev = {
+    .name = VINPUT_PAD,
+    .ops = &vpad_ops,
+};
+
+static int __init vpad_init(void)
+{
+    return vinput_register(&vpad_dev);
+}
+
+static void __exit vpad_end(void)
+{
+    vinput_unregister(&vpad_dev);
+}
+
+module_init(vpad_init);
+module_exit(vpad_end);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Emulate a gamepad through /dev/vinput");
@@ -0,0 +1,113 @@
+/*
+ * vtouch.c
+ *
+ * Multitouch screen on top of vinput, using the type B slot protocol. Text
+ * writes put a finger down or move it with "slot x y" and lift it with
+ * "slot -1":
+ *
+ *   echo "vtouch" | sudo tee /sys/class/vinput/export
+ *   echo "0 100 200" | sudo tee /dev/vinput0
+ *   echo "0 -1" | sudo tee /dev/vinput0
+ *
+ * Binary batches (see vinput_abi.h) carry ABS_MT_SLOT, ABS_MT_TRACKING_ID
+ * and ABS_MT_POSITION_X/Y records. Each frame then goes through
+ * input_mt_sync_frame(), which also emulates a single-touch pointer.
+ * Reading /dev/vinputX returns the bitmask of slots that are down.
+ */
+
+#include <linux/init.h>
+#include <linux/input.h>
+#include <linux/input/mt.h>
+#include <linux/module.h>
+
+#include "vinput.h"
+
+#define VINPUT_TOUCH "vtouch"
+#define VTOUCH_SLOTS 10
+#define VTOUCH_MAX_X 4095
+#define VTOUCH_MAX_Y 4095
+
+static int vinput_vtouch_init(struct vinput *vinput)
+{
+    struct input_dev *input = vinput->input;
+    int err;
+
+    input_set_abs_params(input, ABS_MT_POSITION_X, 0, VTOUCH_MAX_X, 0, 0);
+    input_set_abs_params(input, ABS_MT_POSITION_Y, 0, VTOUCH_MAX_Y, 0, 0);
+
+    /* Also sets up BTN_TOUCH, ABS_X and ABS_Y for pointer emulation */
+    err = input_mt_init_slots(input, VTOUCH_SLOTS, INPUT_MT_DIRECT);
+    if (err)
+        return err;
+
+    return input_register_device(input);
+}
+
+static int vinput_vtouch_read(struct vinput *vinput, char *buff, int len)
+{
+    return snprintf(buff, len, "%#lx\n",
+                    atomic_long_read(&vinput->last_entry));
+}
+
+static int vinput_vtouch_send(struct vinput *vinput, char *buff, int len)
+{
+    int slot, x = 0, y = 0, n;
+    bool down;
+
+    n = sscanf(buff, "%d %d %d", &slot, &x, &y);
+    if (n < 2 || slot < 0 || slot >= VTOUCH_SLOTS) {
+        dev_err(&vinput->dev, "expected \"slot x y\" or \"slot -1\"\n");
+        return -EINVAL;
+    }
+    down = n == 3;
+
+    if (down)
+        atomic_long_or(BIT(slot), &vinput->last_entry);
+    else
+        atomic_long_andnot(BIT(slot), &vinput->last_entry);
+
+    input_mt_slot(vinput->input, slot);
+    input_mt_report_slot_state(vinput->input, MT_TOOL_FINGER, down);
+    if (down) {
+        input_report_abs(vinput->input, ABS_MT_POSITION_X, x);
+        input_report_abs(vinput->input, ABS_MT_POSITION_Y, y);
+    }
+    input_mt_sync_frame(vinput->input);
+    input_sync(vinput->input);
+
+    return len;
+}
+
+static void vinput_vtouch_sync(struct vinput *vinput)
+{
+    input_mt_sync_frame(vinput->input);
+    input_sync(vinput->input);
+}
+
+static struct vinput_ops vtouch_ops = {
+    .init = vinput_vtouch_init,
+    .send = vinput_vtouch_send,
+    .read = vinput_vtouch_read,
+    .sync = vinput_vtouch_sync,
+};
+
+static struct vinput_device vtouch_dev = {
+    .name = VINPUT_TOUCH,
+    .ops = &vtouch_ops,
+};
+
+static int __init vtouch_init(void)
+{
+    return vinput_register(&vtouch_dev);
+}
+
+static void __exit vtouch_end(void)
+{
+    vinput_unregister(&vtouch_dev);
+}
+
+module_init(vtouch_init);
+module_exit(vtouch_end);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Emulate a multitouch screen through /dev/vinput");